@@ -1,9 +1,10 @@
 #!/bin/bash
-# Create a high-quality H.265 video from PNG files in the res directory using ffmpeg
+# Create a high-quality H.265 video from the numbered frames of an animation or a job file
+# (output_0000.png, output_0001.png, ...), in the res directory or in the directory given
 
 set -e
 
-INPUT_DIR="$(dirname "$0")/res"
+INPUT_DIR="${1:-$(dirname "$0")}"
 OUTPUT="output.mp4"
 FRAMERATE=60
 
@@ -14,7 +15,7 @@ if ! command -v ffmpeg &> /dev/null; then
 fi
 
 # Create video from PNG sequence
-ffmpeg -y -framerate "$FRAMERATE" -start_number 0 -i "$INPUT_DIR/output%d.png" \
+ffmpeg -y -framerate "$FRAMERATE" -start_number 0 -i "$INPUT_DIR/output_%04d.png" \
     -c:v libx265 -preset medium -crf 23 -pix_fmt yuv420p "$OUTPUT"
 
 echo "Video created: $OUTPUT"
@@ -0,0 +1,133 @@
+/**
+ * @class Aabb
+ * @brief Axis-aligned bounding box used by the acceleration structures.
+ *
+ * The box is stored as three intervals, one per axis. Besides the usual
+ * slab test against a ray, it provides the helpers needed to build a
+ * bounding volume hierarchy: merging boxes, finding the longest axis and
+ * computing the surface area used by the surface area heuristic (SAH).
+ */
+#pragma once
+
+#include "interval.h"
+#include "ray.h"
+#include "vec3.h"
+
+class Aabb
+{
+ public:
+   Interval x, y, z;
+
+   Aabb() {} // The default AABB is empty, since intervals are empty by default.
+
+   Aabb(const Interval &x, const Interval &y, const Interval &z) : x(x), y(y), z(z) { pad_to_minimums(); }
+
+   Aabb(const Point3 &a, const Point3 &b)
+   {
+      // Treat the two points a and b as extrema for the bounding box, so we don't require a
+      // particular minimum/maximum coordinate order.
+      x = Interval(std::fmin(a[0], b[0]), std::fmax(a[0], b[0]));
+      y = Interval(std::fmin(a[1], b[1]), std::fmax(a[1], b[1]));
+      z = Interval(std::fmin(a[2], b[2]), std::fmax(a[2], b[2]));
+
+      pad_to_minimums();
+   }
+
+   // Create the box tightly enclosing the two input boxes
+   Aabb(const Aabb &box0, const Aabb &box1) : x(box0.x, box1.x), y(box0.y, box1.y), z(box0.z, box1.z) {}
+
+   const Interval &axis_interval(int n) const
+   {
+      if (n == 1)
+         return y;
+      if (n == 2)
+         return z;
+      return x;
+   }
+
+   bool is_empty() const { return x.min > x.max || y.min > y.max || z.min > z.max; }
+
+   Point3 centroid() const { return Point3(0.5 * (x.min + x.max), 0.5 * (y.min + y.max), 0.5 * (z.min + z.max)); }
+
+   // Returns the index of the longest axis of the bounding box
+   int longest_axis() const
+   {
+      if (x.size() > y.size())
+         return x.size() > z.size() ? 0 : 2;
+      else
+         return y.size() > z.size() ? 1 : 2;
+   }
+
+   real surface_area() const
+   {
+      if (is_empty())
+         return 0.0;
+
+      auto dx = x.size(), dy = y.size(), dz = z.size();
+      return 2.0 * (dx * dy + dy * dz + dz * dx);
+   }
+
+   /**
+    * @brief Slab test of a ray against the box
+    *
+    * For each axis the ray is clipped against the two planes of the slab, the
+    * resulting parametric interval is intersected with `ray_t`. The ray hits
+    * the box when the interval stays non-empty after the three axes.
+    *
+    * @param r The ray to test
+    * @param ray_t The parametric interval of the ray that is considered
+    * @return true if the ray hits the box within `ray_t`
+    */
+   bool hit(const Ray &r, Interval ray_t) const
+   {
+      const Vec3 &dir = r.direction();
+      const Vec3 inv_dir(1.0 / dir[0], 1.0 / dir[1], 1.0 / dir[2]);
+      return hit(r.origin(), inv_dir, ray_t);
+   }
+
+   /**
+    * Same as above, but with the inverse ray direction precomputed by the caller.
+    * This is the version used in the BVH traversal where the same ray is tested
+    * against many boxes.
+    */
+   inline bool hit(const Point3 &origin, const Vec3 &inv_dir, Interval ray_t) const
+   {
+      for (int axis = 0; axis < 3; axis++)
+      {
+         const Interval &ax = axis_interval(axis);
+
+         auto t0 = (ax.min - origin[axis]) * inv_dir[axis];
+         auto t1 = (ax.max - origin[axis]) * inv_dir[axis];
+
+         if (t0 > t1)
+            std::swap(t0, t1);
+
+         if (t0 > ray_t.min)
+            ray_t.min = t0;
+         if (t1 < ray_t.max)
+            ray_t.max = t1;
+
+         if (ray_t.max <= ray_t.min)
+            return false;
+      }
+      return true;
+   }
+
+   static const Aabb empty, universe;
+
+ private:
+   void pad_to_minimums()
+   {
+      // Adjust the AABB so that no side is narrower than some delta, padding if necessary.
+      real delta = 0.0001;
+      if (x.size() < delta)
+         x = x.expand(delta);
+      if (y.size() < delta)
+         y = y.expand(delta);
+      if (z.size() < delta)
+         z = z.expand(delta);
+   }
+};
+
+inline const Aabb Aabb::empty = Aabb(Interval::empty, Interval::empty, Interval::empty);
+inline const Aabb Aabb::universe = Aabb(Interval::universe, Interval::universe, Interval::universe);
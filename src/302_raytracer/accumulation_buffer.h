@@ -0,0 +1,286 @@
+/**
+ * @class Accumulation_buffer
+ * @brief Floating-point running sums of the samples of every pixel.
+ *
+ * The renderers add their samples to this buffer instead of writing the final
+ * 8-bit color directly, so that an image can be refined over several passes:
+ * the value of a pixel is the sum of its samples divided by the number of
+ * samples it has received so far. The buffer keeps the full (HDR) range, the
+ * clamping and quantization only happen in `resolve`.
+ *
+ * The sum of the squared luminances of the samples is kept as well, so that the
+ * variance of each pixel can be estimated for adaptive sampling.
+ *
+ * Each pixel is only ever written by the thread rendering it, so no
+ * synchronization is needed as long as two threads never render the same
+ * pixel in the same pass. The parallel renderers sum the samples of a tile in
+ * a `Tile_accumulation` of their own and `merge` it once the tile is done, so
+ * the threads do not write to the cache lines shared by two tiles while they trace.
+ */
+#pragma once
+
+#include "color.h"
+#include "interval.h"
+#include "vec3.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <vector>
+
+/**
+ * @brief Arrangement of the channels of an 8-bit image
+ *
+ * - `Interleaved`: the channels of each pixel together, RGBRGB... or RGBARGBA... with 4 channels,
+ *   the 4-byte pixels of which can be loaded aligned or uploaded to a GPU texture without repacking
+ * - `Planar`: the whole image in each channel one after the other, RR...GG...BB..., as the encoders
+ *   working by plane take it
+ *
+ * A fourth channel is an opaque alpha (255).
+ */
+enum class Pixel_layout
+{
+   Interleaved,
+   Planar
+};
+
+/**
+ * @class Tile_accumulation
+ * @brief The sums of the samples of a tile, merged into an `Accumulation_buffer` once the tile is rendered
+ * Same sums as `Accumulation_buffer`, over the pixels [x0, x1) x [y0, y1) of the image.
+ */
+class Tile_accumulation
+{
+ public:
+   // Starts a tile, with no samples
+   void begin(int x0, int y0, int x1, int y1)
+   {
+      this->x0 = x0;
+      this->y0 = y0;
+      width = x1 - x0;
+      height = y1 - y0;
+      sums.assign((size_t)width * height * 3, 0.0f);
+      luminance_squares.assign((size_t)width * height, 0.0f);
+      counts.assign((size_t)width * height, 0);
+   }
+
+   // Same as `Accumulation_buffer::add`, with the coordinates of the pixel in the image
+   inline void add(int x, int y, const Color &sum, double luminance_square_sum, int n_samples)
+   {
+      size_t index = (size_t)(y - y0) * width + (x - x0);
+      sums[index * 3 + 0] += (float)sum.x();
+      sums[index * 3 + 1] += (float)sum.y();
+      sums[index * 3 + 2] += (float)sum.z();
+      luminance_squares[index] += (float)luminance_square_sum;
+      counts[index] += n_samples;
+   }
+
+ private:
+   friend class Accumulation_buffer;
+
+   int x0 = 0, y0 = 0, width = 0, height = 0;
+   std::vector<float> sums;              // RGB sums, 3 floats per pixel, row by row
+   std::vector<float> luminance_squares; // Sums of the squared luminances of the samples
+   std::vector<int> counts;              // Number of samples per pixel
+};
+
+class Accumulation_buffer
+{
+ public:
+   Accumulation_buffer() {}
+
+   Accumulation_buffer(int width, int height) { resize(width, height); }
+
+   // Changes the size of the buffer and clears it
+   void resize(int width, int height)
+   {
+      this->width = width;
+      this->height = height;
+      sums.assign((size_t)width * height * 3, 0.0f);
+      luminance_squares.assign((size_t)width * height, 0.0f);
+      counts.assign((size_t)width * height, 0);
+   }
+
+   // Forgets all the samples, e.g. when the camera moves
+   void reset()
+   {
+      std::fill(sums.begin(), sums.end(), 0.0f);
+      std::fill(luminance_squares.begin(), luminance_squares.end(), 0.0f);
+      std::fill(counts.begin(), counts.end(), 0);
+   }
+
+   /**
+    * @brief Adds `n_samples` samples to a pixel
+    * @param sum The sum of the sample colors
+    * @param luminance_square_sum The sum of the squared luminances of the samples
+    */
+   inline void add(int x, int y, const Color &sum, double luminance_square_sum, int n_samples)
+   {
+      size_t index = (size_t)y * width + x;
+      sums[index * 3 + 0] += (float)sum.x();
+      sums[index * 3 + 1] += (float)sum.y();
+      sums[index * 3 + 2] += (float)sum.z();
+      luminance_squares[index] += (float)luminance_square_sum;
+      counts[index] += n_samples;
+   }
+
+   /**
+    * @brief Adds the sums of a tile to its pixels, a row of the tile at a time
+    * The pixels without samples in the tile are left as they are.
+    */
+   void merge(const Tile_accumulation &tile)
+   {
+      for (int j = 0; j < tile.height; ++j)
+      {
+         const size_t index = (size_t)(tile.y0 + j) * width + tile.x0;
+         const size_t tile_index = (size_t)j * tile.width;
+         for (int i = 0; i < tile.width * 3; ++i)
+            sums[index * 3 + i] += tile.sums[tile_index * 3 + i];
+         for (int i = 0; i < tile.width; ++i)
+         {
+            luminance_squares[index + i] += tile.luminance_squares[tile_index + i];
+            counts[index + i] += tile.counts[tile_index + i];
+         }
+      }
+   }
+
+   /**
+    * @brief Adds the sums of a buffer of the same size, counted as `n_samples` samples per pixel
+    * E.g. the sums of `Camera::renderRegion` over the whole frame, whose counts include the samples before its range.
+    */
+   void merge(const Accumulation_buffer &range, int n_samples)
+   {
+      for (size_t i = 0; i < sums.size(); ++i)
+         sums[i] += range.sums[i];
+      for (size_t i = 0; i < counts.size(); ++i)
+      {
+         luminance_squares[i] += range.luminance_squares[i];
+         counts[i] += n_samples;
+      }
+   }
+
+   // The mean of the samples of a pixel, black if it has none
+   inline Color mean(int x, int y) const
+   {
+      size_t index = (size_t)y * width + x;
+      if (counts[index] == 0)
+         return Color(0, 0, 0);
+
+      double scale = 1.0 / counts[index];
+      return Color(sums[index * 3 + 0] * scale, sums[index * 3 + 1] * scale, sums[index * 3 + 2] * scale);
+   }
+
+   inline int samples(int x, int y) const { return counts[(size_t)y * width + x]; }
+
+   // The raw sums of a pixel, e.g. to send them to another process that merges them with `add`
+   inline Color sum(int x, int y) const
+   {
+      size_t index = (size_t)y * width + x;
+      return Color(sums[index * 3 + 0], sums[index * 3 + 1], sums[index * 3 + 2]);
+   }
+   inline float luminance_square_sum(int x, int y) const { return luminance_squares[(size_t)y * width + x]; }
+
+   /**
+    * @brief Standard error of the mean luminance of a pixel, i.e. the expected noise of its value
+    * Infinite with less than two samples, since the variance cannot be estimated.
+    */
+   inline double standard_error(int x, int y) const
+   {
+      size_t index = (size_t)y * width + x;
+      int n = counts[index];
+      if (n < 2)
+         return std::numeric_limits<double>::infinity();
+
+      double sum = luminance(Color(sums[index * 3 + 0], sums[index * 3 + 1], sums[index * 3 + 2]));
+      double variance = (luminance_squares[index] - sum * sum / n) / (n - 1);
+      return std::sqrt(std::max(0.0, variance) / n);
+   }
+
+   // Relative luminance of a linear color (Rec. 709 weights)
+   static inline double luminance(const Color &c) { return 0.2126 * c.x() + 0.7152 * c.y() + 0.0722 * c.z(); }
+
+   /**
+    * @brief Converts the current means to 8-bit colors
+    * Same mapping as the renderers: clamped to [0, 0.999] and scaled to 256 levels.
+    *
+    * @param image Destination buffer of `width * height * channels` bytes
+    * @param channels Number of channels of the destination, 3 (RGB) or 4 (RGBA)
+    * @param layout Arrangement of the channels in `image`
+    */
+   void resolve(std::vector<unsigned char> &image, int channels = 3,
+                Pixel_layout layout = Pixel_layout::Interleaved) const
+   {
+      static const Interval intensity(0.0, 0.999);
+
+      const size_t n_pixels = (size_t)width * height;
+      const size_t pixel_step = layout == Pixel_layout::Interleaved ? channels : 1;
+      const size_t channel_step = layout == Pixel_layout::Interleaved ? 1 : n_pixels;
+      for (int y = 0; y < height; ++y)
+      {
+         for (int x = 0; x < width; ++x)
+         {
+            Color c = mean(x, y);
+            size_t index = ((size_t)y * width + x) * pixel_step;
+            image[index] = static_cast<int>(intensity.clamp(c.x()) * 256);
+            image[index + channel_step] = static_cast<int>(intensity.clamp(c.y()) * 256);
+            image[index + 2 * channel_step] = static_cast<int>(intensity.clamp(c.z()) * 256);
+            if (channels == 4)
+               image[index + 3 * channel_step] = 255;
+         }
+      }
+   }
+
+   /**
+    * @brief Rearranges an image whose first `n_pixels * 3` bytes are interleaved RGB, e.g. from the GPU renderers
+    * @param channels The channels of the result, 3 (RGB) or 4 (RGBA), `image` holding `n_pixels * channels` bytes
+    */
+   static void repack(std::vector<unsigned char> &image, size_t n_pixels, int channels, Pixel_layout layout)
+   {
+      if (channels == 3 && layout == Pixel_layout::Interleaved)
+         return;
+
+      const std::vector<unsigned char> rgb(image.begin(), image.begin() + n_pixels * 3);
+      const size_t pixel_step = layout == Pixel_layout::Interleaved ? channels : 1;
+      const size_t channel_step = layout == Pixel_layout::Interleaved ? 1 : n_pixels;
+      for (size_t p = 0; p < n_pixels; ++p)
+      {
+         for (int c = 0; c < 3; ++c)
+            image[p * pixel_step + c * channel_step] = rgb[p * 3 + c];
+         if (channels == 4)
+            image[p * pixel_step + 3 * channel_step] = 255;
+      }
+   }
+
+   // Copies the current means as RGB floats, `width * height * 3` values
+   void resolve(std::vector<float> &hdr_image) const
+   {
+      hdr_image.resize((size_t)width * height * 3);
+      for (int y = 0; y < height; ++y)
+      {
+         for (int x = 0; x < width; ++x)
+         {
+            Color c = mean(x, y);
+            size_t index = ((size_t)y * width + x) * 3;
+            hdr_image[index + 0] = (float)c.x();
+            hdr_image[index + 1] = (float)c.y();
+            hdr_image[index + 2] = (float)c.z();
+         }
+      }
+   }
+
+   int get_width() const { return width; }
+   int get_height() const { return height; }
+
+   // Raw access, used to exchange the sums with the GPU renderer
+   float *sums_data() { return sums.data(); }
+   void set_all_counts(int n_samples) { std::fill(counts.begin(), counts.end(), n_samples); }
+
+   // Number of samples of every pixel, row by row
+   const std::vector<int> &sample_counts() const { return counts; }
+
+ private:
+   int width = 0, height = 0;
+   std::vector<float> sums;              // RGB sums, 3 floats per pixel
+   std::vector<float> luminance_squares; // Sums of the squared luminances of the samples
+   std::vector<int> counts;              // Number of samples per pixel
+};
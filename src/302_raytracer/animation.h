@@ -0,0 +1,239 @@
+/**
+ * @file animation.h
+ * @brief Keyframed camera path and sphere motions of an animation, read from an animation file
+ *
+ * An animation file holds one keyframe per line, as `key=value` settings separated
+ * by spaces, like a job file (see render_job.h). Empty lines and the text after a
+ * `#` are ignored.
+ *
+ * | Key         | Value                                            | Example             |
+ * |-------------|--------------------------------------------------|---------------------|
+ * | `frames`    | Number of frames, alone on its line              | `frames=120`        |
+ * | `frame`     | Frame of the keyframe, from 0                    | `frame=60`          |
+ * | `lookfrom`  | Position of the camera                           | `lookfrom=-2,2,5`   |
+ * | `lookat`    | Point the camera looks at                        | `lookat=-2,-0.5,-1` |
+ * | `vup`       | Up direction of the camera                       | `vup=0,1,0`         |
+ * | `vfov`      | Vertical field of view in degrees                | `vfov=35`           |
+ * | `sphere`    | Index of the sphere moved by the keyframe        | `sphere=12`         |
+ * | `translate` | Offset of the sphere from its place in the scene | `translate=0,1.5,0` |
+ * | `scale`     | Factor of its radius                             | `scale=2`           |
+ *
+ * A keyframe with a `sphere` moves that sphere, its missing `translate` and `scale`
+ * being 0,0,0 and 1. The other keyframes set the camera, the settings they miss
+ * keeping those of the previous camera keyframe, or of the command line for the
+ * first one. The values are interpolated linearly between the keyframes and held
+ * before the first and after the last one. Without a `frames` line, the animation
+ * ends at its last keyframe.
+ *
+ * The spheres are numbered as the objects of the demo scene, or in the order of a
+ * scene file. The frames are written next to the output of the command line,
+ * numbered (e.g. `res/output_0003.png`).
+ */
+#pragma once
+
+#include "bvh.h"
+#include "render_job.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <tuple>
+#include <vector>
+
+/**
+ * @class Animation
+ * @brief The frames of an animation: the camera of each one, and the spheres that move
+ *
+ * The spheres without keyframes stay where they are, so `sphere_updates` only lists
+ * the moving ones and the cost of a frame grows with their number, not with the scene.
+ */
+class Animation
+{
+ public:
+   /**
+    * @brief Reads an animation file, see the top of this file for the format
+    * @param defaults Camera before the first camera keyframe, and samples per pixel of the frames
+    * @return false after printing the first error
+    */
+   bool load(const std::string &path, const Render_job &defaults)
+   {
+      std::ifstream file(path);
+      if (!file)
+      {
+         std::cerr << "Cannot open the animation file " << path << std::endl;
+         return false;
+      }
+
+      base = defaults;
+      Camera_key camera{0, defaults};
+      std::string line;
+      for (int line_number = 1; std::getline(file, line); line_number++)
+      {
+         line = line.substr(0, line.find('#'));
+
+         int frame = 0, sphere = -1;
+         Sphere_key motion;
+         bool empty = true, camera_setting = false, frames_only = true;
+         std::istringstream settings(line);
+         std::string setting;
+         while (settings >> setting)
+         {
+            empty = false;
+            size_t equal = setting.find('=');
+            std::string key = setting.substr(0, equal);
+            std::string value = equal == std::string::npos ? "" : setting.substr(equal + 1);
+            frames_only = frames_only && key == "frames";
+
+            bool ok = !value.empty();
+            if (key == "frames")
+               ok = ok && sscanf(value.c_str(), "%d", &n_frames) == 1 && n_frames > 0;
+            else if (key == "frame")
+               ok = ok && sscanf(value.c_str(), "%d", &frame) == 1 && frame >= 0;
+            else if (key == "sphere")
+               ok = ok && sscanf(value.c_str(), "%d", &sphere) == 1 && sphere >= 0;
+            else if (key == "translate")
+               ok = ok && parse_vec3(value, motion.translate);
+            else if (key == "scale")
+               ok = ok && sscanf(value.c_str(), "%lf", &motion.scale) == 1 && motion.scale >= 0;
+            else if (key == "lookfrom")
+               ok = ok && parse_vec3(value, camera.job.lookfrom);
+            else if (key == "lookat")
+               ok = ok && parse_vec3(value, camera.job.lookat);
+            else if (key == "vup")
+               ok = ok && parse_vec3(value, camera.job.vup);
+            else if (key == "vfov")
+               ok = ok && sscanf(value.c_str(), "%lf", &camera.job.vfov) == 1 && camera.job.vfov > 0 &&
+                    camera.job.vfov < 180;
+            else
+               ok = false;
+            camera_setting = camera_setting || key == "lookfrom" || key == "lookat" || key == "vup" || key == "vfov";
+
+            if (!ok)
+            {
+               std::cerr << path << ":" << line_number << ": invalid setting \"" << setting << "\"" << std::endl;
+               return false;
+            }
+         }
+
+         if (empty || frames_only)
+            continue;
+         if (sphere >= 0 && camera_setting)
+         {
+            std::cerr << path << ":" << line_number << ": a keyframe moves either a sphere or the camera" << std::endl;
+            return false;
+         }
+
+         last_key = std::max(last_key, frame);
+         motion.frame = frame;
+         camera.frame = frame;
+         if (sphere >= 0)
+            spheres[sphere].push_back(motion);
+         else
+            cameras.push_back(camera);
+      }
+
+      // The keyframes may be given in any order
+      auto by_frame = [](const auto &a, const auto &b) { return a.frame < b.frame; };
+      std::stable_sort(cameras.begin(), cameras.end(), by_frame);
+      for (auto &track : spheres)
+         std::stable_sort(track.second.begin(), track.second.end(), by_frame);
+      return true;
+   }
+
+   int frame_count() const { return n_frames > 0 ? n_frames : last_key + 1; }
+
+   // Number of spheres with keyframes
+   int moving_spheres() const { return (int)spheres.size(); }
+
+   /**
+    * @brief Keeps the place of the moving spheres in the scene, to which their keyframes are relative
+    * @return false after printing an error if a sphere is not in the scene, or cannot move (see `Bvh::move_spheres`)
+    */
+   bool bind(const Bvh &bvh)
+   {
+      const Sphere_soa &leaf_spheres = bvh.get_leaf_spheres();
+      rest.clear();
+      for (const auto &track : spheres)
+      {
+         if (track.first >= leaf_spheres.size())
+         {
+            std::cerr << "The animation moves sphere " << track.first << ", but the scene only has "
+                      << leaf_spheres.size() << " spheres that can move" << std::endl;
+            return false;
+         }
+         const int i = bvh.leaf_index(track.first);
+         rest.push_back({track.first, leaf_spheres.center(i), leaf_spheres.get_radius(i)});
+      }
+      return true;
+   }
+
+   // Settings of a frame, written to the numbered output of the command line
+   Render_job job(int frame) const
+   {
+      Render_job job = base;
+      job.output = numbered_output(base.output, frame);
+      if (cameras.empty())
+         return job;
+
+      auto [a, b, t] = interval(cameras, frame);
+      const Render_job &from = a->job, &to = b->job;
+      job.lookfrom = from.lookfrom + t * (to.lookfrom - from.lookfrom);
+      job.lookat = from.lookat + t * (to.lookat - from.lookat);
+      job.vup = from.vup + t * (to.vup - from.vup);
+      job.vfov = from.vfov + t * (to.vfov - from.vfov);
+      return job;
+   }
+
+   // Positions of the moving spheres at a frame, after `bind`
+   void sphere_updates(int frame, std::vector<Sphere_update> &updates) const
+   {
+      updates.clear();
+      for (const Sphere_update &sphere : rest)
+      {
+         auto [a, b, t] = interval(spheres.at(sphere.index), frame);
+         const Vec3 translate = a->translate + t * (b->translate - a->translate);
+         const double scale = a->scale + t * (b->scale - a->scale);
+         updates.push_back({sphere.index, sphere.center + translate, (real)(sphere.radius * scale)});
+      }
+   }
+
+ private:
+   struct Camera_key
+   {
+      int frame;
+      Render_job job; // Only the camera settings are used
+   };
+
+   struct Sphere_key
+   {
+      int frame = 0;
+      Vec3 translate = Vec3(0, 0, 0);
+      double scale = 1;
+   };
+
+   Render_job base;
+   int n_frames = 0;  // From the `frames` line, 0 to end at the last keyframe
+   int last_key = 0;
+   std::vector<Camera_key> cameras;                // By frame
+   std::map<int, std::vector<Sphere_key>> spheres; // Keyframes of each moving sphere, by frame
+   std::vector<Sphere_update> rest;                // Moving spheres as placed in the scene, set by `bind`
+
+   // The keyframes around a frame, and the position of the frame between them from 0 to 1
+   template <typename Key>
+   static std::tuple<const Key *, const Key *, double> interval(const std::vector<Key> &keys, int frame)
+   {
+      auto next = std::upper_bound(keys.begin(), keys.end(), frame,
+                                   [](int f, const Key &key) { return f < key.frame; });
+      if (next == keys.begin())
+         return {&keys.front(), &keys.front(), 0.0};
+      if (next == keys.end())
+         return {&keys.back(), &keys.back(), 0.0};
+
+      const Key &a = *(next - 1), &b = *next;
+      return {&a, &b, double(frame - a.frame) / (b.frame - a.frame)};
+   }
+};
@@ -0,0 +1,744 @@
+/**
+ * @file bench.cc
+ * @brief Benchmark suite of the renderers, and regression check between two versions
+ *
+ * Renders fixed scenes with every combination of the requested renderers, thread
+ * counts and samples per pixel, and reports for each run:
+ * - the wall time and the time of the render itself, and the throughput in Mrays/s,
+ * - the peak resident memory of the process during the run,
+ * - the RMSE and PSNR against a reference image, when one is found (see below).
+ *
+ * The results are written as JSON, one run per line, so that the results of two versions
+ * can be compared with `--compare`: the exit status is then 2 when a run got slower
+ * than the allowed slowdown.
+ *
+ * **Scenes:** `demo` (`demo_scene`), `spheres-<n>` (`many_spheres`, e.g. `spheres-100k`),
+ * `instanced-<n>` (`instanced_spheres`, e.g. `instanced-100M`, tiles of `INSTANCED_TILE_SPHERES`
+ * spheres) or the path of a scene file (see scene_file.h).
+ *
+ * **References:** `<dir>/end_<spp>s.png` for the demo scene (the images of the finished
+ * project in images/expected), `<dir>/<scene>_<spp>s.png` for the others. A reference
+ * larger than the image by an integer factor is averaged down to its size. The images of
+ * a version can be kept as references with `--save-references`.
+ */
+#include "bvh.h"
+#include "camera.h"
+#include "constants.h"
+#include "scene_file.h"
+#include "scenes.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <map>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#ifdef _WIN32
+#include <io.h>
+#include <windows.h>
+#include <psapi.h>
+#pragma comment(lib, "psapi.lib")
+#define FD_DUP _dup
+#define FD_DUP2 _dup2
+#define FD_OPEN _open
+#define FD_CLOSE _close
+#define NULL_DEVICE "NUL"
+#else
+#include <sys/resource.h>
+#include <unistd.h>
+#define FD_DUP dup
+#define FD_DUP2 dup2
+#define FD_OPEN open
+#define FD_CLOSE close
+#define NULL_DEVICE "/dev/null"
+#endif
+
+#define STB_IMAGE_IMPLEMENTATION
+#include "../external/stb_image.h"
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "../external/stb_image_write.h"
+
+#ifndef BENCH_EXPECTED_DIR
+#define BENCH_EXPECTED_DIR "images/expected" // Set by CMake to the directory of the sources
+#endif
+
+using namespace constants;
+
+constexpr int INSTANCED_TILE_SPHERES = 10000; // Spheres of a tile of the instanced-<n> scenes
+
+// Settings of the benchmark, from the command line
+struct Bench_options
+{
+   vector<string> scenes = {"demo", "spheres-1k", "spheres-100k", "spheres-1M"};
+   vector<int> methods = {0, 1, 2, 3, 4, 5}; // Indices in `render_methods`
+   vector<int> threads = {1, 0};          // Of the threaded renderers, 0 for all hardware threads
+   vector<int> samples = {8};
+   int width = IMAGE_WIDTH;
+   int height = IMAGE_HEIGHT;
+   int max_depth = MAX_DEPTH;
+   unsigned int seed = 123;
+   string expected_dir = BENCH_EXPECTED_DIR; // References, none if empty
+   string save_references;                   // Directory receiving the images as references, none if empty
+   string output = "bench.json";
+   string compare;            // Results of a previous version, none if empty
+   double max_slowdown = 0.1; // Relative slowdown of a run reported as a regression
+   bool verbose = false;      // Keep the output of the renderers
+};
+
+// Results of one run
+struct Bench_run
+{
+   string scene, method;
+   int threads = 1, samples = 0;
+   double wall_ms = 0, render_ms = 0;
+   unsigned long long rays = 0;
+   double mrays_per_s = 0;
+   double peak_rss_mb = 0;
+   string reference; // Path of the reference image, empty without one
+   double rmse = 0, psnr = 0;
+   string error; // Why the run failed, empty on success
+};
+
+//==============================================================================
+// MEASUREMENTS
+//==============================================================================
+
+// Restarts the peak resident memory from the current one, where the system allows it (Linux)
+void resetPeakRss()
+{
+#ifndef _WIN32
+   if (FILE *file = fopen("/proc/self/clear_refs", "w"))
+   {
+      fputs("5", file);
+      fclose(file);
+   }
+#endif
+}
+
+// Peak resident memory in MB, since `resetPeakRss` or else since the start of the process
+double peakRssMb()
+{
+#ifdef _WIN32
+   PROCESS_MEMORY_COUNTERS counters;
+   if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+      return counters.PeakWorkingSetSize / (1024.0 * 1024.0);
+   return 0;
+#else
+   if (FILE *file = fopen("/proc/self/status", "r"))
+   {
+      char line[256];
+      long kb = -1;
+      while (fgets(line, sizeof(line), file))
+         if (sscanf(line, "VmHWM: %ld kB", &kb) == 1)
+            break;
+      fclose(file);
+      if (kb >= 0)
+         return kb / 1024.0;
+   }
+   struct rusage usage;
+   getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+   return usage.ru_maxrss / (1024.0 * 1024.0); // Bytes
+#else
+   return usage.ru_maxrss / 1024.0; // KB
+#endif
+#endif
+}
+
+// Path of the reference of a scene rendered with `samples` samples per pixel, see the top of this file
+string referencePath(const string &dir, const string &scene, int samples)
+{
+   return dir + "/" + (scene == "demo" ? string("end") : scene) + "_" + to_string(samples) + "s.png";
+}
+
+/**
+ * @brief RMSE (on a 0-255 scale) and PSNR of an RGB image against a reference PNG
+ * @return false when the reference does not exist or its size is not a multiple of the image size
+ */
+bool compareWithReference(const string &path, const vector<unsigned char> &image, int width, int height,
+                          double &rmse, double &psnr)
+{
+   int ref_width, ref_height, ref_channels;
+   unsigned char *ref = stbi_load(path.c_str(), &ref_width, &ref_height, &ref_channels, CHANNELS);
+   if (ref == nullptr)
+      return false;
+
+   const int factor = ref_width / width;
+   const bool ok = factor >= 1 && ref_width == factor * width && ref_height == factor * height;
+   if (ok)
+   {
+      double sum = 0;
+      for (int y = 0; y < height; y++)
+      {
+         for (int x = 0; x < width; x++)
+         {
+            for (int c = 0; c < CHANNELS; c++)
+            {
+               // Box filter over the pixels of the reference covered by this pixel
+               double value = 0;
+               for (int j = 0; j < factor; j++)
+                  for (int i = 0; i < factor; i++)
+                     value += ref[((y * factor + j) * ref_width + x * factor + i) * CHANNELS + c];
+               double diff = image[(y * width + x) * CHANNELS + c] - value / (factor * factor);
+               sum += diff * diff;
+            }
+         }
+      }
+      rmse = std::sqrt(sum / ((double)width * height * CHANNELS));
+      psnr = rmse > 0 ? 20 * std::log10(255.0 / rmse) : std::numeric_limits<double>::infinity();
+   }
+
+   stbi_image_free(ref);
+   return ok;
+}
+
+// Silences the standard output while the renderers print their progress (also the `printf`s of
+// the CUDA renderer), unless `verbose`
+class Quiet_output
+{
+ public:
+   Quiet_output(bool verbose)
+   {
+      if (verbose)
+         return;
+      cout.flush();
+      fflush(stdout);
+      saved_fd = FD_DUP(fileno(stdout));
+      int null_fd = FD_OPEN(NULL_DEVICE, O_WRONLY);
+      if (saved_fd < 0 || null_fd < 0 || FD_DUP2(null_fd, fileno(stdout)) < 0)
+      {
+         if (saved_fd >= 0)
+            FD_CLOSE(saved_fd);
+         saved_fd = -1;
+      }
+      if (null_fd >= 0)
+         FD_CLOSE(null_fd);
+   }
+
+   ~Quiet_output()
+   {
+      if (saved_fd < 0)
+         return;
+      cout.flush();
+      fflush(stdout);
+      FD_DUP2(saved_fd, fileno(stdout));
+      FD_CLOSE(saved_fd);
+   }
+
+ private:
+   int saved_fd = -1; // The standard output while it goes to the null device
+};
+
+//==============================================================================
+// JSON
+//==============================================================================
+
+string jsonString(const string &text)
+{
+   string quoted = "\"";
+   for (char ch : text)
+   {
+      if (ch == '"' || ch == '\\')
+         quoted += '\\';
+      quoted += ch;
+   }
+   return quoted + "\"";
+}
+
+// A finite number, or null
+string jsonNumber(double value)
+{
+   if (!std::isfinite(value))
+      return "null";
+   char text[32];
+   snprintf(text, sizeof(text), "%.6g", value);
+   return text;
+}
+
+string runToJson(const Bench_run &run)
+{
+   std::ostringstream out;
+   out << "{\"scene\": " << jsonString(run.scene) << ", \"method\": " << jsonString(run.method)
+       << ", \"threads\": " << run.threads << ", \"spp\": " << run.samples;
+   if (!run.error.empty())
+      return out.str() + ", \"error\": " + jsonString(run.error) + "}";
+
+   out << ", \"wall_ms\": " << jsonNumber(run.wall_ms) << ", \"render_ms\": " << jsonNumber(run.render_ms)
+       << ", \"rays\": " << run.rays << ", \"mrays_per_s\": " << jsonNumber(run.mrays_per_s)
+       << ", \"peak_rss_mb\": " << jsonNumber(run.peak_rss_mb);
+   if (!run.reference.empty())
+      out << ", \"reference\": " << jsonString(run.reference) << ", \"rmse\": " << jsonNumber(run.rmse)
+          << ", \"psnr\": " << jsonNumber(run.psnr);
+   out << "}";
+   return out.str();
+}
+
+// Value of a field of a run written by `runToJson`, empty when it is missing
+string jsonField(const string &line, const string &key)
+{
+   size_t start = line.find("\"" + key + "\": ");
+   if (start == string::npos)
+      return "";
+   start += key.size() + 4;
+   size_t end = line[start] == '"' ? line.find('"', start + 1) + 1 : line.find_first_of(",}", start);
+   string value = line.substr(start, end - start);
+   return value.size() >= 2 && value.front() == '"' ? value.substr(1, value.size() - 2) : value;
+}
+
+string runKey(const string &scene, const string &method, const string &threads, const string &samples)
+{
+   return scene + " " + method + " " + threads + "t " + samples + "spp";
+}
+
+/**
+ * @brief Compares the throughput of the runs with those of a previous results file
+ * @return The number of runs slower than `max_slowdown`, or -1 if the file cannot be read
+ */
+int compareResults(const string &path, const vector<Bench_run> &runs, double max_slowdown)
+{
+   std::ifstream file(path);
+   if (!file)
+      return -1;
+
+   std::map<string, double> previous;
+   string line;
+   while (std::getline(file, line))
+   {
+      string mrays = jsonField(line, "mrays_per_s");
+      if (!mrays.empty() && mrays != "null")
+         previous[runKey(jsonField(line, "scene"), jsonField(line, "method"), jsonField(line, "threads"),
+                         jsonField(line, "spp"))] = atof(mrays.c_str());
+   }
+
+   int regressions = 0;
+   printf("\nComparison with %s (Mrays/s):\n", path.c_str());
+   for (const Bench_run &run : runs)
+   {
+      string key = runKey(run.scene, run.method, to_string(run.threads), to_string(run.samples));
+      auto it = previous.find(key);
+      if (!run.error.empty() || it == previous.end() || it->second <= 0)
+         continue;
+
+      double ratio = run.mrays_per_s / it->second;
+      bool slower = ratio < 1 - max_slowdown;
+      regressions += slower;
+      printf("  %-40s %8.2f -> %8.2f  %+6.1f%%%s\n", key.c_str(), it->second, run.mrays_per_s, 100 * (ratio - 1),
+             slower ? "  REGRESSION" : "");
+   }
+   return regressions;
+}
+
+//==============================================================================
+// COMMAND LINE
+//==============================================================================
+
+vector<string> splitList(const string &text)
+{
+   vector<string> items;
+   std::istringstream in(text);
+   string item;
+   while (std::getline(in, item, ','))
+      if (!item.empty())
+         items.push_back(item);
+   return items;
+}
+
+// Number of spheres of a "<prefix><n>" scene, with an optional k, M or G suffix, -1 for another name
+double sphereCount(const string &scene, const string &prefix)
+{
+   if (scene.compare(0, prefix.size(), prefix) != 0)
+      return -1;
+
+   char *end;
+   double count = strtod(scene.c_str() + prefix.size(), &end);
+   if (*end == 'k')
+      count *= 1e3, end++;
+   else if (*end == 'M')
+      count *= 1e6, end++;
+   else if (*end == 'G')
+      count *= 1e9, end++;
+   return *end == '\0' && count >= 1 ? count : -1;
+}
+
+void printUsage(const char *program)
+{
+   cout << "Usage: " << program << " [options]\n";
+   cout << "Options:\n";
+   cout << "  -h, --help          Show this help message\n";
+   cout << "  --scenes <list>     Scenes: demo, spheres-<n> (e.g. spheres-100k), instanced-<n> (e.g. instanced-100M,\n";
+   cout << "                      instances of tiles of spheres) or scene files\n";
+   cout << "                      (default: demo,spheres-1k,spheres-100k,spheres-1M)\n";
+   cout << "  --methods <list>    Renderers by name or number (default: all, see 302_raytracer -h)\n";
+   cout << "  --threads <list>    Thread counts of the parallel and wavefront renderers, 0 for all hardware\n";
+   cout << "                      threads (default: 1,0)\n";
+   cout << "  --spp <list>        Samples per pixel (default: 8)\n";
+   cout << "  -r <W>x<H>          Resolution (default: " << IMAGE_WIDTH << "x" << IMAGE_HEIGHT << ")\n";
+   cout << "  -d <depth>          Maximum number of rays of a path (default: " << MAX_DEPTH << ")\n";
+   cout << "  --seed <seed>       Seed of the random sequences (default: 123)\n";
+   cout << "  --expected <dir>    Reference images, none if empty (default: " << BENCH_EXPECTED_DIR << ")\n";
+   cout << "  --save-references <dir>\n";
+   cout << "                      Write the first image of each scene and spp there, as a reference\n";
+   cout << "  -o <file>           Results in JSON (default: bench.json)\n";
+   cout << "  --compare <file>    Results of a previous version: exit with 2 when a run got slower\n";
+   cout << "  --max-slowdown <f>  Relative slowdown reported as a regression (default: 0.1)\n";
+   cout << "  -v, --verbose       Keep the output of the renderers\n";
+}
+
+bool parseInput(int argc, char *argv[], Bench_options &opts)
+{
+   for (int i = 1; i < argc; ++i)
+   {
+      const bool has_value = i + 1 < argc;
+      if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0)
+      {
+         printUsage(argv[0]);
+         return false;
+      }
+      else if (strcmp(argv[i], "--scenes") == 0 && has_value)
+      {
+         opts.scenes = splitList(argv[++i]);
+      }
+      else if (strcmp(argv[i], "--methods") == 0 && has_value)
+      {
+         opts.methods.clear();
+         for (const string &name : splitList(argv[++i]))
+         {
+            int method = parse_render_method(name);
+            if (method < 0)
+            {
+               cerr << "Unknown rendering method: " << name << "\n";
+               return false;
+            }
+            opts.methods.push_back(method);
+         }
+      }
+      else if ((strcmp(argv[i], "--threads") == 0 || strcmp(argv[i], "--spp") == 0) && has_value)
+      {
+         vector<int> &values = argv[i][2] == 't' ? opts.threads : opts.samples;
+         values.clear();
+         for (const string &item : splitList(argv[++i]))
+            values.push_back(atoi(item.c_str()));
+      }
+      else if (strcmp(argv[i], "-r") == 0 && has_value)
+      {
+         char end;
+         if (sscanf(argv[++i], "%dx%d%c", &opts.width, &opts.height, &end) != 2 || opts.width <= 0 ||
+             opts.height <= 0)
+         {
+            cerr << "Invalid resolution: " << argv[i] << ", expected <width>x<height>\n";
+            return false;
+         }
+      }
+      else if (strcmp(argv[i], "-d") == 0 && has_value)
+      {
+         opts.max_depth = atoi(argv[++i]);
+      }
+      else if (strcmp(argv[i], "--seed") == 0 && has_value)
+      {
+         opts.seed = (unsigned int)strtoul(argv[++i], nullptr, 10);
+      }
+      else if (strcmp(argv[i], "--expected") == 0 && has_value)
+      {
+         opts.expected_dir = argv[++i];
+      }
+      else if (strcmp(argv[i], "--save-references") == 0 && has_value)
+      {
+         opts.save_references = argv[++i];
+      }
+      else if (strcmp(argv[i], "-o") == 0 && has_value)
+      {
+         opts.output = argv[++i];
+      }
+      else if (strcmp(argv[i], "--compare") == 0 && has_value)
+      {
+         opts.compare = argv[++i];
+      }
+      else if (strcmp(argv[i], "--max-slowdown") == 0 && has_value)
+      {
+         opts.max_slowdown = atof(argv[++i]);
+      }
+      else if (strcmp(argv[i], "-v") == 0 || strcmp(argv[i], "--verbose") == 0)
+      {
+         opts.verbose = true;
+      }
+      else
+      {
+         cerr << "Unknown argument: " << argv[i] << "\n";
+         printUsage(argv[0]);
+         return false;
+      }
+   }
+
+   bool positive = opts.max_depth > 0 && !opts.samples.empty() && !opts.threads.empty();
+   for (int n : opts.samples)
+      positive = positive && n > 0;
+   for (int n : opts.threads)
+      positive = positive && n >= 0;
+   if (!positive)
+   {
+      cerr << "The samples, thread counts and maximum depth must be positive\n";
+      return false;
+   }
+
+   return true;
+}
+
+//==============================================================================
+// BENCHMARK
+//==============================================================================
+
+// Builds or loads a scene by its name, see the top of this file
+bool loadScene(const string &name, Scene_file &scene)
+{
+   if (name == "demo")
+      scene.build(demo_scene());
+   else if (sphereCount(name, "spheres-") > 0 && sphereCount(name, "spheres-") <= 1e8)
+      scene.build(many_spheres((int)sphereCount(name, "spheres-")));
+   else if (sphereCount(name, "instanced-") > 0)
+      scene.build(instanced_spheres(sphereCount(name, "instanced-"), INSTANCED_TILE_SPHERES));
+   else
+      return scene.load(name);
+   return true;
+}
+
+Bench_run runOnce(Camera &c, const Bvh &bvh, Render_method method, const Bench_options &opts,
+                  vector<unsigned char> &image)
+{
+   Bench_run run;
+   RndGen::set_seed(opts.seed);
+   resetPeakRss();
+
+   auto start_time = std::chrono::high_resolution_clock::now();
+   {
+      Quiet_output quiet(opts.verbose);
+      switch (method)
+      {
+      case Render_method::Sequential:
+         c.renderPixels(bvh, image);
+         break;
+      case Render_method::Parallel:
+         c.renderPixelsParallel(bvh, image);
+         break;
+      case Render_method::Wavefront:
+         c.renderPixelsWavefront(bvh, image);
+         break;
+      case Render_method::CUDA:
+      case Render_method::CUDA_wavefront:
+         c.renderPixelsCUDA(bvh, image, method == Render_method::CUDA_wavefront);
+         break;
+      case Render_method::Hybrid:
+         c.renderPixelsHybrid(bvh, image);
+         break;
+      }
+   }
+   auto end_time = std::chrono::high_resolution_clock::now();
+
+   run.wall_ms = std::chrono::duration<double, std::milli>(end_time - start_time).count();
+   run.render_ms = c.stats.render_ms;
+   run.rays = c.stats.rays();
+   run.mrays_per_s = run.render_ms > 0 ? run.rays / (run.render_ms * 1000.0) : 0;
+   run.peak_rss_mb = peakRssMb();
+   if (run.rays == 0)
+      run.error = "no ray traced, the renderer is not available";
+   return run;
+}
+
+bool writeResults(const Bench_options &opts, const vector<Bench_run> &runs, const vector<string> &scene_lines)
+{
+   std::ofstream out(opts.output);
+   if (!out)
+      return false;
+
+#if defined(RNG_ENGINE_XOSHIRO256PP)
+   const char *rng = "xoshiro256++";
+#elif defined(RNG_ENGINE_MT19937)
+   const char *rng = "mt19937";
+#else
+   const char *rng = "pcg32";
+#endif
+#if defined(__clang__)
+   const string compiler = "clang " __clang_version__;
+#elif defined(__GNUC__)
+   const string compiler = "gcc " __VERSION__;
+#elif defined(_MSC_VER)
+   const string compiler = "msvc " + to_string(_MSC_VER);
+#else
+   const string compiler = "unknown";
+#endif
+
+   out << "{\n";
+   out << "  \"version\": " << jsonString(ver_major) << ",\n";
+   out << "  \"build\": {\"precision\": " << jsonString(sizeof(real) == sizeof(float) ? "float" : "double")
+       << ", \"simd\": " << jsonString(Sphere_soa::instruction_set()) << ", \"rng\": " << jsonString(rng)
+       << ", \"compiler\": " << jsonString(compiler) << "},\n";
+   out << "  \"settings\": {\"width\": " << opts.width << ", \"height\": " << opts.height
+       << ", \"max_depth\": " << opts.max_depth << ", \"seed\": " << opts.seed
+       << ", \"hardware_threads\": " << std::thread::hardware_concurrency() << "},\n";
+
+   out << "  \"scenes\": [\n";
+   for (size_t i = 0; i < scene_lines.size(); i++)
+      out << "    " << scene_lines[i] << (i + 1 < scene_lines.size() ? ",\n" : "\n");
+   out << "  ],\n";
+
+   out << "  \"runs\": [\n";
+   for (size_t i = 0; i < runs.size(); i++)
+      out << "    " << runToJson(runs[i]) << (i + 1 < runs.size() ? ",\n" : "\n");
+   out << "  ]\n";
+   out << "}\n";
+
+   return (bool)out;
+}
+
+int main(int argc, char *argv[])
+{
+   Bench_options opts;
+   if (!parseInput(argc, argv, opts))
+      return 1;
+
+   // The thread counts, once resolved, without repetition
+   const int hardware_threads = std::max(1u, std::thread::hardware_concurrency());
+   vector<int> thread_counts;
+   for (int n : opts.threads)
+   {
+      int resolved = n == 0 ? hardware_threads : n;
+      if (std::find(thread_counts.begin(), thread_counts.end(), resolved) == thread_counts.end())
+         thread_counts.push_back(resolved);
+   }
+
+   // A single camera, so that the GPU context is created once
+   Camera c(Vec3(0, 0, 0), opts.width, opts.height, CHANNELS, opts.samples[0]);
+   c.max_depth = opts.max_depth;
+   c.show_progress = opts.verbose;
+   vector<unsigned char> image(opts.width * opts.height * CHANNELS);
+
+   printf("302 ray tracer benchmark v%s: %dx%d, %d hardware threads, %s kernel\n\n", ver_major.c_str(), opts.width,
+          opts.height, hardware_threads, Sphere_soa::instruction_set());
+   printf("%-16s %-15s %7s %5s %10s %10s %9s %9s %8s\n", "Scene", "Method", "Threads", "spp", "Wall (ms)", "Mrays/s",
+          "RSS (MB)", "RMSE", "PSNR");
+
+   vector<Bench_run> runs;
+   vector<string> scene_lines;
+   for (const string &scene_name : opts.scenes)
+   {
+      Scene_file scene;
+      auto start_time = std::chrono::high_resolution_clock::now();
+      if (!loadScene(scene_name, scene))
+         return 1;
+      auto end_time = std::chrono::high_resolution_clock::now();
+      const Bvh &bvh = scene.get_bvh();
+      c.invalidateSceneCUDA();
+
+      scene_lines.push_back("{\"name\": " + jsonString(scene_name) +
+                            ", \"objects\": " + to_string(bvh.build_stats().primitive_count) + ", \"setup_ms\": " +
+                            jsonNumber(std::chrono::duration<double, std::milli>(end_time - start_time).count()) +
+                            ", \"bvh_nodes\": " + to_string(bvh.node_count()) + "}");
+
+      vector<int> saved_samples;
+      for (int method_index : opts.methods)
+      {
+         const Render_method method = render_methods[method_index];
+         const bool threaded = method == Render_method::Parallel || method == Render_method::Wavefront ||
+                               method == Render_method::Hybrid;
+         const bool gpu = method == Render_method::CUDA || method == Render_method::CUDA_wavefront ||
+                          method == Render_method::Hybrid;
+
+         // The first GPU frame creates the context and uploads the scene, which is not measured
+         if (gpu)
+         {
+            c.samples_per_pixel = 1;
+            Bench_run warmup = runOnce(c, bvh, method, opts, image);
+            if (!warmup.error.empty())
+            {
+               warmup.scene = scene_name;
+               warmup.method = render_method_names[method_index];
+               printf("%-16s %-15s %s\n", scene_name.c_str(), warmup.method.c_str(), warmup.error.c_str());
+               runs.push_back(warmup);
+               continue;
+            }
+         }
+
+         for (int samples : opts.samples)
+         {
+            for (int threads : threaded ? thread_counts : vector<int>{1})
+            {
+               c.samples_per_pixel = samples;
+               c.num_threads = threads;
+
+               Bench_run run = runOnce(c, bvh, method, opts, image);
+               run.scene = scene_name;
+               run.method = render_method_names[method_index];
+               run.threads = threads;
+               run.samples = samples;
+
+               if (run.error.empty() && !opts.expected_dir.empty())
+               {
+                  string path = referencePath(opts.expected_dir, scene_name, samples);
+                  if (compareWithReference(path, image, opts.width, opts.height, run.rmse, run.psnr))
+                     run.reference = path;
+               }
+
+               // The first image of each sample count becomes the reference
+               if (run.error.empty() && !opts.save_references.empty() &&
+                   std::find(saved_samples.begin(), saved_samples.end(), samples) == saved_samples.end())
+               {
+                  saved_samples.push_back(samples);
+                  string path = referencePath(opts.save_references, scene_name, samples);
+                  std::filesystem::create_directories(opts.save_references);
+                  if (!stbi_write_png(path.c_str(), opts.width, opts.height, CHANNELS, image.data(),
+                                      opts.width * CHANNELS))
+                     cerr << "Cannot write the reference " << path << endl;
+               }
+
+               if (run.error.empty())
+               {
+                  printf("%-16s %-15s %7d %5d %10.1f %10.2f %9.1f", run.scene.c_str(), run.method.c_str(),
+                         run.threads, run.samples, run.wall_ms, run.mrays_per_s, run.peak_rss_mb);
+                  if (run.reference.empty())
+                     printf(" %9s %8s\n", "-", "-");
+                  else
+                     printf(" %9.3f %8.2f\n", run.rmse, run.psnr);
+               }
+               else
+                  printf("%-16s %-15s %s\n", run.scene.c_str(), run.method.c_str(), run.error.c_str());
+               fflush(stdout);
+
+               runs.push_back(run);
+            }
+         }
+      }
+   }
+
+   if (!writeResults(opts, runs, scene_lines))
+   {
+      cerr << "Cannot write the results to " << opts.output << endl;
+      return 1;
+   }
+   printf("\nResults written to %s\n", opts.output.c_str());
+
+   if (!opts.compare.empty())
+   {
+      int regressions = compareResults(opts.compare, runs, opts.max_slowdown);
+      if (regressions < 0)
+      {
+         cerr << "Cannot read the previous results " << opts.compare << endl;
+         return 1;
+      }
+      if (regressions > 0)
+      {
+         printf("%d runs are more than %.0f%% slower\n", regressions, 100 * opts.max_slowdown);
+         return 2;
+      }
+   }
+
+   return 0;
+}
@@ -0,0 +1,698 @@
+/**
+ * @class Bvh
+ * @brief Bounding volume hierarchy built over the objects of a `Hittable_list`.
+ *
+ * The hierarchy replaces the linear scan of `Hittable_list::hit` by a tree
+ * traversal, so that the cost of a ray grows logarithmically with the number
+ * of objects instead of linearly.
+ *
+ * **Construction:**
+ * - The tree is built top-down using a binned surface area heuristic (SAH):
+ *   the primitive centroids are sorted into `SAH_BINS` buckets along each axis
+ *   and the split plane that minimizes the expected traversal cost is kept.
+ * - When splitting a node is not cheaper than testing its primitives, or when
+ *   it holds few enough primitives, a leaf is created.
+ *
+ * **Memory layout:**
+ * - The nodes are stored in a flat array, in depth-first order. The first
+ *   child of an interior node directly follows it, only the index of the
+ *   second child is stored.
+ * - The primitives are reordered so that those of a leaf are contiguous.
+ * - When the scene only holds spheres, they are also copied in leaf order to
+ *   a `Sphere_soa`, and the spheres of a leaf are tested with SIMD instructions
+ *   instead of one virtual call each.
+ * - The hierarchy can also be built directly over a `Sphere_soa`, without any
+ *   `Sphere` object, or wrap nodes and leaf spheres built beforehand, e.g. those
+ *   of a memory-mapped scene file (see scene_file.h), which are not copied.
+ *
+ * **Animation:** `move_spheres` moves some of the spheres of the SoA leaves and
+ * refits the boxes of their leaves and of the ancestors of these, the topology
+ * of the tree being kept. Only the nodes above the moved spheres are visited.
+ *
+ * Statistics about the construction (node count, depth, build time) are kept
+ * and can be printed with `print_build_report`.
+ */
+#pragma once
+
+#include "aabb.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "sphere_soa.h"
+#include "utils.h"
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+
+/**
+ * @brief A node of the flattened hierarchy
+ */
+struct Bvh_node
+{
+   Aabb bbox;  // Box enclosing all the primitives below this node
+   int offset; // Interior node: index of the second child. Leaf: index of the first primitive
+   int count;  // Number of primitives in a leaf, 0 for an interior node
+   int axis;   // Split axis, used to visit the nearest child first
+
+   bool is_leaf() const { return count > 0; }
+};
+
+/**
+ * @brief New position and radius of a sphere of a hierarchy, see `Bvh::move_spheres`
+ */
+struct Sphere_update
+{
+   int index; // Index of the sphere given to the constructor, its leaf index for a prebuilt hierarchy
+   Point3 center;
+   real radius;
+};
+
+class Bvh : public Hittable
+{
+ public:
+   static constexpr int SAH_BINS = 16;      // Number of buckets used to evaluate the SAH
+   static constexpr int MAX_LEAF_SIZE = 4;  // A node is always split above this number of primitives (or SIMD blocks)
+   static constexpr int MAX_TREE_DEPTH = 64; // Also the size of the traversal stack
+
+   /**
+    * @brief Statistics gathered while building the hierarchy
+    */
+   struct Build_stats
+   {
+      int primitive_count = 0;
+      int node_count = 0;
+      int leaf_count = 0;
+      int max_depth = 0;
+      double build_ms = 0.0;
+      double refit_ms = 0.0; // Time of the last `move_spheres`
+   };
+
+   // Over the spheres of the list as they are stored, unless it also holds other objects
+   Bvh(const Hittable_list &list)
+   {
+      if (list.objects.empty())
+         build_spheres(list.spheres);
+      else
+         build_objects(list.all_objects());
+   }
+
+   Bvh(const vector<shared_ptr<Hittable>> &objects) { build_objects(objects); }
+
+   // Same hierarchy as over the equivalent `Sphere` objects, built without allocating them
+   Bvh(const Sphere_soa &spheres) { build_spheres(spheres); }
+
+   /**
+    * @brief Wraps a hierarchy built beforehand, typically by a `Bvh` saved to a scene file
+    *
+    * The nodes are used in place and must outlive the hierarchy, as must the arrays of
+    * `spheres` when it is a view. The spheres must be in the leaf order of the nodes.
+    */
+   Bvh(const Bvh_node *prebuilt_nodes, int n_prebuilt_nodes, Sphere_soa spheres)
+       : nodes(prebuilt_nodes), n_nodes(n_prebuilt_nodes), leaf_spheres(std::move(spheres))
+   {
+      leaf_block = Sphere_soa::WIDTH;
+      stats.primitive_count = leaf_spheres.size();
+      stats.node_count = n_nodes;
+
+      // The depth, for the statistics, is that of the deepest leaf: a node is one level below
+      // its deepest parent, which precedes it in depth-first order
+      vector<int> depth(n_nodes, 1);
+      for (int i = 0; i < n_nodes; i++)
+      {
+         stats.max_depth = std::max(stats.max_depth, depth[i]);
+         if (nodes[i].is_leaf())
+            stats.leaf_count++;
+         else
+            for (int child : {i + 1, nodes[i].offset})
+               depth[child] = std::max(depth[child], depth[i] + 1);
+      }
+   }
+
+   // The nodes may point into `node_storage`
+   Bvh(const Bvh &) = delete;
+   Bvh &operator=(const Bvh &) = delete;
+
+   bool hit(const Ray &r, Interval ray_t, Hit_record &rec) const override
+   {
+      if (n_nodes == 0)
+         return false;
+
+      const Vec3 &dir = r.direction();
+      const Vec3 inv_dir(1.0 / dir[0], 1.0 / dir[1], 1.0 / dir[2]);
+      const bool dir_is_neg[3] = {inv_dir[0] < 0, inv_dir[1] < 0, inv_dir[2] < 0};
+
+      int stack[MAX_TREE_DEPTH];
+      int stack_size = 0;
+      int current = 0;
+
+      Hit_record tmp;
+      bool hitSomething = false;
+      real closestSoFar = ray_t.max;
+
+      while (true)
+      {
+         const Bvh_node &node = nodes[current];
+
+         if (node.bbox.hit(r.origin(), inv_dir, Interval(ray_t.min, closestSoFar)))
+         {
+            if (node.is_leaf() && !leaf_spheres.empty())
+            {
+               if (leaf_spheres.hit_range(r, Interval(ray_t.min, closestSoFar), tmp, node.offset, node.count))
+               {
+                  hitSomething = true;
+                  closestSoFar = tmp.t;
+                  rec = tmp;
+               }
+            }
+            else if (node.is_leaf())
+            {
+               for (int i = node.offset; i < node.offset + node.count; i++)
+               {
+                  if (primitives[i]->hit(r, Interval(ray_t.min, closestSoFar), tmp))
+                  {
+                     hitSomething = true;
+                     closestSoFar = tmp.t;
+                     rec = tmp;
+                  }
+               }
+            }
+            else
+            {
+               // Visit the child on the side the ray comes from first, so that the
+               // closest hit shrinks the interval before the other child is tested
+               if (dir_is_neg[node.axis])
+               {
+                  stack[stack_size++] = current + 1;
+                  current = node.offset;
+               }
+               else
+               {
+                  stack[stack_size++] = node.offset;
+                  current = current + 1;
+               }
+               continue;
+            }
+         }
+
+         if (stack_size == 0)
+            break;
+         current = stack[--stack_size];
+      }
+
+      return hitSomething;
+   }
+
+   /**
+    * @brief Intersects a packet of coherent rays with the hierarchy
+    *
+    * The packet goes down the tree together: a node is visited when at least one of
+    * its rays, not yet stopped by a closer hit, reaches its box. The leaves then test
+    * all the rays at once. Coherent rays (e.g. the primary rays of neighbouring samples)
+    * mostly visit the same nodes, so the traversal cost is shared by the packet.
+    * Without SoA leaves, each ray is traced on its own.
+    *
+    * @param hits Set to whether each ray hit an object, `recs` is only filled for those
+    */
+   void hit_packet(const Ray_packet &packet, Interval ray_t, Hit_record recs[Ray_packet::SIZE],
+                   bool hits[Ray_packet::SIZE]) const
+   {
+      if (n_nodes == 0 || leaf_spheres.empty())
+      {
+         for (int j = 0; j < packet.count; j++)
+            hits[j] = n_nodes > 0 && hit(packet.ray(j), ray_t, recs[j]);
+         return;
+      }
+
+      const int n = packet.count;
+      real closest[Ray_packet::SIZE];
+      int best[Ray_packet::SIZE];
+      Vec3 inv_dir[Ray_packet::SIZE];
+      for (int j = 0; j < Ray_packet::SIZE; j++)
+      {
+         closest[j] = ray_t.max;
+         best[j] = -1;
+         inv_dir[j] = Vec3(1.0 / packet.dx[j], 1.0 / packet.dy[j], 1.0 / packet.dz[j]);
+      }
+
+      // The first ray decides the visiting order, the rays of a packet being coherent
+      const bool dir_is_neg[3] = {inv_dir[0][0] < 0, inv_dir[0][1] < 0, inv_dir[0][2] < 0};
+
+      int stack[MAX_TREE_DEPTH];
+      int stack_size = 0;
+      int current = 0;
+
+      while (true)
+      {
+         const Bvh_node &node = nodes[current];
+
+         bool any = false;
+         for (int j = 0; j < n && !any; j++)
+            any = node.bbox.hit(Point3(packet.ox[j], packet.oy[j], packet.oz[j]), inv_dir[j],
+                                Interval(ray_t.min, closest[j]));
+
+         if (any)
+         {
+            if (node.is_leaf())
+            {
+               leaf_spheres.hit_packet_range(packet, ray_t.min, closest, best, node.offset, node.count);
+            }
+            else
+            {
+               if (dir_is_neg[node.axis])
+               {
+                  stack[stack_size++] = current + 1;
+                  current = node.offset;
+               }
+               else
+               {
+                  stack[stack_size++] = node.offset;
+                  current = current + 1;
+               }
+               continue;
+            }
+         }
+
+         if (stack_size == 0)
+            break;
+         current = stack[--stack_size];
+      }
+
+      for (int j = 0; j < n; j++)
+      {
+         hits[j] = best[j] >= 0;
+         if (hits[j])
+            leaf_spheres.fill_record(packet.ray(j), closest[j], best[j], recs[j]);
+      }
+   }
+
+   Aabb bounding_box() const override { return n_nodes == 0 ? Aabb() : nodes[0].bbox; }
+
+   const Build_stats &build_stats() const { return stats; }
+
+   // The flattened hierarchy, used to upload it to the GPU and to save it
+   const Bvh_node *get_nodes() const { return nodes; }
+   int node_count() const { return n_nodes; }
+
+   // The primitives in leaf order: in `get_leaf_spheres` when they are all spheres, else in `get_primitives`
+   const vector<shared_ptr<Hittable>> &get_primitives() const { return primitives; }
+   const Sphere_soa &get_leaf_spheres() const { return leaf_spheres; }
+
+   // Position in `get_leaf_spheres` of a sphere given to the constructor
+   int leaf_index(int index) const { return leaf_indices.empty() ? index : leaf_indices[index]; }
+
+   /**
+    * @brief Moves spheres of the SoA leaves, then refits the boxes of the nodes above them
+    *
+    * Only the leaves of the moved spheres and their ancestors are updated, in O(moved spheres * depth).
+    * The topology is kept, so the traversal slows down as the spheres get far from those they were
+    * built with. The nodes and spheres of a prebuilt hierarchy are copied by the first move.
+    * @return false, without moving anything, if a sphere is not in the SoA leaves
+    */
+   bool move_spheres(const vector<Sphere_update> &updates)
+   {
+      if (leaf_spheres.empty())
+         return updates.empty();
+      for (const Sphere_update &update : updates)
+         if (update.index < 0 || update.index >= leaf_spheres.size())
+            return false;
+
+      auto start_time = std::chrono::high_resolution_clock::now();
+      if (nodes != node_storage.data())
+      {
+         node_storage.assign(nodes, nodes + n_nodes);
+         nodes = node_storage.data();
+      }
+      if (parents.empty())
+         link_nodes();
+
+      refitted_nodes.clear();
+      for (const Sphere_update &update : updates)
+      {
+         const int i = leaf_index(update.index);
+         leaf_spheres.set_sphere(i, update.center, update.radius);
+
+         // The ancestors not yet reached by another sphere
+         for (int node = sphere_leaves[i]; node >= 0 && !refit_marks[node]; node = parents[node])
+         {
+            refit_marks[node] = 1;
+            refitted_nodes.push_back(node);
+         }
+      }
+
+      // The children follow their parent in depth-first order, refitting by decreasing index visits them first
+      std::sort(refitted_nodes.begin(), refitted_nodes.end(), std::greater<int>());
+      for (int index : refitted_nodes)
+      {
+         Bvh_node &node = node_storage[index];
+         if (node.is_leaf())
+         {
+            node.bbox = Aabb();
+            for (int i = node.offset; i < node.offset + node.count; i++)
+               node.bbox = Aabb(node.bbox, leaf_spheres.sphere_box(i));
+         }
+         else
+            node.bbox = Aabb(node_storage[index + 1].bbox, node_storage[node.offset].bbox);
+         refit_marks[index] = 0;
+      }
+
+      // All the spheres of the refitted leaves, as the updates of the GPU copy
+      moved_spheres.clear();
+      for (int index : refitted_nodes)
+         if (nodes[index].is_leaf())
+            for (int i = nodes[index].offset; i < nodes[index].offset + nodes[index].count; i++)
+               moved_spheres.push_back(i);
+
+      version++;
+      auto end_time = std::chrono::high_resolution_clock::now();
+      stats.refit_ms = std::chrono::duration<double, std::milli>(end_time - start_time).count();
+      return true;
+   }
+
+   // Incremented by every `move_spheres`, whose changes are listed by `last_moved_spheres` and `last_refitted_nodes`
+   unsigned long geometry_version() const { return version; }
+
+   // The leaf spheres of the leaves refitted by the last `move_spheres`, which include the moved ones
+   const vector<int> &last_moved_spheres() const { return moved_spheres; }
+
+   // The nodes refitted by the last `move_spheres`, by decreasing index
+   const vector<int> &last_refitted_nodes() const { return refitted_nodes; }
+
+   void print_build_report() const
+   {
+      // The hierarchies given prebuilt have no build time
+      cout << "BVH " << (stats.build_ms > 0 ? "built" : "loaded") << " over " << stats.primitive_count
+           << " objects: " << stats.node_count << " nodes (" << stats.leaf_count << " leaves), depth "
+           << stats.max_depth;
+      if (stats.build_ms > 0)
+         cout << ", in " << stats.build_ms << " ms";
+      cout << endl;
+      if (!leaf_spheres.empty())
+         cout << "Sphere leaves stored as SoA, " << Sphere_soa::instruction_set() << " kernel (" << Sphere_soa::WIDTH
+              << " lanes)" << endl;
+   }
+
+ private:
+   struct Build_ref
+   {
+      Aabb bbox;
+      Point3 centroid;
+      int index; // Index of the primitive given to the constructor
+   };
+
+   struct Bin
+   {
+      Aabb bbox;
+      int count = 0;
+   };
+
+   vector<Bvh_node> node_storage;           // Nodes built by this hierarchy
+   const Bvh_node *nodes = nullptr;         // Nodes traversed: `node_storage`, or those given to the constructor
+   int n_nodes = 0;
+   vector<shared_ptr<Hittable>> primitives; // Primitives in leaf order, empty with SoA leaves
+   Sphere_soa leaf_spheres;                 // Copy of the primitives when they are all spheres, empty otherwise
+   int leaf_block = 1;                      // Primitives tested at once in a leaf, Sphere_soa::WIDTH with SoA leaves
+   vector<int> leaf_order;                  // Primitives in leaf order, filled by `make_leaf`
+   vector<int> leaf_indices;                // Inverse of the leaf order, empty for a prebuilt hierarchy
+   Build_stats stats;
+
+   // Links from the bottom of the tree, set by the first `move_spheres`
+   vector<int> parents;            // Parent of each node, -1 for the root
+   vector<int> sphere_leaves;      // Leaf node of each leaf sphere
+   vector<char> refit_marks;       // Nodes reached by the current `move_spheres`, cleared after it
+   vector<int> moved_spheres, refitted_nodes;
+   unsigned long version = 0;
+
+   // Builds over objects of any kind, with SoA leaves when they are all spheres
+   void build_objects(const vector<shared_ptr<Hittable>> &objects)
+   {
+      auto start_time = std::chrono::high_resolution_clock::now();
+
+      // The SoA leaves are only used when every primitive can be stored in them. The spheres
+      // of a leaf are then tested a SIMD block at a time, so the leaves can hold more of them.
+      const bool all_spheres = std::all_of(objects.begin(), objects.end(), [](const shared_ptr<Hittable> &p)
+                                           { return dynamic_cast<const Sphere *>(p.get()) != nullptr; });
+      if (all_spheres)
+         leaf_block = Sphere_soa::WIDTH;
+
+      vector<Aabb> boxes(objects.size());
+      for (size_t i = 0; i < objects.size(); i++)
+         boxes[i] = objects[i]->bounding_box();
+      vector<int> order = build_all(boxes);
+
+      if (all_spheres)
+      {
+         set_leaf_indices(order);
+         leaf_spheres.reserve((int)order.size());
+         for (int i : order)
+            leaf_spheres.add(*static_cast<const Sphere *>(objects[i].get()));
+      }
+      else
+      {
+         primitives.reserve(order.size());
+         for (int i : order)
+            primitives.push_back(objects[i]);
+      }
+
+      auto end_time = std::chrono::high_resolution_clock::now();
+      stats.primitive_count = (int)objects.size();
+      stats.build_ms = std::chrono::duration<double, std::milli>(end_time - start_time).count();
+   }
+
+   // Builds over spheres stored as arrays, the leaves being SoA
+   void build_spheres(const Sphere_soa &spheres)
+   {
+      auto start_time = std::chrono::high_resolution_clock::now();
+      leaf_block = Sphere_soa::WIDTH;
+
+      vector<Aabb> boxes(spheres.size());
+      for (int i = 0; i < spheres.size(); i++)
+         boxes[i] = spheres.sphere_box(i);
+      vector<int> order = build_all(boxes);
+      set_leaf_indices(order);
+
+      leaf_spheres.reserve((int)order.size());
+      for (int i : order)
+         leaf_spheres.add(spheres, i);
+
+      auto end_time = std::chrono::high_resolution_clock::now();
+      stats.primitive_count = spheres.size();
+      stats.build_ms = std::chrono::duration<double, std::milli>(end_time - start_time).count();
+   }
+
+   void set_leaf_indices(const vector<int> &order)
+   {
+      leaf_indices.resize(order.size());
+      for (size_t i = 0; i < order.size(); i++)
+         leaf_indices[order[i]] = (int)i;
+   }
+
+   // Sets the parents of the nodes and the leaves of the spheres, the first child of a node following it
+   void link_nodes()
+   {
+      parents.assign(n_nodes, -1);
+      sphere_leaves.assign(leaf_spheres.size(), 0);
+      refit_marks.assign(n_nodes, 0);
+      for (int i = 0; i < n_nodes; i++)
+      {
+         if (nodes[i].is_leaf())
+            std::fill(sphere_leaves.begin() + nodes[i].offset, sphere_leaves.begin() + nodes[i].offset + nodes[i].count,
+                      i);
+         else
+            parents[i + 1] = parents[nodes[i].offset] = i;
+      }
+   }
+
+   /**
+    * @brief Builds the hierarchy over primitives with the given boxes
+    * @return The indices of the primitives in leaf order
+    */
+   vector<int> build_all(const vector<Aabb> &boxes)
+   {
+      // Cache the box and centroid of every primitive, they are used many times during the build
+      vector<Build_ref> refs(boxes.size());
+      for (size_t i = 0; i < boxes.size(); i++)
+      {
+         refs[i].bbox = boxes[i];
+         refs[i].centroid = boxes[i].centroid();
+         refs[i].index = (int)i;
+      }
+
+      node_storage.reserve(2 * boxes.size());
+      leaf_order.reserve(boxes.size());
+
+      if (!refs.empty())
+         build(refs, 0, (int)refs.size(), 1);
+
+      nodes = node_storage.data();
+      n_nodes = (int)node_storage.size();
+      stats.node_count = n_nodes;
+      return std::move(leaf_order);
+   }
+
+   /**
+    * @brief Recursively builds the subtree for the primitives refs[begin, end)
+    * @return The index of the created node
+    */
+   int build(vector<Build_ref> &refs, int begin, int end, int depth)
+   {
+      int node_index = (int)node_storage.size();
+      node_storage.emplace_back();
+
+      // The centroid bounds are kept unpadded, their extent decides if an axis can be split
+      Aabb bbox;
+      Interval centroid_bounds[3];
+      for (int i = begin; i < end; i++)
+      {
+         bbox = Aabb(bbox, refs[i].bbox);
+         for (int a = 0; a < 3; a++)
+            centroid_bounds[a] = Interval(centroid_bounds[a], Interval(refs[i].centroid[a], refs[i].centroid[a]));
+      }
+
+      node_storage[node_index].bbox = bbox;
+      stats.max_depth = std::max(stats.max_depth, depth);
+
+      int count = end - begin;
+
+      if (count == 1 || depth >= MAX_TREE_DEPTH)
+      {
+         make_leaf(node_index, refs, begin, end);
+         return node_index;
+      }
+
+      int axis, split_bin;
+      double split_cost = find_sah_split(refs, begin, end, bbox, centroid_bounds, axis, split_bin);
+
+      // Testing all the primitives of a leaf costs one unit per primitive (or per SIMD block)
+      if (split_cost >= leaf_cost(count) && count <= MAX_LEAF_SIZE * leaf_block)
+      {
+         make_leaf(node_index, refs, begin, end);
+         return node_index;
+      }
+
+      int mid = begin;
+      if (axis >= 0)
+      {
+         auto it = std::partition(refs.begin() + begin, refs.begin() + end, [&](const Build_ref &ref)
+                                  { return bin_index(ref.centroid[axis], centroid_bounds[axis]) <= split_bin; });
+         mid = (int)(it - refs.begin());
+      }
+
+      // All centroids coincide (or fell into the same bin), fall back to a median split
+      if (mid == begin || mid == end)
+      {
+         axis = 0;
+         for (int a = 1; a < 3; a++)
+            if (centroid_bounds[a].size() > centroid_bounds[axis].size())
+               axis = a;
+         mid = begin + count / 2;
+         std::nth_element(refs.begin() + begin, refs.begin() + mid, refs.begin() + end,
+                          [axis](const Build_ref &a, const Build_ref &b)
+                          { return a.centroid[axis] < b.centroid[axis]; });
+      }
+
+      build(refs, begin, mid, depth + 1);
+      int second_child = build(refs, mid, end, depth + 1);
+
+      node_storage[node_index].offset = second_child;
+      node_storage[node_index].count = 0;
+      node_storage[node_index].axis = axis;
+
+      return node_index;
+   }
+
+   void make_leaf(int node_index, const vector<Build_ref> &refs, int begin, int end)
+   {
+      node_storage[node_index].offset = (int)leaf_order.size();
+      node_storage[node_index].count = end - begin;
+      node_storage[node_index].axis = 0;
+
+      for (int i = begin; i < end; i++)
+         leaf_order.push_back(refs[i].index);
+
+      stats.leaf_count++;
+   }
+
+   // Cost of testing the primitives of a leaf, in units of a node traversal
+   double leaf_cost(int count) const { return (count + leaf_block - 1) / leaf_block; }
+
+   static int bin_index(real c, const Interval &extent)
+   {
+      int b = (int)(SAH_BINS * (c - extent.min) / extent.size());
+      return std::clamp(b, 0, SAH_BINS - 1);
+   }
+
+   /**
+    * @brief Evaluates the binned SAH along the three axes
+    *
+    * The cost of a split is `1 + (A_left * N_left + A_right * N_right) / A_node`,
+    * where the traversal of the node costs one unit, as does a primitive test. With SoA
+    * leaves, N counts the SIMD blocks of `leaf_block` primitives rather than the primitives.
+    *
+    * @param axis Set to the best split axis, or -1 if no split was possible
+    * @param split_bin Set to the last bin going to the left child
+    * @return The cost of the best split found (infinity if none)
+    */
+   double find_sah_split(const vector<Build_ref> &refs, int begin, int end, const Aabb &bbox,
+                         const Interval centroid_bounds[3], int &axis, int &split_bin) const
+   {
+      double best_cost = inf;
+      axis = -1;
+      split_bin = -1;
+
+      double node_area = bbox.surface_area();
+      if (node_area <= 0)
+         return best_cost;
+
+      for (int a = 0; a < 3; a++)
+      {
+         // The centroids are all on a plane perpendicular to this axis
+         if (centroid_bounds[a].size() <= 0)
+            continue;
+
+         Bin bins[SAH_BINS];
+         for (int i = begin; i < end; i++)
+         {
+            Bin &b = bins[bin_index(refs[i].centroid[a], centroid_bounds[a])];
+            b.count++;
+            b.bbox = Aabb(b.bbox, refs[i].bbox);
+         }
+
+         // Sweep from the right to get the area and count of every right side
+         double right_area[SAH_BINS - 1];
+         int right_count[SAH_BINS - 1];
+         Aabb right_box;
+         int count = 0;
+         for (int i = SAH_BINS - 1; i > 0; i--)
+         {
+            right_box = Aabb(right_box, bins[i].bbox);
+            count += bins[i].count;
+            right_area[i - 1] = right_box.surface_area();
+            right_count[i - 1] = count;
+         }
+
+         // Then from the left, evaluating the cost of splitting after each bin
+         Aabb left_box;
+         count = 0;
+         for (int i = 0; i < SAH_BINS - 1; i++)
+         {
+            left_box = Aabb(left_box, bins[i].bbox);
+            count += bins[i].count;
+
+            if (count == 0 || right_count[i] == 0)
+               continue;
+
+            double left_cost = left_box.surface_area() * leaf_cost(count);
+            double right_cost = right_area[i] * leaf_cost(right_count[i]);
+            double cost = 1.0 + (left_cost + right_cost) / node_area;
+            if (cost < best_cost)
+            {
+               best_cost = cost;
+               axis = a;
+               split_bin = i;
+            }
+         }
+      }
+
+      return best_cost;
+   }
+};
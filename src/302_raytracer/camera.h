@@ -7,22 +7,87 @@
  * resolution, and sampling for anti-aliasing.
  */
 
+#include "accumulation_buffer.h"
+#include "bvh.h"
 #include "camera_cuda.h"
 #include "constants.h"
+#include "cuda_scene.h"
+#include "denoiser.h"
 #include "hittable.h"
 #include "material.h"
+#include "render_stats.h"
+#include "sample_batches.h"
+#include "sampler.h"
+#include "trace.h"
 #include "utils.h"
 #include "vec3.h"
+#include "wavefront.h"
 
+#include <algorithm>
 #include <atomic>
 #include <chrono>
+#include <functional>
+#include <iomanip>
 #include <mutex>
+#include <optional>
 #include <sstream>
 #include <thread>
 #include <vector>
 
 #pragma once
 
+// The renderers available for a progressive render
+enum class Render_method
+{
+   Sequential,
+   Parallel,
+   CUDA,
+   Wavefront,      // CPU, parallel, see `renderPassWavefront`
+   CUDA_wavefront, // GPU, one kernel per stage and per bounce
+   Hybrid          // GPU and CPU threads together, see `renderPassHybrid`
+};
+
+// The renderers, in the order of the menu, with their command line names
+const char *const render_method_names[] = {"sequential", "parallel", "cuda", "wavefront", "cuda-wavefront", "hybrid"};
+const Render_method render_methods[] = {Render_method::Sequential,     Render_method::Parallel,
+                                        Render_method::CUDA,           Render_method::Wavefront,
+                                        Render_method::CUDA_wavefront, Render_method::Hybrid};
+const int N_RENDER_METHODS = 6;
+
+// Index of a renderer given by its name or its number in the menu, -1 if unknown
+inline int parse_render_method(const string &text)
+{
+   for (int i = 0; i < N_RENDER_METHODS; i++)
+   {
+      if (text == render_method_names[i] || text == to_string(i))
+         return i;
+   }
+   return -1;
+}
+
+// How a progressive render is cut into passes and when it stops
+struct Progressive_settings
+{
+   int samples_per_pass = 1;  // Samples per pixel added by each pass
+   int target_samples = 0;    // Stop once every pixel has this many samples, 0 for `Camera::samples_per_pixel`
+   double time_budget_ms = 0; // Stop after the first pass ending past this wall-clock time, 0 for no limit
+
+   // Called after each pass with the sums so far and the samples per pixel, e.g. to write a snapshot
+   std::function<void(const Accumulation_buffer &, int)> on_pass;
+};
+
+// Adaptive sampling: when a pixel is considered converged and how the samples are distributed
+struct Adaptive_settings
+{
+   double threshold = 0.05;  // Converged when the noise (standard error) is below this fraction of the luminance
+   int min_samples = 4;      // Samples given to every pixel before its noise is estimated
+   int samples_per_pass = 4; // Samples added to the pixels that have not converged at each pass
+   int max_samples = 0;      // Cap on the samples of a single pixel, 0 for 4 * `Camera::samples_per_pixel`
+
+   // Luminance below which the threshold is absolute, so that dark pixels do not need a tiny relative noise
+   double min_luminance = 0.1;
+};
+
 class Camera
 {
 
@@ -31,6 +96,7 @@ class Camera
    int image_width;
    int image_height;
    int image_channels; // Number of color channels per pixel (e.g., 3 for RGB)
+   Pixel_layout image_layout = Pixel_layout::Interleaved; // Arrangement of the channels in the images rendered
 
    // Camera
    double vfov = 35.0;                   // Vertical field of view in degrees
@@ -39,9 +105,26 @@ class Camera
    Vec3 vup = Vec3(0, 1, 0);             // Camera-relative "up" direction
 
    // Ray tracing
-   std::atomic<long long> n_rays{0};           // Number of rays traced so far with this cam (thread-safe)
-   int samples_per_pixel;                      // Number of samples per pixel for anti-aliasing
-   const int max_depth = constants::MAX_DEPTH; // Maximum ray bounce depth
+   Render_stats stats;                             // Ray statistics of the last frame rendered
+   Accumulation_buffer accumulation;               // Sums of the samples of the last CPU or progressive render
+   int samples_per_pixel;                          // Number of samples per pixel for anti-aliasing
+   Sampler_type sampler = Sampler_type::R2;        // Pattern of the sub-pixel jitter
+   int max_depth = constants::MAX_DEPTH;           // Maximum ray bounce depth
+   int roulette_depth = constants::ROULETTE_DEPTH; // Bounces before Russian roulette, max_depth to disable it
+
+   // Parallel rendering
+   int num_threads = 0; // Number of worker threads, 0 to use all the hardware threads
+   int num_gpus = 0;    // Number of GPUs sharing the samples of `renderPixelsCUDA`, 0 to use all the devices
+
+   // Display the progress of `renderPixels`, `renderPixelsParallel` and `renderPixelsWavefront`,
+   // the polling of which delays the end of short renders by up to 50 ms
+   bool show_progress = true;
+
+   // Also copy the sums of a CUDA frame into `accumulation`, e.g. to save the float colors
+   bool cuda_read_accumulation = false;
+
+   // Denoising of the frames by `denoiseFrame`, none by default
+   Denoise_settings denoise_settings;
 
    Camera(const Point3 &center, const int image_width, const int image_height, const int image_channels,
           int samples_per_pixel = 1)
@@ -53,6 +136,37 @@ class Camera
 
    Camera() : Camera(Vec3(0, 0, 0), 720, 3, 1) {}
 
+   ~Camera()
+   {
+      for (Cuda_context &context : cuda_contexts)
+         cudaRendererDestroy(context.renderer);
+   }
+
+   // The camera owns its GPU contexts
+   Camera(const Camera &) = delete;
+   Camera &operator=(const Camera &) = delete;
+
+   /**
+    * @brief Moves the camera, the next frames are rendered from the new pose
+    * The GPU context is kept, so that the frames of an animation or a batch reuse it.
+    */
+   void setView(const Point3 &from, const Point3 &at, const Vec3 &up, double vfov_degrees)
+   {
+      lookfrom = from;
+      lookat = at;
+      vup = up;
+      vfov = vfov_degrees;
+      initialize();
+   }
+
+   // Changes the size of the images, the GPU buffers are reallocated on the next CUDA frame
+   void setResolution(int width, int height)
+   {
+      image_width = width;
+      image_height = height;
+      initialize();
+   }
+
    /**
     * @brief Renders the entire image sequentially pixel by pixel using ray tracing
     *
@@ -64,27 +178,17 @@ class Camera
     */
    void renderPixels(const Hittable &scene, vector<unsigned char> &image)
    {
-      auto start_time = std::chrono::high_resolution_clock::now();
+      TRACE_SCOPE("render", "sequential frame");
+      beginRender(samples_per_pixel, 1);
 
-      // Render each pixel in the image sequentially
-      for (int y = 0; y < image_height; ++y)
-      {
-         for (int x = 0; x < image_width; ++x)
-         {
-            // Compute the color for this pixel using ray tracing with anti-aliasing
-            Color pixel_color = computePixelColor(scene, x, y);
-
-            // Store the computed color in the image buffer
-            setPixel(image, x, y, pixel_color);
-         }
-
-         // Show progress after completing each row
-         showProgress(y, image_height);
-      }
+      auto start_time = std::chrono::high_resolution_clock::now();
 
-      showProgress(image_height - 1, image_height);
+      renderPassSequential(scene, samples_per_pixel, show_progress);
+      resolveImage(image);
+      stats.record_samples_per_pixel(accumulation.sample_counts());
 
       auto end_time = std::chrono::high_resolution_clock::now();
+      stats.render_ms = std::chrono::duration<double, std::milli>(end_time - start_time).count();
 
       cout << endl;
       cout << "CPU single thread rendering completed in " << timeStr(end_time - start_time) << endl;
@@ -93,11 +197,12 @@ class Camera
    /**
     * @brief Renders the entire image using parallel processing for improved performance
     *
-    * This method divides the image into horizontal chunks and processes them concurrently
-    * using multiple threads. Each thread renders a subset of rows independently, with
-    * thread-safe progress tracking using a mutex. The workload is distributed across
-    * a fixed number of threads with the last thread handling any remaining rows
-    * if the image height doesn't divide evenly.
+    * The image is cut into square tiles of `constants::TILE_SIZE` pixels. The worker
+    * threads pull the next tile to render from a shared atomic counter until all
+    * tiles are done, so that a thread finishing a cheap tile (e.g. sky) immediately
+    * picks up more work instead of sitting idle while others handle the expensive
+    * regions of the image. The calling thread only displays the progress, by polling
+    * the number of completed tiles, so the workers never take a lock.
     *
     * @param scene The hittable scene object containing all geometry to render
     * @param image Vector buffer to store the rendered RGB pixel data (modified in-place)
@@ -105,55 +210,53 @@ class Camera
     */
    void renderPixelsParallel(const Hittable &scene, vector<unsigned char> &image)
    {
-      const int num_threads = std::thread::hardware_concurrency(); // Get the number of available hardware threads
-      std::vector<std::thread> threads(num_threads);
-      std::mutex progress_mutex;
-      int completed_rows = 0; // Track globally completed rows
+      TRACE_SCOPE("render", "parallel frame");
+      const int n_threads = threadCount();
+      beginRender(samples_per_pixel, n_threads);
 
       auto start_time = std::chrono::high_resolution_clock::now();
 
-      auto render_chunk = [&](int start_y, int end_y)
-      {
-         for (int y = start_y; y < end_y; ++y)
-         {
-            for (int x = 0; x < image_width; ++x)
-            {
-               // Compute the color for this pixel using the shared helper method
-               Color pixel_color = computePixelColor(scene, x, y);
+      int n_tiles = renderPassParallel(scene, samples_per_pixel, show_progress);
+      resolveImage(image);
+      stats.record_samples_per_pixel(accumulation.sample_counts());
 
-               // Store the computed color in the image buffer
-               setPixel(image, x, y, pixel_color);
-            }
+      auto end_time = std::chrono::high_resolution_clock::now();
+      stats.render_ms = std::chrono::duration<double, std::milli>(end_time - start_time).count();
 
-            // Update progress - increment global counter and show progress
-            {
-               std::lock_guard<std::mutex> lock(progress_mutex);
-               completed_rows++;
-               showProgress(completed_rows - 1, image_height);
-            }
-         }
-      };
+      cout << endl;
+      cout << "Parallel rendering (using " << n_threads << " threads, " << n_tiles << " tiles of "
+           << constants::TILE_SIZE << "x" << constants::TILE_SIZE << ") completed in "
+           << timeStr(end_time - start_time) << endl;
+   }
 
-      int chunk_size = image_height / num_threads;
-      for (int t = 0; t < num_threads; ++t)
-      {
-         int start_y = t * chunk_size;
-         int end_y = (t == num_threads - 1) ? image_height : start_y + chunk_size;
-         threads[t] = std::thread(render_chunk, start_y, end_y);
-      }
+   /**
+    * @brief Renders the entire image with the wavefront path tracer, on `threadCount()` threads
+    *
+    * Same tiles and same image as `renderPixelsParallel`, but each thread moves all the
+    * paths of a tile one bounce forward at a time, see `renderPassWavefront`.
+    *
+    * @param scene The acceleration structure of the scene to render
+    * @param image Vector buffer to store the rendered RGB pixel data (modified in-place)
+    */
+   void renderPixelsWavefront(const Bvh &scene, vector<unsigned char> &image)
+   {
+      TRACE_SCOPE("render", "wavefront frame");
+      const int n_threads = threadCount();
+      beginRender(samples_per_pixel, n_threads);
 
-      for (auto &thread : threads)
-      {
-         thread.join();
-      }
+      auto start_time = std::chrono::high_resolution_clock::now();
 
-      showProgress(image_height - 1, image_height);
+      int n_tiles = renderPassWavefront(scene, samples_per_pixel, show_progress);
+      resolveImage(image);
+      stats.record_samples_per_pixel(accumulation.sample_counts());
 
       auto end_time = std::chrono::high_resolution_clock::now();
+      stats.render_ms = std::chrono::duration<double, std::milli>(end_time - start_time).count();
 
       cout << endl;
-      cout << "Parallel rendering (using " << num_threads << " threads) completed in " << timeStr(end_time - start_time)
-           << endl;
+      cout << "Wavefront rendering (using " << n_threads << " threads, " << n_tiles << " tiles, up to "
+           << constants::WAVEFRONT_SIZE << " paths in flight per thread) completed in "
+           << timeStr(end_time - start_time) << endl;
    }
 
    /**
@@ -164,28 +267,455 @@ class Camera
     * of each pixel in the image buffer and updates the ray count. The method
     * also measures and displays the time taken for the rendering process.
     *
+    * The GPU context (device buffers, random states, scene) is kept by the
+    * camera between calls, so only the first frame pays for the allocations
+    * and the upload. The scene is flattened and uploaded again only when a
+    * different `Bvh` is passed.
+    *
+    * The sums stay on the device, `accumulation` is only updated with `cuda_read_accumulation`.
+    *
+    * With several devices (see `num_gpus`), they share the samples of the frame, see `renderPassMultiCUDA`,
+    * and the time and the rays of each one are reported.
+    *
+    * @param scene The acceleration structure of the scene to render
     * @param image A vector of unsigned char representing the image buffer where
     *              the rendered pixel data will be stored. The buffer must be
     *              pre-allocated with a size of (image_width * image_height * image_channels).
+    * @param wavefront Use the wavefront pipeline instead of the one-thread-per-pixel kernel
     */
-   void renderPixelsCUDA(vector<unsigned char> &image)
+   void renderPixelsCUDA(const Bvh &scene, vector<unsigned char> &image, bool wavefront = false)
    {
+      TRACE_SCOPE("render", "CUDA frame");
       auto start_time = std::chrono::high_resolution_clock::now();
-      printf("CUDA renderer starting: %dx%d, %d samples, max_depth=%d\n", image_width, image_height, samples_per_pixel,
-             max_depth);
+      const int n_devices = gpuCount();
+      printf("CUDA renderer starting: %dx%d, %d samples, max_depth=%d%s", image_width, image_height,
+             samples_per_pixel, max_depth, wavefront ? ", wavefront" : "");
+      if (n_devices > 1)
+         printf(", %d GPUs", n_devices);
+      printf("\n");
 
-      // Call CUDA rendering function with expanded parameters and get ray count back
-      unsigned long long cuda_ray_count = ::renderPixelsCUDA(
-          image.data(), image_width, image_height, camera_center.x(), camera_center.y(), camera_center.z(),
-          pixel00_loc.x(), pixel00_loc.y(), pixel00_loc.z(), pixel_delta_u.x(), pixel_delta_u.y(), pixel_delta_u.z(),
-          pixel_delta_v.x(), pixel_delta_v.y(), pixel_delta_v.z(), samples_per_pixel, max_depth);
-
-      // Add the CUDA ray count to our atomic counter
-      n_rays.fetch_add(cuda_ray_count, std::memory_order_relaxed);
+      std::vector<Cuda_device_report> report;
+      stats.reset(std::max(1, n_devices));
+      if (n_devices > 1)
+         renderPassMultiCUDA(scene, image, wavefront, n_devices, report);
+      else if (submitFrameCUDA(scene, 0, -1, wavefront))
+         finishFrameCUDA(image, cuda_read_accumulation);
 
       auto end_time = std::chrono::high_resolution_clock::now();
       auto duration = end_time - start_time;
-      cout << "CUDA rendering completed in " << timeStr(duration) << endl;
+      stats.render_ms = std::chrono::duration<double, std::milli>(duration).count();
+      cout << "CUDA rendering completed in " << timeStr(duration);
+      if (n_devices > 1 && (int)report.size() < n_devices)
+         cout << " on " << report.size() << " of " << n_devices << " GPUs";
+      else if (n_devices > 1)
+         cout << " on " << n_devices << " GPUs";
+      cout << endl;
+
+      for (const Cuda_device_report &r : report)
+      {
+         cout << "   GPU " << r.device << " (" << r.name << "): " << r.samples << " samples per pixel in " << r.batches
+              << " batches, busy " << std::fixed << std::setprecision(1) << r.busy_ms << " ms, " << r.rays
+              << " rays (" << std::setprecision(2) << (r.busy_ms > 0 ? r.rays / (r.busy_ms * 1000.0) : 0.0)
+              << " Mrays/s)" << std::defaultfloat << endl;
+      }
+   }
+
+   /**
+    * @brief Renders the image with the GPU and the CPU threads together, see `renderPassHybrid`
+    *
+    * @param scene The acceleration structure of the scene to render
+    * @param image Vector buffer to store the rendered RGB pixel data (modified in-place)
+    */
+   void renderPixelsHybrid(const Bvh &scene, vector<unsigned char> &image)
+   {
+      TRACE_SCOPE("render", "hybrid frame");
+      const int n_threads = threadCount();
+      beginRender(samples_per_pixel, n_threads + 1);
+
+      auto start_time = std::chrono::high_resolution_clock::now();
+
+      int gpu_samples = renderPassHybrid(scene, 0, samples_per_pixel);
+      resolveImage(image);
+      stats.record_samples_per_pixel(accumulation.sample_counts());
+
+      auto end_time = std::chrono::high_resolution_clock::now();
+      stats.render_ms = std::chrono::duration<double, std::milli>(end_time - start_time).count();
+
+      cout << "Hybrid rendering (" << gpu_samples << " samples per pixel on the GPU, "
+           << samples_per_pixel - gpu_samples << " on " << n_threads << " CPU threads) completed in "
+           << timeStr(end_time - start_time) << endl;
+   }
+
+   /**
+    * @brief Renders the image in passes of a few samples per pixel, refining it after each pass
+    *
+    * The samples of all the passes are summed in `accumulation`, and `image` is updated
+    * with the current mean after every pass, so a first noisy image is available after
+    * the first pass instead of at the end of the whole render. The render stops when the
+    * target number of samples per pixel is reached or when the time budget is spent,
+    * whichever comes first. The passes continue the sample sequence of each pixel, so for
+    * a given number of samples the result matches a one-shot render up to float rounding.
+    *
+    * @param scene The acceleration structure of the scene to render
+    * @param image The 8-bit image, updated after every pass
+    * @param method The renderer used for the passes
+    * @param settings Pass size, stopping criterion and snapshot callback
+    * @return The number of samples per pixel rendered
+    */
+   int renderProgressive(const Bvh &scene, vector<unsigned char> &image, Render_method method,
+                         const Progressive_settings &settings)
+   {
+      TRACE_SCOPE("render", "progressive render");
+      const int target = settings.target_samples > 0 ? settings.target_samples : samples_per_pixel;
+      const int per_pass = std::max(1, settings.samples_per_pass);
+
+      beginProgressive(method, target);
+
+      auto start_time = std::chrono::high_resolution_clock::now();
+      int done = 0, passes = 0;
+
+      while (done < target)
+      {
+         const int n = std::min(per_pass, target - done);
+         if (!renderProgressivePass(scene, image, method, done, n))
+            return done;
+
+         done += n;
+         passes++;
+
+         auto elapsed = std::chrono::high_resolution_clock::now() - start_time;
+         cout << "Pass " << passes << ": " << done << "/" << target << " samples per pixel after " << timeStr(elapsed)
+              << "    \r" << std::flush;
+
+         if (settings.on_pass)
+            settings.on_pass(accumulation, done);
+
+         if (settings.time_budget_ms > 0 &&
+             std::chrono::duration<double, std::milli>(elapsed).count() >= settings.time_budget_ms)
+            break;
+      }
+
+      stats.record_samples_per_pixel(accumulation.sample_counts());
+
+      auto end_time = std::chrono::high_resolution_clock::now();
+      stats.render_ms = std::chrono::duration<double, std::milli>(end_time - start_time).count();
+
+      cout << endl;
+      cout << "Progressive rendering completed: " << done << " samples per pixel in " << passes << " passes, "
+           << timeStr(end_time - start_time) << endl;
+      return done;
+   }
+
+   /**
+    * @brief Forgets the samples of the previous render, before the passes of a progressive render
+    *
+    * Only clears the sums, the buffers and the GPU context are kept, so that e.g. an interactive
+    * preview can restart the accumulation whenever the view changes (see `setView`). The GPU
+    * sums restart with the next pass starting at sample 0.
+    *
+    * @param target_samples Samples per pixel of the whole render, which set the stratification of the sampler
+    */
+   void beginProgressive(Render_method method, int target_samples)
+   {
+      const bool threaded = method == Render_method::Parallel || method == Render_method::Wavefront;
+      beginRender(target_samples, method == Render_method::Hybrid ? threadCount() + 1 : threaded ? threadCount() : 1);
+   }
+
+   /**
+    * @brief Adds the samples [first_sample, first_sample + n_samples) to every pixel and updates `image`
+    * with the mean so far, one pass of a progressive render started by `beginProgressive`
+    *
+    * The passes must continue each other, from sample 0. The ray counts of the passes add up in `stats`.
+    *
+    * @return false if the GPU renderer failed
+    */
+   bool renderProgressivePass(const Bvh &scene, vector<unsigned char> &image, Render_method method, int first_sample,
+                              int n_samples)
+   {
+      TRACE_SCOPE_ARGS("pass", "pass", "first sample", first_sample, "samples", n_samples);
+
+      switch (method)
+      {
+      case Render_method::Sequential:
+         renderPassSequential(scene, n_samples, false);
+         break;
+      case Render_method::Parallel:
+         renderPassParallel(scene, n_samples, false);
+         break;
+      case Render_method::Wavefront:
+         renderPassWavefront(scene, n_samples, false);
+         break;
+      case Render_method::CUDA:
+      case Render_method::CUDA_wavefront:
+         if (!submitFrameCUDA(scene, first_sample, n_samples, method == Render_method::CUDA_wavefront))
+            return false;
+         finishFrameCUDA(image, true);
+         return true;
+      case Render_method::Hybrid:
+         renderPassHybrid(scene, first_sample, n_samples);
+         break;
+      }
+
+      resolveImage(image);
+      return true;
+   }
+
+   /**
+    * @brief Renders the image with a number of samples adapted to the noise of each pixel
+    *
+    * All the pixels first get `min_samples` samples. Then, pass after pass, only the pixels
+    * in a region whose estimated noise is still above the threshold get more samples, until
+    * every pixel has converged or reached `max_samples`. Flat regions such as the sky stop after the first
+    * pass, and the samples they did not use go to the noisy regions (diffuse surfaces, shadows).
+    * The total is capped by the budget of a uniform render, `samples_per_pixel` per pixel on
+    * average, checked between passes.
+    *
+    * Only the CPU renderers support adaptive sampling, the GPU and hybrid methods use the parallel one.
+    *
+    * @param scene The scene to render
+    * @param image The 8-bit image, updated after every pass
+    * @param method The renderer used for the passes
+    * @param settings Convergence criterion and sample distribution
+    */
+   void renderAdaptive(const Bvh &scene, vector<unsigned char> &image, Render_method method,
+                       const Adaptive_settings &settings)
+   {
+      TRACE_SCOPE("render", "adaptive render");
+      const bool parallel = method != Render_method::Sequential;
+      const int max_samples = settings.max_samples > 0 ? settings.max_samples : 4 * samples_per_pixel;
+      const size_t budget = (size_t)samples_per_pixel * image_width * image_height;
+
+      Adaptive_settings pass_settings = settings;
+      pass_settings.max_samples = max_samples;
+
+      beginRender(samples_per_pixel, parallel ? threadCount() : 1);
+
+      auto start_time = std::chrono::high_resolution_clock::now();
+      size_t spent = 0;
+      int passes = 0;
+
+      while (spent < budget)
+      {
+         // The first pass samples every pixel, the next ones only those that still need it
+         const bool first_pass = passes == 0;
+         const int n = first_pass ? std::min(settings.min_samples, max_samples) : settings.samples_per_pass;
+
+         size_t active = first_pass ? (size_t)image_width * image_height : updateActivePixels(pass_settings);
+         if (active == 0 || n <= 0)
+            break;
+         TRACE_SCOPE_ARGS("pass", "pass", "active pixels", (long long)active, "samples", n);
+
+         if (method == Render_method::Wavefront)
+            renderPassWavefront(scene, n, false, !first_pass);
+         else if (parallel)
+            renderPassParallel(scene, n, false, !first_pass);
+         else
+            renderPassSequential(scene, n, false, !first_pass);
+
+         spent += active * n;
+         passes++;
+
+         cout << "Pass " << passes << ": " << active << " pixels sampled, " << std::fixed << std::setprecision(1)
+              << 100.0 * spent / budget << " % of the budget used    \r" << std::defaultfloat << std::flush;
+      }
+
+      resolveImage(image);
+      stats.record_samples_per_pixel(accumulation.sample_counts());
+
+      auto end_time = std::chrono::high_resolution_clock::now();
+      stats.render_ms = std::chrono::duration<double, std::milli>(end_time - start_time).count();
+
+      cout << endl;
+      cout << "Adaptive rendering completed in " << passes << " passes, " << timeStr(end_time - start_time) << endl;
+   }
+
+   /**
+    * @brief Adds the samples [first_sample, first_sample + n_samples) of the pixels [x0, x1) x [y0, y1) to
+    * `accumulation`
+    *
+    * One part of a frame rendered by a worker of a distributed render, see distributed.h. Since the random
+    * sequence of a sample only depends on its pixel and its index, the parts merged by the coordinator give
+    * the image of a render on one machine. The sums of the rectangle only hold the samples of the range (its
+    * counts include the samples before it), the other pixels are not rendered.
+    *
+    * The GPU renderers trace the whole image. Their random states are not counter-based, so a range is traced
+    * with a seed depending on `first_sample` to stay independent of the others. The hybrid renderer shares
+    * a whole frame between the GPU and the CPU threads, and renders the smaller rectangles on the CPU.
+    *
+    * @param total_samples Samples per pixel of the whole frame, which set the stratification of the sampler
+    * @return false if the GPU renderer failed
+    */
+   bool renderRegion(const Bvh &scene, Render_method method, int x0, int y0, int x1, int y1, int first_sample,
+                     int n_samples, int total_samples)
+   {
+      TRACE_SCOPE_ARGS("render", "region", "x", x0, "y", y0);
+      const bool whole_frame = x0 <= 0 && y0 <= 0 && x1 >= image_width && y1 >= image_height;
+      const bool hybrid = method == Render_method::Hybrid && whole_frame;
+      const bool threaded = method == Render_method::Parallel || method == Render_method::Wavefront ||
+                            method == Render_method::Hybrid;
+      beginRender(total_samples, hybrid ? threadCount() + 1 : threaded ? threadCount() : 1);
+
+      auto start_time = std::chrono::high_resolution_clock::now();
+      bool ok = true;
+
+      if (hybrid)
+         renderPassHybrid(scene, first_sample, n_samples);
+      else if (method == Render_method::CUDA || method == Render_method::CUDA_wavefront)
+      {
+         const unsigned int seed = (unsigned int)RndGen::get_seed();
+         RndGen::set_seed(first_sample == 0 ? seed : (unsigned int)RndGen::hash(seed ^ RndGen::hash(first_sample)));
+
+         std::vector<unsigned char> image((size_t)image_width * image_height * image_channels);
+         ok = submitFrameCUDA(scene, first_sample, n_samples, method == Render_method::CUDA_wavefront, 0);
+         if (ok)
+            finishFrameCUDA(image, true);
+         RndGen::set_seed(seed);
+      }
+      else
+      {
+         // The range continues the sample sequence of the pixels of the rectangle, and only they are sampled
+         accumulation.set_all_counts(first_sample);
+         active_pixels.assign((size_t)image_width * image_height, 0);
+         for (int y = std::max(0, y0); y < std::min(y1, image_height); ++y)
+            std::fill_n(active_pixels.begin() + (size_t)y * image_width + std::max(0, x0),
+                        std::max(0, std::min(x1, image_width) - std::max(0, x0)), 1);
+
+         if (method == Render_method::Wavefront)
+            renderPassWavefront(scene, n_samples, false, true);
+         else if (threaded)
+            renderPassParallel(scene, n_samples, false, true);
+         else
+            renderPassSequential(scene, n_samples, false, true);
+      }
+
+      auto end_time = std::chrono::high_resolution_clock::now();
+      stats.render_ms = std::chrono::duration<double, std::milli>(end_time - start_time).count();
+      return ok;
+   }
+
+   /**
+    * @brief Starts rendering a frame on the GPU without waiting for it
+    *
+    * Together with `finishFrameCUDA`, this allows to pipeline a sequence of frames:
+    * the readback of a frame overlaps the rendering of the next one when the next
+    * frame is submitted before the previous one is finished. At most two frames
+    * can be in flight.
+    *
+    * The samples are summed in a float buffer kept on the device. A frame starting at
+    * sample 0 restarts the sums, later frames add to them and the returned image is the
+    * mean of all the samples so far.
+    *
+    * @param first_sample Index of the first sample of the frame
+    * @param n_samples Samples per pixel of the frame, or -1 for `samples_per_pixel`
+    * @param wavefront Use the wavefront pipeline instead of the one-thread-per-pixel kernel
+    * @param summed_samples Samples already summed on the device, 0 to restart the sums, -1 for `first_sample`
+    *                       (the frames continue each other)
+    * @return false if the frame could not be started
+    */
+   bool submitFrameCUDA(const Bvh &scene, int first_sample = 0, int n_samples = -1, bool wavefront = false,
+                        int summed_samples = -1)
+   {
+      return submitFrameOnDevice(0, scene, first_sample, n_samples, wavefront, summed_samples);
+   }
+
+   /**
+    * @brief Waits for the oldest frame submitted with `submitFrameCUDA` and copies it to `image`
+    * The ray counters of the frame are added to `stats`.
+    *
+    * @param read_accumulation Also copy the device sums into `accumulation`. Only valid with
+    *                          a single frame in flight, since the sums are those of the last frame.
+    */
+   void finishFrameCUDA(vector<unsigned char> &image, bool read_accumulation = false)
+   {
+      if (!finishFrameOnDevice(0, image, cuda_shard))
+         return;
+      cuda_resolved_device = 0;
+      Accumulation_buffer::repack(image, (size_t)image_width * image_height, image_channels, image_layout);
+
+      if (read_accumulation)
+         readAccumulationCUDA(0);
+   }
+
+   /**
+    * @brief Forgets the uploaded scene, so that it is uploaded again on the next CUDA frame
+    * To be called when the `Bvh` passed to the CUDA renderer is modified in place.
+    */
+   void invalidateSceneCUDA()
+   {
+      for (Cuda_context &context : cuda_contexts)
+         context.scene = nullptr;
+   }
+
+   /**
+    * @brief Averages the albedo and the normal of the first hit of `constants::AOV_SAMPLES` jittered primary rays
+    * per pixel, the auxiliary buffers of the denoisers
+    *
+    * Traced on the CPU threads whatever the renderer of the image, only one hit per ray. The rays are
+    * not counted in `stats`.
+    */
+   void renderAovs(const Hittable &scene, Aov_buffers &aovs)
+   {
+      TRACE_SCOPE("cpu", "render aovs");
+      aovs.resize(image_width, image_height);
+      forEachTileParallel(false,
+                          [&](int, int x0, int y0, int x1, int y1)
+                          {
+                             for (int y = y0; y < y1; ++y)
+                             {
+                                for (int x = x0; x < x1; ++x)
+                                   aovPixel(scene, x, y, aovs);
+                             }
+                          });
+   }
+
+   /**
+    * @brief Denoises the frame last rendered with `method` into `image`, with `denoise_settings`
+    *
+    * The a-trous filter runs on the device of the CUDA frames and on the CPU threads otherwise, taking
+    * the sums of `accumulation`. Open Image Denoise takes the sums from the host, read back from the
+    * device for the CUDA frames.
+    *
+    * @param aovs The buffers of `renderAovs` for the view of the frame
+    * @param colors Receives the denoised float RGB colors, e.g. for the float formats
+    * @return false, `image` being left as it is, without denoiser or on error
+    */
+   bool denoiseFrame(const Aov_buffers &aovs, Render_method method, vector<unsigned char> &image,
+                     vector<float> &colors)
+   {
+      if (denoise_settings.type == Denoiser_type::None)
+         return false;
+
+      TRACE_SCOPE("cpu", "denoise");
+
+      const size_t n_pixels = (size_t)image_width * image_height;
+      const bool cuda = method == Render_method::CUDA || method == Render_method::CUDA_wavefront;
+      Cuda_context &context = cuda_contexts[cuda_resolved_device];
+      colors.resize(n_pixels * 3);
+      if (cuda && context.renderer != nullptr && denoise_settings.type == Denoiser_type::Atrous)
+      {
+         Cuda_denoise_params params{denoise_settings.iterations, denoise_settings.sigma_color,
+                                    denoise_settings.sigma_normal, denoise_settings.sigma_albedo};
+         if (!cudaRendererDenoise(context.renderer, context.samples, aovs.albedo.data(), aovs.normal.data(),
+                                  &params, image.data(), colors.data()))
+            return false;
+      }
+      else
+      {
+         if (cuda && context.renderer != nullptr)
+            readAccumulationCUDA(cuda_resolved_device);
+         accumulation.resolve(colors);
+
+         if (denoise_settings.type == Denoiser_type::Atrous)
+            denoise::atrous(colors, aovs, denoise_settings, threadCount());
+         else if (!denoise::oidn(colors, aovs))
+            return false;
+
+         // Same mapping as `Accumulation_buffer::resolve`
+         for (size_t i = 0; i < n_pixels * 3; i++)
+            image[i] = (unsigned char)(256.0f * std::min(std::max(colors[i], 0.0f), 0.999f));
+      }
+      Accumulation_buffer::repack(image, n_pixels, image_channels, image_layout);
+      return true;
    }
 
  private:
@@ -195,6 +725,26 @@ class Camera
    Vec3 pixel_delta_v;   // Offset to pixel below
    Vec3 u, v, w;         // Camera frame basis vectors
 
+   // Persistent GPU context of a device, created on its first CUDA frame
+   struct Cuda_context
+   {
+      Cuda_renderer *renderer = nullptr;
+      const Bvh *scene = nullptr; // Scene currently uploaded to the device
+      unsigned long scene_version = 0; // Its `Bvh::geometry_version` at the upload
+      int samples = 0;            // Samples per pixel summed on the device after the last submitted frame
+#ifdef RT_TRACE
+      double submit_us[2];             // Trace time of the submission of the frames in flight
+      int submitted = 0, finished = 0; // Frames submitted and finished, to find their submission time
+#endif
+   };
+   std::vector<Cuda_context> cuda_contexts = std::vector<Cuda_context>(1); // Indexed by device
+   int cuda_shard = 0; // Statistics shard of the CUDA frames, after those of the CPU threads if hybrid
+   int cuda_resolved_device = 0; // Device holding the sums of all the samples of the last CUDA frame
+
+   int planned_samples = 1; // Samples per pixel of the current render, sets the stratification of the sampler
+
+   std::vector<unsigned char> active_pixels; // Pixels sampled by the current adaptive pass
+
    void initialize()
    {
       camera_center = lookfrom;
@@ -226,103 +776,1013 @@ class Camera
    }
 
    /**
-    * @brief Computes the color for a single pixel using ray tracing with anti-aliasing
-    * This helper method contains the core pixel rendering logic
+    * @brief Marks the pixels that need more samples in the next adaptive pass, returns their number
     *
-    * @param scene The scene to render
-    * @param x Pixel x coordinate
-    * @param y Pixel y coordinate
-    * @return Color The computed pixel color after anti-aliasing
+    * The noise of a pixel estimated from a handful of samples is unreliable: a pixel in a
+    * penumbra may get identical samples by chance and look converged. The worst relative
+    * noise of the 3x3 neighbourhood is therefore used, so that a pixel keeps sampling as long
+    * as its region is noisy. The mask is computed between passes, the passes only read it.
     */
-   Color computePixelColor(const Hittable &scene, int x, int y)
+   size_t updateActivePixels(const Adaptive_settings &settings)
    {
-      Color pixel_color(0, 0, 0); // The pixel color starts as black
+      active_pixels.assign((size_t)image_width * image_height, 0);
 
-      // Supersampling anti-aliasing by averaging multiple samples per pixel
-      for (int s = 0; s < samples_per_pixel; ++s)
+      // Relative noise of every pixel
+      std::vector<float> noise((size_t)image_width * image_height);
+      for (int y = 0; y < image_height; ++y)
       {
-         // Random offsets in the range [-0.5, 0.5) for jittering around the pixel
-         // are but remain within the pixel area
-         double offset_x = RndGen::random_double() - 0.5;
-         double offset_y = RndGen::random_double() - 0.5;
+         for (int x = 0; x < image_width; ++x)
+         {
+            double luminance = Accumulation_buffer::luminance(accumulation.mean(x, y));
+            noise[(size_t)y * image_width + x] =
+                (float)(accumulation.standard_error(x, y) / std::max(luminance, settings.min_luminance));
+         }
+      }
 
-         // Calculate the direction of the ray for the current pixel
-         Vec3 pixel_center = pixel00_loc + (x + offset_x) * pixel_delta_u + (y + offset_y) * pixel_delta_v;
-         Vec3 ray_direction = pixel_center - camera_center;
+      size_t active = 0;
+      for (int y = 0; y < image_height; ++y)
+      {
+         for (int x = 0; x < image_width; ++x)
+         {
+            if (accumulation.samples(x, y) >= settings.max_samples)
+               continue;
 
-         // Create a ray from the camera center through the pixel
-         Ray ray(camera_center, unit_vector(ray_direction));
+            float worst = 0;
+            for (int ny = std::max(0, y - 1); ny <= std::min(image_height - 1, y + 1); ++ny)
+               for (int nx = std::max(0, x - 1); nx <= std::min(image_width - 1, x + 1); ++nx)
+                  worst = std::max(worst, noise[(size_t)ny * image_width + nx]);
 
-         // And launch baby, launch the ray to get the color
-         Color sample(ray_color(ray, scene, max_depth));
-         pixel_color += sample;
+            if (worst > settings.threshold)
+            {
+               active_pixels[(size_t)y * image_width + x] = 1;
+               active++;
+            }
+         }
       }
 
-      pixel_color /= samples_per_pixel; // Average the samples
-      return pixel_color;
+      return active;
    }
 
+   // Whether a pixel is sampled by the current adaptive pass, see `updateActivePixels`
+   inline bool needsSamples(int x, int y) const { return active_pixels[(size_t)y * image_width + x] != 0; }
+
+   // Position of a pixel in its tile
+   struct Tile_offset
+   {
+      int x, y;
+   };
+
    /**
-    * Computes the color seen along a ray by tracing it through the scene
+    * @brief The pixels of a tile of `constants::TILE_SIZE` pixels in Morton (Z) order
+    * The bits of the index alternate between x and y, so that the pixels traced one after the
+    * other are neighbours: their rays reach the same nodes of the hierarchy, still in the cache,
+    * instead of starting each row of the tile anew. The pixels past the edge of the image are
+    * skipped by the renderers.
     */
-   inline Color ray_color(const Ray &r, const Hittable &world, int depth)
+   static const std::vector<Tile_offset> &tileOrder()
    {
-      if (depth <= 0)
-         return Color(0, 0, 0); // No more light is gathered
-
-      n_rays.fetch_add(1, std::memory_order_relaxed);
-
-      Hit_record rec;
+      static_assert((constants::TILE_SIZE & (constants::TILE_SIZE - 1)) == 0, "The tiles must be a power of 2");
 
-      if (world.hit(r, Interval(0.0001, inf), rec))
+      static const std::vector<Tile_offset> order = []
       {
-         Ray scattered;
-         Color attenuation;
-
-         if (Constant *c = dynamic_cast<Constant *>(rec.mat_ptr.get()))
-         {
-            return c->color;
-         }
-
-         if (ShowNormals *c = dynamic_cast<ShowNormals *>(rec.mat_ptr.get()))
+         std::vector<Tile_offset> pixels(constants::TILE_SIZE * constants::TILE_SIZE);
+         for (int i = 0; i < (int)pixels.size(); i++)
          {
-            rec.mat_ptr->scatter(r, rec, attenuation, scattered);
-            return attenuation;
+            pixels[i] = {0, 0};
+            for (int bit = 0; (1 << 2 * bit) < (int)pixels.size(); bit++)
+            {
+               pixels[i].x |= ((i >> 2 * bit) & 1) << bit;
+               pixels[i].y |= ((i >> (2 * bit + 1)) & 1) << bit;
+            }
          }
+         return pixels;
+      }();
+      return order;
+   }
 
-         if (rec.mat_ptr->scatter(r, rec, attenuation, scattered))
+   // Clears the accumulation and the statistics before a new render
+   void beginRender(int planned, int n_shards)
+   {
+      accumulation.resize(image_width, image_height);
+      planned_samples = planned;
+      stats.reset(n_shards);
+   }
+
+   /**
+    * @brief Adds `n_samples` samples to every pixel of `accumulation`
+    * The statistics go to shard 0.
+    *
+    * @param adaptive Only sample the pixels marked by `updateActivePixels`
+    */
+   void renderPassSequential(const Hittable &scene, int n_samples, bool show_progress, bool adaptive = false)
+   {
+      Thread_stats &thread_stats = stats.shard(0);
+
+      // Render each pixel in the image sequentially
+      for (int y = 0; y < image_height; ++y)
+      {
+         TRACE_SCOPE_ARGS("tile", "row", "x", 0, "y", y);
+         for (int x = 0; x < image_width; ++x)
+         {
+            if (!adaptive || needsSamples(x, y))
+               accumulatePixel(scene, x, y, n_samples, thread_stats, accumulation);
+         }
+
+         // Show progress after completing each row
+         if (show_progress)
+            showProgress(y, image_height);
+      }
+   }
+
+   /**
+    * @brief Same as `renderPassSequential`, with the tiles shared by `threadCount()` threads
+    * The statistics must have been reset with at least as many shards as threads.
+    *
+    * The pixels of a tile are traced in Morton order (see `tileOrder`), into a tile buffer of the
+    * thread merged into `accumulation` at the end of the tile. The samples of a pixel do not depend
+    * on the order, so the image is the same as with `renderPassSequential`.
+    *
+    * @return The number of tiles
+    */
+   int renderPassParallel(const Hittable &scene, int n_samples, bool show_progress, bool adaptive = false)
+   {
+      std::vector<Tile_accumulation> tiles(threadCount());
+
+      return forEachTileParallel(show_progress,
+                                 [&](int thread_index, int x0, int y0, int x1, int y1)
+                                 {
+                                    Thread_stats &thread_stats = stats.shard(thread_index);
+                                    Tile_accumulation &tile = tiles[thread_index];
+                                    tile.begin(x0, y0, x1, y1);
+                                    for (const Tile_offset &offset : tileOrder())
+                                    {
+                                       const int x = x0 + offset.x, y = y0 + offset.y;
+                                       if (x < x1 && y < y1 && (!adaptive || needsSamples(x, y)))
+                                          accumulatePixel(scene, x, y, n_samples, thread_stats, tile);
+                                    }
+                                    accumulation.merge(tile);
+                                 });
+   }
+
+   /**
+    * @brief Same as `renderPassParallel`, each thread rendering its tiles with the wavefront path tracer
+    *
+    * The paths of a tile are moved forward in waves of up to `constants::WAVEFRONT_SIZE`
+    * paths (see wavefront.h): all the rays of a bounce are intersected, then shaded
+    * grouped by material, and the scattered rays are queued for the next bounce. Every
+    * path has its own random sequence, so the image is the same as with `renderPassParallel`.
+    *
+    * @return The number of tiles
+    */
+   int renderPassWavefront(const Bvh &scene, int n_samples, bool show_progress, bool adaptive = false)
+   {
+      std::vector<Wavefront_state> states(threadCount());
+
+      return forEachTileParallel(show_progress,
+                                 [&](int thread_index, int x0, int y0, int x1, int y1)
+                                 {
+                                    renderTileWavefront(scene, x0, y0, x1, y1, n_samples, adaptive,
+                                                        states[thread_index], stats.shard(thread_index));
+                                 });
+   }
+
+   /**
+    * @brief Adds the samples [first_sample, first_sample + n_samples) to every pixel, on the GPU and the CPU
+    * threads together
+    *
+    * The samples are cut into `constants::SAMPLE_BATCHES` batches of whole frames that the GPU (driven by
+    * its own thread) and the parallel CPU renderer take at their own pace, see sample_batches.h, so that
+    * the split follows their throughputs and the slower device does not delay the end. The sums of the GPU
+    * are added to `accumulation` at the end. If the GPU is not available, all the batches are rendered on
+    * the CPU.
+    *
+    * The CPU and GPU renderers trace the same paths, but with different random sequences: the image has
+    * the same expected value whatever the split, not the same noise. A pass of a few samples only has a
+    * few batches, the passes of a progressive render should have several samples to be shared.
+    *
+    * The statistics must have been reset with one shard more than the threads, the last one for the GPU.
+    *
+    * @return The samples per pixel rendered on the GPU
+    */
+   int renderPassHybrid(const Bvh &scene, int first_sample, int n_samples)
+   {
+      const int n_threads = threadCount();
+
+      enum Device
+      {
+         CPU,
+         GPU
+      };
+      Sample_batches batches(first_sample, n_samples, constants::SAMPLE_BATCHES, 2);
+
+      // The GPU sums restart with the first batch of the pass, whatever its samples
+      int gpu_samples = 0;
+      std::vector<unsigned char> gpu_image((size_t)image_width * image_height * image_channels);
+      cuda_shard = n_threads;
+      std::thread gpu(
+          [&]
+          {
+             TRACE_THREAD("GPU driver", -1);
+             batches.run(GPU,
+                         [&](int first, int n)
+                         {
+                            if (!submitFrameCUDA(scene, first, n, false, gpu_samples))
+                               return false;
+                            finishFrameCUDA(gpu_image);
+                            gpu_samples += n;
+                            return true;
+                         });
+          });
+
+      // The CPU batches continue the sample sequence of the pixels from their first sample
+      auto render_cpu = [&](int first, int n)
+      {
+         accumulation.set_all_counts(first);
+         renderPassParallel(scene, n, false);
+         return true;
+      };
+      batches.run(CPU, render_cpu);
+      gpu.join();
+      cuda_shard = 0;
+
+      // The batches that failed on the GPU after the CPU stopped
+      batches.run(CPU, render_cpu);
+
+      if (gpu_samples > 0)
+      {
+         std::vector<float> sums((size_t)image_width * image_height * 3);
+         if (cudaRendererReadAccumulation(cuda_contexts[0].renderer, sums.data()))
+         {
+            for (int y = 0; y < image_height; ++y)
+            {
+               for (int x = 0; x < image_width; ++x)
+               {
+                  const float *sum = &sums[((size_t)y * image_width + x) * 3];
+                  accumulation.add(x, y, Color(sum[0], sum[1], sum[2]), 0, 0);
+               }
+            }
+         }
+      }
+      accumulation.set_all_counts(first_sample + n_samples);
+      return gpu_samples;
+   }
+
+   // The share of a multi-GPU frame rendered by one device, see `renderPassMultiCUDA`
+   struct Cuda_device_report
+   {
+      int device;
+      std::string name;
+      int samples, batches;
+      double busy_ms;
+      unsigned long long rays;
+   };
+
+   /**
+    * @brief Renders the frame on the GPUs [0, n_devices), which share its samples
+    *
+    * The scene is flattened once and uploaded to every device. The samples per pixel are cut into batches
+    * that the devices, each one driven by its own thread, take at their own pace (see sample_batches.h),
+    * so that a faster card renders more of them. Each device sums its samples in its own buffer. The sums
+    * of the other devices are then added to those of the first one, directly between the cards when they
+    * have peer access, and the first device resolves the image.
+    *
+    * The random states of each device have their own seed: the image has the same expected value as on
+    * one device, not the same noise.
+    *
+    * The statistics must have been reset with one shard per device.
+    *
+    * @return false if no device rendered anything
+    */
+   bool renderPassMultiCUDA(const Bvh &scene, vector<unsigned char> &image, bool wavefront, int n_devices,
+                            std::vector<Cuda_device_report> &report)
+   {
+      // The contexts are created here, before the threads take references to them
+      std::vector<char> ready(n_devices);
+      {
+         std::optional<Cuda_scene> flat;
+         for (int device = 0; device < n_devices; device++)
+            ready[device] = prepareDeviceCUDA(device, scene, &flat);
+      }
+
+      Sample_batches batches(0, samples_per_pixel, std::max(constants::SAMPLE_BATCHES, 4 * n_devices), n_devices);
+      std::vector<int> summed(n_devices, 0); // Samples summed by each device
+      std::vector<std::vector<unsigned char>> images(n_devices);
+
+      auto render_on = [&](int device)
+      {
+         return [&, device](int first, int n)
+         {
+            images[device].resize((size_t)image_width * image_height * image_channels);
+            if (!submitFrameOnDevice(device, scene, first, n, wavefront, summed[device]))
+               return false;
+            finishFrameOnDevice(device, images[device], device);
+            summed[device] += n;
+            return true;
+         };
+      };
+
+      std::vector<std::thread> threads;
+      for (int device = 0; device < n_devices; device++)
+      {
+         if (ready[device])
+            threads.emplace_back(
+                [&, device]
+                {
+                   TRACE_THREAD("GPU driver", device);
+                   batches.run(device, render_on(device));
+                });
+      }
+      for (auto &thread : threads)
+         thread.join();
+
+      // The batches left by the devices that failed after the others stopped
+      for (int device = 0; device < n_devices; device++)
+         if (ready[device] && !batches.failed(device))
+            batches.run(device, render_on(device));
+
+      const int root = (int)(std::find_if(summed.begin(), summed.end(), [](int n) { return n > 0; }) - summed.begin());
+      if (root == n_devices)
+         return false;
+
+      int total = summed[root];
+      {
+         TRACE_SCOPE("cuda", "merge devices");
+         for (int device = root + 1; device < n_devices; device++)
          {
-            // For constant materials, the scattered ray direction is zero, so we just return the attenuation
-            if (scattered.direction().length() == 0.0)
-               return attenuation;
-            else
-               return attenuation * ray_color(scattered, world, depth - 1);
+            if (summed[device] > 0 &&
+                cudaRendererAddAccumulation(cuda_contexts[root].renderer, cuda_contexts[device].renderer))
+               total += summed[device];
          }
+         if (!cudaRendererResolve(cuda_contexts[root].renderer, total, image.data()))
+            return false;
+         Accumulation_buffer::repack(image, (size_t)image_width * image_height, image_channels, image_layout);
+      }
+      cuda_contexts[root].samples = total;
+      cuda_resolved_device = root;
+      if (cuda_read_accumulation)
+         readAccumulationCUDA(root);
+
+      for (int device = 0; device < n_devices; device++)
+      {
+         if (ready[device])
+            report.push_back({device, cudaRendererDeviceName(cuda_contexts[device].renderer), summed[device],
+                              batches.batches(device), batches.busy_ms(device), stats.shard(device).rays});
+      }
+      return true;
+   }
+
+   /**
+    * @brief Creates the renderer of a device and uploads the scene to it, if not done yet
+    * A scene whose spheres moved since the previous frame (see `Bvh::move_spheres`) is only updated.
+    * The contexts may be added, so no other thread may use them meanwhile unless the device already has one.
+    *
+    * @param flat The flattened scene, to flatten it only once for several devices. Filled if empty and needed.
+    * @return false if the device cannot be used
+    */
+   bool prepareDeviceCUDA(int device, const Bvh &scene, std::optional<Cuda_scene> *flat = nullptr)
+   {
+      if ((int)cuda_contexts.size() <= device)
+         cuda_contexts.resize(device + 1);
+
+      Cuda_context &context = cuda_contexts[device];
+      if (context.renderer == nullptr)
+      {
+         TRACE_SCOPE("cuda", "create CUDA renderer");
+         context.renderer = cudaRendererCreate(device);
+         if (context.renderer == nullptr)
+            return false;
+      }
+
+      if (context.scene == &scene && context.scene_version == scene.geometry_version())
+         return true;
+
+      // Only the spheres and nodes of the last refit changed since the previous frame
+      if (context.scene == &scene && context.scene_version + 1 == scene.geometry_version())
+      {
+         TRACE_SCOPE("cuda", "update scene");
+         Cuda_scene_update update(scene);
+         if (cudaRendererUpdateScene(context.renderer, update.sphere_indices.data(), update.spheres.data(),
+                                     (int)update.spheres.size(), update.node_indices.data(), update.nodes.data(),
+                                     (int)update.nodes.size()))
+         {
+            context.scene_version = scene.geometry_version();
+            return true;
+         }
+      }
+
+      TRACE_SCOPE("cuda", "upload scene");
+      std::optional<Cuda_scene> local;
+      if (flat == nullptr)
+         flat = &local;
+      if (!flat->has_value())
+         flat->emplace(scene);
+
+      const Cuda_scene &gpu_scene = **flat;
+      if (!cudaRendererUploadScene(context.renderer, gpu_scene.spheres.data(), (int)gpu_scene.spheres.size(),
+                                   gpu_scene.nodes.data(), (int)gpu_scene.nodes.size(), gpu_scene.materials.data(),
+                                   (int)gpu_scene.materials.size(), gpu_scene.instances.data(),
+                                   (int)gpu_scene.instances.size()))
+      {
+         context.scene = nullptr;
+         return false;
+      }
+      context.scene = &scene;
+      context.scene_version = scene.geometry_version();
+      return true;
+   }
+
+   /**
+    * @brief Starts rendering a frame on a device, see `submitFrameCUDA`
+    * The devices after the first one seed their random states differently, so that their samples are independent.
+    */
+   bool submitFrameOnDevice(int device, const Bvh &scene, int first_sample, int n_samples, bool wavefront,
+                            int summed_samples)
+   {
+      if (!prepareDeviceCUDA(device, scene))
+         return false;
+
+      if (summed_samples < 0)
+         summed_samples = first_sample;
+      const unsigned long long seed = RndGen::get_seed();
+      Cuda_frame_params params{image_width,
+                               image_height,
+                               n_samples < 0 ? samples_per_pixel : n_samples,
+                               max_depth,
+                               roulette_depth,
+                               first_sample,
+                               summed_samples,
+                               wavefront ? 1 : 0,
+                               device == 0 ? seed : RndGen::hash(seed ^ RndGen::hash(device)),
+                               seed};
+      for (int i = 0; i < 3; i++)
+      {
+         params.cam_center[i] = camera_center[i];
+         params.pixel00[i] = pixel00_loc[i];
+         params.delta_u[i] = pixel_delta_u[i];
+         params.delta_v[i] = pixel_delta_v[i];
+      }
+
+      Cuda_context &context = cuda_contexts[device];
+#ifdef RT_TRACE
+      context.submit_us[context.submitted % 2] = Trace::now_us();
+#endif
+      if (!cudaRendererSubmitFrame(context.renderer, &params))
+         return false;
+
+#ifdef RT_TRACE
+      context.submitted++;
+#endif
+      context.samples = summed_samples + params.samples_per_pixel;
+      return true;
+   }
+
+   /**
+    * @brief Waits for the oldest frame submitted to a device and copies it to `image`
+    * The ray counters of the frame are added to the given shard of `stats`.
+    * @return false if the device has no renderer
+    */
+   bool finishFrameOnDevice(int device, vector<unsigned char> &image, int shard)
+   {
+      if ((int)cuda_contexts.size() <= device || cuda_contexts[device].renderer == nullptr)
+         return false;
+
+      Cuda_context &context = cuda_contexts[device];
+      Ray_counters cuda_counters{};
+      {
+         TRACE_SCOPE("cuda", "wait for frame");
+         cudaRendererFinishFrame(context.renderer, image.data(), &cuda_counters);
+      }
+      stats.shard(shard).merge(cuda_counters);
+#ifdef RT_TRACE
+      traceFrameCUDA(device, context.submit_us[context.finished++ % 2]);
+#endif
+      return true;
+   }
+
+   // Copies the sums of a device into `accumulation`
+   void readAccumulationCUDA(int device)
+   {
+      if (accumulation.get_width() != image_width || accumulation.get_height() != image_height)
+         accumulation.resize(image_width, image_height);
+
+      cudaRendererReadAccumulation(cuda_contexts[device].renderer, accumulation.sums_data());
+      accumulation.set_all_counts(cuda_contexts[device].samples);
+   }
+
+   /**
+    * @brief Shares the tiles of the image between `threadCount()` threads
+    *
+    * The image is cut into square tiles of `constants::TILE_SIZE` pixels, and the threads pull
+    * the next tile to render from a shared atomic counter. The calling thread only displays the
+    * progress, by polling the number of completed tiles, so the workers never take a lock.
+    *
+    * @param render_tile Called as `render_tile(thread_index, x0, y0, x1, y1)` for the pixels [x0, x1) x [y0, y1)
+    * @return The number of tiles
+    */
+   template <typename Render_tile> int forEachTileParallel(bool show_progress, Render_tile render_tile)
+   {
+      const int n_threads = threadCount();
+      std::vector<std::thread> threads(n_threads);
+
+      const int tile_size = constants::TILE_SIZE;
+      const int tiles_x = (image_width + tile_size - 1) / tile_size;
+      const int tiles_y = (image_height + tile_size - 1) / tile_size;
+      const int n_tiles = tiles_x * tiles_y;
+
+      std::atomic<int> next_tile{0};      // Next tile to be picked up by a worker
+      std::atomic<int> completed_tiles{0}; // Number of tiles fully rendered
+
+      auto render_tiles = [&](int thread_index)
+      {
+         TRACE_THREAD("worker", thread_index);
+         TRACE_SCOPE("worker", "worker");
+         while (true)
+         {
+            int tile = next_tile.fetch_add(1, std::memory_order_relaxed);
+            if (tile >= n_tiles)
+               break;
+
+            int x0 = (tile % tiles_x) * tile_size;
+            int y0 = (tile / tiles_x) * tile_size;
+            int x1 = std::min(x0 + tile_size, image_width);
+            int y1 = std::min(y0 + tile_size, image_height);
+
+            TRACE_SCOPE_ARGS("tile", "tile", "x", x0, "y", y0);
+            render_tile(thread_index, x0, y0, x1, y1);
+
+            completed_tiles.fetch_add(1, std::memory_order_release);
+         }
+      };
+
+      for (int t = 0; t < n_threads; ++t)
+      {
+         threads[t] = std::thread(render_tiles, t);
+      }
+
+      // Show progress from this thread while the workers render
+      int done;
+      while (show_progress && (done = completed_tiles.load(std::memory_order_acquire)) < n_tiles)
+      {
+         showProgress(done - 1, n_tiles);
+         std::this_thread::sleep_for(std::chrono::milliseconds(50));
+      }
+
+      for (auto &thread : threads)
+      {
+         thread.join();
+      }
+
+      if (show_progress)
+         showProgress(n_tiles - 1, n_tiles);
+
+      return n_tiles;
+   }
+
+   /**
+    * @brief Adds `n_samples` samples to the pixels [x0, x1) x [y0, y1) with the wavefront path tracer
+    *
+    * Same samples as `accumulatePixel`, in waves of `constants::WAVEFRONT_SIZE` paths at most
+    * (a range of samples of every pixel of the tile). The colors of the paths are summed in
+    * sample order once the wave is done, so the sums are the same as those of `accumulatePixel`.
+    *
+    * @param adaptive Only sample the pixels marked by `updateActivePixels`
+    * @param state The working buffers of the calling thread
+    * @param thread_stats The statistics shard of the calling thread
+    */
+   void renderTileWavefront(const Bvh &scene, int x0, int y0, int x1, int y1, int n_samples, bool adaptive,
+                            Wavefront_state &state, Thread_stats &thread_stats)
+   {
+      state.pixels.clear();
+      for (const Tile_offset &offset : tileOrder())
+      {
+         const int x = x0 + offset.x, y = y0 + offset.y;
+         if (x < x1 && y < y1 && (!adaptive || needsSamples(x, y)))
+            state.pixels.push_back(y * image_width + x);
       }
 
-      // A blue to white gradient universe, where unit_direction varies between -1 and +1 in x and y
-      Vec3 unit_direction = unit_vector(r.direction());
+      const int n_pixels = (int)state.pixels.size();
+      if (n_pixels == 0)
+         return;
+
+      state.pixel_colors.assign(n_pixels, Color(0, 0, 0));
+      state.luminance_squares.assign(n_pixels, 0.0);
+
+      // Samples of every pixel per wave, path `p * wave_samples + j` being sample j of the p-th pixel
+      const int wave_samples = std::max(1, std::min(n_samples, constants::WAVEFRONT_SIZE / n_pixels));
+
+      for (int first = 0; first < n_samples; first += wave_samples)
+      {
+         const int m = std::min(wave_samples, n_samples - first);
+
+         generateWave(state, first, m);
+         for (int depth = 0; depth < max_depth && !state.rays.empty(); depth++)
+         {
+            intersectWave(scene, state, depth, thread_stats);
+            shadeWave(state, depth);
+         }
+
+         for (int p = 0; p < n_pixels; p++)
+         {
+            for (int j = 0; j < m; j++)
+            {
+               const Color &sample = state.colors[p * m + j];
+               state.pixel_colors[p] += sample;
+
+               double l = Accumulation_buffer::luminance(sample);
+               state.luminance_squares[p] += l * l;
+            }
+         }
+      }
+
+      state.tile.begin(x0, y0, x1, y1);
+      for (int p = 0; p < n_pixels; p++)
+      {
+         const int x = state.pixels[p] % image_width, y = state.pixels[p] / image_width;
+         state.tile.add(x, y, state.pixel_colors[p], state.luminance_squares[p], n_samples);
+      }
+      accumulation.merge(state.tile);
+   }
+
+   // Wavefront stage 1: queues the primary rays of the samples [first, first + m) of every pixel of the tile
+   void generateWave(Wavefront_state &state, int first, int m)
+   {
+      const int n_paths = (int)state.pixels.size() * m;
+      state.rays.clear();
+      state.engines.resize(n_paths);
+      state.colors.assign(n_paths, Color(0, 0, 0));
+
+      for (int p = 0; p < (int)state.pixels.size(); p++)
+      {
+         const int pixel_index = state.pixels[p];
+         const int x = pixel_index % image_width, y = pixel_index / image_width;
+         const int pixel_first = accumulation.samples(x, y) + first;
+         Pixel_sampler pixel_sampler(sampler, pixel_index, planned_samples);
+
+         for (int j = 0; j < m; j++)
+         {
+            const int s = pixel_first + j;
+            RndGen::seed_sample(pixel_index, s);
+
+            double offset_x, offset_y;
+            pixel_sampler.offset(s, offset_x, offset_y);
+
+            Vec3 pixel_center = pixel00_loc + (x + offset_x) * pixel_delta_u + (y + offset_y) * pixel_delta_v;
+            Ray ray(camera_center, unit_vector(pixel_center - camera_center));
+
+            // The rest of the sequence of the sample is drawn by the path
+            const int path = p * m + j;
+            state.engines[path] = RndGen::save_state();
+            state.rays.push(ray, Color(1, 1, 1), path);
+         }
+      }
+   }
+
+   /**
+    * Wavefront stage 2: intersects all the queued rays with the scene
+    * The primary rays of a pixel are queued one after the other, they are traced in SIMD packets.
+    */
+   void intersectWave(const Bvh &scene, Wavefront_state &state, int depth, Thread_stats &thread_stats)
+   {
+      TRACE_STAGE(Trace_stage::Intersect);
+      const Path_queue &rays = state.rays;
+      const int n = rays.size();
+      state.recs.resize(n);
+      state.hits.resize(n);
+
+      if (depth == 0)
+      {
+         for (int i = 0; i < n; i += Ray_packet::SIZE)
+         {
+            const int count = std::min(Ray_packet::SIZE, n - i);
+            bool hits[Ray_packet::SIZE];
+            scene.hit_packet(rays.packet(i, count), Interval(RAY_T_MIN, inf), &state.recs[i], hits);
+            for (int j = 0; j < count; j++)
+               state.hits[i + j] = hits[j];
+         }
+      }
+      else
+      {
+         for (int i = 0; i < n; i++)
+            state.hits[i] = scene.hit(rays.ray(i), Interval(RAY_T_MIN, inf), state.recs[i]);
+      }
+
+      for (int i = 0; i < n; i++)
+         thread_stats.count_ray(depth, state.hits[i]);
+   }
+
+   /**
+    * Wavefront stage 3: shades the hits grouped by material, and compacts the scattered rays
+    * into the queue of the next bounce, which keeps them grouped by the material they come from.
+    */
+   void shadeWave(Wavefront_state &state, int depth)
+   {
+      const Path_queue &rays = state.rays;
+      const int n = rays.size();
+
+      // Key 0 for the rays that escaped to the sky, then one key per material type
+      state.keys.resize(n);
+      for (int i = 0; i < n; i++)
+         state.keys[i] = state.hits[i] ? 1 + (int)state.recs[i].mat_ptr->type : 0;
+      state.sort_by_key(1 + (int)Material_type::ShowNormals + 1);
+
+      state.next.clear();
+      for (int i : state.order)
+      {
+         const int path = rays.path[i];
+         Ray r = rays.ray(i);
+         Color throughput = rays.throughput(i);
+
+         if (!state.hits[i])
+         {
+            state.colors[path] = throughput * sky_color(r.direction());
+            continue;
+         }
+
+         RndGen::restore_state(state.engines[path]);
+         if (scatterPath(r, state.recs[i], depth, throughput))
+         {
+            state.engines[path] = RndGen::save_state();
+            state.next.push(r, throughput, path);
+         }
+         else
+            state.colors[path] = throughput;
+      }
+
+      std::swap(state.rays, state.next);
+   }
+
+   // The AOVs of a pixel, see `renderAovs`
+   void aovPixel(const Hittable &scene, int x, int y, Aov_buffers &aovs) const
+   {
+      const uint64_t pixel_index = (uint64_t)y * image_width + x;
+      Pixel_sampler pixel_sampler(sampler, pixel_index, constants::AOV_SAMPLES);
+
+      Color albedo(0, 0, 0);
+      Vec3 normal(0, 0, 0);
+      for (int s = 0; s < constants::AOV_SAMPLES; ++s)
+      {
+         RndGen::seed_sample(pixel_index, s);
+         double offset_x, offset_y;
+         pixel_sampler.offset(s, offset_x, offset_y);
+
+         Vec3 pixel_center = pixel00_loc + (x + offset_x) * pixel_delta_u + (y + offset_y) * pixel_delta_v;
+         Ray ray(camera_center, unit_vector(pixel_center - camera_center));
+
+         Hit_record rec;
+         if (!scene.hit(ray, Interval(RAY_T_MIN, inf), rec))
+         {
+            albedo += sky_color(ray.direction());
+            continue;
+         }
+         albedo += surfaceAlbedo(rec);
+         normal += rec.normal;
+      }
+
+      const size_t index = pixel_index * 3;
+      for (int c = 0; c < 3; c++)
+      {
+         aovs.albedo[index + c] = (float)(albedo[c] / constants::AOV_SAMPLES);
+         aovs.normal[index + c] = (float)(normal[c] / constants::AOV_SAMPLES);
+      }
+   }
+
+   // The color of a surface for the denoisers: the albedo of the known materials, white for the others
+   static Color surfaceAlbedo(const Hit_record &rec)
+   {
+      switch (rec.mat_ptr->type)
+      {
+      case Material_type::Lambertian:
+         return static_cast<const Lambertian *>(rec.mat_ptr)->albedo;
+      case Material_type::Constant:
+         return static_cast<const Constant *>(rec.mat_ptr)->color;
+      case Material_type::ShowNormals:
+         return 0.5 * (rec.normal + Color(1, 1, 1));
+      default:
+         return Color(1, 1, 1);
+      }
+   }
+
+   /**
+    * @brief Traces `n_samples` more samples of a pixel and adds them to `sums`
+    *
+    * The samples continue the sequence of the pixel: they are numbered from the number
+    * of samples already accumulated, so that each pass gets new, reproducible samples.
+    *
+    * @param scene The scene to render
+    * @param x Pixel x coordinate
+    * @param y Pixel y coordinate
+    * @param n_samples Number of samples to trace
+    * @param thread_stats The statistics shard of the calling thread
+    * @param sums `accumulation`, or the `Tile_accumulation` of the tile of the pixel
+    */
+   template <typename Sums>
+   void accumulatePixel(const Hittable &scene, int x, int y, int n_samples, Thread_stats &thread_stats, Sums &sums)
+   {
+      Color pixel_color(0, 0, 0);  // The pixel color starts as black
+      double luminance_square = 0; // For the variance estimate of adaptive sampling
+
+      const int first_sample = accumulation.samples(x, y);
+
+      const uint64_t pixel_index = (uint64_t)y * image_width + x;
+      Pixel_sampler pixel_sampler(sampler, pixel_index, planned_samples);
+
+      // Supersampling anti-aliasing by summing multiple samples per pixel
+      for (int s = first_sample; s < first_sample + n_samples; ++s)
+      {
+         // Every sample gets its own random sequence, so that the image does not depend on the threads
+         RndGen::seed_sample(pixel_index, s);
+
+         // Offsets in the range [-0.5, 0.5) for jittering around the pixel
+         // but remain within the pixel area
+         double offset_x, offset_y;
+         pixel_sampler.offset(s, offset_x, offset_y);
+
+         // Calculate the direction of the ray for the current pixel
+         Vec3 pixel_center = pixel00_loc + (x + offset_x) * pixel_delta_u + (y + offset_y) * pixel_delta_v;
+         Vec3 ray_direction = pixel_center - camera_center;
+
+         // Create a ray from the camera center through the pixel
+         Ray ray(camera_center, unit_vector(ray_direction));
+
+         // And launch baby, launch the ray to get the color
+         Color sample(ray_color(ray, scene, thread_stats));
+         pixel_color += sample;
+
+         double l = Accumulation_buffer::luminance(sample);
+         luminance_square += l * l;
+      }
+
+      sums.add(x, y, pixel_color, luminance_square, n_samples);
+   }
+
+   /**
+    * Computes the color seen along a ray by tracing its path through the scene
+    *
+    * Iterative, like `trace_path` on the GPU: the attenuations of the successive bounces
+    * are multiplied into a running throughput. The path ends when the ray escapes to the
+    * sky, hits an emissive or debug material, is absorbed, or after `max_depth` rays.
+    */
+   inline Color ray_color(Ray r, const Hittable &world, Thread_stats &thread_stats)
+   {
+      Color throughput(1, 1, 1);
+      Hit_record rec;
+
+      for (int depth = 0; depth < max_depth; depth++)
+      {
+         bool hit;
+         {
+            TRACE_STAGE(Trace_stage::Intersect);
+            hit = world.hit(r, Interval(RAY_T_MIN, inf), rec);
+         }
+         thread_stats.count_ray(depth, hit);
+
+         if (!hit)
+            return throughput * sky_color(r.direction());
+
+         if (!scatterPath(r, rec, depth, throughput))
+            return throughput;
+      }
+
+      return Color(0, 0, 0); // No more light is gathered
+   }
+
+   /**
+    * @brief One bounce of a path at the hit `rec` of its ray `r`, shared by `ray_color` and the wavefront renderer
+    *
+    * When the path goes on, `r` becomes its next ray and `throughput` is multiplied by the
+    * attenuation of the material. Otherwise `throughput` is set to the color gathered by the path.
+    *
+    * Once `roulette_depth` rays are traced, each further ray is traced with a probability equal
+    * to the largest throughput component of the path (Russian roulette), the survivors being weighted
+    * up so that the estimate stays unbiased. Paths whose throughput became negligible end right away,
+    * whatever their depth.
+    *
+    * @param depth Number of rays of the path before `r`
+    * @return Whether the path continues with the new `r`
+    */
+   inline bool scatterPath(Ray &r, const Hit_record &rec, int depth, Color &throughput) const
+   {
+      TRACE_STAGE(Trace_stage::Shade);
+      Ray scattered;
+      Color attenuation;
+
+      // Dispatch on the material tag: emissive and debug materials end the path
+      // right away, and the known materials are called without a virtual call
+      const Material *mat = rec.mat_ptr;
+      bool scatters;
+
+      switch (mat->type)
+      {
+      case Material_type::Constant:
+         throughput = throughput * static_cast<const Constant *>(mat)->color;
+         return false;
+
+      case Material_type::ShowNormals:
+         static_cast<const ShowNormals *>(mat)->ShowNormals::scatter(r, rec, attenuation, scattered);
+         throughput = throughput * attenuation;
+         return false;
+
+      case Material_type::Lambertian:
+         scatters = static_cast<const Lambertian *>(mat)->Lambertian::scatter(r, rec, attenuation, scattered);
+         break;
+
+      default:
+         scatters = mat->scatter(r, rec, attenuation, scattered);
+         break;
+      }
+
+      // For constant materials, the scattered ray direction is zero, so the attenuation is the color
+      if (scatters && scattered.direction().length_squared() == 0.0)
+      {
+         throughput = throughput * attenuation;
+         return false;
+      }
+
+      throughput = throughput * attenuation;
+      r = scattered;
+
+      // The ray is absorbed, or the path is too long or too dark to contribute
+      if (!scatters || depth + 1 >= max_depth ||
+          std::max({throughput.x(), throughput.y(), throughput.z()}) < constants::MIN_THROUGHPUT)
+      {
+         throughput = Color(0, 0, 0);
+         return false;
+      }
+
+      // Russian roulette
+      if (depth + 1 >= roulette_depth)
+      {
+         double survival = std::max({throughput.x(), throughput.y(), throughput.z()});
+         if (survival < 1.0)
+         {
+            if (RndGen::random_double() >= survival)
+            {
+               throughput = Color(0, 0, 0);
+               return false;
+            }
+            throughput /= survival;
+         }
+      }
+
+      return true;
+   }
+
+   // A blue to white gradient universe, where unit_direction varies between -1 and +1 in x and y
+   static inline Color sky_color(const Vec3 &direction)
+   {
+      Vec3 unit_direction = unit_vector(direction);
       float t = 0.5f * (unit_direction.y() + 1.0f);
       return (1.0f - t) * Vec3(1.0f, 1.0f, 1.0f) + t * Vec3(0.5f, 0.7f, 1.0f);
    }
 
+   // The 8-bit image of the sums of `accumulation`
+   void resolveImage(vector<unsigned char> &image)
+   {
+      TRACE_SCOPE("cpu", "resolve image");
+      accumulation.resolve(image, image_channels, image_layout);
+   }
+
+#ifdef RT_TRACE
    /**
-    * Sets the pixel color in the image buffer
+    * @brief Adds the cudaEvent timings of the last finished frame to the trace
+    * Only the durations are measured on the GPU: the frame is placed as if it started when it was
+    * submitted, which is early by the time it waited for the frames submitted before it.
     */
-   inline void setPixel(vector<unsigned char> &image, int x, int y, Color &c)
+   void traceFrameCUDA(int device, double submit_us)
    {
-      int index = (y * image_width + x) * image_channels;
-
-      static const Interval intensity(0.0, 0.999);
+      Cuda_frame_timings t;
+      if (!cudaRendererLastFrameTimings(cuda_contexts[device].renderer, &t))
+         return;
 
-      image[index + 0] = static_cast<int>(intensity.clamp(c.x()) * 256);
-      image[index + 1] = static_cast<int>(intensity.clamp(c.y()) * 256);
-      image[index + 2] = static_cast<int>(intensity.clamp(c.z()) * 256);
+      const double us = 1000; // Per ms
+      const std::string gpu = device == 0 ? "GPU" : "GPU " + std::to_string(device);
+      const int compute = Trace::track_id(gpu + " compute"), copy = Trace::track_id(gpu + " copy");
+      if (t.setup_ms > 0)
+         Trace::add_event("gpu", "allocate buffers, init random states", submit_us, t.setup_ms * us, compute);
+      Trace::add_event("gpu", "render kernels", submit_us + t.setup_ms * us, t.kernel_ms * us, compute);
+      Trace::add_event("gpu", "readback", submit_us + t.readback_start_ms * us, t.readback_ms * us, copy);
    }
+#endif
 
    /***
     * Utility functions
     */
+   int threadCount() const
+   {
+      if (num_threads > 0)
+         return num_threads;
+
+      // hardware_concurrency() may return 0 when it cannot be determined
+      return std::max(1u, std::thread::hardware_concurrency());
+   }
+
+   // Number of GPUs used by `renderPixelsCUDA`, 0 without a device
+   int gpuCount() const
+   {
+      const int available = cudaRendererDeviceCount();
+      return num_gpus > 0 ? std::min(num_gpus, available) : available;
+   }
+
    void showProgress(int current, int total)
    {
       const int barWidth = 70;
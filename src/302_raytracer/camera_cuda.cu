@@ -1,15 +1,30 @@
 /**
  * @file camera_cuda.cu
- * @brief CUDA-accelerated ray tracing template
+ * @brief CUDA-accelerated path tracer
+ *
+ * The GPU version of `Camera::ray_color`: one thread per pixel, an iterative
+ * bounce loop (the GPU cannot recurse efficiently), and a BVH traversal over
+ * the flattened scene uploaded by the host (see cuda_scene.h). The materials
+ * and the color mapping are the same as on the CPU, so that both renderers
+ * can be compared on the same scene.
+ *
+ * The same paths can also be traced by a set of wavefront kernels, one per
+ * stage of a bounce, see `wavefrontGenerate`.
  */
 
 #include <cfloat>
 #include <cmath>
 #include <cstdio>
+#include <cstring>
+#include <initializer_list>
+#include <utility>
+#include <vector>
 #include <cuda_runtime.h>
 #include <curand_kernel.h>
 #include <device_launch_parameters.h>
 
+#include "camera_cuda.h"
+
 #ifndef M_PI
 #define M_PI 3.14159265358979323846f
 #endif
@@ -40,6 +55,29 @@ struct float3_simple
 
    __device__ __host__ float3_simple operator*(float t) const { return float3_simple(x * t, y * t, z * t); }
 
+   /** @brief Component-wise product, used to apply an attenuation */
+   __device__ __host__ float3_simple operator*(const float3_simple &other) const
+   {
+      return float3_simple(x * other.x, y * other.y, z * other.z);
+   }
+
+   __device__ __host__ float3_simple &operator+=(const float3_simple &other)
+   {
+      x += other.x;
+      y += other.y;
+      z += other.z;
+      return *this;
+   }
+
+   __device__ __host__ float operator[](int i) const { return i == 0 ? x : (i == 1 ? y : z); }
+
+   /** @brief Same threshold as `Vec3::near_zero` */
+   __device__ __host__ bool near_zero() const
+   {
+      const float s = 1e-8f;
+      return (fabsf(x) < s) && (fabsf(y) < s) && (fabsf(z) < s);
+   }
+
    __device__ __host__ float3_simple operator/(float t) const { return float3_simple(x / t, y / t, z / t); }
 
    __device__ __host__ float3_simple operator-() const { return float3_simple(-x, -y, -z); }
@@ -107,6 +145,398 @@ __device__ float smoothstep(float edge0, float edge1, float x)
    return t * t * (3.0f - 2.0f * t);
 }
 
+/** @brief Random unit vector around the z axis, of density cos(theta) / pi, as `Vec3::random_cosine_direction` */
+__device__ float3_simple random_cosine_direction(curandState *state)
+{
+   const float r1 = random_float(state), r2 = random_float(state);
+   const float r = sqrtf(r2);
+   float s, c;
+   sincospif(2.0f * r1, &s, &c);
+   return float3_simple(c * r, s * r, sqrtf(fmaxf(0.0f, 1.0f - r2))); // r2 is in (0, 1]
+}
+
+/** @brief The splitmix64 finalizer, same as `RndGen::hash` */
+__device__ __host__ inline unsigned long long hash64(unsigned long long x)
+{
+   x += 0x9e3779b97f4a7c15ULL;
+   x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+   x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+   return x ^ (x >> 31);
+}
+
+/**
+ * @brief Sub-pixel offset in [-0.5, 0.5) from the R2 sequence, as `Sampler_type::R2` on the CPU
+ * The sequence is rotated by a per-pixel offset derived from a hash of the global seed and the pixel index.
+ */
+__device__ inline void r2_offset(unsigned long long sampler_seed, unsigned long long pixel_index, int sample,
+                                 float &offset_x, float &offset_y)
+{
+   const unsigned long long key = hash64(sampler_seed);
+   double rotation_x = (hash64(key ^ (2 * pixel_index)) >> 11) * 0x1p-53;
+   double rotation_y = (hash64(key ^ (2 * pixel_index + 1)) >> 11) * 0x1p-53;
+   double u = rotation_x + 0.7548776662466927600 * sample;
+   double v = rotation_y + 0.5698402909980532659 * sample;
+   offset_x = (float)(u - floor(u)) - 0.5f;
+   offset_y = (float)(v - floor(v)) - 0.5f;
+}
+
+//==============================================================================
+// SCENE INTERSECTION
+//==============================================================================
+
+// Size of the BVH traversal stack, large enough for `Bvh::MAX_TREE_DEPTH`
+#define BVH_STACK_SIZE 64
+
+// Minimal ray distance, larger than on the CPU (0.0001) to avoid self-intersections in single precision
+#define RAY_T_MIN 0.001f
+
+// Throughput below which a path is ended, same as `constants::MIN_THROUGHPUT`
+#define MIN_THROUGHPUT 1e-4f
+
+/**
+ * @brief Device pointers to the flattened scene, passed by value to the kernels
+ */
+struct Device_scene
+{
+   const Cuda_sphere *spheres;
+   const Cuda_bvh_node *nodes;
+   int n_nodes;
+   const Cuda_material *materials;
+   const Cuda_instance *instances;
+};
+
+/**
+ * @brief Details of a ray-object intersection, the GPU counterpart of `Hit_record`
+ */
+struct hit_record_simple
+{
+   float3_simple p;      ///< The point where the ray hits the object
+   float3_simple normal; ///< Outward normal at the hit point (not flipped, as on the CPU)
+   float t;              ///< The ray distance at the hit point
+   int material;         ///< Index of the material in the material table
+};
+
+/** @brief Ray/sphere intersection, same algorithm as `Sphere::hit`. The record is only written on a hit. */
+__device__ inline bool hit_sphere(const Cuda_sphere &s, const ray_simple &r, float t_min, float t_max,
+                                  hit_record_simple &rec)
+{
+   // Placeholder for the objects the GPU does not support
+   if (s.radius <= 0.0f)
+      return false;
+
+   float3_simple center(s.cx, s.cy, s.cz);
+   float3_simple oc = center - r.orig;
+   float a = r.dir.length_squared();
+   float h = dot(r.dir, oc);
+   float c = oc.length_squared() - s.radius * s.radius;
+
+   float discriminant = h * h - a * c;
+   if (discriminant < 0.0f)
+      return false;
+
+   float sqrtd = sqrtf(discriminant);
+
+   // Find the nearest root that lies in the acceptable range
+   float root = (h - sqrtd) / a;
+   if (root <= t_min || root >= t_max)
+   {
+      root = (h + sqrtd) / a;
+      if (root <= t_min || root >= t_max)
+         return false;
+   }
+
+   rec.t = root;
+   rec.p = r.at(root);
+   rec.normal = (rec.p - center) / s.radius;
+   rec.material = s.material;
+   return true;
+}
+
+/** @brief Slab test of a ray against the box of a node, see `Aabb::hit` */
+__device__ inline bool hit_box(const Cuda_bvh_node &n, const float3_simple &orig, const float3_simple &inv_dir,
+                               float t_min, float t_max)
+{
+   float t0 = (n.min_x - orig.x) * inv_dir.x;
+   float t1 = (n.max_x - orig.x) * inv_dir.x;
+   t_min = fmaxf(t_min, fminf(t0, t1));
+   t_max = fminf(t_max, fmaxf(t0, t1));
+
+   t0 = (n.min_y - orig.y) * inv_dir.y;
+   t1 = (n.max_y - orig.y) * inv_dir.y;
+   t_min = fmaxf(t_min, fminf(t0, t1));
+   t_max = fminf(t_max, fmaxf(t0, t1));
+
+   t0 = (n.min_z - orig.z) * inv_dir.z;
+   t1 = (n.max_z - orig.z) * inv_dir.z;
+   t_min = fmaxf(t_min, fminf(t0, t1));
+   t_max = fminf(t_max, fmaxf(t0, t1));
+
+   return t_min < t_max;
+}
+
+__device__ bool hit_instance(const Device_scene &scene, const Cuda_instance &instance, const ray_simple &r,
+                             float t_min, float t_max, hit_record_simple &rec);
+
+/**
+ * @brief Closest intersection of a ray with the hierarchy starting at node `root`, same traversal as `Bvh::hit`
+ * The nearest child is visited first, the other one is pushed on a small per-thread stack. The instances are only
+ * entered from the scene, they cannot hold instances themselves.
+ */
+template <bool SCENE>
+__device__ bool hit_bvh(const Device_scene &scene, int root, const ray_simple &r, float t_min, float t_max,
+                        hit_record_simple &rec)
+{
+   float3_simple inv_dir(1.0f / r.dir.x, 1.0f / r.dir.y, 1.0f / r.dir.z);
+
+   int stack[BVH_STACK_SIZE];
+   int stack_size = 0;
+   int current = root;
+
+   bool hit_anything = false;
+   float closest_so_far = t_max;
+
+   while (true)
+   {
+      const Cuda_bvh_node &node = scene.nodes[current];
+
+      if (hit_box(node, r.orig, inv_dir, t_min, closest_so_far))
+      {
+         if (node.count > 0)
+         {
+            for (int i = node.offset; i < node.offset + node.count; i++)
+            {
+               const Cuda_sphere &sphere = scene.spheres[i];
+               bool hit = SCENE && sphere.radius < 0.0f
+                              ? hit_instance(scene, scene.instances[sphere.material], r, t_min, closest_so_far, rec)
+                              : hit_sphere(sphere, r, t_min, closest_so_far, rec);
+               if (hit)
+               {
+                  hit_anything = true;
+                  closest_so_far = rec.t;
+               }
+            }
+         }
+         else
+         {
+            if (inv_dir[node.axis] < 0.0f)
+            {
+               stack[stack_size++] = current + 1;
+               current = node.offset;
+            }
+            else
+            {
+               stack[stack_size++] = node.offset;
+               current = current + 1;
+            }
+            continue;
+         }
+      }
+
+      if (stack_size == 0)
+         break;
+      current = stack[--stack_size];
+   }
+
+   return hit_anything;
+}
+
+/**
+ * @brief Intersection of a ray with an instance, see `Instance::hit`
+ * The direction is not normalized in the space of the object, so that the distances are the same in both spaces.
+ */
+__device__ bool hit_instance(const Device_scene &scene, const Cuda_instance &instance, const ray_simple &r,
+                             float t_min, float t_max, hit_record_simple &rec)
+{
+   const float *m = instance.to_object;
+   const float3_simple &o = r.orig, &d = r.dir;
+   ray_simple local(float3_simple(m[0] * o.x + m[1] * o.y + m[2] * o.z + m[3],
+                                  m[4] * o.x + m[5] * o.y + m[6] * o.z + m[7],
+                                  m[8] * o.x + m[9] * o.y + m[10] * o.z + m[11]),
+                    float3_simple(m[0] * d.x + m[1] * d.y + m[2] * d.z, m[4] * d.x + m[5] * d.y + m[6] * d.z,
+                                  m[8] * d.x + m[9] * d.y + m[10] * d.z));
+   if (!hit_bvh<false>(scene, instance.root, local, t_min, t_max, rec))
+      return false;
+
+   // The normals are brought back by the transpose of the inverse transform
+   const float3_simple n = rec.normal;
+   rec.p = r.at(rec.t);
+   rec.normal = unit_vector(float3_simple(m[0] * n.x + m[4] * n.y + m[8] * n.z, m[1] * n.x + m[5] * n.y + m[9] * n.z,
+                                          m[2] * n.x + m[6] * n.y + m[10] * n.z));
+   return true;
+}
+
+/** @brief Closest intersection of a ray with the scene */
+__device__ bool hit_scene(const Device_scene &scene, const ray_simple &r, float t_min, float t_max,
+                          hit_record_simple &rec)
+{
+   return scene.n_nodes > 0 && hit_bvh<true>(scene, 0, r, t_min, t_max, rec);
+}
+
+//==============================================================================
+// RAY STATISTICS
+//==============================================================================
+
+/**
+ * @brief Ray counters of one thread, kept in registers while it renders
+ * The depth histogram is too large for registers, it is accumulated in the
+ * shared memory of the block instead.
+ */
+struct Local_counters
+{
+   unsigned long long rays = 0, primary_rays = 0, secondary_rays = 0, hits = 0, misses = 0;
+};
+
+/** @brief Zero the counters of the block, must be called by all the threads of the block */
+__device__ void init_block_counters(Ray_counters &block)
+{
+   const int n_words = sizeof(Ray_counters) / sizeof(unsigned long long);
+   unsigned long long *words = reinterpret_cast<unsigned long long *>(&block);
+   int tid = threadIdx.y * blockDim.x + threadIdx.x;
+
+   for (int i = tid; i < n_words; i += blockDim.x * blockDim.y)
+      words[i] = 0;
+
+   __syncthreads();
+}
+
+/** @brief Record a traced ray, same semantic as `Thread_stats::count_ray` on the CPU */
+__device__ inline void count_ray(Local_counters &local, Ray_counters &block, int bounce, bool hit)
+{
+   local.rays++;
+   if (bounce == 0)
+      local.primary_rays++;
+   else
+      local.secondary_rays++;
+
+   if (hit)
+      local.hits++;
+   else
+      local.misses++;
+
+   atomicAdd(&block.depth_histogram[min(bounce, Ray_counters::HISTOGRAM_SIZE - 1)], 1ull);
+}
+
+/**
+ * @brief Merge the thread counters into the block, then the block into the global counters
+ * Only one global atomic per counter and per block is issued. Must be called by all the threads of the block.
+ */
+__device__ void flush_counters(const Local_counters &local, Ray_counters &block, Ray_counters *global)
+{
+   atomicAdd(&block.rays, local.rays);
+   atomicAdd(&block.primary_rays, local.primary_rays);
+   atomicAdd(&block.secondary_rays, local.secondary_rays);
+   atomicAdd(&block.hits, local.hits);
+   atomicAdd(&block.misses, local.misses);
+
+   __syncthreads();
+
+   const int n_words = sizeof(Ray_counters) / sizeof(unsigned long long);
+   const unsigned long long *words = reinterpret_cast<const unsigned long long *>(&block);
+   unsigned long long *global_words = reinterpret_cast<unsigned long long *>(global);
+   int tid = threadIdx.y * blockDim.x + threadIdx.x;
+
+   for (int i = tid; i < n_words; i += blockDim.x * blockDim.y)
+   {
+      if (words[i] != 0)
+         atomicAdd(&global_words[i], words[i]);
+   }
+}
+
+//==============================================================================
+// PATH TRACING
+//==============================================================================
+
+/** @brief A blue to white gradient universe, same as on the CPU */
+__device__ inline float3_simple sky_color(const float3_simple &direction)
+{
+   float3_simple unit_direction = unit_vector(direction);
+   float t = 0.5f * (unit_direction.y + 1.0f);
+   return (1.0f - t) * float3_simple(1.0f, 1.0f, 1.0f) + t * float3_simple(0.5f, 0.7f, 1.0f);
+}
+
+/**
+ * @brief Russian roulette, same as on the CPU: the path survives with a probability equal to
+ * its largest throughput component, and its throughput is then scaled up to stay unbiased.
+ * @return False if the path is ended
+ */
+__device__ inline bool russian_roulette(float3_simple &throughput, curandState *state)
+{
+   // curand_uniform is in (0, 1]
+   float survival = fmaxf(throughput.x, fmaxf(throughput.y, throughput.z));
+   if (survival < 1.0f)
+   {
+      if (random_float(state) > survival)
+         return false;
+      throughput = throughput / survival;
+   }
+   return true;
+}
+
+/**
+ * @brief Direction of a ray scattered by a Lambertian surface, as `Lambertian::scatter`
+ * Cosine-weighted around the unit normal, placed by the branch-free basis of `Onb`.
+ */
+__device__ inline float3_simple lambertian_direction(const float3_simple &n, curandState *state)
+{
+   const float sign = copysignf(1.0f, n.z);
+   const float a = -1.0f / (sign + n.z);
+   const float b = n.x * n.y * a;
+   const float3_simple u(1.0f + sign * n.x * n.x * a, sign * b, -sign * n.x);
+   const float3_simple v(b, sign + n.y * n.y * a, -n.y);
+
+   const float3_simple d = random_cosine_direction(state);
+   return d.x * u + d.y * v + d.z * n;
+}
+
+/**
+ * @brief Computes the color seen along a ray, same bounce loop as `Camera::ray_color`
+ *
+ * Instead of recursing, the attenuations of the successive bounces are multiplied
+ * into a running throughput. The path ends when the ray escapes to the sky, hits an
+ * emissive (`Constant`) or debug (`ShowNormals`) material, or after `max_depth` rays.
+ * The rays past `roulette_depth` are subject to Russian roulette, as on the CPU.
+ */
+__device__ float3_simple trace_path(ray_simple r, const Device_scene &scene, int max_depth, int roulette_depth,
+                                    curandState *state, Local_counters &local_counters, Ray_counters &block_counters)
+{
+   float3_simple throughput(1.0f, 1.0f, 1.0f);
+
+   for (int depth = 0; depth < max_depth; depth++)
+   {
+      if (depth >= roulette_depth && !russian_roulette(throughput, state))
+         break;
+
+      hit_record_simple rec;
+      bool hit = hit_scene(scene, r, RAY_T_MIN, FLT_MAX, rec);
+      count_ray(local_counters, block_counters, depth, hit);
+
+      if (!hit)
+         return throughput * sky_color(r.dir);
+
+      const Cuda_material mat = scene.materials[rec.material];
+      float3_simple albedo(mat.r, mat.g, mat.b);
+
+      switch (mat.type)
+      {
+      case CUDA_MATERIAL_CONSTANT:
+         return throughput * albedo;
+
+      case CUDA_MATERIAL_SHOW_NORMALS:
+         return throughput * normal_to_color(rec.normal);
+
+      default: // Lambertian
+         throughput = throughput * albedo;
+         r = ray_simple(rec.p, lambertian_direction(rec.normal, state));
+         break;
+      }
+
+      if (fmaxf(throughput.x, fmaxf(throughput.y, throughput.z)) < MIN_THROUGHPUT)
+         break;
+   }
+
+   return float3_simple(0.0f, 0.0f, 0.0f); // No more light is gathered
+}
+
 //==============================================================================
 // CUDA KERNELS
 //==============================================================================
@@ -128,66 +558,445 @@ __global__ void init_random_states(curandState *rand_states, int num_states, uns
    }
 }
 
+/** @brief Writes the mean color of a pixel to the image */
+__device__ inline void write_pixel(float3_simple mean, int pixel_idx, unsigned char *image)
+{
+   int base_idx = pixel_idx * 3;
+
+   // Same mapping as `Accumulation_buffer::resolve`: clamp to [0, 0.999] and scale to 256 levels
+   image[base_idx] = (unsigned char)(256.0f * fminf(fmaxf(mean.x, 0.0f), 0.999f));
+   image[base_idx + 1] = (unsigned char)(256.0f * fminf(fmaxf(mean.y, 0.0f), 0.999f));
+   image[base_idx + 2] = (unsigned char)(256.0f * fminf(fmaxf(mean.z, 0.0f), 0.999f));
+}
+
+/**
+ * @brief Adds the samples of a frame to the sums of the previous frames (or restarts them)
+ * and writes the mean of a pixel to the image
+ * @param summed_samples Samples already in the sums, 0 to restart them
+ */
+__device__ inline void store_pixel(float3_simple pixel_color, int pixel_idx, int summed_samples,
+                                   int samples_per_pixel, float *accumulation, unsigned char *image)
+{
+   int base_idx = pixel_idx * 3;
+
+   if (summed_samples > 0)
+   {
+      pixel_color.x += accumulation[base_idx];
+      pixel_color.y += accumulation[base_idx + 1];
+      pixel_color.z += accumulation[base_idx + 2];
+   }
+   accumulation[base_idx] = pixel_color.x;
+   accumulation[base_idx + 1] = pixel_color.y;
+   accumulation[base_idx + 2] = pixel_color.z;
+
+   write_pixel(pixel_color / (float)(summed_samples + samples_per_pixel), pixel_idx, image);
+}
+
 /**
  * @brief Main CUDA kernel for ray tracing entire image
  * Each thread processes one pixel with multiple samples for anti-aliasing
  * @param image Output image buffer (RGB, 8-bit per channel)
  * @param width Image width in pixels
  * @param height Image height in pixels
+ * @param first_sample Index of the first sample, for the sub-pixel pattern
+ * @param sampler_seed Global seed, which rotates the sub-pixel pattern
+ * @param summed_samples Samples already in the accumulation, 0 to restart it
  * @param samples_per_pixel Number of rays per pixel for anti-aliasing
- * @param max_depth Maximum ray recursion depth
+ * @param max_depth Maximum number of rays of a path
+ * @param roulette_depth Bounces before the paths may be ended by Russian roulette
  * @param cam_center_* Camera center position components
  * @param pixel00_* Top-left pixel center position components
  * @param delta_u_* Pixel step in U direction components
  * @param delta_v_* Pixel step in V direction components
- * @param ray_count Global counter for rays traced
+ * @param scene The flattened scene in device memory
  * @param rand_states Shared array of random states (one per thread/pixel)
+ * @param counters Global ray counters, incremented once per block
  */
-__global__ void renderKernel(unsigned char *image, int width, int height, int samples_per_pixel, int max_depth,
-                             float cam_center_x, float cam_center_y, float cam_center_z, float pixel00_x,
-                             float pixel00_y, float pixel00_z, float delta_u_x, float delta_u_y, float delta_u_z,
-                             float delta_v_x, float delta_v_y, float delta_v_z, curandState *rand_states)
+__global__ void renderKernel(unsigned char *image, float *accumulation, int width, int height, int first_sample,
+                             unsigned long long sampler_seed, int summed_samples, int samples_per_pixel,
+                             int max_depth, int roulette_depth, float cam_center_x, float cam_center_y,
+                             float cam_center_z, float pixel00_x, float pixel00_y, float pixel00_z, float delta_u_x,
+                             float delta_u_y, float delta_u_z, float delta_v_x, float delta_v_y, float delta_v_z,
+                             Device_scene scene, curandState *rand_states, Ray_counters *counters)
 {
+   __shared__ Ray_counters block_counters;
+   Local_counters local_counters;
+
+   // All the threads of the block take part in the counters reduction, including
+   // those outside of the image, so that no thread returns before the barriers
+   init_block_counters(block_counters);
+
    int x = blockIdx.x * blockDim.x + threadIdx.x;
    int y = blockIdx.y * blockDim.y + threadIdx.y;
 
    // Strict bounds checking
-   if (x >= width || y >= height)
+   if (x < width && y < height)
+   {
+      int pixel_idx = y * width + x;
+
+      // Work on a register copy of the pre-initialized random state of this pixel
+      curandState local_rand_state = rand_states[pixel_idx];
+
+      // Convert parameters to float3_simple
+      float3_simple camera_center(cam_center_x, cam_center_y, cam_center_z);
+      float3_simple pixel00(pixel00_x, pixel00_y, pixel00_z);
+      float3_simple delta_u(delta_u_x, delta_u_y, delta_u_z);
+      float3_simple delta_v(delta_v_x, delta_v_y, delta_v_z);
+      float3_simple pixel_color(0, 0, 0);
+
+      // Supersampling anti-aliasing by averaging multiple samples per pixel
+      for (int s = first_sample; s < first_sample + samples_per_pixel; s++)
+      {
+         float offset_x, offset_y;
+         r2_offset(sampler_seed, pixel_idx, s, offset_x, offset_y);
+
+         float3_simple pixel_center = pixel00 + (x + offset_x) * delta_u + (y + offset_y) * delta_v;
+         ray_simple r(camera_center, unit_vector(pixel_center - camera_center));
+
+         pixel_color +=
+             trace_path(r, scene, max_depth, roulette_depth, &local_rand_state, local_counters, block_counters);
+      }
+
+      rand_states[pixel_idx] = local_rand_state;
+      store_pixel(pixel_color, pixel_idx, summed_samples, samples_per_pixel, accumulation, image);
+   }
+
+   flush_counters(local_counters, block_counters, counters);
+}
+
+//==============================================================================
+// WAVEFRONT KERNELS
+//==============================================================================
+
+/**
+ * The wavefront renderer splits `trace_path` into one kernel per stage, each
+ * thread working on one queue entry instead of one pixel:
+ *
+ * - `wavefrontGenerate` queues the primary ray of one sample of every pixel.
+ * - `wavefrontIntersect` traces the queued rays. The paths that end (sky,
+ *   emissive and debug materials) add their color to the sums of the frame,
+ *   the hits on scattering materials are compacted into the Lambertian queue.
+ * - `wavefrontShadeLambertian` scatters these hits into the ray queue of the
+ *   next bounce, so that all its threads run the same material code.
+ * - `wavefrontResolve` adds the sums of the frame to the accumulation.
+ *
+ * A wave holds one sample per pixel and the samples of a frame are waves in
+ * order, so that the random sequence of each pixel and thus the image are the
+ * same as with `renderKernel`. The kernels of the bounces are launched for the
+ * capacity of the queues, the threads past the size of the queue return at once,
+ * which avoids reading the sizes back on the host.
+ */
+
+/** @brief Camera parameters of the wavefront kernels */
+struct Device_camera
+{
+   float3_simple center, pixel00, delta_u, delta_v;
+};
+
+/** @brief The rays of the paths in flight, with the pixel and throughput of their path */
+struct Ray_queue
+{
+   int *pixel;
+   float *ox, *oy, *oz; // Origins
+   float *dx, *dy, *dz; // Directions
+   float *tr, *tg, *tb; // Throughputs of the paths
+   int *count;
+
+   __device__ ray_simple ray(int i) const
+   {
+      return ray_simple(float3_simple(ox[i], oy[i], oz[i]), float3_simple(dx[i], dy[i], dz[i]));
+   }
+
+   __device__ float3_simple throughput(int i) const { return float3_simple(tr[i], tg[i], tb[i]); }
+
+   __device__ void store(int i, int pixel_idx, const ray_simple &r, const float3_simple &t)
+   {
+      pixel[i] = pixel_idx;
+      ox[i] = r.orig.x;
+      oy[i] = r.orig.y;
+      oz[i] = r.orig.z;
+      dx[i] = r.dir.x;
+      dy[i] = r.dir.y;
+      dz[i] = r.dir.z;
+      tr[i] = t.x;
+      tg[i] = t.y;
+      tb[i] = t.z;
+   }
+};
+
+/** @brief The hits to shade with one material, with the index of their ray in the ray queue */
+struct Hit_queue
+{
+   int *ray;
+   float *px, *py, *pz; // Hit points
+   float *nx, *ny, *nz; // Normals
+   int *material;
+   int *count;
+};
+
+// Number of 4-byte values per pixel of the wavefront buffers: two ray queues, one hit queue
+// and the RGB sums of the frame
+#define WAVEFRONT_VALUES_PER_PIXEL (2 * 10 + 8 + 3)
+
+/** @brief Queues the primary ray of sample `sample` of every pixel, rotated by `sampler_seed` as in `renderKernel` */
+__global__ void wavefrontGenerate(Ray_queue rays, int width, int height, int sample, unsigned long long sampler_seed,
+                                  Device_camera camera)
+{
+   int pixel_idx = blockIdx.x * blockDim.x + threadIdx.x;
+   if (pixel_idx == 0)
+      *rays.count = width * height;
+   if (pixel_idx >= width * height)
       return;
 
-   int pixel_idx = y * width + x;
-   int base_idx = pixel_idx * 3;
+   int x = pixel_idx % width;
+   int y = pixel_idx / width;
+
+   // Same ray as in `renderKernel`
+   float offset_x, offset_y;
+   r2_offset(sampler_seed, pixel_idx, sample, offset_x, offset_y);
+
+   float3_simple pixel_center = camera.pixel00 + (x + offset_x) * camera.delta_u + (y + offset_y) * camera.delta_v;
+   ray_simple r(camera.center, unit_vector(pixel_center - camera.center));
+   rays.store(pixel_idx, pixel_idx, r, float3_simple(1.0f, 1.0f, 1.0f));
+}
 
-   // Double check bounds for memory access
-   if (pixel_idx >= width * height || base_idx + 2 >= width * height * 3)
+/**
+ * @brief Traces the rays of bounce `depth`, ends the paths that leave the scene or hit a
+ * non-scattering material, and queues the other hits for shading
+ */
+__global__ void wavefrontIntersect(Ray_queue rays, Hit_queue hits, float *frame_sums, int depth, Device_scene scene,
+                                   Ray_counters *counters)
+{
+   __shared__ Ray_counters block_counters;
+   Local_counters local_counters;
+   init_block_counters(block_counters);
+
+   int i = blockIdx.x * blockDim.x + threadIdx.x;
+   if (i < *rays.count)
    {
+      ray_simple r = rays.ray(i);
+      hit_record_simple rec;
+      bool hit = hit_scene(scene, r, RAY_T_MIN, FLT_MAX, rec);
+      count_ray(local_counters, block_counters, depth, hit);
+
+      // Color of the path if it ends here
+      bool ended = true;
+      float3_simple color;
+      if (!hit)
+         color = sky_color(r.dir);
+      else
+      {
+         const Cuda_material mat = scene.materials[rec.material];
+         if (mat.type == CUDA_MATERIAL_CONSTANT)
+            color = float3_simple(mat.r, mat.g, mat.b);
+         else if (mat.type == CUDA_MATERIAL_SHOW_NORMALS)
+            color = normal_to_color(rec.normal);
+         else
+            ended = false;
+      }
+
+      if (ended)
+      {
+         // A pixel has a single path in flight, no other thread writes its sums
+         float *sum = &frame_sums[rays.pixel[i] * 3];
+         color = rays.throughput(i) * color;
+         sum[0] += color.x;
+         sum[1] += color.y;
+         sum[2] += color.z;
+      }
+      else
+      {
+         int slot = atomicAdd(hits.count, 1);
+         hits.ray[slot] = i;
+         hits.px[slot] = rec.p.x;
+         hits.py[slot] = rec.p.y;
+         hits.pz[slot] = rec.p.z;
+         hits.nx[slot] = rec.normal.x;
+         hits.ny[slot] = rec.normal.y;
+         hits.nz[slot] = rec.normal.z;
+         hits.material[slot] = rec.material;
+      }
+   }
+
+   flush_counters(local_counters, block_counters, counters);
+}
+
+/**
+ * @brief Scatters the hits on Lambertian surfaces of bounce `depth` into the ray queue of the
+ * next bounce, with the same end conditions as `trace_path`
+ */
+__global__ void wavefrontShadeLambertian(Hit_queue hits, Ray_queue rays, Ray_queue next, int depth, int max_depth,
+                                         int roulette_depth, Device_scene scene, curandState *rand_states)
+{
+   int i = blockIdx.x * blockDim.x + threadIdx.x;
+   if (i >= *hits.count)
+      return;
+
+   int ray_idx = hits.ray[i];
+   int pixel_idx = rays.pixel[ray_idx];
+   float3_simple p(hits.px[i], hits.py[i], hits.pz[i]);
+   float3_simple normal(hits.nx[i], hits.ny[i], hits.nz[i]);
+   const Cuda_material mat = scene.materials[hits.material[i]];
+
+   curandState local_rand_state = rand_states[pixel_idx];
+
+   float3_simple throughput = rays.throughput(ray_idx) * float3_simple(mat.r, mat.g, mat.b);
+   ray_simple scattered(p, lambertian_direction(normal, &local_rand_state));
+
+   // The ended paths gather no more light, their sums are left as they are
+   bool alive = fmaxf(throughput.x, fmaxf(throughput.y, throughput.z)) >= MIN_THROUGHPUT && depth + 1 < max_depth;
+   alive = alive && (depth + 1 < roulette_depth || russian_roulette(throughput, &local_rand_state));
+
+   rand_states[pixel_idx] = local_rand_state;
+
+   if (alive)
+      next.store(atomicAdd(next.count, 1), pixel_idx, scattered, throughput);
+}
+
+/** @brief Adds the sums of the frame to the accumulation and writes the image */
+__global__ void wavefrontResolve(unsigned char *image, float *accumulation, const float *frame_sums, int n_pixels,
+                                 int summed_samples, int samples_per_pixel)
+{
+   int pixel_idx = blockIdx.x * blockDim.x + threadIdx.x;
+   if (pixel_idx >= n_pixels)
       return;
+
+   const float *sum = &frame_sums[pixel_idx * 3];
+   store_pixel(float3_simple(sum[0], sum[1], sum[2]), pixel_idx, summed_samples, samples_per_pixel, accumulation,
+               image);
+}
+
+//==============================================================================
+// MULTI-GPU KERNELS
+//==============================================================================
+
+/** @brief Adds the sums copied from another device to the accumulation */
+__global__ void addAccumulation(float *accumulation, const float *sums, int n_values)
+{
+   int idx = blockIdx.x * blockDim.x + threadIdx.x;
+   if (idx < n_values)
+      accumulation[idx] += sums[idx];
+}
+
+/** @brief Writes the mean of the sums of the accumulation, `samples` per pixel, to the image */
+__global__ void resolveAccumulation(unsigned char *image, const float *accumulation, int n_pixels, int samples)
+{
+   int pixel_idx = blockIdx.x * blockDim.x + threadIdx.x;
+   if (pixel_idx >= n_pixels)
+      return;
+
+   const float *sum = &accumulation[pixel_idx * 3];
+   write_pixel(float3_simple(sum[0], sum[1], sum[2]) / (float)samples, pixel_idx, image);
+}
+
+//==============================================================================
+// DENOISER KERNELS
+//==============================================================================
+
+// Same constants as denoiser.h
+__constant__ float ATROUS_KERNEL[5] = {1.0f / 16, 1.0f / 4, 3.0f / 8, 1.0f / 4, 1.0f / 16};
+#define ALBEDO_EPSILON 1e-3f
+
+__device__ inline float3_simple load3(const float *values, int pixel_idx)
+{
+   return float3_simple(values[pixel_idx * 3], values[pixel_idx * 3 + 1], values[pixel_idx * 3 + 2]);
+}
+
+__device__ inline void store3(float *values, int pixel_idx, const float3_simple &v)
+{
+   values[pixel_idx * 3] = v.x;
+   values[pixel_idx * 3 + 1] = v.y;
+   values[pixel_idx * 3 + 2] = v.z;
+}
+
+/** @brief The illumination of a pixel, its mean divided by its albedo, as in `denoise::atrous` */
+__global__ void denoiseDemodulate(float *illumination, const float *accumulation, const float *albedo,
+                                  int n_pixels, int samples)
+{
+   int pixel_idx = blockIdx.x * blockDim.x + threadIdx.x;
+   if (pixel_idx >= n_pixels)
+      return;
+
+   const float3_simple a = load3(albedo, pixel_idx) + float3_simple(ALBEDO_EPSILON, ALBEDO_EPSILON, ALBEDO_EPSILON);
+   const float3_simple mean = load3(accumulation, pixel_idx) / (float)samples;
+   store3(illumination, pixel_idx, float3_simple(mean.x / a.x, mean.y / a.y, mean.z / a.z));
+}
+
+/** @brief One pass of the a-trous filter, as `denoise::atrous_rows` */
+__global__ void denoiseAtrous(float *out, const float *in, const float *albedo, const float *normal, int width,
+                              int height, int step, float inv_color, float inv_normal, float inv_albedo)
+{
+   int x = blockIdx.x * blockDim.x + threadIdx.x;
+   int y = blockIdx.y * blockDim.y + threadIdx.y;
+   if (x >= width || y >= height)
+      return;
+
+   const int p = y * width + x;
+   const float3_simple c_p = load3(in, p), n_p = load3(normal, p), a_p = load3(albedo, p);
+   float3_simple sum(0.0f, 0.0f, 0.0f);
+   float total = 0.0f;
+   for (int j = -2; j <= 2; ++j)
+   {
+      const int qy = y + j * step;
+      if (qy < 0 || qy >= height)
+         continue;
+      for (int i = -2; i <= 2; ++i)
+      {
+         const int qx = x + i * step;
+         if (qx < 0 || qx >= width)
+            continue;
+
+         const int q = qy * width + qx;
+         const float3_simple c_q = load3(in, q);
+         const float w = ATROUS_KERNEL[i + 2] * ATROUS_KERNEL[j + 2] *
+                         expf(-(c_p - c_q).length_squared() * inv_color -
+                              (n_p - load3(normal, q)).length_squared() * inv_normal -
+                              (a_p - load3(albedo, q)).length_squared() * inv_albedo);
+         sum = sum + w * c_q;
+         total += w;
+      }
    }
+   store3(out, p, sum / total);
+}
 
-   // Use the pre-initialized random state for this pixel
-   curandState *local_rand_state = &rand_states[pixel_idx];
+/** @brief Multiplies the filtered illumination back by the albedo, and writes the pixel to the image */
+__global__ void denoiseRemodulate(unsigned char *image, float *colors, const float *illumination,
+                                  const float *albedo, int n_pixels)
+{
+   int pixel_idx = blockIdx.x * blockDim.x + threadIdx.x;
+   if (pixel_idx >= n_pixels)
+      return;
 
-   // Convert parameters to float3_simple
-   float3_simple camera_center(cam_center_x, cam_center_y, cam_center_z);
-   float3_simple pixel_color(0, 0, 0);
+   const float3_simple a = load3(albedo, pixel_idx) + float3_simple(ALBEDO_EPSILON, ALBEDO_EPSILON, ALBEDO_EPSILON);
+   const float3_simple c = load3(illumination, pixel_idx) * a;
+   store3(colors, pixel_idx, c);
+   write_pixel(c, pixel_idx, image);
+}
 
-   pixel_color = pixel_color + float3_simple(random_float(local_rand_state), random_float(local_rand_state),
-                                             random_float(local_rand_state));
+//==============================================================================
+// SCENE UPDATE KERNELS
+//==============================================================================
 
-   // Gamma correction (gamma=2)
-   pixel_color.x = sqrtf(fmaxf(pixel_color.x, 0.0f));
-   pixel_color.y = sqrtf(fmaxf(pixel_color.y, 0.0f));
-   pixel_color.z = sqrtf(fmaxf(pixel_color.z, 0.0f));
+/** @brief Moves the spheres `indices[i]` to the centers and radii of `updated[i]`, keeping their material */
+__global__ void updateSpheres(Cuda_sphere *spheres, const int *indices, const Cuda_sphere *updated, int n)
+{
+   int idx = blockIdx.x * blockDim.x + threadIdx.x;
+   if (idx >= n)
+      return;
 
-   // Convert to bytes with clamping
-   unsigned char r = (unsigned char)(255.0f * fminf(fmaxf(pixel_color.x, 0.0f), 1.0f));
-   unsigned char g = (unsigned char)(255.0f * fminf(fmaxf(pixel_color.y, 0.0f), 1.0f));
-   unsigned char b = (unsigned char)(255.0f * fminf(fmaxf(pixel_color.z, 0.0f), 1.0f));
+   Cuda_sphere &sphere = spheres[indices[idx]];
+   sphere.cx = updated[idx].cx;
+   sphere.cy = updated[idx].cy;
+   sphere.cz = updated[idx].cz;
+   sphere.radius = updated[idx].radius;
+}
 
-   // Store in image buffer - each kernel writes to its own unique location
-   image[base_idx] = r;
-   image[base_idx + 1] = g;
-   image[base_idx + 2] = b;
+/** @brief Replaces the nodes `indices[i]` by `updated[i]` */
+__global__ void updateNodes(Cuda_bvh_node *nodes, const int *indices, const Cuda_bvh_node *updated, int n)
+{
+   int idx = blockIdx.x * blockDim.x + threadIdx.x;
+   if (idx < n)
+      nodes[indices[idx]] = updated[idx];
 }
 
 //==============================================================================
@@ -195,92 +1004,753 @@ __global__ void renderKernel(unsigned char *image, int width, int height, int sa
 //==============================================================================
 
 /**
- * @brief Host function for tile-based rendering (useful for real-time display)
- * Renders only a rectangular portion of the image for progressive rendering
- * @param image Full image buffer (input/output)
- * @param width Full image width in pixels
- * @param height Full image height in pixels
- * @param cam_center_* Camera position components
- * @param pixel00_* Top-left pixel center position components
- * @param delta_u_* Pixel step in U direction components
- * @param delta_v_* Pixel step in V direction components
- * @param samples_per_pixel Number of rays per pixel for anti-aliasing
- * @param max_depth Maximum ray recursion depth
+ * @brief Persistent GPU state of a renderer, see camera_cuda.h for the interface
+ *
+ * The per-resolution buffers (random states and the frame slots) are only
+ * reallocated when the resolution changes, and the scene only when a new one
+ * is uploaded, so that a sequence of frames pays the setup cost once.
+ *
+ * Two frame slots are used in turn. A frame is rendered on the compute stream
+ * into the device image of its slot, then copied on the copy stream into the
+ * pinned host buffer of the slot. Since the copy of frame N and the kernel of
+ * frame N+1 are on different streams, they overlap when the caller submits the
+ * next frame before finishing the previous one.
  */
-extern "C" unsigned long long renderPixelsCUDA(unsigned char *image, int width, int height, double cam_center_x,
-                                               double cam_center_y, double cam_center_z, double pixel00_x,
-                                               double pixel00_y, double pixel00_z, double delta_u_x, double delta_u_y,
-                                               double delta_u_z, double delta_v_x, double delta_v_y, double delta_v_z,
-                                               int samples_per_pixel, int max_depth)
+struct Cuda_renderer
 {
+   static const int N_SLOTS = 2;
+
+   int device = 0;     // Selected by every call, so that each device can be driven by its own thread
+   char name[256] = ""; // Name of the device
+
+   struct Frame_slot
+   {
+      unsigned char *d_image = nullptr;  // Device image of the frame
+      unsigned char *h_image = nullptr;  // Pinned host copy of the image
+      Ray_counters *d_counters = nullptr; // Ray statistics, accumulated by the blocks of the kernel
+      Ray_counters *h_counters = nullptr; // Pinned host copy of the counters
+      cudaEvent_t rendered;              // Recorded on the compute stream after the kernel
+      cudaEvent_t copied;                // Recorded on the copy stream after the readback
+      bool pending = false;              // Submitted but not finished yet
+#ifdef RT_TRACE
+      // Timing events, see `cudaRendererLastFrameTimings`
+      cudaEvent_t t_begin, t_setup, t_rendered, t_copy_begin, t_copied;
+      bool setup = false; // The frame allocated the buffers or seeded the random states
+#endif
+   };
+
+   cudaStream_t compute_stream;
+   cudaStream_t copy_stream;
+
+   // Per-resolution state
+   int width = 0, height = 0;
+   unsigned long long seed = 0; // Seed of the random states
+   curandState *d_rand_states = nullptr;
+   float *d_accumulation = nullptr; // RGB sums of the samples, shared by the frames
+   Frame_slot slots[N_SLOTS];
+   int next_slot = 0;    // Slot used by the next submitted frame
+   int oldest_slot = 0;  // Slot returned by the next finished frame
+   int pending_frames = 0;
+
+   // Queues of the wavefront kernels, allocated on their first use at this resolution
+   char *d_wavefront = nullptr;
+   Ray_queue rays, next_rays;
+   Hit_queue lambertian_hits;
+   float *d_frame_sums = nullptr; // RGB sums of the samples of the current frame
+
+   // Sums of another device, copied by `cudaRendererAddAccumulation`
+   float *d_peer_sums = nullptr;
+
+   // Buffers of `cudaRendererDenoise`: albedo, normal, two illuminations and the float colors, 3 floats per pixel
+   float *d_denoise = nullptr;
+   std::vector<int> peer_access; // Per source device: 0 not checked yet, 1 direct copies, 2 copies through the host
+
+   // The flattened scene
+   Cuda_sphere *d_spheres = nullptr;
+   Cuda_bvh_node *d_nodes = nullptr;
+   Cuda_material *d_materials = nullptr;
+   Cuda_instance *d_instances = nullptr;
+   int n_spheres = 0, n_nodes = 0, n_materials = 0, n_instances = 0;
+   size_t spheres_capacity = 0, nodes_capacity = 0, materials_capacity = 0, instances_capacity = 0;
+
+   // Staging buffers of `cudaRendererUpdateScene`, sized for the largest update
+   int *d_update_sphere_indices = nullptr, *d_update_node_indices = nullptr;
+   Cuda_sphere *d_update_spheres = nullptr;
+   Cuda_bvh_node *d_update_nodes = nullptr;
+   size_t update_capacities[4] = {};
+
+#ifdef RT_TRACE
+   // Start of the frame being submitted, swapped with the event of its slot once the slot is
+   // known, since the setup of a new resolution resets the slots
+   cudaEvent_t t_next_begin;
+   Cuda_frame_timings last_timings{};
+   bool has_timings = false;
+#endif
+};
+
+#ifdef RT_TRACE
+/** @brief The timing events of a renderer */
+static std::vector<cudaEvent_t *> timing_events(Cuda_renderer *r)
+{
+   std::vector<cudaEvent_t *> events = {&r->t_next_begin};
+   for (auto &slot : r->slots)
+      events.insert(events.end(), {&slot.t_begin, &slot.t_setup, &slot.t_rendered, &slot.t_copy_begin, &slot.t_copied});
+   return events;
+}
+#endif
+
+/** @brief Print the error if any, returns true if the call succeeded */
+static bool check(cudaError_t err, const char *what)
+{
+   if (err != cudaSuccess)
+   {
+      printf("CUDA error (%s): %s\n", what, cudaGetErrorString(err));
+      return false;
+   }
+   return true;
+}
+
+/**
+ * @brief Copy an array to a device buffer, growing the buffer if it is too small
+ * @return The error of the allocation or of the copy
+ */
+template <typename T> static cudaError_t upload(T **d_ptr, size_t &capacity, const T *h_ptr, int count)
+{
+   if (count <= 0)
+      return cudaSuccess;
+
+   if ((size_t)count > capacity)
+   {
+      cudaFree(*d_ptr);
+      *d_ptr = nullptr;
+      capacity = 0;
+
+      cudaError_t err = cudaMalloc(d_ptr, count * sizeof(T));
+      if (err != cudaSuccess)
+         return err;
+      capacity = count;
+   }
+
+   return cudaMemcpyAsync(*d_ptr, h_ptr, count * sizeof(T), cudaMemcpyHostToDevice);
+}
+
+static void free_resolution_buffers(Cuda_renderer *r)
+{
+   cudaFree(r->d_rand_states);
+   cudaFree(r->d_accumulation);
+   cudaFree(r->d_wavefront);
+   cudaFree(r->d_peer_sums);
+   cudaFree(r->d_denoise);
+   r->d_rand_states = nullptr;
+   r->d_accumulation = nullptr;
+   r->d_wavefront = nullptr;
+   r->d_peer_sums = nullptr;
+   r->d_denoise = nullptr;
+
+   for (auto &slot : r->slots)
+   {
+      cudaFree(slot.d_image);
+      cudaFree(slot.d_counters);
+      cudaFreeHost(slot.h_image);
+      cudaFreeHost(slot.h_counters);
+      slot.d_image = slot.h_image = nullptr;
+      slot.d_counters = slot.h_counters = nullptr;
+      slot.pending = false;
+   }
+
+   r->width = r->height = 0;
+   r->next_slot = r->oldest_slot = r->pending_frames = 0;
+}
+
+/** @brief Initialize the random states of all the pixels, on the compute stream */
+static bool init_rand_states(Cuda_renderer *r, int num_pixels, unsigned long long seed)
+{
+   int threads_per_block = 256;
+   int num_blocks = (num_pixels + threads_per_block - 1) / threads_per_block;
+   init_random_states<<<num_blocks, threads_per_block, 0, r->compute_stream>>>(r->d_rand_states, num_pixels, seed);
+
+   if (!check(cudaGetLastError(), "random state init"))
+      return false;
+
+   r->seed = seed;
+   return true;
+}
+
+/** @brief (Re)allocate the per-resolution buffers and initialize the random states */
+static bool ensure_resolution(Cuda_renderer *r, int width, int height, unsigned long long seed)
+{
+   // The frames in flight are on the same stream, they use the old states before the reinitialization
+   if (r->width == width && r->height == height)
+      return r->seed == seed || init_rand_states(r, width * height, seed);
+
+   // Buffers may still be in use by submitted frames
+   cudaDeviceSynchronize();
+   free_resolution_buffers(r);
 
-   // Allocate device memory for the full image (we need to maintain the full buffer)
-   unsigned char *d_image;
-   size_t image_size = width * height * 3 * sizeof(unsigned char);
    int num_pixels = width * height;
+   size_t image_size = num_pixels * 3 * sizeof(unsigned char);
 
-   // Random generato states
-   curandState *d_rand_states;
+   bool ok = check(cudaMalloc(&r->d_rand_states, num_pixels * sizeof(curandState)), "malloc random states");
+   ok = ok && check(cudaMalloc(&r->d_accumulation, num_pixels * 3 * sizeof(float)), "malloc accumulation");
+   for (auto &slot : r->slots)
+   {
+      ok = ok && check(cudaMalloc(&slot.d_image, image_size), "malloc image");
+      ok = ok && check(cudaMalloc(&slot.d_counters, sizeof(Ray_counters)), "malloc counters");
+      ok = ok && check(cudaMallocHost(&slot.h_image, image_size), "malloc pinned image");
+      ok = ok && check(cudaMallocHost(&slot.h_counters, sizeof(Ray_counters)), "malloc pinned counters");
+   }
 
-   cudaError_t malloc_err1 = cudaMalloc(&d_image, image_size);
-   cudaError_t malloc_err2 = cudaMalloc(&d_rand_states, num_pixels * sizeof(curandState));
+   if (!ok)
+   {
+      free_resolution_buffers(r);
+      return false;
+   }
 
-   if (malloc_err1 != cudaSuccess || malloc_err2 != cudaSuccess)
+   // Initialize random states for all pixels, once per resolution and seed. The states
+   // then carry on from frame to frame, so every frame gets different noise.
+   if (!init_rand_states(r, num_pixels, seed))
    {
-      printf("CUDA malloc error: %s, %s\n", cudaGetErrorString(malloc_err1), cudaGetErrorString(malloc_err2));
-      return 0;
+      free_resolution_buffers(r);
+      return false;
    }
 
-   // Initialize random states for all pixels
+   r->width = width;
+   r->height = height;
+   printf("CUDA buffers allocated for %dx%d\n", width, height);
+   return true;
+}
+
+/** @brief Returns the next `count` values of type T of a buffer being split into arrays */
+template <typename T> static T *take(char *&buffer, int count)
+{
+   T *p = reinterpret_cast<T *>(buffer);
+   buffer += count * sizeof(T);
+   return p;
+}
+
+static void split_ray_queue(Ray_queue &q, char *&buffer, int capacity)
+{
+   q.pixel = take<int>(buffer, capacity);
+   for (float **array : {&q.ox, &q.oy, &q.oz, &q.dx, &q.dy, &q.dz, &q.tr, &q.tg, &q.tb})
+      *array = take<float>(buffer, capacity);
+}
+
+/** @brief Allocate the queues of the wavefront kernels for the current resolution, if not done yet */
+static bool ensure_wavefront(Cuda_renderer *r)
+{
+   if (r->d_wavefront != nullptr)
+      return true;
+
+   int num_pixels = r->width * r->height;
+   size_t size = (size_t)num_pixels * WAVEFRONT_VALUES_PER_PIXEL * 4 + 3 * sizeof(int);
+   if (!check(cudaMalloc(&r->d_wavefront, size), "malloc wavefront queues"))
+      return false;
+
+   char *buffer = r->d_wavefront;
+   split_ray_queue(r->rays, buffer, num_pixels);
+   split_ray_queue(r->next_rays, buffer, num_pixels);
+
+   Hit_queue &hits = r->lambertian_hits;
+   hits.ray = take<int>(buffer, num_pixels);
+   for (float **array : {&hits.px, &hits.py, &hits.pz, &hits.nx, &hits.ny, &hits.nz})
+      *array = take<float>(buffer, num_pixels);
+   hits.material = take<int>(buffer, num_pixels);
+
+   r->d_frame_sums = take<float>(buffer, num_pixels * 3);
+   r->rays.count = take<int>(buffer, 1);
+   r->next_rays.count = take<int>(buffer, 1);
+   hits.count = take<int>(buffer, 1);
+   return true;
+}
+
+/**
+ * @brief Renders a frame with the wavefront kernels, see `wavefrontGenerate`
+ * The kernels of every bounce are launched, up to `max_depth`, even once all the paths have ended,
+ * so that the frame is queued without waiting for the device.
+ */
+static bool launch_wavefront(Cuda_renderer *r, const Cuda_frame_params *params, const Device_scene &scene,
+                             Cuda_renderer::Frame_slot &slot)
+{
+   if (!ensure_wavefront(r))
+      return false;
+
+   Device_camera camera;
+   camera.center = float3_simple(params->cam_center[0], params->cam_center[1], params->cam_center[2]);
+   camera.pixel00 = float3_simple(params->pixel00[0], params->pixel00[1], params->pixel00[2]);
+   camera.delta_u = float3_simple(params->delta_u[0], params->delta_u[1], params->delta_u[2]);
+   camera.delta_v = float3_simple(params->delta_v[0], params->delta_v[1], params->delta_v[2]);
+
+   int num_pixels = params->width * params->height;
    int threads_per_block = 256;
    int num_blocks = (num_pixels + threads_per_block - 1) / threads_per_block;
-   init_random_states<<<num_blocks, threads_per_block>>>(d_rand_states, num_pixels, 1984);
+   cudaStream_t stream = r->compute_stream;
+
+   cudaMemsetAsync(r->d_frame_sums, 0, num_pixels * 3 * sizeof(float), stream);
+
+   for (int s = params->first_sample; s < params->first_sample + params->samples_per_pixel; s++)
+   {
+      Ray_queue rays = r->rays, next = r->next_rays;
+      wavefrontGenerate<<<num_blocks, threads_per_block, 0, stream>>>(rays, params->width, params->height, s,
+                                                                       params->sampler_seed, camera);
 
-   cudaError_t init_err = cudaGetLastError();
-   if (init_err != cudaSuccess)
+      for (int depth = 0; depth < params->max_depth; depth++)
+      {
+         cudaMemsetAsync(r->lambertian_hits.count, 0, sizeof(int), stream);
+         cudaMemsetAsync(next.count, 0, sizeof(int), stream);
+
+         wavefrontIntersect<<<num_blocks, threads_per_block, 0, stream>>>(rays, r->lambertian_hits, r->d_frame_sums,
+                                                                          depth, scene, slot.d_counters);
+         wavefrontShadeLambertian<<<num_blocks, threads_per_block, 0, stream>>>(
+             r->lambertian_hits, rays, next, depth, params->max_depth, params->roulette_depth, scene,
+             r->d_rand_states);
+
+         Ray_queue tmp = rays;
+         rays = next;
+         next = tmp;
+      }
+   }
+
+   wavefrontResolve<<<num_blocks, threads_per_block, 0, stream>>>(
+       slot.d_image, r->d_accumulation, r->d_frame_sums, num_pixels, params->summed_samples, params->samples_per_pixel);
+   return true;
+}
+
+extern "C" int cudaRendererDeviceCount()
+{
+   int count = 0;
+   if (cudaGetDeviceCount(&count) != cudaSuccess)
    {
-      printf("CUDA random state init error: %s\n", cudaGetErrorString(init_err));
-      cudaFree(d_image);
-      cudaFree(d_rand_states);
+      // No driver or no device, clear the error so that it is not reported by the next call
+      cudaGetLastError();
       return 0;
    }
+   return count;
+}
+
+extern "C" Cuda_renderer *cudaRendererCreate(int device)
+{
+   if (!check(cudaSetDevice(device), "select device"))
+      return nullptr;
+
+   Cuda_renderer *r = new Cuda_renderer();
+   r->device = device;
+
+   cudaDeviceProp properties;
+   if (cudaGetDeviceProperties(&properties, device) == cudaSuccess)
+      snprintf(r->name, sizeof(r->name), "%s", properties.name);
+
+   bool ok = check(cudaStreamCreateWithFlags(&r->compute_stream, cudaStreamNonBlocking), "create stream");
+   ok = ok && check(cudaStreamCreateWithFlags(&r->copy_stream, cudaStreamNonBlocking), "create stream");
+   for (auto &slot : r->slots)
+   {
+      ok = ok && check(cudaEventCreateWithFlags(&slot.rendered, cudaEventDisableTiming), "create event");
+      ok = ok && check(cudaEventCreateWithFlags(&slot.copied, cudaEventDisableTiming), "create event");
+   }
+#ifdef RT_TRACE
+   for (cudaEvent_t *e : timing_events(r))
+      ok = ok && check(cudaEventCreate(e), "create event");
+#endif
+
+   if (!ok)
+   {
+      delete r;
+      return nullptr;
+   }
+
+   return r;
+}
+
+extern "C" void cudaRendererDestroy(Cuda_renderer *r)
+{
+   if (r == nullptr)
+      return;
+
+   cudaSetDevice(r->device);
 
    cudaDeviceSynchronize();
+   free_resolution_buffers(r);
+
+   cudaFree(r->d_spheres);
+   cudaFree(r->d_nodes);
+   cudaFree(r->d_materials);
+   cudaFree(r->d_instances);
+   cudaFree(r->d_update_sphere_indices);
+   cudaFree(r->d_update_node_indices);
+   cudaFree(r->d_update_spheres);
+   cudaFree(r->d_update_nodes);
+
+   for (auto &slot : r->slots)
+   {
+      cudaEventDestroy(slot.rendered);
+      cudaEventDestroy(slot.copied);
+   }
+#ifdef RT_TRACE
+   for (cudaEvent_t *e : timing_events(r))
+      cudaEventDestroy(*e);
+#endif
+   cudaStreamDestroy(r->compute_stream);
+   cudaStreamDestroy(r->copy_stream);
+
+   delete r;
+}
 
-   // Set up grid and block dimensions for the tile
-   dim3 block_size(32, 4);
-   dim3 grid_size((width + block_size.x - 1) / block_size.x, (height + block_size.y - 1) / block_size.y);
+extern "C" int cudaRendererUploadScene(Cuda_renderer *r, const Cuda_sphere *spheres, int n_spheres,
+                                       const Cuda_bvh_node *nodes, int n_nodes, const Cuda_material *materials,
+                                       int n_materials, const Cuda_instance *instances, int n_instances)
+{
+   cudaSetDevice(r->device);
 
-   printf("Tile grid size: (%d, %d), Block size: (%d, %d)\n", grid_size.x, grid_size.y, block_size.x, block_size.y);
+   // The previous scene may still be in use by submitted frames
+   cudaDeviceSynchronize();
 
-   // Launch tile rendering kernel
-   renderKernel<<<grid_size, block_size>>>(d_image, width, height, samples_per_pixel, max_depth, (float)cam_center_x,
-                                           (float)cam_center_y, (float)cam_center_z, (float)pixel00_x, (float)pixel00_y,
-                                           (float)pixel00_z, (float)delta_u_x, (float)delta_u_y, (float)delta_u_z,
-                                           (float)delta_v_x, (float)delta_v_y, (float)delta_v_z, d_rand_states);
+   bool ok = check(upload(&r->d_spheres, r->spheres_capacity, spheres, n_spheres), "upload spheres");
+   ok = ok && check(upload(&r->d_nodes, r->nodes_capacity, nodes, n_nodes), "upload BVH nodes");
+   ok = ok && check(upload(&r->d_materials, r->materials_capacity, materials, n_materials), "upload materials");
+   ok = ok && check(upload(&r->d_instances, r->instances_capacity, instances, n_instances), "upload instances");
+   ok = ok && check(cudaDeviceSynchronize(), "upload scene");
 
-   // Check for kernel errors
-   cudaError_t kernel_err = cudaGetLastError();
-   if (kernel_err != cudaSuccess)
+   if (!ok)
    {
-      printf("CUDA kernel error: %s\n", cudaGetErrorString(kernel_err));
-      cudaFree(d_image);
+      r->n_spheres = r->n_nodes = r->n_materials = r->n_instances = 0;
       return 0;
    }
 
+   r->n_spheres = n_spheres;
+   r->n_nodes = n_nodes;
+   r->n_materials = n_materials;
+   r->n_instances = n_instances;
+
+   printf("Scene uploaded: %d spheres, %d BVH nodes, %d materials", n_spheres, n_nodes, n_materials);
+   if (n_instances > 0)
+      printf(", %d instances", n_instances);
+   printf("\n");
+   return 1;
+}
+
+extern "C" int cudaRendererUpdateScene(Cuda_renderer *r, const int *sphere_indices, const Cuda_sphere *spheres,
+                                       int n_spheres, const int *node_indices, const Cuda_bvh_node *nodes,
+                                       int n_nodes)
+{
+   cudaSetDevice(r->device);
+
+   for (int i = 0; i < n_spheres; i++)
+      if (sphere_indices[i] < 0 || sphere_indices[i] >= r->n_spheres)
+         return 0;
+   for (int i = 0; i < n_nodes; i++)
+      if (node_indices[i] < 0 || node_indices[i] >= r->n_nodes)
+         return 0;
+
+   // The scene may still be in use by submitted frames
    cudaDeviceSynchronize();
 
-   // Copy result back to host
-   cudaError_t copy_err = cudaMemcpy(image, d_image, image_size, cudaMemcpyDeviceToHost);
-   if (copy_err != cudaSuccess)
+   size_t *capacity = r->update_capacities;
+   bool ok = check(upload(&r->d_update_sphere_indices, capacity[0], sphere_indices, n_spheres), "upload updates");
+   ok = ok && check(upload(&r->d_update_spheres, capacity[1], spheres, n_spheres), "upload updates");
+   ok = ok && check(upload(&r->d_update_node_indices, capacity[2], node_indices, n_nodes), "upload updates");
+   ok = ok && check(upload(&r->d_update_nodes, capacity[3], nodes, n_nodes), "upload updates");
+
+   int threads_per_block = 256;
+   if (ok && n_spheres > 0)
+      updateSpheres<<<(n_spheres + threads_per_block - 1) / threads_per_block, threads_per_block>>>(
+          r->d_spheres, r->d_update_sphere_indices, r->d_update_spheres, n_spheres);
+   if (ok && n_nodes > 0)
+      updateNodes<<<(n_nodes + threads_per_block - 1) / threads_per_block, threads_per_block>>>(
+          r->d_nodes, r->d_update_node_indices, r->d_update_nodes, n_nodes);
+   ok = ok && check(cudaGetLastError(), "update scene");
+   ok = ok && check(cudaDeviceSynchronize(), "update scene");
+   return ok ? 1 : 0;
+}
+
+extern "C" int cudaRendererSubmitFrame(Cuda_renderer *r, const Cuda_frame_params *params)
+{
+   cudaSetDevice(r->device);
+
+   // Both slots are busy, the caller must finish a frame first
+   if (r->pending_frames == Cuda_renderer::N_SLOTS)
    {
-      printf("Memory copy error: %s\n", cudaGetErrorString(copy_err));
-      cudaFree(d_image);
+      printf("CUDA error: too many frames in flight\n");
       return 0;
    }
 
-   // Clean up
-   cudaFree(d_image);
+#ifdef RT_TRACE
+   const bool setup = r->width != params->width || r->height != params->height || r->seed != params->seed;
+   cudaEventRecord(r->t_next_begin, r->compute_stream);
+#endif
+
+   if (!ensure_resolution(r, params->width, params->height, params->seed))
+      return 0;
+
+   Cuda_renderer::Frame_slot &slot = r->slots[r->next_slot];
+#ifdef RT_TRACE
+   std::swap(slot.t_begin, r->t_next_begin);
+   slot.setup = setup;
+   cudaEventRecord(slot.t_setup, r->compute_stream);
+#endif
+   size_t image_size = params->width * params->height * 3 * sizeof(unsigned char);
+
+   Device_scene scene;
+   scene.spheres = r->d_spheres;
+   scene.nodes = r->d_nodes;
+   scene.n_nodes = r->n_nodes;
+   scene.materials = r->d_materials;
+   scene.instances = r->d_instances;
 
+   cudaMemsetAsync(slot.d_counters, 0, sizeof(Ray_counters), r->compute_stream);
+
+   if (params->wavefront)
+   {
+      if (!launch_wavefront(r, params, scene, slot))
+         return 0;
+   }
+   else
+   {
+      // Set up grid and block dimensions for the tile
+      dim3 block_size(32, 4);
+      dim3 grid_size((params->width + block_size.x - 1) / block_size.x,
+                     (params->height + block_size.y - 1) / block_size.y);
+
+      // Launch tile rendering kernel
+      renderKernel<<<grid_size, block_size, 0, r->compute_stream>>>(
+          slot.d_image, r->d_accumulation, params->width, params->height, params->first_sample,
+          params->sampler_seed, params->summed_samples, params->samples_per_pixel, params->max_depth,
+          params->roulette_depth,
+          (float)params->cam_center[0], (float)params->cam_center[1], (float)params->cam_center[2],
+          (float)params->pixel00[0], (float)params->pixel00[1], (float)params->pixel00[2], (float)params->delta_u[0],
+          (float)params->delta_u[1], (float)params->delta_u[2], (float)params->delta_v[0], (float)params->delta_v[1],
+          (float)params->delta_v[2], scene, r->d_rand_states, slot.d_counters);
+   }
+
+   if (!check(cudaGetLastError(), "kernel launch"))
+      return 0;
+
+   cudaEventRecord(slot.rendered, r->compute_stream);
+#ifdef RT_TRACE
+   cudaEventRecord(slot.t_rendered, r->compute_stream);
+#endif
+
+   // The readback waits for the kernel of this frame only, not for the ones submitted later
+   cudaStreamWaitEvent(r->copy_stream, slot.rendered, 0);
+#ifdef RT_TRACE
+   cudaEventRecord(slot.t_copy_begin, r->copy_stream);
+#endif
+   cudaMemcpyAsync(slot.h_image, slot.d_image, image_size, cudaMemcpyDeviceToHost, r->copy_stream);
+   cudaMemcpyAsync(slot.h_counters, slot.d_counters, sizeof(Ray_counters), cudaMemcpyDeviceToHost, r->copy_stream);
+   cudaEventRecord(slot.copied, r->copy_stream);
+#ifdef RT_TRACE
+   cudaEventRecord(slot.t_copied, r->copy_stream);
+#endif
+
+   slot.pending = true;
+   r->pending_frames++;
+   r->next_slot = (r->next_slot + 1) % Cuda_renderer::N_SLOTS;
    return 1;
-}
\ No newline at end of file
+}
+
+extern "C" unsigned long long cudaRendererFinishFrame(Cuda_renderer *r, unsigned char *image, Ray_counters *counters)
+{
+   cudaSetDevice(r->device);
+
+   if (r->pending_frames == 0)
+   {
+      printf("CUDA error: no frame was submitted\n");
+      return 0;
+   }
+
+   Cuda_renderer::Frame_slot &slot = r->slots[r->oldest_slot];
+   r->oldest_slot = (r->oldest_slot + 1) % Cuda_renderer::N_SLOTS;
+   r->pending_frames--;
+   slot.pending = false;
+
+   if (!check(cudaEventSynchronize(slot.copied), "render frame"))
+      return 0;
+
+#ifdef RT_TRACE
+   Cuda_frame_timings &t = r->last_timings;
+   cudaEventSynchronize(slot.t_copied);
+   cudaEventElapsedTime(&t.setup_ms, slot.t_begin, slot.t_setup);
+   cudaEventElapsedTime(&t.kernel_ms, slot.t_setup, slot.t_rendered);
+   cudaEventElapsedTime(&t.readback_start_ms, slot.t_begin, slot.t_copy_begin);
+   cudaEventElapsedTime(&t.readback_ms, slot.t_copy_begin, slot.t_copied);
+   if (!slot.setup)
+   {
+      // The time between the two events is that of the submission on the host, not of the GPU
+      t.kernel_ms += t.setup_ms;
+      t.setup_ms = 0;
+   }
+   r->has_timings = true;
+#endif
+
+   memcpy(image, slot.h_image, r->width * r->height * 3 * sizeof(unsigned char));
+   if (counters)
+      *counters = *slot.h_counters;
+
+   return slot.h_counters->rays;
+}
+
+extern "C" int cudaRendererReadAccumulation(Cuda_renderer *r, float *sums)
+{
+   if (r->d_accumulation == nullptr)
+      return 0;
+
+   cudaSetDevice(r->device);
+
+   // The streams are non-blocking, so wait explicitly for all the submitted kernels
+   if (!check(cudaStreamSynchronize(r->compute_stream), "render frame"))
+      return 0;
+
+   size_t size = r->width * r->height * 3 * sizeof(float);
+   return check(cudaMemcpy(sums, r->d_accumulation, size, cudaMemcpyDeviceToHost), "read accumulation") ? 1 : 0;
+}
+
+extern "C" int cudaRendererLastFrameTimings(Cuda_renderer *r, Cuda_frame_timings *timings)
+{
+#ifdef RT_TRACE
+   if (r->has_timings)
+   {
+      *timings = r->last_timings;
+      return 1;
+   }
+#endif
+   return 0;
+}
+
+extern "C" const char *cudaRendererDeviceName(Cuda_renderer *r) { return r->name; }
+
+extern "C" int cudaRendererAddAccumulation(Cuda_renderer *r, Cuda_renderer *source)
+{
+   if (r->d_accumulation == nullptr || source->d_accumulation == nullptr || r->width != source->width ||
+       r->height != source->height)
+   {
+      printf("CUDA error: no accumulation to add at this resolution\n");
+      return 0;
+   }
+
+   // The copy reads the sums of the source once all its kernels are done
+   cudaSetDevice(source->device);
+   if (!check(cudaStreamSynchronize(source->compute_stream), "render frame"))
+      return 0;
+
+   cudaSetDevice(r->device);
+   if ((int)r->peer_access.size() <= source->device)
+      r->peer_access.resize(source->device + 1, 0);
+
+   int &access = r->peer_access[source->device];
+   if (access == 0)
+   {
+      // Without peer access, cudaMemcpyPeer stages the copy through the host
+      int can_access = 0;
+      cudaDeviceCanAccessPeer(&can_access, r->device, source->device);
+      cudaError_t err = can_access ? cudaDeviceEnablePeerAccess(source->device, 0) : cudaErrorPeerAccessUnsupported;
+      access = err == cudaSuccess || err == cudaErrorPeerAccessAlreadyEnabled ? 1 : 2;
+      cudaGetLastError();
+   }
+
+   int n_values = r->width * r->height * 3;
+   if (r->d_peer_sums == nullptr && !check(cudaMalloc(&r->d_peer_sums, n_values * sizeof(float)), "malloc peer sums"))
+      return 0;
+
+   bool ok = check(cudaMemcpyPeerAsync(r->d_peer_sums, r->device, source->d_accumulation, source->device,
+                                       n_values * sizeof(float), r->compute_stream),
+                   "copy peer sums");
+
+   int threads_per_block = 256;
+   int num_blocks = (n_values + threads_per_block - 1) / threads_per_block;
+   if (ok)
+      addAccumulation<<<num_blocks, threads_per_block, 0, r->compute_stream>>>(r->d_accumulation, r->d_peer_sums,
+                                                                               n_values);
+   return ok && check(cudaGetLastError(), "add peer sums") ? 1 : 0;
+}
+
+extern "C" int cudaRendererResolve(Cuda_renderer *r, int samples, unsigned char *image)
+{
+   if (r->d_accumulation == nullptr || r->pending_frames > 0 || samples <= 0)
+   {
+      printf("CUDA error: no accumulation to resolve\n");
+      return 0;
+   }
+
+   cudaSetDevice(r->device);
+
+   // All the slots are free, the image of the next one is used as the output
+   Cuda_renderer::Frame_slot &slot = r->slots[r->next_slot];
+   int num_pixels = r->width * r->height;
+   int threads_per_block = 256;
+   int num_blocks = (num_pixels + threads_per_block - 1) / threads_per_block;
+   resolveAccumulation<<<num_blocks, threads_per_block, 0, r->compute_stream>>>(slot.d_image, r->d_accumulation,
+                                                                                num_pixels, samples);
+   if (!check(cudaGetLastError(), "resolve accumulation"))
+      return 0;
+
+   bool ok = check(cudaMemcpyAsync(slot.h_image, slot.d_image, num_pixels * 3, cudaMemcpyDeviceToHost,
+                                   r->compute_stream),
+                   "read image");
+   ok = ok && check(cudaStreamSynchronize(r->compute_stream), "resolve accumulation");
+   if (ok)
+      memcpy(image, slot.h_image, num_pixels * 3 * sizeof(unsigned char));
+   return ok ? 1 : 0;
+}
+
+extern "C" int cudaRendererDenoise(Cuda_renderer *r, int samples, const float *albedo, const float *normal,
+                                   const Cuda_denoise_params *params, unsigned char *image, float *colors)
+{
+   if (r->d_accumulation == nullptr || r->pending_frames > 0 || samples <= 0)
+   {
+      printf("CUDA error: no accumulation to denoise\n");
+      return 0;
+   }
+
+   cudaSetDevice(r->device);
+
+   const int num_pixels = r->width * r->height;
+   const size_t plane = (size_t)num_pixels * 3;
+   if (r->d_denoise == nullptr && !check(cudaMalloc(&r->d_denoise, 5 * plane * sizeof(float)), "malloc denoiser"))
+      return 0;
+   float *d_albedo = r->d_denoise, *d_normal = d_albedo + plane, *d_in = d_normal + plane, *d_out = d_in + plane;
+   float *d_colors = d_out + plane;
+
+   bool ok = check(cudaMemcpyAsync(d_albedo, albedo, plane * sizeof(float), cudaMemcpyHostToDevice,
+                                   r->compute_stream),
+                   "upload albedo");
+   ok = ok && check(cudaMemcpyAsync(d_normal, normal, plane * sizeof(float), cudaMemcpyHostToDevice,
+                                    r->compute_stream),
+                    "upload normal");
+   if (!ok)
+      return 0;
+
+   int threads_per_block = 256;
+   int num_blocks = (num_pixels + threads_per_block - 1) / threads_per_block;
+   denoiseDemodulate<<<num_blocks, threads_per_block, 0, r->compute_stream>>>(d_in, r->d_accumulation, d_albedo,
+                                                                              num_pixels, samples);
+
+   dim3 block(16, 16);
+   dim3 grid((r->width + block.x - 1) / block.x, (r->height + block.y - 1) / block.y);
+   const float inv_normal = 1.0f / (params->sigma_normal * params->sigma_normal);
+   const float inv_albedo = 1.0f / (params->sigma_albedo * params->sigma_albedo);
+   for (int pass = 0; pass < params->iterations; pass++)
+   {
+      const float sigma_color = params->sigma_color / (float)(1 << pass);
+      denoiseAtrous<<<grid, block, 0, r->compute_stream>>>(d_out, d_in, d_albedo, d_normal, r->width, r->height,
+                                                           1 << pass, 1.0f / (sigma_color * sigma_color),
+                                                           inv_normal, inv_albedo);
+      std::swap(d_in, d_out);
+   }
+
+   // All the slots are free, the image of the next one is used as the output
+   Cuda_renderer::Frame_slot &slot = r->slots[r->next_slot];
+   denoiseRemodulate<<<num_blocks, threads_per_block, 0, r->compute_stream>>>(slot.d_image, d_colors, d_in,
+                                                                              d_albedo, num_pixels);
+   if (!check(cudaGetLastError(), "denoise"))
+      return 0;
+
+   ok = check(cudaMemcpyAsync(slot.h_image, slot.d_image, num_pixels * 3, cudaMemcpyDeviceToHost,
+                              r->compute_stream),
+              "read image");
+   if (colors != nullptr)
+      ok = ok && check(cudaMemcpyAsync(colors, d_colors, plane * sizeof(float), cudaMemcpyDeviceToHost,
+                                       r->compute_stream),
+                       "read colors");
+   ok = ok && check(cudaStreamSynchronize(r->compute_stream), "denoise");
+   if (ok)
+      memcpy(image, slot.h_image, num_pixels * 3 * sizeof(unsigned char));
+   return ok ? 1 : 0;
+}
@@ -1,17 +1,157 @@
 #pragma once
 
+#include "render_stats.h"
+
+/**
+ * Flattened scene description uploaded to the GPU (see cuda_scene.h for the
+ * conversion from the CPU scene). All the structures are plain data so that
+ * they can be copied as-is to the device.
+ */
+
+// Material kinds understood by the kernel, same order as `Material_type`
+enum Cuda_material_type
+{
+   CUDA_MATERIAL_GENERIC = 0,
+   CUDA_MATERIAL_LAMBERTIAN = 1,
+   CUDA_MATERIAL_CONSTANT = 2,
+   CUDA_MATERIAL_SHOW_NORMALS = 3
+};
+
+struct Cuda_material
+{
+   int type;      // One of Cuda_material_type
+   float r, g, b; // Albedo or emitted color, depending on the type
+};
+
+// A sphere of a leaf. A radius of 0 marks an object that is never hit, a negative one an instance, whose
+// `material` is then its index in the instance table.
+struct Cuda_sphere
+{
+   float cx, cy, cz; // Center
+   float radius;
+   int material; // Index in the material table
+};
+
+// A shared hierarchy of spheres placed by a transform, see `Instance`
+struct Cuda_instance
+{
+   float to_object[12]; // World to object transform, row-major 3x4
+   int root;            // First node of the hierarchy of the object, in the node array
+};
+
+// Node of the flattened BVH, same layout rules as `Bvh_node`
+struct Cuda_bvh_node
+{
+   float min_x, min_y, min_z;
+   float max_x, max_y, max_z;
+   int offset; // Interior node: index of the second child. Leaf: index of the first sphere
+   int count;  // Number of spheres in a leaf, 0 for an interior node
+   int axis;   // Split axis
+};
+
+// Camera and sampling parameters of one frame
+struct Cuda_frame_params
+{
+   int width, height;               // Image size in pixels
+   int samples_per_pixel;           // Number of rays per pixel traced by this frame
+   int max_depth;                   // Maximum ray bounce depth
+   int roulette_depth;              // Bounces before the paths may be ended by Russian roulette
+   int first_sample;                // Index of the first sample, for the sub-pixel pattern
+   int summed_samples;              // Samples already summed on the device, 0 to restart the accumulation
+   int wavefront;                   // 1 to render with the wavefront kernels, 0 with the one-thread-per-pixel kernel
+   unsigned long long seed;         // Seed of the random states of the pixels, reinitialized when it changes
+   unsigned long long sampler_seed; // Global seed, which rotates the sub-pixel pattern as `Pixel_sampler`
+   double cam_center[3];            // Camera position
+   double pixel00[3];               // Top-left pixel center position
+   double delta_u[3];               // Pixel step in U direction
+   double delta_v[3];               // Pixel step in V direction
+};
+
+// Durations of a frame measured with cudaEvents, only available with the TRACE option (see trace.h)
+struct Cuda_frame_timings
+{
+   float setup_ms;          // Allocation of the buffers and seeding of the random states, 0 when they were reused
+   float kernel_ms;         // Kernels of the frame, from the end of the setup
+   float readback_start_ms; // From the start of the frame to the start of the copy of the image to the host
+   float readback_ms;       // Copy of the image and the counters to the host
+};
+
+// Settings of the a-trous filter of `cudaRendererDenoise`, same as `Denoise_settings`
+struct Cuda_denoise_params
+{
+   int iterations;     // Passes of the filter
+   float sigma_color;  // Tolerance to the differences of illumination, halved at every pass
+   float sigma_normal; // Tolerance to the differences of normal
+   float sigma_albedo; // Tolerance to the differences of albedo
+};
+
+// Opaque long-lived GPU renderer (device buffers, random states, streams), defined in camera_cuda.cu
+typedef struct Cuda_renderer Cuda_renderer;
+
 #ifdef __cplusplus
 extern "C"
 {
 #endif
 
-   // Host function declaration for tile-based CUDA rendering (for real-time display)
-   unsigned long long renderPixelsCUDA(unsigned char *image, int width, int height, double cam_center_x,
-                                       double cam_center_y, double cam_center_z, double pixel00_x, double pixel00_y,
-                                       double pixel00_z, double delta_u_x, double delta_u_y, double delta_u_z,
-                                       double delta_v_x, double delta_v_y, double delta_v_z, int samples_per_pixel,
-                                       int max_depth);
+   // Number of CUDA devices, 0 when there is no device or no driver
+   int cudaRendererDeviceCount();
+
+   // Creates a renderer on a device (0 to cudaRendererDeviceCount() - 1), or returns null if the device
+   // cannot be used. Every call on a renderer selects its device, so that the renderers of several devices
+   // can be driven from different threads, one thread per renderer.
+   Cuda_renderer *cudaRendererCreate(int device);
+
+   // Name of the device of the renderer
+   const char *cudaRendererDeviceName(Cuda_renderer *renderer);
+
+   // Waits for the frames in flight and releases all the device memory
+   void cudaRendererDestroy(Cuda_renderer *renderer);
+
+   // Uploads (or replaces) the scene. The spheres must be in the leaf order of the BVH nodes, the nodes of
+   // the instanced hierarchies following those of the scene. Returns 0 on error.
+   int cudaRendererUploadScene(Cuda_renderer *renderer, const Cuda_sphere *spheres, int n_spheres,
+                               const Cuda_bvh_node *nodes, int n_nodes, const Cuda_material *materials,
+                               int n_materials, const Cuda_instance *instances, int n_instances);
+
+   // Replaces the spheres `sphere_indices` and the nodes `node_indices` of the uploaded scene, e.g. those
+   // refitted after moving spheres, the other ones and the materials being kept. The spheres keep their
+   // material, only their center and radius are copied. Returns 0 on error.
+   int cudaRendererUpdateScene(Cuda_renderer *renderer, const int *sphere_indices, const Cuda_sphere *spheres,
+                               int n_spheres, const int *node_indices, const Cuda_bvh_node *nodes, int n_nodes);
+
+   // Starts rendering a frame asynchronously. Up to two frames can be in flight, the readback of
+   // a frame overlapping the rendering of the next one. Returns 0 on error.
+   int cudaRendererSubmitFrame(Cuda_renderer *renderer, const Cuda_frame_params *params);
+
+   // Waits for the oldest submitted frame and copies it to `image` (width * height * 3 bytes), the
+   // mean of all the samples accumulated so far. Returns the number of rays traced by the frame, the
+   // detailed counters are written to `counters` when not null.
+   unsigned long long cudaRendererFinishFrame(Cuda_renderer *renderer, unsigned char *image, Ray_counters *counters);
+
+   // The timings of the last frame returned by `cudaRendererFinishFrame`. Returns 0 when the renderer
+   // was built without the TRACE option.
+   int cudaRendererLastFrameTimings(Cuda_renderer *renderer, Cuda_frame_timings *timings);
+
+   // Waits for all the frames and copies the float sums of the samples (width * height * 3 values)
+   // to `sums`. Returns 0 on error.
+   int cudaRendererReadAccumulation(Cuda_renderer *renderer, float *sums);
+
+   // Waits for the frames of `source`, rendered on another device at the same resolution, and adds its
+   // sums to those of `renderer`. The sums are copied directly between the devices when they have peer
+   // access, through the host otherwise. Returns 0 on error.
+   int cudaRendererAddAccumulation(Cuda_renderer *renderer, Cuda_renderer *source);
+
+   // Writes to `image` (width * height * 3 bytes) the mean of the sums, divided by `samples`. There must be
+   // no frame in flight. Returns 0 on error.
+   int cudaRendererResolve(Cuda_renderer *renderer, int samples, unsigned char *image);
+
+   // Denoises the mean of the sums, divided by `samples`, with the a-trous filter of denoiser.h guided by the
+   // `albedo` and `normal` buffers (width * height * 3 floats each, see `Aov_buffers`). Writes the result to
+   // `image` (width * height * 3 bytes), and its float colors to `colors` when not null. There must be no
+   // frame in flight, the sums are left as they are. Returns 0 on error.
+   int cudaRendererDenoise(Cuda_renderer *renderer, int samples, const float *albedo, const float *normal,
+                           const Cuda_denoise_params *params, unsigned char *image, float *colors);
 
 #ifdef __cplusplus
 }
-#endif
\ No newline at end of file
+#endif
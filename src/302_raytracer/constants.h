@@ -15,7 +15,13 @@ const int IMAGE_WIDTH = (int)(ASPECT_RATIO * SET_IMAGE_HEIGHT);
 const int CHANNELS = 3; // RGB
 
 // Renderer specific settings
-const int SAMPLES_PER_PIXEL = 16; // Number of samples per pixel for anti-aliasing
-const int MAX_DEPTH = 16;         // Maximum recursion depth for ray tracing
+const int SAMPLES_PER_PIXEL = 16;   // Number of samples per pixel for anti-aliasing
+const int MAX_DEPTH = 16;           // Maximum number of rays of a path
+const int ROULETTE_DEPTH = 6;       // Bounces before the paths may be ended by Russian roulette
+const double MIN_THROUGHPUT = 1e-4; // Throughput below which a path no longer contributes and is ended
+const int TILE_SIZE = 16;           // Size of the square tiles distributed to the threads by the parallel renderer
+const int WAVEFRONT_SIZE = 4096;    // Paths in flight per thread of the wavefront renderer
+const int SAMPLE_BATCHES = 16;      // Sample batches of a frame shared between devices (GPU and CPU, or GPUs)
+const int AOV_SAMPLES = 4;          // Primary rays per pixel of the albedo and normal buffers of the denoisers
 
 }; 
\ No newline at end of file
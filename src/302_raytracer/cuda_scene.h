@@ -0,0 +1,208 @@
+/**
+ * @class Cuda_scene
+ * @brief Flattened copy of a scene, ready to be uploaded to the GPU.
+ *
+ * The GPU cannot follow the `shared_ptr` graph of the CPU scene nor call its
+ * virtual functions. This class converts a `Bvh` into three plain arrays:
+ *
+ * - the spheres, in the leaf order of the hierarchy, each with the index of
+ *   its material,
+ * - the BVH nodes, with the same layout as on the CPU,
+ * - the material table, one entry per distinct material, tagged with its type.
+ *
+ * Only spheres and the instances of a `Bvh` of spheres (see instance.h) are
+ * supported on the GPU. Other primitives are replaced by an empty sphere that is
+ * never hit, so that the leaf ranges stay valid. Each hierarchy instanced is
+ * flattened once, its spheres and nodes following those of the scene, and the
+ * instances only add their transform to the instance table.
+ *
+ * `Cuda_scene_update` holds instead what the last `Bvh::move_spheres` changed,
+ * to update a scene already uploaded without converting it again.
+ */
+#pragma once
+
+#include "bvh.h"
+#include "camera_cuda.h"
+#include "instance.h"
+#include "material.h"
+#include "sphere.h"
+
+#include <unordered_map>
+
+class Cuda_scene
+{
+ public:
+   vector<Cuda_sphere> spheres;
+   vector<Cuda_bvh_node> nodes;
+   vector<Cuda_material> materials;
+   vector<Cuda_instance> instances;
+
+   Cuda_scene() {}
+
+   Cuda_scene(const Bvh &bvh)
+   {
+      unordered_map<const Material *, int> material_index;
+      int unsupported = 0;
+
+      // With SoA leaves, the spheres are only stored there
+      const Sphere_soa &leaf_spheres = bvh.get_leaf_spheres();
+      for (int i = 0; i < leaf_spheres.size(); i++)
+      {
+         int id = material_id(leaf_spheres.get_materials()[leaf_spheres.get_material_id(i)].get(), material_index);
+         spheres.push_back(to_cuda(leaf_spheres, i, id));
+      }
+
+      // The instanced hierarchies are added after the scene, their first node being only known then
+      vector<const Bvh *> instanced;
+      for (const auto &object : bvh.get_primitives())
+      {
+         if (const Instance *instance = dynamic_cast<const Instance *>(object.get()))
+         {
+            const Bvh *shared = dynamic_cast<const Bvh *>(&instance->get_object());
+            if (shared != nullptr && shared->node_count() > 0 &&
+                shared->get_leaf_spheres().size() == shared->build_stats().primitive_count)
+            {
+               spheres.push_back(Cuda_sphere{0, 0, 0, -1, (int)instances.size()});
+               instances.push_back(to_cuda(instance->get_inverse()));
+               instanced.push_back(shared);
+               continue;
+            }
+         }
+
+         const Sphere *sphere = dynamic_cast<const Sphere *>(object.get());
+         if (sphere == nullptr)
+         {
+            unsupported++;
+            spheres.push_back(Cuda_sphere{0, 0, 0, 0, 0});
+            continue;
+         }
+
+         int id = material_id(sphere->get_material(), material_index);
+         const Point3 &c = sphere->get_center();
+         spheres.push_back(Cuda_sphere{(float)c.x(), (float)c.y(), (float)c.z(), (float)sphere->get_radius(), id});
+      }
+
+      for (int i = 0; i < bvh.node_count(); i++)
+         nodes.push_back(to_cuda(bvh.get_nodes()[i]));
+
+      unordered_map<const Bvh *, int> roots;
+      for (size_t i = 0; i < instanced.size(); i++)
+      {
+         auto it = roots.find(instanced[i]);
+         if (it == roots.end())
+            it = roots.emplace(instanced[i], add_hierarchy(*instanced[i], material_index)).first;
+         instances[i].root = it->second;
+      }
+
+      // Materials must exist even for an empty scene, the kernel never indexes an empty table
+      if (materials.empty())
+         materials.push_back(Cuda_material{CUDA_MATERIAL_LAMBERTIAN, 0.5f, 0.5f, 0.5f});
+
+      if (unsupported > 0)
+         cerr << "Warning: " << unsupported << " non-sphere objects are ignored by the CUDA renderer" << endl;
+   }
+
+ static Cuda_sphere to_cuda(const Sphere_soa &spheres, int i, int material)
+   {
+      const Point3 c = spheres.center(i);
+      return Cuda_sphere{(float)c.x(), (float)c.y(), (float)c.z(), (float)spheres.get_radius(i), material};
+   }
+
+   static Cuda_bvh_node to_cuda(const Bvh_node &node)
+   {
+      return Cuda_bvh_node{(float)node.bbox.x.min, (float)node.bbox.y.min, (float)node.bbox.z.min,
+                           (float)node.bbox.x.max, (float)node.bbox.y.max, (float)node.bbox.z.max,
+                           node.offset, node.count, node.axis};
+   }
+
+   // The instance of a hierarchy by its world to object transform, its root being set once the hierarchy is added
+   static Cuda_instance to_cuda(const Transform &to_object)
+   {
+      Cuda_instance instance{};
+      for (int i = 0; i < 3; i++)
+         for (int j = 0; j < 4; j++)
+            instance.to_object[4 * i + j] = (float)to_object.m[i][j];
+      return instance;
+   }
+
+ private:
+   // Appends the spheres and nodes of a hierarchy with SoA leaves, returns the index of its root
+   int add_hierarchy(const Bvh &bvh, unordered_map<const Material *, int> &material_index)
+   {
+      const int first_sphere = (int)spheres.size(), first_node = (int)nodes.size();
+      const Sphere_soa &leaf_spheres = bvh.get_leaf_spheres();
+      for (int i = 0; i < leaf_spheres.size(); i++)
+      {
+         int id = material_id(leaf_spheres.get_materials()[leaf_spheres.get_material_id(i)].get(), material_index);
+         spheres.push_back(to_cuda(leaf_spheres, i, id));
+      }
+
+      for (int i = 0; i < bvh.node_count(); i++)
+      {
+         Cuda_bvh_node node = to_cuda(bvh.get_nodes()[i]);
+         node.offset += node.count > 0 ? first_sphere : first_node;
+         nodes.push_back(node);
+      }
+      return first_node;
+   }
+
+   // Index of a material in the table, added on its first use
+   int material_id(const Material *mat, unordered_map<const Material *, int> &material_index)
+   {
+      auto it = material_index.find(mat);
+      if (it == material_index.end())
+      {
+         it = material_index.emplace(mat, (int)materials.size()).first;
+         materials.push_back(to_cuda(mat));
+      }
+      return it->second;
+   }
+
+   static Cuda_material to_cuda(const Material *mat)
+   {
+      switch (mat->type)
+      {
+      case Material_type::Lambertian:
+      {
+         const Color &a = static_cast<const Lambertian *>(mat)->albedo;
+         return Cuda_material{CUDA_MATERIAL_LAMBERTIAN, (float)a.x(), (float)a.y(), (float)a.z()};
+      }
+      case Material_type::Constant:
+      {
+         const Color &c = static_cast<const Constant *>(mat)->color;
+         return Cuda_material{CUDA_MATERIAL_CONSTANT, (float)c.x(), (float)c.y(), (float)c.z()};
+      }
+      case Material_type::ShowNormals:
+         return Cuda_material{CUDA_MATERIAL_SHOW_NORMALS, 0, 0, 0};
+      default:
+         cerr << "Warning: generic materials are not supported by the CUDA renderer, using a grey diffuse" << endl;
+         return Cuda_material{CUDA_MATERIAL_LAMBERTIAN, 0.5f, 0.5f, 0.5f};
+      }
+   }
+};
+
+/**
+ * @class Cuda_scene_update
+ * @brief The spheres and nodes changed by the last `Bvh::move_spheres`, see `cudaRendererUpdateScene`
+ *
+ * The spheres keep their material on the GPU, their `material` field is not set.
+ */
+class Cuda_scene_update
+{
+ public:
+   vector<int> sphere_indices;
+   vector<Cuda_sphere> spheres;
+   vector<int> node_indices;
+   vector<Cuda_bvh_node> nodes;
+
+   Cuda_scene_update(const Bvh &bvh)
+   {
+      sphere_indices = bvh.last_moved_spheres();
+      for (int i : sphere_indices)
+         spheres.push_back(Cuda_scene::to_cuda(bvh.get_leaf_spheres(), i, 0));
+
+      node_indices = bvh.last_refitted_nodes();
+      for (int i : node_indices)
+         nodes.push_back(Cuda_scene::to_cuda(bvh.get_nodes()[i]));
+   }
+};
@@ -0,0 +1,215 @@
+/**
+ * @file denoiser.h
+ * @brief Denoising of low-sample renders, guided by the albedo and normal of the first surface seen
+ *
+ * The auxiliary buffers (AOVs) come from `Camera::renderAovs`: a few jittered primary rays
+ * per pixel, which gives them antialiased edges without noise. Two denoisers use them:
+ *
+ * - `Denoiser_type::Atrous`: the edge-avoiding a-trous wavelet filter of Dammertz et al.
+ *   (HPG 2010), on the CPU threads, or on the GPU for the frames of the CUDA renderers (see
+ *   `cudaRendererDenoise`). The color is divided by the albedo before filtering and multiplied
+ *   back after, so that only the illumination is blurred (as in SVGF), and each pass averages
+ *   5x5 taps spaced 2^i pixels apart, weighted down across the changes of illumination, normal
+ *   and albedo. Four passes cover 61x61 pixels at the cost of 100 taps per pixel.
+ * - `Denoiser_type::Oidn`: Intel Open Image Denoise, in builds configured with `-DOIDN=ON`.
+ */
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#ifdef RT_OIDN
+#include <OpenImageDenoise/oidn.hpp>
+#endif
+
+enum class Denoiser_type
+{
+   None,
+   Atrous,
+   Oidn
+};
+
+// Settings of the denoisers, the tolerances being those of the a-trous filter
+struct Denoise_settings
+{
+   Denoiser_type type = Denoiser_type::None;
+   int iterations = 4;         // Passes of the a-trous filter
+   float sigma_color = 0.5f;   // Tolerance to the differences of illumination, halved at every pass
+   float sigma_normal = 0.2f;  // Tolerance to the differences of normal
+   float sigma_albedo = 0.05f; // Tolerance to the differences of albedo
+};
+
+/**
+ * @class Aov_buffers
+ * @brief Albedo and normal of the first surface seen through each pixel, averaged over its samples
+ * The rays escaping to the sky give its color as albedo, and a zero normal.
+ */
+struct Aov_buffers
+{
+   int width = 0, height = 0;
+   std::vector<float> albedo; // RGB, 3 floats per pixel, row by row
+   std::vector<float> normal; // XYZ in world space, 3 floats per pixel, row by row
+
+   void resize(int width, int height)
+   {
+      this->width = width;
+      this->height = height;
+      albedo.assign((size_t)width * height * 3, 0.0f);
+      normal.assign((size_t)width * height * 3, 0.0f);
+   }
+};
+
+namespace denoise
+{
+
+// Added to the albedo before dividing the color by it, so that the black surfaces keep their noise-free black
+const float ALBEDO_EPSILON = 1e-3f;
+
+// B3 spline weights of the 5 taps of each axis
+const float ATROUS_KERNEL[5] = {1.0f / 16, 1.0f / 4, 3.0f / 8, 1.0f / 4, 1.0f / 16};
+
+inline float distance_squared(const float *a, const float *b)
+{
+   const float dx = a[0] - b[0], dy = a[1] - b[1], dz = a[2] - b[2];
+   return dx * dx + dy * dy + dz * dz;
+}
+
+/**
+ * @brief One pass of the a-trous filter over the rows [y0, y1), from `in` to `out`
+ * @param step Spacing of the taps, 2^i at pass i
+ * @param inv_color, inv_normal, inv_albedo The inverse squared tolerances of the pass
+ */
+inline void atrous_rows(const std::vector<float> &in, std::vector<float> &out, const Aov_buffers &aovs, int step,
+                        float inv_color, float inv_normal, float inv_albedo, int y0, int y1)
+{
+   const int width = aovs.width, height = aovs.height;
+   for (int y = y0; y < y1; ++y)
+   {
+      for (int x = 0; x < width; ++x)
+      {
+         const size_t p = ((size_t)y * width + x) * 3;
+         float sum[3] = {0, 0, 0}, total = 0;
+         for (int j = -2; j <= 2; ++j)
+         {
+            const int qy = y + j * step;
+            if (qy < 0 || qy >= height)
+               continue;
+            for (int i = -2; i <= 2; ++i)
+            {
+               const int qx = x + i * step;
+               if (qx < 0 || qx >= width)
+                  continue;
+
+               const size_t q = ((size_t)qy * width + qx) * 3;
+               const float w = ATROUS_KERNEL[i + 2] * ATROUS_KERNEL[j + 2] *
+                               std::exp(-distance_squared(&in[p], &in[q]) * inv_color -
+                                        distance_squared(&aovs.normal[p], &aovs.normal[q]) * inv_normal -
+                                        distance_squared(&aovs.albedo[p], &aovs.albedo[q]) * inv_albedo);
+               for (int c = 0; c < 3; ++c)
+                  sum[c] += w * in[q + c];
+               total += w;
+            }
+         }
+
+         // The center tap has weight 1, so the total is never 0
+         for (int c = 0; c < 3; ++c)
+            out[p + c] = sum[c] / total;
+      }
+   }
+}
+
+/**
+ * @brief Denoises float RGB colors (`width * height * 3`) in place with the a-trous filter
+ * @param n_threads Threads sharing the rows of each pass
+ */
+inline void atrous(std::vector<float> &colors, const Aov_buffers &aovs, const Denoise_settings &settings,
+                   int n_threads)
+{
+   const size_t n_values = colors.size();
+
+   // The illumination, without the texture of the surfaces
+   std::vector<float> a(n_values), b(n_values);
+   for (size_t i = 0; i < n_values; ++i)
+      a[i] = colors[i] / (aovs.albedo[i] + ALBEDO_EPSILON);
+
+   n_threads = std::max(1, std::min(n_threads, aovs.height));
+   for (int pass = 0; pass < settings.iterations; ++pass)
+   {
+      const float sigma_color = settings.sigma_color / (float)(1 << pass);
+      const float inv_color = 1.0f / (sigma_color * sigma_color);
+      const float inv_normal = 1.0f / (settings.sigma_normal * settings.sigma_normal);
+      const float inv_albedo = 1.0f / (settings.sigma_albedo * settings.sigma_albedo);
+
+      std::vector<std::thread> threads;
+      for (int t = 0; t < n_threads; ++t)
+      {
+         const int y0 = aovs.height * t / n_threads, y1 = aovs.height * (t + 1) / n_threads;
+         threads.emplace_back([&, y0, y1]
+                              { atrous_rows(a, b, aovs, 1 << pass, inv_color, inv_normal, inv_albedo, y0, y1); });
+      }
+      for (auto &thread : threads)
+         thread.join();
+      std::swap(a, b);
+   }
+
+   for (size_t i = 0; i < n_values; ++i)
+      colors[i] = a[i] * (aovs.albedo[i] + ALBEDO_EPSILON);
+}
+
+// Whether the build has Open Image Denoise
+constexpr bool oidn_available()
+{
+#ifdef RT_OIDN
+   return true;
+#else
+   return false;
+#endif
+}
+
+/**
+ * @brief Denoises float RGB colors (`width * height * 3`) in place with Open Image Denoise
+ * @return false after printing the error, or without the OIDN option
+ */
+inline bool oidn(std::vector<float> &colors, const Aov_buffers &aovs)
+{
+#ifdef RT_OIDN
+   const size_t bytes = colors.size() * sizeof(float);
+   oidn::DeviceRef device = oidn::newDevice();
+   device.commit();
+
+   oidn::BufferRef color = device.newBuffer(bytes), albedo = device.newBuffer(bytes),
+                   normal = device.newBuffer(bytes);
+   color.write(0, bytes, colors.data());
+   albedo.write(0, bytes, aovs.albedo.data());
+   normal.write(0, bytes, aovs.normal.data());
+
+   // The "RT" filter is trained on path traced images, the colors are HDR
+   oidn::FilterRef filter = device.newFilter("RT");
+   filter.setImage("color", color, oidn::Format::Float3, aovs.width, aovs.height);
+   filter.setImage("albedo", albedo, oidn::Format::Float3, aovs.width, aovs.height);
+   filter.setImage("normal", normal, oidn::Format::Float3, aovs.width, aovs.height);
+   filter.setImage("output", color, oidn::Format::Float3, aovs.width, aovs.height);
+   filter.set("hdr", true);
+   filter.commit();
+   filter.execute();
+
+   const char *message;
+   if (device.getError(message) != oidn::Error::None)
+   {
+      std::cerr << "Open Image Denoise: " << message << std::endl;
+      return false;
+   }
+   color.read(0, bytes, colors.data());
+   return true;
+#else
+   (void)colors;
+   (void)aovs;
+   std::cerr << "Built without the OIDN option, the image is not denoised" << std::endl;
+   return false;
+#endif
+}
+
+} // namespace denoise
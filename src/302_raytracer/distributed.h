@@ -0,0 +1,986 @@
+/**
+ * @file distributed.h
+ * @brief Renders the frames on several machines, a coordinator sharing their parts between workers over TCP
+ *
+ * A worker (`--worker <port>`) waits for a coordinator. The coordinator (`--coordinator host:port,...`)
+ * connects to every worker, sends it the scene in the binary format of scene_file.h, then hands out
+ * tasks: a rectangle of a frame, seen from the view of the frame, with a range of samples. The worker
+ * sends back the float sums of the samples of every pixel of the rectangle, which the coordinator adds
+ * to the accumulation buffer of the frame: a pixel rendered in several parts gets the mean of all their
+ * samples, each part weighted by its number of samples.
+ *
+ * The frames are cut into tasks according to the `Shard_mode`:
+ * - `Tiles`: square tiles with all the samples, for the CPU workers
+ * - `Samples`: the whole frame with a range of the samples, for the GPU workers which trace whole images
+ * - `Frames`: whole frames, for the batches of a job file (`-j`)
+ *
+ * The random sequence of a sample only depends on its pixel and its index (see rnd_gen.h), so the image
+ * does not depend on the number of workers nor on the tasks they got, up to the float rounding of the
+ * sums merged by the coordinator.
+ *
+ * One thread of the coordinator per worker pulls the tasks from a shared queue, so the fast machines get
+ * more of them. A worker that closes the connection, sends an invalid message or does not answer a task
+ * within the timeout is dropped, and its task goes back to the front of the queue. Once no worker is
+ * left, the coordinator renders the remaining tasks itself.
+ *
+ * **Protocol**: every message is a `Net_header` followed by `size` bytes. The structs are sent as they
+ * are in memory, so the machines must be little-endian and run the same version of the program, which
+ * the `Net_hello` of both sides checks.
+ *
+ * | Message  | From        | Content                                                                 |
+ * |----------|-------------|-------------------------------------------------------------------------|
+ * | `Hello`  | both        | `Net_hello`, the first message of each side                              |
+ * | `Scene`  | coordinator | The binary scene file                                                   |
+ * | `Task`   | coordinator | `Net_task`                                                              |
+ * | `Result` | worker      | `Net_result`, then the r, g, b and squared luminance sums of each pixel |
+ * | `Bye`    | coordinator | Nothing, the worker then waits for the next coordinator                 |
+ */
+#pragma once
+
+#include "accumulation_buffer.h"
+#include "bvh.h"
+#include "camera.h"
+#include "render_job.h"
+#include "render_stats.h"
+#include "scene_file.h"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <cerrno>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+/**
+ * @class Socket
+ * @brief A blocking TCP connection, or a listening socket
+ */
+class Socket
+{
+ public:
+#ifdef _WIN32
+   using Handle = SOCKET;
+   static constexpr Handle INVALID = INVALID_SOCKET;
+#else
+   using Handle = int;
+   static constexpr Handle INVALID = -1;
+#endif
+
+   Socket() {}
+   explicit Socket(Handle handle) : handle(handle) {}
+   ~Socket() { close(); }
+
+   Socket(const Socket &) = delete;
+   Socket &operator=(const Socket &) = delete;
+   Socket(Socket &&other) noexcept : handle(other.handle) { other.handle = INVALID; }
+   Socket &operator=(Socket &&other) noexcept
+   {
+      std::swap(handle, other.handle);
+      return *this;
+   }
+
+   bool is_open() const { return handle != INVALID; }
+
+   /**
+    * @brief Connects to a host, trying each of its addresses
+    * @param timeout_ms For each address, so that an unreachable machine does not hold its thread for minutes
+    */
+   bool connect(const std::string &host, int port, int timeout_ms)
+   {
+      close();
+      if (!startup())
+         return false;
+
+      addrinfo hints = {};
+      hints.ai_family = AF_UNSPEC;
+      hints.ai_socktype = SOCK_STREAM;
+      addrinfo *addresses = nullptr;
+      if (getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &addresses) != 0)
+         return false;
+
+      for (addrinfo *a = addresses; a != nullptr && !is_open(); a = a->ai_next)
+      {
+         handle = ::socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+         if (!is_open())
+            continue;
+
+         // Connected without blocking, to wait for it with a timeout
+         set_blocking(false);
+         bool connected = ::connect(handle, a->ai_addr, (int)a->ai_addrlen) == 0 ||
+                          (connecting() && wait_writable(timeout_ms) && pending_error() == 0);
+         if (connected)
+            set_blocking(true);
+         else
+            close();
+      }
+      freeaddrinfo(addresses);
+
+      if (is_open())
+         configure();
+      return is_open();
+   }
+
+   // Listens on all the interfaces, `backlog` connections waiting to be accepted at most
+   bool listen(int port, int backlog = 4)
+   {
+      close();
+      if (!startup())
+         return false;
+
+      handle = ::socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+      if (!is_open())
+         return false;
+
+      int reuse = 1; // Restarting a worker does not wait for the connections of the previous one to expire
+      setsockopt(handle, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<const char *>(&reuse), sizeof(reuse));
+
+      sockaddr_in address = {};
+      address.sin_family = AF_INET;
+      address.sin_addr.s_addr = htonl(INADDR_ANY);
+      address.sin_port = htons((uint16_t)port);
+      if (::bind(handle, reinterpret_cast<const sockaddr *>(&address), sizeof(address)) != 0 ||
+          ::listen(handle, backlog) != 0)
+      {
+         close();
+         return false;
+      }
+      return true;
+   }
+
+   // Waits for the next connection, not open on error
+   Socket accept()
+   {
+      Socket connection(::accept(handle, nullptr, nullptr));
+      if (connection.is_open())
+         connection.configure();
+      return connection;
+   }
+
+   /**
+    * @brief Fails the sends and receives that take longer than `timeout_ms`, 0 to wait forever
+    * The connection must then be closed, since a message may have been partly sent or received.
+    */
+   void set_timeout(int timeout_ms)
+   {
+#ifdef _WIN32
+      DWORD timeout = (DWORD)timeout_ms;
+#else
+      timeval timeout = {timeout_ms / 1000, (timeout_ms % 1000) * 1000};
+#endif
+      setsockopt(handle, SOL_SOCKET, SO_RCVTIMEO, reinterpret_cast<const char *>(&timeout), sizeof(timeout));
+      setsockopt(handle, SOL_SOCKET, SO_SNDTIMEO, reinterpret_cast<const char *>(&timeout), sizeof(timeout));
+   }
+
+   bool send_all(const void *data, size_t size)
+   {
+      const char *bytes = static_cast<const char *>(data);
+      while (size > 0)
+      {
+         int sent = (int)::send(handle, bytes, (int)std::min(size, CHUNK_SIZE), SEND_FLAGS);
+         if (sent <= 0)
+            return false;
+         bytes += sent;
+         size -= sent;
+      }
+      return true;
+   }
+
+   // False when the connection is closed or fails before `size` bytes
+   bool receive_all(void *data, size_t size)
+   {
+      char *bytes = static_cast<char *>(data);
+      while (size > 0)
+      {
+         int received = (int)::recv(handle, bytes, (int)std::min(size, CHUNK_SIZE), 0);
+         if (received <= 0)
+            return false;
+         bytes += received;
+         size -= received;
+      }
+      return true;
+   }
+
+   // Receives what arrived, up to `size` bytes, 0 or less when the connection is closed or fails
+   int receive_some(void *data, size_t size)
+   {
+      return (int)::recv(handle, static_cast<char *>(data), (int)std::min(size, CHUNK_SIZE), 0);
+   }
+
+   void close()
+   {
+      if (!is_open())
+         return;
+#ifdef _WIN32
+      closesocket(handle);
+#else
+      ::close(handle);
+#endif
+      handle = INVALID;
+   }
+
+ private:
+   static constexpr size_t CHUNK_SIZE = 1 << 20; // Of the calls to send and recv, whose sizes are int on Windows
+#ifdef MSG_NOSIGNAL
+   static constexpr int SEND_FLAGS = MSG_NOSIGNAL; // A closed connection fails the send instead of killing the process
+#else
+   static constexpr int SEND_FLAGS = 0;
+#endif
+
+   Handle handle = INVALID;
+
+   // Initializes the socket library once, on Windows
+   static bool startup()
+   {
+#ifdef _WIN32
+      static const bool started = []
+      {
+         WSADATA data;
+         return WSAStartup(MAKEWORD(2, 2), &data) == 0;
+      }();
+      return started;
+#else
+      return true;
+#endif
+   }
+
+   void configure()
+   {
+      int no_delay = 1; // The small task messages are sent at once
+      setsockopt(handle, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char *>(&no_delay), sizeof(no_delay));
+#if !defined(MSG_NOSIGNAL) && defined(SO_NOSIGPIPE)
+      int no_sigpipe = 1;
+      setsockopt(handle, SOL_SOCKET, SO_NOSIGPIPE, &no_sigpipe, sizeof(no_sigpipe));
+#endif
+   }
+
+   void set_blocking(bool blocking)
+   {
+#ifdef _WIN32
+      u_long non_blocking = blocking ? 0 : 1;
+      ioctlsocket(handle, FIONBIO, &non_blocking);
+#else
+      int flags = fcntl(handle, F_GETFL, 0);
+      fcntl(handle, F_SETFL, blocking ? flags & ~O_NONBLOCK : flags | O_NONBLOCK);
+#endif
+   }
+
+   static bool connecting()
+   {
+#ifdef _WIN32
+      return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+      return errno == EINPROGRESS;
+#endif
+   }
+
+   bool wait_writable(int timeout_ms)
+   {
+      pollfd entry = {};
+      entry.fd = handle;
+      entry.events = POLLOUT;
+#ifdef _WIN32
+      return WSAPoll(&entry, 1, timeout_ms) == 1;
+#else
+      return poll(&entry, 1, timeout_ms) == 1;
+#endif
+   }
+
+   // The error of the connection in progress, 0 once connected
+   int pending_error()
+   {
+      int error = 0;
+      socklen_t size = sizeof(error);
+      if (getsockopt(handle, SOL_SOCKET, SO_ERROR, reinterpret_cast<char *>(&error), &size) != 0)
+         return -1;
+      return error;
+   }
+};
+
+//==============================================================================
+// PROTOCOL
+//==============================================================================
+
+enum class Net_message : uint32_t
+{
+   Hello = 1,
+   Scene = 2,
+   Task = 3,
+   Result = 4,
+   Bye = 5,
+};
+
+struct Net_header
+{
+   uint32_t type;     // A `Net_message`
+   uint32_t reserved; // 0
+   uint64_t size;     // Bytes following the header
+};
+
+// The first message of both sides, the connection is closed when they do not match
+struct Net_hello
+{
+   char magic[8];        // "RT302NET"
+   uint32_t version;     // `NET_VERSION`
+   uint32_t real_size;   // sizeof(real), the precision of the geometry
+   int32_t threads;      // Render threads of the worker, 0 from the coordinator
+   int32_t method;       // `Render_method` of the worker, -1 from the coordinator
+};
+
+// A part of a frame to render
+struct Net_task
+{
+   uint32_t id;
+   uint32_t seed;                         // Of the random sequences, see `RndGen::set_seed`
+   double lookfrom[3], lookat[3], vup[3]; // View of the frame
+   double vfov;
+   int32_t width, height;                 // Of the whole frame
+   int32_t max_depth;
+   int32_t x0, y0, x1, y1;                // The pixels [x0, x1) x [y0, y1)
+   int32_t first_sample, n_samples;       // The samples [first_sample, first_sample + n_samples) of each pixel
+   int32_t total_samples;                 // Samples per pixel of the frame, for the stratification of the sampler
+};
+
+// Followed by 4 floats per pixel of the rectangle, row by row
+struct Net_result
+{
+   uint32_t id;           // Of the task
+   uint32_t reserved;     // 0
+   Ray_counters counters; // Of the task
+   double render_ms;
+};
+
+constexpr uint32_t NET_VERSION = 1;
+constexpr uint64_t NET_MAX_SCENE = 1ull << 34;    // Larger scenes are taken for a corrupted stream
+constexpr uint64_t NET_RECEIVE_STEP = 1ull << 24; // The payloads grow by this many bytes at most as they arrive
+constexpr int64_t NET_MAX_PIXELS = 1ll << 28;     // Of the frame of a task, 16384 x 16384
+
+inline Net_hello net_hello(int threads, int method)
+{
+   Net_hello hello = {};
+   memcpy(hello.magic, "RT302NET", 8);
+   hello.version = NET_VERSION;
+   hello.real_size = sizeof(real);
+   hello.threads = threads;
+   hello.method = method;
+   return hello;
+}
+
+inline bool compatible(const Net_hello &a, const Net_hello &b)
+{
+   return memcmp(a.magic, b.magic, 8) == 0 && a.version == b.version && a.real_size == b.real_size;
+}
+
+inline bool send_message(Socket &socket, Net_message type, const void *data = nullptr, size_t size = 0)
+{
+   Net_header header = {(uint32_t)type, 0, size};
+   return socket.send_all(&header, sizeof(header)) && (size == 0 || socket.send_all(data, size));
+}
+
+/**
+ * @brief Receives a message, false when its payload is larger than `max_size(type)` bytes
+ *
+ * The sizes expected depend on the state of the connection, e.g. only a `Net_hello` during the handshake. The
+ * payload grows as it is received, so that the size announced by a peer is never allocated before the bytes come.
+ * @param max_size Called with the `Net_message` type of the header, returns the largest valid payload
+ */
+template <typename Max_size>
+inline bool receive_message(Socket &socket, Net_message &type, std::vector<unsigned char> &payload, Max_size max_size)
+{
+   Net_header header;
+   if (!socket.receive_all(&header, sizeof(header)))
+      return false;
+   type = (Net_message)header.type;
+   if (header.size > (uint64_t)max_size(type))
+      return false;
+
+   payload.clear();
+   while (payload.size() < header.size)
+   {
+      const size_t received = payload.size();
+      payload.resize(received + (size_t)std::min(header.size - received, NET_RECEIVE_STEP));
+      if (!socket.receive_all(payload.data() + received, payload.size() - received))
+         return false;
+   }
+   return true;
+}
+
+// The payload of a message of type `expected`, and of no other type, is at most `size` bytes
+inline auto net_only(Net_message expected, uint64_t size)
+{
+   return [=](Net_message type) { return type == expected ? size : 0; };
+}
+
+// The sums of the pixels of a rectangle of `accumulation`, in the layout of a `Result` message
+inline void pack_region(const Accumulation_buffer &accumulation, int x0, int y0, int x1, int y1,
+                        std::vector<float> &sums)
+{
+   sums.resize((size_t)(x1 - x0) * (y1 - y0) * 4);
+   float *out = sums.data();
+   for (int y = y0; y < y1; y++)
+   {
+      for (int x = x0; x < x1; x++)
+      {
+         Color sum = accumulation.sum(x, y);
+         *out++ = (float)sum.x();
+         *out++ = (float)sum.y();
+         *out++ = (float)sum.z();
+         *out++ = accumulation.luminance_square_sum(x, y);
+      }
+   }
+}
+
+// Splits "host:port", false if the port is missing or invalid
+inline bool parse_address(const std::string &address, std::string &host, int &port)
+{
+   size_t colon = address.find_last_of(':');
+   if (colon == std::string::npos || colon == 0)
+      return false;
+   host = address.substr(0, colon);
+   char *end;
+   long value = strtol(address.c_str() + colon + 1, &end, 10);
+   port = (int)value;
+   return *end == '\0' && end != address.c_str() + colon + 1 && value > 0 && value < 65536;
+}
+
+//==============================================================================
+// WORKER
+//==============================================================================
+
+/**
+ * @brief Renders the tasks of the coordinators connecting to `port`, one coordinator at a time, until the
+ * process is stopped
+ *
+ * @param camera Its threads and the GPU context are used for all the tasks, its view and resolution are
+ *               those of each task
+ * @param method The renderer of the tasks
+ * @return 1 if the port is not available
+ */
+inline int run_render_worker(int port, Camera &camera, Render_method method)
+{
+   Socket server;
+   if (!server.listen(port))
+   {
+      std::cerr << "Cannot listen on port " << port << std::endl;
+      return 1;
+   }
+   std::cout << "Worker listening on port " << port << ", rendering with " << render_method_names[(int)method]
+             << std::endl;
+
+   camera.show_progress = false;
+   Scene_file scene;
+   std::vector<unsigned char> payload;
+   std::vector<float> sums;
+   std::vector<unsigned char> result;
+
+   while (true)
+   {
+      Socket connection = server.accept();
+      if (!connection.is_open())
+         continue;
+
+      Net_message type;
+      const int threads = camera.num_threads > 0 ? camera.num_threads : (int)std::thread::hardware_concurrency();
+      Net_hello hello = net_hello(threads, (int)method);
+      if (!receive_message(connection, type, payload, net_only(Net_message::Hello, sizeof(Net_hello))) ||
+          type != Net_message::Hello ||
+          payload.size() != sizeof(Net_hello) || !compatible(*reinterpret_cast<Net_hello *>(payload.data()), hello))
+      {
+         std::cerr << "Connection refused: not a coordinator of the same version" << std::endl;
+         continue;
+      }
+      send_message(connection, Net_message::Hello, &hello, sizeof(hello));
+      std::cout << "Coordinator connected" << std::endl;
+
+      bool has_scene = false;
+      int tasks = 0;
+      auto task_size = [](Net_message type) -> uint64_t
+      { return type == Net_message::Scene ? NET_MAX_SCENE : type == Net_message::Task ? sizeof(Net_task) : 0; };
+      while (receive_message(connection, type, payload, task_size) && type != Net_message::Bye)
+      {
+         if (type == Net_message::Scene)
+         {
+            has_scene = scene.load_memory(std::move(payload), "received scene");
+            camera.invalidateSceneCUDA();
+            if (!has_scene)
+               break;
+            std::cout << "Scene received, " << scene.get_bvh().build_stats().primitive_count << " objects" << std::endl;
+            continue;
+         }
+
+         Net_task task;
+         if (type != Net_message::Task || payload.size() != sizeof(task) || !has_scene)
+            break;
+         memcpy(&task, payload.data(), sizeof(task));
+
+         // The resolution is limited before the buffers of the camera are allocated for it
+         if (task.width <= 0 || task.height <= 0 || (int64_t)task.width * task.height > NET_MAX_PIXELS ||
+             task.x0 < 0 || task.y0 < 0 || task.x1 > task.width || task.y1 > task.height || task.x0 >= task.x1 ||
+             task.y0 >= task.y1 || task.n_samples <= 0 || task.max_depth <= 0 || task.first_sample < 0 ||
+             task.total_samples < (int64_t)task.first_sample + task.n_samples)
+            break;
+
+         if (camera.image_width != task.width || camera.image_height != task.height)
+            camera.setResolution(task.width, task.height);
+         camera.setView(Point3(task.lookfrom[0], task.lookfrom[1], task.lookfrom[2]),
+                        Point3(task.lookat[0], task.lookat[1], task.lookat[2]),
+                        Vec3(task.vup[0], task.vup[1], task.vup[2]), task.vfov);
+         camera.max_depth = task.max_depth;
+         RndGen::set_seed(task.seed);
+
+         if (!camera.renderRegion(scene.get_bvh(), method, task.x0, task.y0, task.x1, task.y1, task.first_sample,
+                                  task.n_samples, task.total_samples))
+            break;
+
+         Net_result header = {};
+         header.id = task.id;
+         header.counters = camera.stats.total();
+         header.render_ms = camera.stats.render_ms;
+         pack_region(camera.accumulation, task.x0, task.y0, task.x1, task.y1, sums);
+
+         result.resize(sizeof(header) + sums.size() * sizeof(float));
+         memcpy(result.data(), &header, sizeof(header));
+         memcpy(result.data() + sizeof(header), sums.data(), sums.size() * sizeof(float));
+         if (!send_message(connection, Net_message::Result, result.data(), result.size()))
+            break;
+         tasks++;
+      }
+      std::cout << "Coordinator disconnected after " << tasks << " tasks" << std::endl;
+   }
+}
+
+//==============================================================================
+// COORDINATOR
+//==============================================================================
+
+enum class Shard_mode
+{
+   Tiles,   // Square tiles with all the samples
+   Samples, // The whole frame with a range of the samples
+   Frames,  // Whole frames
+};
+
+inline const char *const shard_mode_names[] = {"tiles", "samples", "frames"};
+
+// -1 for an unknown name
+inline int parse_shard_mode(const char *name)
+{
+   for (int i = 0; i < 3; i++)
+      if (strcmp(name, shard_mode_names[i]) == 0)
+         return i;
+   return -1;
+}
+
+// How the frames are shared between the workers
+struct Distributed_settings
+{
+   Shard_mode shard = Shard_mode::Tiles;
+   int tile_size = 128;             // Of `Shard_mode::Tiles`, large enough for all the threads of a worker
+   int ranges_per_worker = 2;       // Sample ranges of a frame per worker with `Shard_mode::Samples`
+   int timeout_ms = 600000;         // To answer a task, after which the worker is dropped
+   int connect_timeout_ms = 5000;
+};
+
+/**
+ * @class Render_coordinator
+ * @brief Shares the frames of a batch between workers, see the top of this file
+ */
+class Render_coordinator
+{
+ public:
+   Render_coordinator(const std::vector<std::string> &addresses, const Distributed_settings &settings)
+       : settings(settings)
+   {
+      for (const std::string &address : addresses)
+         workers.push_back(Worker{address});
+   }
+
+   /**
+    * @brief Renders the frames in tasks shared between the workers
+    *
+    * @param camera Gives the resolution, depth and seed of the frames, and renders the tasks left
+    *               when no worker is left, with `method`
+    * @param on_frame Called as `on_frame(index, accumulation)` for each frame, in the order of `jobs`,
+    *                 with `camera.stats` holding the statistics of the frame
+    * @return false if the scene cannot be sent, after printing the error
+    */
+   bool render(const Bvh &scene, Camera &camera, Render_method method, const std::vector<Render_job> &jobs,
+               const std::function<void(int, Accumulation_buffer &)> &on_frame)
+   {
+      if (!Scene_file::serialize(scene, scene_bytes))
+         return false;
+
+      frame_jobs = &jobs;
+      width = camera.image_width;
+      height = camera.image_height;
+      max_depth = camera.max_depth;
+      seed = (uint32_t)RndGen::get_seed();
+      make_tasks();
+
+      frames.assign(jobs.size(), Frame());
+      for (const Render_task &task : tasks)
+         frames[task.frame].remaining++;
+      pending.clear();
+      for (int i = 0; i < (int)tasks.size(); i++)
+         pending.push_back(i);
+      alive = (int)workers.size();
+      finished = false;
+
+      std::cout << "Distributing " << tasks.size() << " tasks (" << shard_mode_names[(int)settings.shard]
+                << ") to " << workers.size() << " workers" << std::endl;
+
+      std::vector<std::thread> threads;
+      for (Worker &worker : workers)
+         threads.emplace_back(&Render_coordinator::serve_worker, this, std::ref(worker));
+
+      std::vector<float> sums;
+      std::unique_lock<std::mutex> lock(mutex);
+      for (int next_frame = 0; next_frame < (int)frames.size();)
+      {
+         changed.wait(lock, [&] { return frames[next_frame].remaining == 0 || (alive == 0 && !pending.empty()); });
+
+         Frame &frame = frames[next_frame];
+         if (frame.remaining == 0)
+         {
+            Accumulation_buffer accumulation = std::move(frame.accumulation);
+            Thread_stats counters = frame.counters;
+            auto elapsed = std::chrono::high_resolution_clock::now() - frame.start;
+            lock.unlock();
+
+            if (accumulation.get_width() != width)
+               accumulation.resize(width, height); // A frame without tasks
+            camera.stats.reset(1);
+            camera.stats.add(counters);
+            camera.stats.render_ms = std::chrono::duration<double, std::milli>(elapsed).count();
+            camera.stats.record_samples_per_pixel(accumulation.sample_counts());
+            on_frame(next_frame, accumulation);
+
+            lock.lock();
+            next_frame++;
+            continue;
+         }
+
+         // No worker is left, the tasks are rendered here
+         int index = take_task();
+         const Render_task &task = tasks[index];
+         const Render_job &job = jobs[task.frame];
+         lock.unlock();
+
+         camera.setView(job.lookfrom, job.lookat, job.vup, job.vfov);
+         bool ok = camera.renderRegion(scene, method, task.x0, task.y0, task.x1, task.y1, task.first_sample,
+                                       task.n_samples, job.samples);
+         pack_region(camera.accumulation, task.x0, task.y0, task.x1, task.y1, sums);
+
+         lock.lock();
+         if (!ok)
+         {
+            std::cerr << "The remaining tasks cannot be rendered by the coordinator" << std::endl;
+            return stop(threads, lock, false);
+         }
+         local_tasks++;
+         merge(index, camera.stats.total(), sums.data());
+      }
+
+      return stop(threads, lock, true);
+   }
+
+ private:
+   // A part of a frame, see `Net_task`
+   struct Render_task
+   {
+      int frame;
+      int x0, y0, x1, y1;
+      int first_sample, n_samples;
+   };
+
+   struct Frame
+   {
+      Accumulation_buffer accumulation; // Allocated with the first result
+      Thread_stats counters;
+      int remaining = 0;                // Tasks not merged yet
+      bool started = false;
+      std::chrono::high_resolution_clock::time_point start;
+   };
+
+   struct Worker
+   {
+      std::string address;
+      int tasks = 0;
+      unsigned long long rays = 0;
+      double render_ms = 0;
+      std::string error; // Why the worker was dropped, empty if it was not
+   };
+
+   Distributed_settings settings;
+   std::vector<Worker> workers;
+
+   // Of the current render
+   const std::vector<Render_job> *frame_jobs = nullptr;
+   std::vector<unsigned char> scene_bytes;
+   int width = 0, height = 0, max_depth = 0;
+   uint32_t seed = 0;
+   std::vector<Render_task> tasks;
+
+   // Shared with the threads of the workers
+   std::mutex mutex;
+   std::condition_variable changed;
+   std::deque<int> pending; // Tasks to hand out, by index
+   std::vector<Frame> frames;
+   int alive = 0;           // Workers not dropped
+   int local_tasks = 0;     // Rendered by the coordinator
+   bool finished = false;
+
+   void make_tasks()
+   {
+      tasks.clear();
+      const int n_workers = std::max(1, (int)workers.size());
+      for (int f = 0; f < (int)frame_jobs->size(); f++)
+      {
+         const int samples = (*frame_jobs)[f].samples;
+         switch (settings.shard)
+         {
+         case Shard_mode::Tiles:
+         {
+            const int size = std::max(1, settings.tile_size);
+            for (int y = 0; y < height; y += size)
+               for (int x = 0; x < width; x += size)
+                  tasks.push_back({f, x, y, std::min(x + size, width), std::min(y + size, height), 0, samples});
+            break;
+         }
+         case Shard_mode::Samples:
+         {
+            // Even ranges, their first samples rounded down
+            const int ranges = std::clamp(n_workers * settings.ranges_per_worker, 1, samples);
+            for (int r = 0; r < ranges; r++)
+            {
+               int first = (int)((long long)samples * r / ranges);
+               int end = (int)((long long)samples * (r + 1) / ranges);
+               tasks.push_back({f, 0, 0, width, height, first, end - first});
+            }
+            break;
+         }
+         case Shard_mode::Frames:
+            tasks.push_back({f, 0, 0, width, height, 0, samples});
+            break;
+         }
+      }
+   }
+
+   // The next pending task, to be called with the lock held
+   int take_task()
+   {
+      int index = pending.front();
+      pending.pop_front();
+
+      Frame &frame = frames[tasks[index].frame];
+      if (!frame.started)
+      {
+         frame.started = true;
+         frame.start = std::chrono::high_resolution_clock::now();
+      }
+      return index;
+   }
+
+   // Adds the sums of a task to its frame, with the lock held
+   void merge(int index, const Ray_counters &counters, const float *sums)
+   {
+      const Render_task &task = tasks[index];
+      Frame &frame = frames[task.frame];
+      if (frame.accumulation.get_width() != width || frame.accumulation.get_height() != height)
+         frame.accumulation.resize(width, height);
+
+      for (int y = task.y0; y < task.y1; y++)
+      {
+         for (int x = task.x0; x < task.x1; x++, sums += 4)
+            frame.accumulation.add(x, y, Color(sums[0], sums[1], sums[2]), sums[3], task.n_samples);
+      }
+      frame.counters.merge(counters);
+      frame.remaining--;
+      changed.notify_all();
+   }
+
+   // Waits for the threads of the workers and prints what each of them did
+   bool stop(std::vector<std::thread> &threads, std::unique_lock<std::mutex> &lock, bool ok)
+   {
+      finished = true;
+      changed.notify_all();
+      lock.unlock();
+      for (std::thread &thread : threads)
+         thread.join();
+
+      for (const Worker &worker : workers)
+      {
+         std::cout << "  " << worker.address << ": " << worker.tasks << " tasks, " << worker.rays << " rays in "
+                   << (int)worker.render_ms << " ms";
+         if (!worker.error.empty())
+            std::cout << ", dropped: " << worker.error;
+         std::cout << std::endl;
+      }
+      if (local_tasks > 0)
+         std::cout << "  coordinator: " << local_tasks << " tasks" << std::endl;
+      return ok;
+   }
+
+   // Drops a worker, to be called with the lock held
+   void drop(Worker &worker, const std::string &error)
+   {
+      worker.error = error;
+      alive--;
+      std::cerr << "Worker " << worker.address << " dropped: " << error << std::endl;
+      changed.notify_all();
+   }
+
+   // Connects to the worker and sends it the scene, false with the reason in `error`
+   bool connect(Worker &worker, Socket &socket, std::string &error)
+   {
+      std::string host;
+      int port;
+      if (!parse_address(worker.address, host, port))
+      {
+         error = "invalid address, expected <host>:<port>";
+         return false;
+      }
+      if (!socket.connect(host, port, settings.connect_timeout_ms))
+      {
+         error = "cannot connect";
+         return false;
+      }
+      socket.set_timeout(settings.timeout_ms);
+
+      Net_hello hello = net_hello(0, -1);
+      Net_message type;
+      std::vector<unsigned char> payload;
+      if (!send_message(socket, Net_message::Hello, &hello, sizeof(hello)) ||
+          !receive_message(socket, type, payload, net_only(Net_message::Hello, sizeof(hello))) ||
+          type != Net_message::Hello || payload.size() != sizeof(hello) ||
+          !compatible(*reinterpret_cast<Net_hello *>(payload.data()), hello))
+      {
+         error = "not a worker of the same version";
+         return false;
+      }
+
+      Net_hello worker_hello;
+      memcpy(&worker_hello, payload.data(), sizeof(worker_hello));
+      {
+         std::lock_guard<std::mutex> lock(mutex);
+         std::cout << "Worker " << worker.address << ": " << worker_hello.threads << " threads, "
+                   << render_method_names[std::clamp(worker_hello.method, 0, N_RENDER_METHODS - 1)] << std::endl;
+      }
+
+      if (!send_message(socket, Net_message::Scene, scene_bytes.data(), scene_bytes.size()))
+      {
+         error = "cannot send the scene";
+         return false;
+      }
+      return true;
+   }
+
+   // Sends a task and waits for its result, false with the reason in `error`
+   bool run_task(Worker &worker, Socket &socket, int index, std::vector<unsigned char> &payload, std::string &error)
+   {
+      const Render_task &task = tasks[index];
+      const Render_job &job = (*frame_jobs)[task.frame];
+
+      Net_task message = {};
+      message.id = (uint32_t)index;
+      message.seed = seed;
+      for (int i = 0; i < 3; i++)
+      {
+         message.lookfrom[i] = job.lookfrom[i];
+         message.lookat[i] = job.lookat[i];
+         message.vup[i] = job.vup[i];
+      }
+      message.vfov = job.vfov;
+      message.width = width;
+      message.height = height;
+      message.max_depth = max_depth;
+      message.x0 = task.x0;
+      message.y0 = task.y0;
+      message.x1 = task.x1;
+      message.y1 = task.y1;
+      message.first_sample = task.first_sample;
+      message.n_samples = task.n_samples;
+      message.total_samples = job.samples;
+
+      Net_message type;
+      const size_t pixels = (size_t)(task.x1 - task.x0) * (task.y1 - task.y0);
+      const size_t expected = sizeof(Net_result) + pixels * 4 * sizeof(float);
+      if (!send_message(socket, Net_message::Task, &message, sizeof(message)) ||
+          !receive_message(socket, type, payload, net_only(Net_message::Result, expected)))
+      {
+         error = "connection lost or timed out";
+         return false;
+      }
+
+      Net_result result;
+      if (type != Net_message::Result || payload.size() != expected ||
+          (memcpy(&result, payload.data(), sizeof(result)), result.id != message.id))
+      {
+         error = "invalid result";
+         return false;
+      }
+
+      std::lock_guard<std::mutex> lock(mutex);
+      worker.tasks++;
+      worker.rays += result.counters.rays;
+      worker.render_ms += result.render_ms;
+      merge(index, result.counters, reinterpret_cast<const float *>(payload.data() + sizeof(result)));
+      return true;
+   }
+
+   // The thread of a worker: hands it the pending tasks until all the frames are done
+   void serve_worker(Worker &worker)
+   {
+      Socket socket;
+      std::string error;
+      if (!connect(worker, socket, error))
+      {
+         std::lock_guard<std::mutex> lock(mutex);
+         drop(worker, error);
+         return;
+      }
+
+      std::vector<unsigned char> payload;
+      while (true)
+      {
+         int index;
+         {
+            // Also waits while the last tasks are rendered elsewhere, in case they come back
+            std::unique_lock<std::mutex> lock(mutex);
+            changed.wait(lock, [&] { return finished || !pending.empty(); });
+            if (finished)
+               break;
+            index = take_task();
+         }
+
+         if (!run_task(worker, socket, index, payload, error))
+         {
+            std::lock_guard<std::mutex> lock(mutex);
+            pending.push_front(index);
+            drop(worker, error);
+            return;
+         }
+      }
+
+      send_message(socket, Net_message::Bye);
+   }
+};
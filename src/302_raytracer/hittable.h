@@ -16,22 +16,30 @@
  * @param r The ray that intersected the object.
  * @param outward_normal The outward normal vector of the surface at the hit
  *        point. This vector is assumed to have unit length.
+ *
+ * @note The record is trivially copyable: the material is referenced by a
+ *       non-owning pointer, the materials being owned by the scene objects.
+ *       Copying a record during the traversal is thus a plain memory copy,
+ *       without any reference count update.
  */
 #pragma once
 
+#include "aabb.h"
 #include "color.h"
 #include "interval.h"
 #include "ray.h"
 #include "vec3.h"
 
+#include <type_traits>
+
 class Hit_record
 {
  public:
    Point3 p;                           // The point where the ray hits the object
    Vec3 normal;                        // The normal vector at the hit point
-   double t;                           // The ray distance at the hit point
+   real t;                             // The ray distance at the hit point
    bool frontFacing;                   // True if the ray hits the front face of the object
-   shared_ptr<class Material> mat_ptr; // Pointer to the material of the hit object
+   const class Material *mat_ptr;      // Non-owning pointer to the material of the hit object
 
    void set_face_normal(const Ray &r, const Vec3 &outward_normal)
    {
@@ -42,10 +50,15 @@ class Hit_record
    }
 };
 
+static_assert(std::is_trivially_copyable<Hit_record>::value, "Hit_record must stay cheap to copy");
+
 class Hittable
 {
  public:
    virtual ~Hittable() = default;
 
    virtual bool hit(const Ray &r, Interval ray_t, Hit_record &rec) const = 0;
+
+   // Returns the box enclosing the object, used to build the acceleration structures
+   virtual Aabb bounding_box() const = 0;
 };
\ No newline at end of file
@@ -7,12 +7,22 @@
  * clear the list, and determine if a ray intersects with any of the objects
  * in the list.
  *
+ * **Storage:**
+ * - The spheres are stored by value in a `Sphere_soa`: contiguous arrays, the
+ *   materials being referenced by their index in a table. Adding a sphere does not
+ *   allocate it, and the list is freed with a few arrays instead of one object at
+ *   a time. The spheres are tested with SIMD instructions, without virtual calls.
+ * - The other kinds of objects are kept in `objects`, through a pointer.
+ *
  * @note The `hit` method checks for the closest intersection of a ray with
- *       the objects in the list and updates the hit record accordingly.
+ *       the objects in the list and updates the hit record accordingly. For
+ *       large scenes, wrap the list into a `Bvh` instead of tracing it directly.
  */
 #pragma once
 
 #include "hittable.h"
+#include "sphere.h"
+#include "sphere_soa.h"
 #include "utils.h"
 
 using namespace std;
@@ -20,20 +30,56 @@ using namespace std;
 class Hittable_list : public Hittable
 {
  public:
-   vector<shared_ptr<Hittable>> objects;
+   Sphere_soa spheres;                   // The spheres, in the order they were added
+   vector<shared_ptr<Hittable>> objects; // The objects that are not spheres
 
    Hittable_list() {}
    Hittable_list(shared_ptr<Hittable> object) { add(object); }
 
-   void clear() { objects.clear(); }
+   void clear()
+   {
+      spheres.clear();
+      objects.clear();
+      objects_bbox = Aabb();
+   }
+
+   // A `Sphere` is copied into the arrays, the list does not keep the pointer
+   void add(shared_ptr<Hittable> object)
+   {
+      if (const Sphere *sphere = dynamic_cast<const Sphere *>(object.get()))
+         spheres.add(*sphere);
+      else
+      {
+         objects.push_back(object);
+         objects_bbox = Aabb(objects_bbox, object->bounding_box());
+      }
+   }
+
+   // Same as adding `make_shared<Sphere>(center, radius, mat)`, without allocating the sphere
+   void add_sphere(const Point3 &center, real radius, const shared_ptr<Material> &mat)
+   {
+      spheres.add(center, radius, mat);
+   }
+
+   int size() const { return spheres.size() + (int)objects.size(); }
 
-   void add(shared_ptr<Hittable> object) { objects.push_back(object); }
+   // All the objects through pointers, the spheres being allocated as `Sphere`s
+   vector<shared_ptr<Hittable>> all_objects() const
+   {
+      vector<shared_ptr<Hittable>> all;
+      all.reserve(size());
+      for (int i = 0; i < spheres.size(); i++)
+         all.push_back(make_shared<Sphere>(spheres.center(i), spheres.get_radius(i),
+                                           spheres.get_materials()[spheres.get_material_id(i)]));
+      all.insert(all.end(), objects.begin(), objects.end());
+      return all;
+   }
 
    bool hit(const Ray &r, Interval ray_t, Hit_record &rec) const override
    {
       Hit_record tmp;
-      bool hitSomething = false;
-      double closestSoFar = ray_t.max;
+      bool hitSomething = spheres.hit(r, ray_t, rec);
+      real closestSoFar = hitSomething ? rec.t : ray_t.max;
 
       for (int i = 0; i < objects.size(); i++)
       {
@@ -48,4 +94,9 @@ class Hittable_list : public Hittable
 
       return hitSomething;
    }
-};
\ No newline at end of file
+
+   Aabb bounding_box() const override { return Aabb(spheres.bounding_box(), objects_bbox); }
+
+ private:
+   Aabb objects_bbox; // Box of `objects`, `spheres` keeping its own
+};
@@ -0,0 +1,551 @@
+/**
+ * @file image_writer.h
+ * @brief Image output off the render thread: a pool of encoder threads, fast formats and a video pipe
+ *
+ * Encoding a PNG at a high resolution takes a noticeable part of a low sample count
+ * frame. `Image_writer` copies the frame into a queue and returns at once, its threads
+ * encoding and writing the files while the next frame renders.
+ *
+ * **Formats** (chosen by the extension of the file):
+ * - `.png`: deflate level 1 to 9 through stb_image_write, or 0 for an uncompressed PNG.
+ * - `.ppm`: raw 8-bit RGB, no encoding at all.
+ * - `.pfm`: raw float RGB, e.g. the means of the accumulation buffer before clamping.
+ * - `.exr`: uncompressed OpenEXR with 32-bit float channels, for the same use.
+ *
+ * `Video_pipe` streams the frames in order to an ffmpeg process instead, so that a
+ * sequence does not need one intermediate image per frame on disk.
+ */
+#pragma once
+
+#include "../external/stb_image_write.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#define popen _popen
+#define pclose _pclose
+#endif
+
+enum class Image_format
+{
+   PNG,
+   PPM,
+   PFM,
+   EXR
+};
+
+// Format of a file from its extension, PNG when it is not recognized
+inline Image_format image_format(const std::string &path)
+{
+   size_t dot = path.find_last_of('.');
+   std::string extension = dot == std::string::npos ? "" : path.substr(dot + 1);
+   std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+
+   if (extension == "ppm")
+      return Image_format::PPM;
+   if (extension == "pfm")
+      return Image_format::PFM;
+   if (extension == "exr")
+      return Image_format::EXR;
+   return Image_format::PNG;
+}
+
+// Whether the format keeps the colors as floats
+inline bool is_float_format(Image_format format) { return format == Image_format::PFM || format == Image_format::EXR; }
+
+//==============================================================================
+// ENCODERS, all taking RGB pixels row by row from the top
+//==============================================================================
+
+namespace image_io
+{
+inline bool write_file(const std::string &path, const std::vector<unsigned char> &bytes)
+{
+   FILE *file = fopen(path.c_str(), "wb");
+   if (file == nullptr)
+      return false;
+   bool ok = fwrite(bytes.data(), 1, bytes.size(), file) == bytes.size();
+   return fclose(file) == 0 && ok;
+}
+
+inline void append(std::vector<unsigned char> &bytes, const void *data, size_t size)
+{
+   const unsigned char *p = static_cast<const unsigned char *>(data);
+   bytes.insert(bytes.end(), p, p + size);
+}
+
+inline void append_u32_be(std::vector<unsigned char> &bytes, uint32_t v)
+{
+   unsigned char b[4] = {(unsigned char)(v >> 24), (unsigned char)(v >> 16), (unsigned char)(v >> 8), (unsigned char)v};
+   append(bytes, b, 4);
+}
+
+// Little-endian values, the byte order of the float formats
+template <typename T> inline void append_le(std::vector<unsigned char> &bytes, T v)
+{
+   unsigned char b[sizeof(T)];
+   memcpy(b, &v, sizeof(T));
+   append(bytes, b, sizeof(T));
+}
+
+inline bool write_ppm(const std::string &path, int width, int height, const unsigned char *rgb)
+{
+   std::string header = "P6\n" + std::to_string(width) + " " + std::to_string(height) + "\n255\n";
+   std::vector<unsigned char> bytes(header.begin(), header.end());
+   append(bytes, rgb, (size_t)width * height * 3);
+   return write_file(path, bytes);
+}
+
+// The rows of a PFM go from the bottom to the top, a negative scale marks little-endian floats
+inline bool write_pfm(const std::string &path, int width, int height, const float *rgb)
+{
+   std::string header = "PF\n" + std::to_string(width) + " " + std::to_string(height) + "\n-1.0\n";
+   std::vector<unsigned char> bytes(header.begin(), header.end());
+   for (int y = height - 1; y >= 0; y--)
+      append(bytes, rgb + (size_t)y * width * 3, (size_t)width * 3 * sizeof(float));
+   return write_file(path, bytes);
+}
+
+/**
+ * @brief Writes a scanline OpenEXR file without compression, with B, G and R float channels
+ * Just the required attributes, one scanline per block, see "The OpenEXR File Layout".
+ */
+inline bool write_exr(const std::string &path, int width, int height, const float *rgb)
+{
+   std::vector<unsigned char> bytes;
+   const unsigned char magic[] = {0x76, 0x2f, 0x31, 0x01, 2, 0, 0, 0};
+   append(bytes, magic, sizeof(magic));
+
+   auto attribute = [&](const char *name, const char *type, int32_t size)
+   {
+      append(bytes, name, strlen(name) + 1);
+      append(bytes, type, strlen(type) + 1);
+      append_le<int32_t>(bytes, size);
+   };
+
+   // Channels in alphabetical order: name, pixel type (2 = FLOAT), linear flag and reserved bytes, sampling
+   attribute("channels", "chlist", 3 * 18 + 1);
+   for (const char *channel : {"B", "G", "R"})
+   {
+      append(bytes, channel, 2);
+      append_le<int32_t>(bytes, 2);
+      append_le<int32_t>(bytes, 0);
+      append_le<int32_t>(bytes, 1);
+      append_le<int32_t>(bytes, 1);
+   }
+   bytes.push_back(0);
+
+   attribute("compression", "compression", 1);
+   bytes.push_back(0);
+   for (const char *window : {"dataWindow", "displayWindow"})
+   {
+      attribute(window, "box2i", 16);
+      for (int32_t v : {0, 0, width - 1, height - 1})
+         append_le<int32_t>(bytes, v);
+   }
+   attribute("lineOrder", "lineOrder", 1);
+   bytes.push_back(0);
+   attribute("pixelAspectRatio", "float", 4);
+   append_le<float>(bytes, 1.0f);
+   attribute("screenWindowCenter", "v2f", 8);
+   append_le<float>(bytes, 0.0f);
+   append_le<float>(bytes, 0.0f);
+   attribute("screenWindowWidth", "float", 4);
+   append_le<float>(bytes, 1.0f);
+   bytes.push_back(0); // End of the header
+
+   // Offsets of the scanlines, then the scanlines: y, size, the B values, the G values, the R values
+   const int32_t line_size = width * 3 * (int32_t)sizeof(float);
+   uint64_t offset = bytes.size() + (uint64_t)height * 8;
+   for (int y = 0; y < height; y++, offset += 8 + line_size)
+      append_le<uint64_t>(bytes, offset);
+
+   for (int y = 0; y < height; y++)
+   {
+      append_le<int32_t>(bytes, y);
+      append_le<int32_t>(bytes, line_size);
+      const float *row = rgb + (size_t)y * width * 3;
+      for (int channel = 2; channel >= 0; channel--)
+      {
+         for (int x = 0; x < width; x++)
+            append_le<float>(bytes, row[x * 3 + channel]);
+      }
+   }
+
+   return write_file(path, bytes);
+}
+
+inline uint32_t png_crc32(const unsigned char *data, size_t size, uint32_t crc = 0)
+{
+   static const std::vector<uint32_t> table = []
+   {
+      std::vector<uint32_t> t(256);
+      for (uint32_t n = 0; n < 256; n++)
+      {
+         uint32_t c = n;
+         for (int k = 0; k < 8; k++)
+            c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+         t[n] = c;
+      }
+      return t;
+   }();
+
+   crc = ~crc;
+   for (size_t i = 0; i < size; i++)
+      crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+   return ~crc;
+}
+
+/**
+ * @brief Encodes a PNG whose pixels are stored without compression
+ * The deflate stream is made of "stored" blocks, so that encoding is a plain copy.
+ */
+inline std::vector<unsigned char> png_uncompressed(int width, int height, const unsigned char *rgb)
+{
+   // Rows prefixed by their filter type, 0 for none
+   const size_t row_size = (size_t)width * 3 + 1;
+   std::vector<unsigned char> raw(row_size * height);
+   for (int y = 0; y < height; y++)
+   {
+      raw[y * row_size] = 0;
+      memcpy(&raw[y * row_size + 1], rgb + (size_t)y * width * 3, row_size - 1);
+   }
+
+   // zlib stream: header, stored blocks of at most 65535 bytes, Adler-32 of the data
+   std::vector<unsigned char> zlib = {0x78, 0x01};
+   for (size_t first = 0; first < raw.size(); first += 65535)
+   {
+      uint16_t length = (uint16_t)std::min<size_t>(65535, raw.size() - first);
+      zlib.push_back(first + length >= raw.size() ? 1 : 0);
+      append_le<uint16_t>(zlib, length);
+      append_le<uint16_t>(zlib, (uint16_t)~length);
+      append(zlib, raw.data() + first, length);
+   }
+   uint32_t a = 1, b = 0;
+   for (unsigned char byte : raw)
+   {
+      a = (a + byte) % 65521;
+      b = (b + a) % 65521;
+   }
+   append_u32_be(zlib, (b << 16) | a);
+
+   std::vector<unsigned char> bytes = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+   auto chunk = [&](const char *type, const std::vector<unsigned char> &data)
+   {
+      append_u32_be(bytes, (uint32_t)data.size());
+      size_t start = bytes.size();
+      append(bytes, type, 4);
+      append(bytes, data.data(), data.size());
+      append_u32_be(bytes, png_crc32(&bytes[start], bytes.size() - start));
+   };
+
+   // Size, 8 bits per channel, RGB, deflate, adaptive filtering, no interlacing
+   std::vector<unsigned char> header;
+   append_u32_be(header, width);
+   append_u32_be(header, height);
+   for (unsigned char v : {8, 2, 0, 0, 0})
+      header.push_back(v);
+
+   chunk("IHDR", header);
+   chunk("IDAT", zlib);
+   chunk("IEND", {});
+   return bytes;
+}
+
+inline bool write_png_uncompressed(const std::string &path, int width, int height, const unsigned char *rgb)
+{
+   return write_file(path, png_uncompressed(width, height, rgb));
+}
+
+// Guards `stbi_write_png_compression_level`, see `with_stb_png_level`
+inline std::shared_mutex &stb_png_level_mutex()
+{
+   static std::shared_mutex mutex;
+   return mutex;
+}
+
+/**
+ * @brief Runs `encode` with the deflate level of stb set to `level`, the level being a global of stb
+ * The encodings at the current level run concurrently, each holding the lock shared. Another level
+ * is only set with the lock held exclusively, once the encodings in progress are done.
+ */
+template <typename Encode>
+inline auto with_stb_png_level(int level, Encode encode)
+{
+   std::shared_mutex &mutex = stb_png_level_mutex();
+   std::shared_lock<std::shared_mutex> lock(mutex);
+   while (stbi_write_png_compression_level != level)
+   {
+      lock.unlock();
+      {
+         std::unique_lock<std::shared_mutex> exclusive(mutex);
+         stbi_write_png_compression_level = level;
+      }
+      lock.lock(); // Until then, an encoding at another level may have set it again
+   }
+   return encode();
+}
+
+/**
+ * @brief Writes a PNG with the given deflate level
+ * Level 0 stores the pixels uncompressed. The levels of stb_image_write below 5 behave
+ * as 5. The encodings at other levels wait for this one, see `with_stb_png_level`.
+ */
+inline bool write_png(const std::string &path, int width, int height, const unsigned char *rgb, int level)
+{
+   if (level <= 0)
+      return write_png_uncompressed(path, width, height, rgb);
+
+   const int written =
+       with_stb_png_level(level, [&] { return stbi_write_png(path.c_str(), width, height, 3, rgb, width * 3); });
+   return written != 0;
+}
+
+// The bytes of the PNG of `write_png`, e.g. to send it over the network
+inline std::vector<unsigned char> encode_png(int width, int height, const unsigned char *rgb, int level)
+{
+   if (level <= 0)
+      return png_uncompressed(width, height, rgb);
+
+   std::vector<unsigned char> bytes;
+   with_stb_png_level(level,
+                      [&]
+                      {
+                         return stbi_write_png_to_func(
+                             [](void *context, void *data, int size)
+                             { append(*static_cast<std::vector<unsigned char> *>(context), data, size); },
+                             &bytes, width, height, 3, rgb, width * 3);
+                      });
+   return bytes;
+}
+
+// Same mapping as `Accumulation_buffer::resolve`: clamp to [0, 0.999] and scale to 256 levels
+inline std::vector<unsigned char> quantize(const std::vector<float> &rgb)
+{
+   std::vector<unsigned char> bytes(rgb.size());
+   for (size_t i = 0; i < rgb.size(); i++)
+      bytes[i] = (unsigned char)(256.0f * std::min(std::max(rgb[i], 0.0f), 0.999f));
+   return bytes;
+}
+
+} // namespace image_io
+
+//==============================================================================
+// WRITER THREADS
+//==============================================================================
+
+/**
+ * @class Image_writer
+ * @brief Writes images on its own threads, while the caller renders the next frame
+ *
+ * The images are copied into a queue of at most `max_pending` entries: `write` only
+ * blocks when the encoders fall behind, so that a fast renderer cannot fill the memory
+ * with frames. The tasks are started in order, so a writer with a single thread also
+ * finishes them in order.
+ */
+class Image_writer
+{
+ public:
+   int png_level = 8; // Deflate level of the PNGs, 0 for uncompressed
+
+   Image_writer(int n_threads = 2, int max_pending = 4) : max_pending(std::max(1, max_pending))
+   {
+      for (int i = 0; i < std::max(1, n_threads); i++)
+         threads.emplace_back([this, i] { run(i); });
+   }
+
+   // Writes all the queued images before returning
+   ~Image_writer()
+   {
+      {
+         std::lock_guard<std::mutex> lock(mutex);
+         stopping = true;
+      }
+      queue_changed.notify_all();
+      for (auto &thread : threads)
+         thread.join();
+   }
+
+   Image_writer(const Image_writer &) = delete;
+   Image_writer &operator=(const Image_writer &) = delete;
+
+   // Queues an 8-bit RGB image, the float formats receive the colors divided by 256
+   void write(const std::string &path, int width, int height, std::vector<unsigned char> rgb)
+   {
+      const int level = png_level;
+      submit(
+          [=, rgb = std::move(rgb)]
+          {
+             Image_format format = image_format(path);
+             if (!is_float_format(format))
+                return encode(path, width, height, rgb.data(), format, level);
+
+             std::vector<float> values(rgb.size());
+             for (size_t i = 0; i < rgb.size(); i++)
+                values[i] = rgb[i] / 256.0f;
+             return encode(path, width, height, values.data(), format);
+          });
+   }
+
+   // Queues float RGB colors (e.g. `Accumulation_buffer::resolve`), quantized for the 8-bit formats
+   void write(const std::string &path, int width, int height, std::vector<float> rgb)
+   {
+      const int level = png_level;
+      submit(
+          [=, rgb = std::move(rgb)]
+          {
+             Image_format format = image_format(path);
+             if (is_float_format(format))
+                return encode(path, width, height, rgb.data(), format);
+             return encode(path, width, height, image_io::quantize(rgb).data(), format, level);
+          });
+   }
+
+   /**
+    * @brief Queues a task, which returns false on failure
+    * Blocks while `max_pending` tasks are queued or running.
+    */
+   void submit(std::function<bool()> task)
+   {
+      std::unique_lock<std::mutex> lock(mutex);
+      queue_changed.wait(lock, [this] { return (int)(tasks.size()) + running < max_pending; });
+      tasks.push_back(std::move(task));
+      queue_changed.notify_all();
+   }
+
+   // Waits until all the queued tasks are done, returns the number of failed tasks so far
+   int wait()
+   {
+      std::unique_lock<std::mutex> lock(mutex);
+      queue_changed.wait(lock, [this] { return tasks.empty() && running == 0; });
+      return failures;
+   }
+
+   static bool encode(const std::string &path, int width, int height, const unsigned char *rgb, Image_format format,
+                      int png_level)
+   {
+      if (format == Image_format::PPM)
+         return image_io::write_ppm(path, width, height, rgb);
+      return image_io::write_png(path, width, height, rgb, png_level);
+   }
+
+   static bool encode(const std::string &path, int width, int height, const float *rgb, Image_format format)
+   {
+      if (format == Image_format::PFM)
+         return image_io::write_pfm(path, width, height, rgb);
+      return image_io::write_exr(path, width, height, rgb);
+   }
+
+ private:
+   std::vector<std::thread> threads;
+   std::deque<std::function<bool()>> tasks;
+   std::mutex mutex;
+   std::condition_variable queue_changed; // Signaled when a task is queued or done, and when stopping
+   const int max_pending;
+   int running = 0;
+   int failures = 0;
+   bool stopping = false;
+
+   void run(int thread_index)
+   {
+      std::unique_lock<std::mutex> lock(mutex);
+      while (true)
+      {
+         queue_changed.wait(lock, [this] { return stopping || !tasks.empty(); });
+         if (tasks.empty())
+            return;
+
+         std::function<bool()> task = std::move(tasks.front());
+         tasks.pop_front();
+         running++;
+
+         lock.unlock();
+         bool ok;
+         {
+            TRACE_THREAD("encoder", thread_index);
+            TRACE_SCOPE("io", "write image");
+            ok = task();
+         }
+         lock.lock();
+
+         running--;
+         if (!ok)
+            failures++;
+         queue_changed.notify_all();
+      }
+   }
+};
+
+/**
+ * @class Video_pipe
+ * @brief Streams frames to an ffmpeg process, encoded like res/make_video.sh
+ * The frames are written by a single writer thread, in the order of the calls.
+ */
+class Video_pipe
+{
+ public:
+   ~Video_pipe() { close(); }
+
+   // Starts ffmpeg, the frames must then all be `width` x `height`. Returns false if it cannot be started.
+   bool open(const std::string &path, int width, int height, int frame_rate = 60)
+   {
+      close();
+      failures_at_open = writer.wait();
+
+      std::string command = "ffmpeg -y -loglevel error -f rawvideo -pix_fmt rgb24 -s " + std::to_string(width) + "x" +
+                            std::to_string(height) + " -framerate " + std::to_string(frame_rate) +
+                            " -i - -c:v libx265 -preset medium -crf 23 -pix_fmt yuv420p \"" + path + "\"";
+#ifdef _WIN32
+      pipe = popen(command.c_str(), "wb");
+#else
+      // If ffmpeg fails, the writes to the pipe must fail instead of killing the process
+      signal(SIGPIPE, SIG_IGN);
+      pipe = popen(command.c_str(), "w");
+#endif
+      frame_size = (size_t)width * height * 3;
+      return pipe != nullptr;
+   }
+
+   bool is_open() const { return pipe != nullptr; }
+
+   void write(std::vector<unsigned char> rgb)
+   {
+      if (pipe == nullptr || rgb.size() != frame_size)
+         return;
+
+      FILE *out = pipe;
+      writer.submit([out, rgb = std::move(rgb)] { return fwrite(rgb.data(), 1, rgb.size(), out) == rgb.size(); });
+   }
+
+   // Waits for the queued frames and for the end of the encoding, returns false if a frame could not be written
+   bool close()
+   {
+      if (pipe == nullptr)
+         return true;
+
+      bool ok = writer.wait() == failures_at_open;
+      ok = pclose(pipe) == 0 && ok;
+      pipe = nullptr;
+      return ok;
+   }
+
+ private:
+   FILE *pipe = nullptr;
+   size_t frame_size = 0;
+   Image_writer writer{1};
+   int failures_at_open = 0; // Failures of the writer before the current video
+};
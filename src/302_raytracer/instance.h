@@ -0,0 +1,187 @@
+/**
+ * @file instance.h
+ * @brief Affine transforms, and instances placing a shared object in the scene with one
+ *
+ * A scene repeating the same group of objects (a tile of a sphere field, a tree of a
+ * forest...) stores the group once, usually as a `Bvh`, and an `Instance` per copy:
+ * the copies then cost a transform and a box each, whatever the size of the group.
+ * A `Bvh` built over the instances is a two-level hierarchy, the rays entering the
+ * hierarchy of the group through the transform of the instance they reach.
+ *
+ * The CUDA renderers support the instances of a `Bvh` of spheres, see cuda_scene.h.
+ */
+#pragma once
+
+#include "aabb.h"
+#include "hittable.h"
+#include "utils.h"
+
+#include <cmath>
+#include <memory>
+
+/**
+ * @class Transform
+ * @brief An affine transform of the space, a 3x3 linear part followed by a translation
+ */
+class Transform
+{
+ public:
+   real m[3][4]; // Row-major, the last column being the translation
+
+   // The identity
+   Transform() : m{{1, 0, 0, 0}, {0, 1, 0, 0}, {0, 0, 1, 0}} {}
+
+   static Transform translate(const Vec3 &offset)
+   {
+      Transform t;
+      for (int i = 0; i < 3; i++)
+         t.m[i][3] = offset[i];
+      return t;
+   }
+
+   static Transform scale(real factor) { return scale(Vec3(factor, factor, factor)); }
+
+   static Transform scale(const Vec3 &factors)
+   {
+      Transform t;
+      for (int i = 0; i < 3; i++)
+         t.m[i][i] = factors[i];
+      return t;
+   }
+
+   // Rotation of `degrees` around `axis`, counterclockwise when the axis points to the viewer
+   static Transform rotate(const Vec3 &axis, double degrees)
+   {
+      const Vec3 a = unit_vector(axis);
+      const double theta = utils::degrees_to_radians(degrees);
+      const double c = std::cos(theta), s = std::sin(theta), k = 1 - c;
+
+      Transform t;
+      t.m[0][0] = c + a.x() * a.x() * k;
+      t.m[0][1] = a.x() * a.y() * k - a.z() * s;
+      t.m[0][2] = a.x() * a.z() * k + a.y() * s;
+      t.m[1][0] = a.y() * a.x() * k + a.z() * s;
+      t.m[1][1] = c + a.y() * a.y() * k;
+      t.m[1][2] = a.y() * a.z() * k - a.x() * s;
+      t.m[2][0] = a.z() * a.x() * k - a.y() * s;
+      t.m[2][1] = a.z() * a.y() * k + a.x() * s;
+      t.m[2][2] = c + a.z() * a.z() * k;
+      return t;
+   }
+
+   // The transform applying `other` first, then this one
+   Transform operator*(const Transform &other) const
+   {
+      Transform t;
+      for (int i = 0; i < 3; i++)
+      {
+         for (int j = 0; j < 4; j++)
+         {
+            t.m[i][j] = j == 3 ? m[i][3] : 0;
+            for (int k = 0; k < 3; k++)
+               t.m[i][j] += m[i][k] * other.m[k][j];
+         }
+      }
+      return t;
+   }
+
+   // The inverse transform, the linear part must be invertible
+   Transform inverse() const
+   {
+      // Inverse of the linear part by its cofactors
+      Transform t;
+      const real det = m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1]) -
+                       m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0]) +
+                       m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+      for (int i = 0; i < 3; i++)
+      {
+         for (int j = 0; j < 3; j++)
+         {
+            const int r0 = (j + 1) % 3, r1 = (j + 2) % 3, c0 = (i + 1) % 3, c1 = (i + 2) % 3;
+            t.m[i][j] = (m[r0][c0] * m[r1][c1] - m[r0][c1] * m[r1][c0]) / det;
+         }
+      }
+
+      // Then of the translation
+      for (int i = 0; i < 3; i++)
+         t.m[i][3] = -(t.m[i][0] * m[0][3] + t.m[i][1] * m[1][3] + t.m[i][2] * m[2][3]);
+      return t;
+   }
+
+   Point3 point(const Point3 &p) const
+   {
+      return Point3(m[0][0] * p.x() + m[0][1] * p.y() + m[0][2] * p.z() + m[0][3],
+                    m[1][0] * p.x() + m[1][1] * p.y() + m[1][2] * p.z() + m[1][3],
+                    m[2][0] * p.x() + m[2][1] * p.y() + m[2][2] * p.z() + m[2][3]);
+   }
+
+   // A direction, which is not translated
+   Vec3 vector(const Vec3 &v) const
+   {
+      return Vec3(m[0][0] * v.x() + m[0][1] * v.y() + m[0][2] * v.z(),
+                  m[1][0] * v.x() + m[1][1] * v.y() + m[1][2] * v.z(),
+                  m[2][0] * v.x() + m[2][1] * v.y() + m[2][2] * v.z());
+   }
+
+   // By the transpose of the linear part: the inverse transform thus maps the normals of the transformed surfaces
+   Vec3 transposed_vector(const Vec3 &v) const
+   {
+      return Vec3(m[0][0] * v.x() + m[1][0] * v.y() + m[2][0] * v.z(),
+                  m[0][1] * v.x() + m[1][1] * v.y() + m[2][1] * v.z(),
+                  m[0][2] * v.x() + m[1][2] * v.y() + m[2][2] * v.z());
+   }
+
+   // The box enclosing the transformed corners of a box
+   Aabb box(const Aabb &b) const
+   {
+      Aabb result;
+      for (int corner = 0; corner < 8; corner++)
+      {
+         const Point3 p = point(Point3(corner & 1 ? b.x.max : b.x.min, corner & 2 ? b.y.max : b.y.min,
+                                       corner & 4 ? b.z.max : b.z.min));
+         result = Aabb(result, Aabb(p, p));
+      }
+      return result;
+   }
+};
+
+/**
+ * @class Instance
+ * @brief A shared object placed in the scene by a transform
+ *
+ * The rays are brought to the space of the object by the inverse transform. Their
+ * direction is not normalized there, so that the distances along the ray are the same
+ * in both spaces and the hit records only need their point and normal brought back.
+ */
+class Instance : public Hittable
+{
+ public:
+   Instance(std::shared_ptr<const Hittable> object, const Transform &to_world)
+       : object(std::move(object)), to_world(to_world), to_object(to_world.inverse()),
+         bbox(to_world.box(this->object->bounding_box()))
+   {
+   }
+
+   bool hit(const Ray &r, Interval ray_t, Hit_record &rec) const override
+   {
+      const Ray local(to_object.point(r.origin()), to_object.vector(r.direction()));
+      if (!object->hit(local, ray_t, rec))
+         return false;
+
+      // The normal faces the ray in both spaces, the inverse transpose keeping the sign of its dot product
+      rec.p = r.at(rec.t);
+      rec.normal = unit_vector(to_object.transposed_vector(rec.normal));
+      return true;
+   }
+
+   Aabb bounding_box() const override { return bbox; }
+
+   const Hittable &get_object() const { return *object; }
+   const Transform &get_transform() const { return to_world; }
+   const Transform &get_inverse() const { return to_object; }
+
+ private:
+   std::shared_ptr<const Hittable> object;
+   Transform to_world, to_object;
+   Aabb bbox;
+};
@@ -18,19 +18,31 @@
 class Interval
 {
  public:
-   double min, max;
+   real min, max;
 
    Interval() : min(+inf), max(-inf) {} // Default interval is empty
 
-   Interval(double min, double max) : min(min), max(max) {}
+   Interval(real min, real max) : min(min), max(max) {}
 
-   double size() const { return max - min; }
+   // Create the interval tightly enclosing the two input intervals
+   Interval(const Interval &a, const Interval &b) : min(std::fmin(a.min, b.min)), max(std::fmax(a.max, b.max)) {}
 
-   bool contains(double x) const { return min <= x && x <= max; }
+   real size() const { return max - min; }
 
-   bool surrounds(double x) const { return min < x && x < max; }
+   bool contains(real x) const { return min <= x && x <= max; }
 
-   double clamp(double x) const { return std::max(min, std::min(x, max)); }
+   bool surrounds(real x) const { return min < x && x < max; }
+
+   real clamp(real x) const { return std::max(min, std::min(x, max)); }
+
+   Interval expand(real delta) const
+   {
+      auto padding = delta / 2;
+      return Interval(min - padding, max + padding);
+   }
 
    static const Interval empty, universe;
-};
\ No newline at end of file
+};
+
+inline const Interval Interval::empty = Interval(+inf, -inf);
+inline const Interval Interval::universe = Interval(-inf, +inf);
\ No newline at end of file
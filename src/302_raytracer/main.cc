@@ -1,11 +1,22 @@
+#include "animation.h"
+#include "bvh.h"
 #include "camera.h"
 #include "constants.h"
+#include "distributed.h"
 #include "hittable_list.h"
+#include "image_writer.h"
+#include "preview.h"
+#include "render_job.h"
+#include "render_server.h"
+#include "scene_file.h"
+#include "scenes.h"
 #include "sphere.h"
+#include "trace.h"
 
 #include <filesystem>
 #include <future>
 #include <iostream>
+#include <sstream>
 #include <vector>
 
 #define STB_IMAGE_WRITE_IMPLEMENTATION
@@ -13,18 +24,13 @@
 
 using namespace constants;
 
-// Function to write image buffer to PNG file
-void writeImage(const vector<unsigned char> &image, int image_width, int image_height, const string &filename)
+// Creates the directory of a file if it does not exist
+void createDirectory(const string &filename)
 {
-   const int channels = 3; // RGB
-   if (stbi_write_png(filename.c_str(), image_width, image_height, channels, image.data(), image_width * channels))
-   {
-      cout << "Image saved successfully to " << filename << endl;
-   }
-   else
-   {
-      cerr << "Failed to save image to " << filename << endl;
-   }
+   std::error_code error;
+   std::filesystem::path directory = std::filesystem::path(filename).parent_path();
+   if (!directory.empty())
+      std::filesystem::create_directories(directory, error);
 }
 
 /**
@@ -45,79 +51,417 @@ void fillGradientImage(vector<unsigned char> &image)
    }
 }
 
-void dumpImageToFile(vector<unsigned char> &image, string name)
+// Settings that can be changed from the command line
+struct Options
 {
-   // Write image to file
-   writeImage(image, IMAGE_WIDTH, IMAGE_HEIGHT, name);
-}
+   int samples = SAMPLES_PER_PIXEL;  // Samples per pixel
+   int threads = 0;                  // Threads used by the parallel renderer, 0 for all hardware threads
+   int gpus = 0;                     // GPUs sharing the frames of the CUDA renderers, 0 for all the devices
+   int pass_samples = 0;             // Samples per pass of a progressive render, 0 for a one-shot render
+   double time_budget_ms = 0;        // Time budget of a progressive render, 0 for none
+   double adaptive_threshold = 0;    // Noise threshold of adaptive sampling, 0 for uniform sampling
+   int method = -1;                  // Index of the renderer in the menu, -1 to ask for it
+   int width = IMAGE_WIDTH;          // Image size in pixels
+   int height = IMAGE_HEIGHT;
+   int max_depth = MAX_DEPTH;        // Maximum number of rays of a path
+   unsigned int seed = 123;          // Seed of the random sequences
+   string output = "res/output.png"; // Path of the image, or of the images of a batch once numbered
+   string job_file;                  // Frames of a batch render, see render_job.h
+   string animation;                 // Keyframes of an animation rendered as a batch, see animation.h
+   int png_level = 8;                // Deflate level of the PNGs, 0 for uncompressed
+   string video;                     // Video receiving the frames through ffmpeg, none if empty
+   string scene;                     // Scene file rendered instead of the demo scene, see scene_file.h
+   string save_scene;                // Scene file written instead of rendering, none if empty
+   string trace;                     // Chrome trace of the timings, see trace.h, none if empty
+   int worker_port = 0;              // Render the tasks of coordinators on this port instead, see distributed.h
+   vector<string> workers;           // Addresses of the workers rendering the frames, none to render them here
+   Distributed_settings distributed; // How the frames are shared between the workers
+   bool preview = false;             // Show the image in a window refining while the camera is moved
+   Denoiser_type denoiser = Denoiser_type::None; // Denoiser of the frames, see denoiser.h
+   bool aovs = false;                            // Also write the albedo and normal buffers of the frames
+   int serve_port = 0;                           // Answer the render requests of HTTP clients on this port instead
+   Server_settings server;                       // Scene cache and batching of the server, see render_server.h
+};
 
-using scene = Hittable_list;
-
-scene demo_scene()
+void printUsage(const char *program)
 {
-   scene s;
-
-   auto material_uniform_red = make_shared<Constant>(Color(1, 0.0, 0.0));
-   auto material_uniform_blue = make_shared<Constant>(Color(0, 0.0, 1.0));
-   auto material_normals = make_shared<ShowNormals>(Color(0, 0.0, 0.0));
-   auto material_lambert = make_shared<Lambertian>(Color(0.7, 0.7, 0.7));
-
-   s.add(make_shared<Sphere>(Point3(0, -950.5, -1), 950, material_lambert)); // Ground
-   s.add(make_shared<Sphere>(Point3(-3.5, 0.45, -1.8), .8, material_uniform_red));
-   s.add(make_shared<Sphere>(Point3(-1.3, 0.18, -5), .7, material_uniform_blue));
-   s.add(make_shared<Sphere>(Point3(-.7, .2, -.3), .6, material_lambert));
-   s.add(make_shared<Sphere>(Point3(1.2, 0, -2), 0.5, material_lambert));
-
-   // Small "ISC" spheres at the bottom
-   for (int i = 0; i < 5; i++)
-   {
-      s.add(make_shared<Sphere>(Point3(-3.5 + i * 0.5, -0.3, 1.2), 0.2, material_normals));
-   }
-
-   return s;
+   cout << "Usage: " << program << " [options]\n";
+   cout << "Options:\n";
+   cout << "  -h, --help, /?  Show this help message\n";
+   cout << "  -s <samples>    Set the number of samples per pixel (default: " << SAMPLES_PER_PIXEL << ")\n";
+   cout << "  -t <threads>    Set the number of threads of the parallel renderer (default: all hardware threads)\n";
+   cout << "  -g <gpus>       Set the number of GPUs sharing the samples of a CUDA frame (default: all devices)\n";
+   cout << "  -p <samples>    Render progressively, adding this many samples per pixel at each pass\n";
+   cout << "  -b <ms>         Stop a progressive render after this time budget (default: none)\n";
+   cout << "  -a <threshold>  Adaptive sampling, until the relative noise of the pixels is below the threshold\n";
+   cout << "                  (e.g. 0.05), with -s samples per pixel on average at most\n";
+   cout << "  -m <method>     Renderer, by name or number, without asking for it: sequential (0), parallel (1),\n";
+   cout << "                  cuda (2), wavefront (3), cuda-wavefront (4) or hybrid (5, the GPU and the CPU threads)\n";
+   cout << "  -r <W>x<H>      Set the resolution (default: " << IMAGE_WIDTH << "x" << IMAGE_HEIGHT << ")\n";
+   cout << "  -d <depth>      Set the maximum number of rays of a path (default: " << MAX_DEPTH << ")\n";
+   cout << "  -o <file>       Path of the image (default: res/output.png), .png, .ppm, or .pfm and .exr for the\n";
+   cout << "                  float colors before clamping\n";
+   cout << "  -j <file>       Render the frames of a job file one after the other, see render_job.h\n";
+   cout << "  --animation <file>\n";
+   cout << "                  Render the frames of an animation, its camera path and moving spheres given by\n";
+   cout << "                  keyframes, see animation.h\n";
+   cout << "  --seed <seed>   Seed of the random sequences (default: 123)\n";
+   cout << "  --png-level <n> Deflate level of the PNGs, 0 (uncompressed, fastest) to 9 (default: 8)\n";
+   cout << "  --video <file>  Also stream the frames to ffmpeg, encoded into this video\n";
+   cout << "  --scene <file>  Render the scene of a binary or text scene file instead of the demo scene\n";
+   cout << "  --save-scene <file>\n";
+   cout << "                  Write the scene to a file and exit, as text for a .txt file, else binary\n";
+   cout << "  --trace <file>  Record the timings of the tiles, threads, stages and GPU kernels as a Chrome trace\n";
+   cout << "                  (chrome://tracing or ui.perfetto.dev), with a build configured with -DTRACE=ON\n";
+   cout << "  --denoise <denoiser>\n";
+   cout << "                  Denoise the frames with atrous (the a-trous filter, on the GPU for the CUDA frames) or\n";
+   cout << "                  oidn (Open Image Denoise, with a build configured with -DOIDN=ON), see denoiser.h\n";
+   cout << "  --aovs          Also write the albedo and normal of the first surfaces seen, the buffers guiding\n";
+   cout << "                  the denoisers, next to the images (e.g. res/output_albedo.png)\n";
+   cout << "  --preview       Show the image in a window, refined progressively while the camera is moved with\n";
+   cout << "                  the mouse and the keys, with a build configured with -DPREVIEW=ON (see preview.h)\n";
+   cout << "  --serve <port>  Answer the render requests of HTTP clients on this port, the images streamed as they\n";
+   cout << "                  refine, with the -m renderer (default: parallel) and the other options as defaults\n";
+   cout << "                  (see render_server.h)\n";
+   cout << "  --scene-cache <n>\n";
+   cout << "                  Scenes kept loaded by --serve (default: 8)\n";
+   cout << "  --serve-batch <n>\n";
+   cout << "                  Requests rendered together by --serve, a pass of each in turn (default: 8)\n";
+   cout << "  --worker <port> Render the tasks of the coordinators connecting to this port, with the -m renderer\n";
+   cout << "                  (default: parallel) and -t threads\n";
+   cout << "  --coordinator <host:port,...>\n";
+   cout << "                  Share the frames between these workers, the tasks left when none of them answers\n";
+   cout << "                  any more being rendered here\n";
+   cout << "  --shard <mode>  Tasks of the workers: tiles (default), samples (ranges of the samples of the whole\n";
+   cout << "                  frame, for the GPU workers) or frames\n";
+   cout << "  --shard-tile <pixels>\n";
+   cout << "                  Size of the tiles of --shard tiles (default: 128)\n";
+   cout << "  --worker-timeout <s>\n";
+   cout << "                  Time given to a worker to render a task before it is dropped (default: 600)\n";
 }
 
-int parseInput(int argc, char *argv[])
+bool parseInput(int argc, char *argv[], Options &opts)
 {
    // Parse command-line arguments
    for (int i = 1; i < argc; ++i)
    {
       if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0 || strcmp(argv[i], "/?") == 0)
       {
-         cout << "Usage: " << argv[0] << " [options]\n";
-         cout << "Options:\n";
-         cout << "  -h, --help, /?  Show this help message\n";
-         cout << "  -s <samples>    Set the number of samples per pixel (default: " << SAMPLES_PER_PIXEL << ")\n";
-         return -1;
+         printUsage(argv[0]);
+         return false;
       }
       else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc)
       {
-         return atoi(argv[++i]);
+         opts.samples = atoi(argv[++i]);
+      }
+      else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc)
+      {
+         opts.threads = atoi(argv[++i]);
+      }
+      else if (strcmp(argv[i], "-g") == 0 && i + 1 < argc)
+      {
+         opts.gpus = atoi(argv[++i]);
+      }
+      else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc)
+      {
+         opts.pass_samples = atoi(argv[++i]);
+      }
+      else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc)
+      {
+         opts.time_budget_ms = atof(argv[++i]);
+      }
+      else if (strcmp(argv[i], "-a") == 0 && i + 1 < argc)
+      {
+         opts.adaptive_threshold = atof(argv[++i]);
+      }
+      else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc)
+      {
+         opts.method = parse_render_method(argv[++i]);
+         if (opts.method < 0)
+         {
+            cerr << "Unknown rendering method: " << argv[i] << "\n";
+            return false;
+         }
+      }
+      else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc)
+      {
+         char end;
+         if (sscanf(argv[++i], "%dx%d%c", &opts.width, &opts.height, &end) != 2 || opts.width <= 0 ||
+             opts.height <= 0)
+         {
+            cerr << "Invalid resolution: " << argv[i] << ", expected <width>x<height>\n";
+            return false;
+         }
+      }
+      else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc)
+      {
+         opts.max_depth = atoi(argv[++i]);
+      }
+      else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+      {
+         opts.output = argv[++i];
+      }
+      else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc)
+      {
+         opts.job_file = argv[++i];
+      }
+      else if (strcmp(argv[i], "--animation") == 0 && i + 1 < argc)
+      {
+         opts.animation = argv[++i];
+      }
+      else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc)
+      {
+         opts.seed = (unsigned int)strtoul(argv[++i], nullptr, 10);
+      }
+      else if (strcmp(argv[i], "--png-level") == 0 && i + 1 < argc)
+      {
+         opts.png_level = std::clamp(atoi(argv[++i]), 0, 9);
+      }
+      else if (strcmp(argv[i], "--video") == 0 && i + 1 < argc)
+      {
+         opts.video = argv[++i];
+      }
+      else if (strcmp(argv[i], "--scene") == 0 && i + 1 < argc)
+      {
+         opts.scene = argv[++i];
+      }
+      else if (strcmp(argv[i], "--save-scene") == 0 && i + 1 < argc)
+      {
+         opts.save_scene = argv[++i];
+      }
+      else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc)
+      {
+         opts.trace = argv[++i];
+      }
+      else if (strcmp(argv[i], "--denoise") == 0 && i + 1 < argc)
+      {
+         ++i;
+         if (strcmp(argv[i], "atrous") == 0)
+            opts.denoiser = Denoiser_type::Atrous;
+         else if (strcmp(argv[i], "oidn") == 0 && denoise::oidn_available())
+            opts.denoiser = Denoiser_type::Oidn;
+         else if (strcmp(argv[i], "oidn") == 0)
+         {
+            cerr << "Built without the OIDN option, --denoise oidn is not available\n";
+            return false;
+         }
+         else
+         {
+            cerr << "Unknown denoiser: " << argv[i] << ", expected atrous or oidn\n";
+            return false;
+         }
+      }
+      else if (strcmp(argv[i], "--aovs") == 0)
+      {
+         opts.aovs = true;
+      }
+      else if (strcmp(argv[i], "--preview") == 0)
+      {
+         opts.preview = true;
+      }
+      else if (strcmp(argv[i], "--serve") == 0 && i + 1 < argc)
+      {
+         opts.serve_port = atoi(argv[++i]);
+         if (opts.serve_port <= 0 || opts.serve_port > 65535)
+         {
+            cerr << "Invalid port: " << argv[i] << "\n";
+            return false;
+         }
+      }
+      else if (strcmp(argv[i], "--scene-cache") == 0 && i + 1 < argc)
+      {
+         opts.server.scene_cache = std::max(1, atoi(argv[++i]));
+      }
+      else if (strcmp(argv[i], "--serve-batch") == 0 && i + 1 < argc)
+      {
+         opts.server.max_batch = std::max(1, atoi(argv[++i]));
+      }
+      else if (strcmp(argv[i], "--worker") == 0 && i + 1 < argc)
+      {
+         opts.worker_port = atoi(argv[++i]);
+         if (opts.worker_port <= 0 || opts.worker_port > 65535)
+         {
+            cerr << "Invalid port: " << argv[i] << "\n";
+            return false;
+         }
+      }
+      else if (strcmp(argv[i], "--coordinator") == 0 && i + 1 < argc)
+      {
+         std::istringstream addresses(argv[++i]);
+         string address, host;
+         int port;
+         while (getline(addresses, address, ','))
+         {
+            if (!parse_address(address, host, port))
+            {
+               cerr << "Invalid worker address: " << address << ", expected <host>:<port>\n";
+               return false;
+            }
+            opts.workers.push_back(address);
+         }
+      }
+      else if (strcmp(argv[i], "--shard") == 0 && i + 1 < argc)
+      {
+         int mode = parse_shard_mode(argv[++i]);
+         if (mode < 0)
+         {
+            cerr << "Unknown shard mode: " << argv[i] << ", expected tiles, samples or frames\n";
+            return false;
+         }
+         opts.distributed.shard = (Shard_mode)mode;
+      }
+      else if (strcmp(argv[i], "--shard-tile") == 0 && i + 1 < argc)
+      {
+         opts.distributed.tile_size = std::max(1, atoi(argv[++i]));
+      }
+      else if (strcmp(argv[i], "--worker-timeout") == 0 && i + 1 < argc)
+      {
+         opts.distributed.timeout_ms = (int)(std::max(0.001, atof(argv[++i])) * 1000);
       }
       else if (argv[i][0] == '-')
       {
          cerr << "Unknown argument: " << argv[i] << "\n";
-         cout << "Usage: " << argv[0] << " [options]\n";
-         cout << "Options:\n";
-         cout << "  -h, --help, /?  Show this help message\n";
-         cout << "  -s <samples>    Set the number of samples per pixel (default: " << SAMPLES_PER_PIXEL << ")\n";
-         return -1;
+         printUsage(argv[0]);
+         return false;
       }
       else
       {
          cerr << "Unexpected argument: " << argv[i] << "\n";
-         return -1;
+         return false;
       }
    }
 
-   return SAMPLES_PER_PIXEL;
+   if (opts.samples <= 0 || opts.max_depth <= 0)
+   {
+      cerr << "The number of samples and the maximum depth must be positive\n";
+      return false;
+   }
+
+   return true;
+}
+
+// Asks for the renderer on the standard input, the CUDA one being the default
+int askMethod()
+{
+   cout << "Choose rendering method:" << endl;
+   cout << "\t0. CPU sequential" << endl;
+   cout << "\t1. CPU parallel" << endl;
+   cout << "\t2. CUDA GPU (default)" << endl;
+   cout << "\t3. CPU wavefront" << endl;
+   cout << "\t4. CUDA GPU wavefront" << endl;
+   cout << "\t5. Hybrid GPU and CPU parallel" << endl;
+   cout << "Enter choice (0 to 5): ";
+
+   int choice = 2; // Default to CUDA
+   string input;
+   getline(cin, input);
+
+   cout << endl;
+
+   if (!input.empty())
+   {
+      choice = stoi(input);
+   }
+
+   return std::clamp(choice, 0, N_RENDER_METHODS - 1);
+}
+
+// Renders one frame with the settings of the command line into `image`, `save` writing the snapshots of progressive
+// renders
+void renderFrame(Camera &c, const Bvh &bvh, Render_method method, const Options &opts, vector<unsigned char> &image,
+                 const std::function<void()> &save)
+{
+   if (opts.adaptive_threshold > 0)
+   {
+      Adaptive_settings settings;
+      settings.threshold = opts.adaptive_threshold;
+
+      cout << "Using adaptive sampling, noise threshold " << settings.threshold << "..." << endl;
+      c.renderAdaptive(bvh, image, method, settings);
+   }
+   else if (opts.pass_samples > 0 || opts.time_budget_ms > 0)
+   {
+
+      // The image is updated after every pass and written as a snapshot, so it can be watched while it refines
+      Progressive_settings settings;
+      settings.samples_per_pass = opts.pass_samples > 0 ? opts.pass_samples : 1;
+      settings.time_budget_ms = opts.time_budget_ms;
+      settings.on_pass = [&](const Accumulation_buffer &, int) { save(); };
+
+      cout << "Using progressive rendering, " << settings.samples_per_pass << " samples per pass..." << endl;
+      c.renderProgressive(bvh, image, method, settings);
+   }
+   else
+   {
+      switch (method)
+      {
+      case Render_method::Sequential:
+         cout << "Using CPU single threaded..." << endl;
+         c.renderPixels(bvh, image);
+         break;
+      case Render_method::Parallel:
+         cout << "Using CPU parallel rendering..." << endl;
+         c.renderPixelsParallel(bvh, image);
+         break;
+      case Render_method::Wavefront:
+         cout << "Using CPU wavefront rendering..." << endl;
+         c.renderPixelsWavefront(bvh, image);
+         break;
+      case Render_method::CUDA_wavefront:
+         cout << "Using CUDA GPU wavefront rendering..." << endl;
+         c.renderPixelsCUDA(bvh, image, true);
+         break;
+      case Render_method::Hybrid:
+         cout << "Using hybrid GPU and CPU rendering..." << endl;
+         c.renderPixelsHybrid(bvh, image);
+         break;
+      default:
+         cout << "Using CUDA GPU rendering..." << endl;
+         c.renderPixelsCUDA(bvh, image);
+         break;
+      }
+   }
 }
 
 int main(int argc, char *argv[])
 {
-   int samples = parseInput(argc, argv);
+   Options opts;
+   if (!parseInput(argc, argv, opts))
+      return 1;
+
+#ifdef RT_TRACE
+   if (!opts.trace.empty())
+   {
+      Trace::start();
+      TRACE_THREAD("main", -1);
+   }
+#else
+   if (!opts.trace.empty())
+      cerr << "Built without the TRACE option, --trace is ignored" << endl;
+#endif
 
-   Camera c(Vec3(0, 0, 0), IMAGE_WIDTH, IMAGE_HEIGHT, CHANNELS, samples);
+   Camera c(Vec3(0, 0, 0), opts.width, opts.height, CHANNELS, opts.samples);
+   c.num_threads = opts.threads;
+   c.num_gpus = opts.gpus;
+   c.max_depth = opts.max_depth;
+   c.denoise_settings.type = opts.denoiser;
+
+   // A single frame from the command line, or the frames of the job file
+   Render_job defaults{opts.output, opts.samples, c.lookfrom, c.lookat, c.vup, c.vfov};
+   vector<Render_job> jobs;
+   Animation animation;
+   if (!opts.animation.empty())
+   {
+      if (!animation.load(opts.animation, defaults))
+         return 1;
+      for (int i = 0; i < animation.frame_count(); i++)
+         jobs.push_back(animation.job(i));
+   }
+   else if (opts.job_file.empty())
+      jobs.push_back(defaults);
+   else if (!read_job_file(opts.job_file, defaults, jobs))
+      return 1;
+   const bool batch = !opts.job_file.empty() || !opts.animation.empty();
 
    vector<unsigned char> image(c.image_width * c.image_height * CHANNELS);
 
@@ -126,54 +470,227 @@ int main(int argc, char *argv[])
    cout << " 302 Ray tracer project v" << ver_major << " -- P.-A. Mudry, ISC 2026" << endl;
    cout << "=====================================================" << endl << endl;
    cout << "Rendering at resolution: " << c.image_width << " x " << c.image_height << " pixels" << endl;
-   cout << "Samples per pixel: " << samples << endl << endl;
+   if (batch)
+      cout << "Frames: " << jobs.size() << " from " << (opts.animation.empty() ? opts.job_file : opts.animation)
+           << endl << endl;
+   else
+      cout << "Samples per pixel: " << opts.samples << endl << endl;
 
-   RndGen::set_seed(123);
+   RndGen::set_seed(opts.seed);
 
-   // scene s = many_spheres();
-   scene scene = demo_scene();
+   // The scene and the frames come from the coordinators
+   if (opts.worker_port > 0)
+      return run_render_worker(opts.worker_port, c,
+                               opts.method >= 0 ? render_methods[opts.method] : Render_method::Parallel);
 
-   vector<unsigned char> localImage(image.size());
+   // Acceleration structure used by all the renderers, over the demo scene or that of a file
+   Scene_file scene_file;
+   if (opts.scene.empty())
+      scene_file.build(demo_scene());
+   else if (scene_file.load(opts.scene))
+      cout << "Scene loaded from " << opts.scene << " in " << scene_file.get_load_ms() << " ms" << endl;
+   else
+      return 1;
+   const Bvh &bvh = scene_file.get_bvh();
+   bvh.print_build_report();
+   cout << endl;
 
-   // Choose rendering method
-   cout << "Choose rendering method:" << endl;
-   cout << "\t0. CPU sequential" << endl;
-   cout << "\t1. CPU parallel" << endl;
-   cout << "\t2. CUDA GPU (default)" << endl;
-   cout << "Enter choice (0, 1, or 2): ";
+   // The static spheres and the hierarchy are kept for all the frames, only the moving spheres are refitted
+   if (!opts.animation.empty())
+   {
+      if (!animation.bind(bvh))
+         return 1;
+      cout << "Animation: " << animation.moving_spheres() << " moving spheres" << endl << endl;
+   }
 
-   int choice = 2; // Default to CUDA
-   string input;
-   getline(cin, input);
+   if (!opts.save_scene.empty())
+   {
+      createDirectory(opts.save_scene);
+      if (!Scene_file::save(opts.save_scene, bvh))
+         return 1;
+      cout << "Scene written to " << opts.save_scene << endl;
+      return 0;
+   }
 
-   cout << endl;
+   // The scene, the camera and its GPU context are kept for all the requests
+   if (opts.serve_port > 0)
+      return run_render_server(opts.serve_port, c,
+                               opts.method >= 0 ? render_methods[opts.method] : Render_method::Parallel, bvh,
+                               defaults, opts.server);
 
-   if (!input.empty())
+   Render_method method = render_methods[opts.method >= 0 ? opts.method : askMethod()];
+
+   // The window refines the image of the view until it is closed, -s samples per pixel at most
+   if (opts.preview)
+      return run_preview(bvh, c, method, Preview_settings());
+
+   // The images are encoded and written by other threads while the next frame renders
+   Image_writer writer;
+   writer.png_level = opts.png_level;
+
+   Video_pipe video;
+   if (!opts.video.empty())
    {
-      choice = stoi(input);
+      createDirectory(opts.video);
+      if (!video.open(opts.video, c.image_width, c.image_height))
+         cerr << "Cannot start ffmpeg, the video is not written" << endl;
    }
 
-   switch (choice)
+   const bool progressive = opts.adaptive_threshold <= 0 && (opts.pass_samples > 0 || opts.time_budget_ms > 0);
+
+   // The float formats keep the means of the samples before clamping, which the GPU only returns on request
+   const bool float_output = std::any_of(jobs.begin(), jobs.end(), [](const Render_job &job)
+                                         { return is_float_format(image_format(job.output)); });
+   c.cuda_read_accumulation = float_output;
+
+   // The denoised float colors of the frame, empty until it is denoised
+   vector<float> denoised;
+
+   auto save = [&](const Render_job &job)
    {
-   case 0:
-      cout << "Using CPU single threaded..." << endl;
-      c.renderPixels(scene, localImage);
-      break;
-   case 1:
-      cout << "Using CPU parallel rendering..." << endl;
-      c.renderPixelsParallel(scene, localImage);
-      break;
-   default:
-      cout << "Using CUDA GPU rendering..." << endl;
-      c.renderPixelsCUDA(localImage);
-      break;
+      createDirectory(job.output);
+      if (is_float_format(image_format(job.output)))
+      {
+         vector<float> colors = denoised;
+         if (colors.empty())
+            c.accumulation.resolve(colors);
+         writer.write(job.output, c.image_width, c.image_height, std::move(colors));
+      }
+      else
+         writer.write(job.output, c.image_width, c.image_height, image);
+   };
+
+   // Denoises the frame and writes its AOVs, as requested, before it is saved. The normals are written
+   // as 0.5 * (n + 1) in the 8-bit formats.
+   Aov_buffers aovs;
+   auto finish = [&](const Render_job &job, Render_method frame_method)
+   {
+      denoised.clear();
+      if (opts.denoiser == Denoiser_type::None && !opts.aovs)
+         return;
+
+      c.renderAovs(bvh, aovs);
+      if (opts.aovs)
+      {
+         vector<float> normal_colors = aovs.normal;
+         if (!is_float_format(image_format(job.output)))
+            for (float &value : normal_colors)
+               value = 0.5f * (value + 1.0f);
+         writer.write(suffixed_output(job.output, "_albedo"), c.image_width, c.image_height, aovs.albedo);
+         writer.write(suffixed_output(job.output, "_normal"), c.image_width, c.image_height, normal_colors);
+      }
+      if (opts.denoiser != Denoiser_type::None && !c.denoiseFrame(aovs, frame_method, image, denoised))
+         cerr << "The frame could not be denoised" << endl;
+   };
+
+   // The scene, its hierarchy and the GPU context are shared by all the frames
+   auto batch_start = std::chrono::high_resolution_clock::now();
+   double refit_ms = 0; // Time spent moving the spheres of an animation
+   if (!opts.workers.empty())
+   {
+      if (progressive || opts.adaptive_threshold > 0)
+         cerr << "The distributed renders are one-shot, the progressive and adaptive settings are ignored" << endl;
+      if (animation.moving_spheres() > 0)
+         cerr << "The workers render the scene as it was sent, the moving spheres stay in place" << endl;
+
+      // The frames come back in order, as soon as all their tasks are merged
+      Render_coordinator coordinator(opts.workers, opts.distributed);
+      bool ok = coordinator.render(bvh, c, method, jobs,
+                                   [&](int i, Accumulation_buffer &frame)
+                                   {
+                                      c.accumulation = std::move(frame);
+                                      c.accumulation.resolve(image, c.image_channels, c.image_layout);
+                                      c.setView(jobs[i].lookfrom, jobs[i].lookat, jobs[i].vup, jobs[i].vfov);
+                                      finish(jobs[i], Render_method::Parallel); // The merged sums are here
+                                      save(jobs[i]);
+                                      if (video.is_open())
+                                         video.write(image);
+                                      cout << "Writing " << jobs[i].output << endl;
+                                   });
+      if (!ok)
+         return 1;
    }
+   else
+   {
+      vector<Sphere_update> updates;
+      for (size_t i = 0; i < jobs.size(); i++)
+      {
+         const Render_job &job = jobs[i];
+         if (batch)
+            cout << "Frame " << i + 1 << " / " << jobs.size() << ", " << job.samples << " samples per pixel" << endl;
+
+         if (animation.moving_spheres() > 0)
+         {
+            animation.sphere_updates((int)i, updates);
+            scene_file.get_bvh().move_spheres(updates);
+            refit_ms += bvh.build_stats().refit_ms;
+         }
+
+         c.setView(job.lookfrom, job.lookat, job.vup, job.vfov);
+         c.samples_per_pixel = job.samples;
+
+         // The snapshots of a progressive render overwrite the same file, so they are written one at a time
+         auto save_snapshot = [&]
+         {
+            writer.wait();
+            save(job);
+         };
 
-   // Create res directory if it doesn't exist
-   dumpImageToFile(localImage, "res/output.png");
+         denoised.clear();
+         renderFrame(c, bvh, method, opts, image, save_snapshot);
+         if (progressive)
+            writer.wait();
+         finish(job, method);
+         save(job);
+         if (video.is_open())
+            video.write(image);
+
+         cout << "Writing " << job.output << endl;
+         if (batch)
+            cout << endl;
+      }
+   }
+
+   int failures = writer.wait();
+   if (failures > 0)
+      cerr << failures << " images could not be written" << endl;
+   if (video.is_open())
+   {
+      if (video.close())
+         cout << "Video written to " << opts.video << endl;
+      else
+         cerr << "The video could not be written to " << opts.video << endl;
+   }
 
    cout.imbue(locale("en_US.UTF-8"));
-   cout << "Rays traced: " << fixed << c.n_rays << endl;
+   cout << endl;
+   if (batch)
+   {
+      auto batch_end = std::chrono::high_resolution_clock::now();
+      double seconds = std::chrono::duration<double>(batch_end - batch_start).count();
+      cout << jobs.size() << " frames rendered in " << std::fixed << std::setprecision(2) << seconds << " s ("
+           << jobs.size() * 60 / seconds << " frames/minute)";
+      if (animation.moving_spheres() > 0 && opts.workers.empty())
+         cout << ", " << animation.moving_spheres() << " spheres moved in " << refit_ms / jobs.size()
+              << " ms per frame";
+      cout << ", statistics of the last one:" << endl;
+      cout.unsetf(std::ios::floatfield);
+   }
+   c.stats.print_report(cout);
+
+#ifdef RT_TRACE
+   if (!opts.trace.empty())
+   {
+      Trace::stop();
+      cout << endl;
+      createDirectory(opts.trace);
+      if (Trace::write(opts.trace))
+         cout << "Trace written to " << opts.trace << endl;
+      else
+         cerr << "Cannot write the trace to " << opts.trace << endl;
+      Trace::print_summary(cout);
+   }
+#endif
 
    return 0;
-}
\ No newline at end of file
+}
@@ -2,11 +2,31 @@
 
 #include "color.h"
 #include "hittable.h"
+#include "onb.h"
 #include "ray.h"
 
+/**
+ * @brief Tag identifying the concrete class of a material
+ *
+ * The renderers switch on this tag instead of using RTTI, so that the common
+ * materials are handled without `dynamic_cast` nor virtual call. User-defined
+ * materials keep the `Generic` tag and go through the virtual `scatter`.
+ */
+enum class Material_type
+{
+   Generic,
+   Lambertian,
+   Constant,
+   ShowNormals
+};
+
 class Material
 {
  public:
+   const Material_type type;
+
+   Material(Material_type type = Material_type::Generic) : type(type) {}
+
    virtual ~Material() = default;
 
    virtual bool scatter(const Ray &r_in, const Hit_record &rec, Color &attenuation, Ray &scattered) const
@@ -18,7 +38,7 @@ class Material
 class Constant : public Material
 {
  public:
-   Constant(const Color &a) : color(a) {}
+   Constant(const Color &a) : Material(Material_type::Constant), color(a) {}
 
    virtual bool scatter(const Ray &r_in, const Hit_record &rec, Color &attenuation, Ray &scattered) const override
    {
@@ -34,7 +54,7 @@ class Constant : public Material
 class ShowNormals : public Material
 {
  public:
-   ShowNormals(const Color &a) : albedo(a) {}
+   ShowNormals(const Color &a) : Material(Material_type::ShowNormals), albedo(a) {}
 
    virtual bool scatter(const Ray &r_in, const Hit_record &rec, Color &attenuation, Ray &scattered) const override
    {
@@ -50,17 +70,13 @@ class ShowNormals : public Material
 class Lambertian : public Material
 {
  public:
-   Lambertian(const Color &a) : albedo(a) {}
+   Lambertian(const Color &a) : Material(Material_type::Lambertian), albedo(a) {}
 
    virtual bool scatter(const Ray &r_in, const Hit_record &rec, Color &attenuation, Ray &scattered) const override
    {
-      Vec3 scatter_direction = rec.normal + Vec3::random_in_hemisphere(rec.normal);
-
-      // Catch degenerate scatter direction
-      if (scatter_direction.near_zero())
-         scatter_direction = rec.normal;
-
-      scattered = Ray(rec.p, scatter_direction);
+      // Cosine-weighted around the normal: the density cancels the cosine of the rendering
+      // equation, so the weight of the ray is just the albedo
+      scattered = Ray(rec.p, Onb(rec.normal).transform(Vec3::random_cosine_direction()));
 
       attenuation = albedo;
       return true;
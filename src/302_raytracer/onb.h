@@ -0,0 +1,36 @@
+/**
+ * @class Onb
+ * @brief Orthonormal basis around a unit vector, to place the directions sampled around the z axis
+ *
+ * The basis is built without branches nor normalization, following Duff et al., "Building an
+ * Orthonormal Basis, Revisited" (JCGT 2017): the tangents are continuous everywhere but at the
+ * sign change of the z coordinate of the normal, which the sampled directions do not depend on.
+ * The CUDA renderers build the same basis in `lambertian_direction`.
+ */
+#pragma once
+
+#include "vec3.h"
+
+#include <cmath>
+
+class Onb
+{
+ public:
+   // The basis whose third axis is `n`, which must be a unit vector
+   explicit Onb(const Vec3 &n) : w(n)
+   {
+      const real sign = std::copysign(real(1), n.z());
+      const real a = -1 / (sign + n.z());
+      const real b = n.x() * n.y() * a;
+      u = Vec3(1 + sign * n.x() * n.x() * a, sign * b, -sign * n.x());
+      v = Vec3(b, sign + n.y() * n.y() * a, -n.y());
+   }
+
+   // The vector of coordinates `local` in this basis
+   Vec3 transform(const Vec3 &local) const { return local.x() * u + local.y() * v + local.z() * w; }
+
+   const Vec3 &normal() const { return w; }
+
+ private:
+   Vec3 u, v, w;
+};
@@ -0,0 +1,373 @@
+/**
+ * @file preview.h
+ * @brief Interactive preview window, refining the image progressively while the camera is moved
+ *
+ * The preview (`--preview`) shows the accumulation of a progressive render as it refines. Every
+ * change of the view only moves the camera (`Camera::setView`) and restarts the accumulation
+ * (`Camera::beginProgressive`): the scene, its hierarchy, the buffers and the GPU context are
+ * kept, so the first image of the new view comes after a single pass of one sample per pixel.
+ *
+ * The passes run on the thread of the window, between the events. Their number of samples is
+ * adapted to keep them around `Preview_settings::frame_ms`, doubled while they are much shorter
+ * and halved when they get longer, so that the window stays responsive while the image converges.
+ * Once every pixel has `Camera::samples_per_pixel` samples, the preview waits for the next event.
+ *
+ * The frame time, the throughput and the time to the first image of the view are shown in the
+ * title of the window. The images of all the renderers come back to the host, and are drawn as
+ * the texture of a quad. With `--denoise`, or after pressing N, the image shown is denoised after
+ * every pass, the albedo and normal buffers being traced once per view.
+ *
+ * | Input            | Action                                                   |
+ * |------------------|----------------------------------------------------------|
+ * | Left drag        | Orbit around the point looked at                         |
+ * | Right drag       | Pan                                                      |
+ * | Scroll           | Move towards the point looked at, zoom with Shift        |
+ * | W, A, S, D, Q, E | Move forward, left, backward, right, down and up         |
+ * | R                | Back to the initial view                                 |
+ * | N                | Denoise the image or not, see denoiser.h                 |
+ * | P                | Print the view as a line of a job file, see render_job.h |
+ * | Escape           | Close the window                                         |
+ *
+ * The window needs GLFW and OpenGL, configure with `-DPREVIEW=ON`.
+ */
+#pragma once
+
+#include "bvh.h"
+#include "camera.h"
+#include "vec3.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#ifdef RT_PREVIEW
+#include <GLFW/glfw3.h>
+#endif
+
+// Settings of the preview window
+struct Preview_settings
+{
+   double frame_ms = 33.0; // Target duration of a pass, which sets its number of samples
+   int window_scale = 1;   // Size of the window in screen pixels per image pixel
+};
+
+/**
+ * @class View_controls
+ * @brief Orbit camera around the point looked at, driven by the mouse and the keyboard
+ *
+ * The view is kept as the point looked at, the distance of the camera and its direction
+ * around the up axis (yaw) and above the horizon (pitch). The up direction does not change.
+ */
+class View_controls
+{
+ public:
+   explicit View_controls(const Camera &camera)
+       : target(camera.lookat), up(unit_vector(camera.vup)), vfov(camera.vfov)
+   {
+      Vec3 offset = camera.lookfrom - camera.lookat;
+      distance = std::max((double)offset.length(), 1e-3);
+
+      // The angles are measured in a frame whose y axis is the up direction
+      Vec3 side = unit_vector(cross(up, std::fabs(up.y()) < 0.9 ? Vec3(0, 1, 0) : Vec3(1, 0, 0)));
+      Vec3 front = cross(side, up);
+      pitch = std::asin(std::clamp(dot(offset, up) / distance, -1.0, 1.0));
+      yaw = std::atan2(dot(offset, side), dot(offset, front));
+      reference_side = side;
+      reference_front = front;
+   }
+
+   Point3 eye() const
+   {
+      Vec3 horizontal = std::sin(yaw) * reference_side + std::cos(yaw) * reference_front;
+      return target + distance * (std::cos(pitch) * horizontal + std::sin(pitch) * up);
+   }
+
+   // Turns around the point looked at, by angles in radians
+   void orbit(double d_yaw, double d_pitch)
+   {
+      yaw += d_yaw;
+      pitch = std::clamp(pitch + d_pitch, -MAX_PITCH, MAX_PITCH);
+   }
+
+   // Moves the point looked at in the plane of the image, by fractions of the distance
+   void pan(double dx, double dy)
+   {
+      Vec3 forward = unit_vector(target - eye());
+      Vec3 right = unit_vector(cross(forward, up));
+      Vec3 image_up = cross(right, forward);
+      target += distance * (dx * right + dy * image_up);
+   }
+
+   // Moves the camera and the point looked at, by fractions of the distance
+   void move(double forward_amount, double right_amount, double up_amount)
+   {
+      Vec3 forward = unit_vector(target - eye());
+      Vec3 right = unit_vector(cross(forward, up));
+      target += distance * (forward_amount * forward + right_amount * right + up_amount * up);
+   }
+
+   // Moves towards the point looked at, by steps of 10 % of the distance
+   void dolly(double steps) { distance = std::max(distance * std::pow(0.9, steps), 1e-3); }
+
+   // Narrows the field of view, by steps of 5 %
+   void zoom(double steps) { vfov = std::clamp(vfov * std::pow(0.95, steps), 1.0, 150.0); }
+
+   void apply(Camera &camera) const { camera.setView(eye(), target, up, vfov); }
+
+ private:
+   static constexpr double MAX_PITCH = 1.55; // Just below the vertical, where the view direction would be the up one
+
+   Point3 target;
+   Vec3 up;
+   double vfov;
+   double distance, yaw, pitch;
+   Vec3 reference_side, reference_front; // Directions of yaw pi / 2 and 0
+};
+
+#ifdef RT_PREVIEW
+
+// State of the window shared with the GLFW callbacks
+struct Preview_input
+{
+   View_controls controls;
+   View_controls initial;
+   bool changed = true; // The view changed since the last pass
+   double cursor_x = 0, cursor_y = 0;
+   bool print_view = false;
+   bool denoise = false; // Show the denoised image
+};
+
+/**
+ * @brief Opens the preview window and renders the scene until it is closed
+ * @return The exit code of the program, 1 if the window cannot be opened
+ */
+inline int run_preview(const Bvh &scene, Camera &camera, Render_method method, const Preview_settings &settings)
+{
+   if (!glfwInit())
+   {
+      std::cerr << "Cannot initialize GLFW, the preview needs a display" << std::endl;
+      return 1;
+   }
+
+   const int scale = std::max(1, settings.window_scale);
+   GLFWwindow *window = glfwCreateWindow(camera.image_width * scale, camera.image_height * scale, "302 ray tracer",
+                                         nullptr, nullptr);
+   if (window == nullptr)
+   {
+      std::cerr << "Cannot open the preview window" << std::endl;
+      glfwTerminate();
+      return 1;
+   }
+   glfwMakeContextCurrent(window);
+   glfwSwapInterval(0); // The passes set the pace, not the display
+
+   Preview_input input{View_controls(camera), View_controls(camera)};
+   const Denoiser_type denoise_type = camera.denoise_settings.type;
+   const Denoiser_type denoiser = denoise_type != Denoiser_type::None ? denoise_type : Denoiser_type::Atrous;
+   input.denoise = denoise_type != Denoiser_type::None;
+   glfwSetWindowUserPointer(window, &input);
+
+   glfwSetCursorPosCallback(window,
+                            [](GLFWwindow *w, double x, double y)
+                            {
+                               auto &in = *static_cast<Preview_input *>(glfwGetWindowUserPointer(w));
+                               int width, height;
+                               glfwGetWindowSize(w, &width, &height);
+                               const double dx = (x - in.cursor_x) / std::max(1, height);
+                               const double dy = (y - in.cursor_y) / std::max(1, height);
+                               in.cursor_x = x;
+                               in.cursor_y = y;
+
+                               if (glfwGetMouseButton(w, GLFW_MOUSE_BUTTON_LEFT) == GLFW_PRESS)
+                                  in.controls.orbit(-3.0 * dx, 3.0 * dy);
+                               else if (glfwGetMouseButton(w, GLFW_MOUSE_BUTTON_RIGHT) == GLFW_PRESS)
+                                  in.controls.pan(-dx, dy);
+                               else
+                                  return;
+                               in.changed = true;
+                            });
+   glfwSetScrollCallback(window,
+                         [](GLFWwindow *w, double, double steps)
+                         {
+                            auto &in = *static_cast<Preview_input *>(glfwGetWindowUserPointer(w));
+                            if (glfwGetKey(w, GLFW_KEY_LEFT_SHIFT) == GLFW_PRESS ||
+                                glfwGetKey(w, GLFW_KEY_RIGHT_SHIFT) == GLFW_PRESS)
+                               in.controls.zoom(steps);
+                            else
+                               in.controls.dolly(steps);
+                            in.changed = true;
+                         });
+   glfwSetKeyCallback(window,
+                      [](GLFWwindow *w, int key, int, int action, int)
+                      {
+                         auto &in = *static_cast<Preview_input *>(glfwGetWindowUserPointer(w));
+                         if (action != GLFW_PRESS)
+                            return;
+                         if (key == GLFW_KEY_ESCAPE)
+                            glfwSetWindowShouldClose(w, GLFW_TRUE);
+                         else if (key == GLFW_KEY_R)
+                         {
+                            in.controls = in.initial;
+                            in.changed = true;
+                         }
+                         else if (key == GLFW_KEY_P)
+                            in.print_view = true;
+                         else if (key == GLFW_KEY_N)
+                         {
+                            in.denoise = !in.denoise;
+                            in.changed = true;
+                         }
+                      });
+
+   GLuint texture;
+   glGenTextures(1, &texture);
+   glBindTexture(GL_TEXTURE_2D, texture);
+   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+   glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, camera.image_width, camera.image_height, 0, GL_RGBA, GL_UNSIGNED_BYTE,
+                nullptr);
+   glEnable(GL_TEXTURE_2D);
+
+   // RGBA pixels, which the driver copies to the texture as they are, the rows being 4-byte aligned
+   const int channels = camera.image_channels;
+   const Pixel_layout layout = camera.image_layout;
+   camera.image_channels = 4;
+   camera.image_layout = Pixel_layout::Interleaved;
+   std::vector<unsigned char> image((size_t)camera.image_width * camera.image_height * camera.image_channels);
+   const int target = camera.samples_per_pixel;
+   Aov_buffers aovs; // Of the current view, when denoising
+   std::vector<float> denoised;
+   int done = 0, pass_samples = 1;
+   bool first_pass = true;
+   auto view_time = std::chrono::high_resolution_clock::now(); // Change of the view, for the time to the first image
+   double first_image_ms = 0, pass_ms = 0, mrays = 0;
+   auto last_move = std::chrono::high_resolution_clock::now();
+
+   while (!glfwWindowShouldClose(window))
+   {
+      // Keep the window responsive without spinning once the image has converged
+      if (done < target || input.changed)
+         glfwPollEvents();
+      else
+         glfwWaitEvents();
+
+      // The keys move the camera at a speed independent of the frame rate, one distance per second
+      auto now = std::chrono::high_resolution_clock::now();
+      const double seconds = std::min(0.1, std::chrono::duration<double>(now - last_move).count());
+      last_move = now;
+      auto axis = [&](int positive, int negative)
+      { return (glfwGetKey(window, positive) == GLFW_PRESS) - (glfwGetKey(window, negative) == GLFW_PRESS); };
+      const int forward = axis(GLFW_KEY_W, GLFW_KEY_S), right = axis(GLFW_KEY_D, GLFW_KEY_A),
+                upward = axis(GLFW_KEY_E, GLFW_KEY_Q);
+      if (forward || right || upward)
+      {
+         input.controls.move(forward * seconds, right * seconds, upward * seconds);
+         input.changed = true;
+      }
+
+      if (input.print_view)
+      {
+         printf("lookfrom=%g,%g,%g lookat=%g,%g,%g vup=%g,%g,%g vfov=%g\n", camera.lookfrom.x(), camera.lookfrom.y(),
+                camera.lookfrom.z(), camera.lookat.x(), camera.lookat.y(), camera.lookat.z(), camera.vup.x(),
+                camera.vup.y(), camera.vup.z(), camera.vfov);
+         input.print_view = false;
+      }
+
+      // A new view only restarts the accumulation, everything else is kept
+      if (input.changed)
+      {
+         input.controls.apply(camera);
+         camera.beginProgressive(method, target);
+         camera.denoise_settings.type = input.denoise ? denoiser : Denoiser_type::None;
+         if (input.denoise)
+            camera.renderAovs(scene, aovs);
+         input.changed = false;
+         done = 0;
+         pass_samples = 1;
+         first_pass = true;
+         view_time = now;
+      }
+
+      if (done >= target)
+         continue;
+
+      const int n = std::min(pass_samples, target - done);
+      const unsigned long long rays_before = camera.stats.rays();
+      auto start_time = std::chrono::high_resolution_clock::now();
+      if (!camera.renderProgressivePass(scene, image, method, done, n))
+         break;
+      auto end_time = std::chrono::high_resolution_clock::now();
+      done += n;
+
+      pass_ms = std::chrono::duration<double, std::milli>(end_time - start_time).count();
+      mrays = pass_ms > 0 ? (camera.stats.rays() - rays_before) / (pass_ms * 1000.0) : 0;
+      if (pass_ms < settings.frame_ms / 2)
+         pass_samples *= 2;
+      else if (pass_ms > settings.frame_ms && pass_samples > 1)
+         pass_samples /= 2;
+
+      // Outside of the time of the pass, which only sets its number of samples
+      if (input.denoise)
+         camera.denoiseFrame(aovs, method, image, denoised);
+
+      int width, height;
+      glfwGetFramebufferSize(window, &width, &height);
+      glViewport(0, 0, width, height);
+      glClear(GL_COLOR_BUFFER_BIT);
+
+      // The image keeps its aspect ratio, centered in the window
+      const double image_aspect = (double)camera.image_width / camera.image_height;
+      const double window_aspect = (double)width / std::max(1, height);
+      const float sx = (float)std::min(1.0, image_aspect / window_aspect);
+      const float sy = (float)std::min(1.0, window_aspect / image_aspect);
+
+      glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, camera.image_width, camera.image_height, GL_RGBA, GL_UNSIGNED_BYTE,
+                      image.data());
+      glBegin(GL_QUADS); // The first row of the image is the top one
+      glTexCoord2f(0, 1);
+      glVertex2f(-sx, -sy);
+      glTexCoord2f(1, 1);
+      glVertex2f(sx, -sy);
+      glTexCoord2f(1, 0);
+      glVertex2f(sx, sy);
+      glTexCoord2f(0, 0);
+      glVertex2f(-sx, sy);
+      glEnd();
+      glfwSwapBuffers(window);
+
+      if (first_pass)
+      {
+         first_image_ms =
+             std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - view_time).count();
+         first_pass = false;
+      }
+
+      char title[256];
+      snprintf(title, sizeof(title),
+               "302 ray tracer - %s - %d/%d spp - pass %.1f ms (%d spp) - %.1f Mrays/s - first image %.1f ms",
+               render_method_names[(int)method], done, target, pass_ms, n, mrays, first_image_ms);
+      glfwSetWindowTitle(window, title);
+   }
+
+   camera.image_channels = channels;
+   camera.image_layout = layout;
+   camera.denoise_settings.type = denoise_type;
+   glDeleteTextures(1, &texture);
+   glfwDestroyWindow(window);
+   glfwTerminate();
+   return 0;
+}
+
+#else
+
+inline int run_preview(const Bvh &, Camera &, Render_method, const Preview_settings &)
+{
+   std::cerr << "Built without the PREVIEW option, configure with -DPREVIEW=ON for the preview window" << std::endl;
+   return 1;
+}
+
+#endif
@@ -18,7 +18,7 @@ class Ray
    const Point3 &origin() const { return orig; }
    const Vec3 &direction() const { return dir; }
 
-   Point3 at(double t) const { return orig + t * dir; }
+   Point3 at(real t) const { return orig + t * dir; }
 
  private:
    Point3 orig;
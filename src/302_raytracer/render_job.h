@@ -0,0 +1,131 @@
+/**
+ * @file render_job.h
+ * @brief Frames of a batch render, read from a job file
+ *
+ * A job file describes one frame per line, as `key=value` settings separated by
+ * spaces. Empty lines and the text after a `#` are ignored. The settings missing
+ * from a line keep the values given on the command line.
+ *
+ * | Key        | Value                                   | Example                 |
+ * |------------|-----------------------------------------|-------------------------|
+ * | `output`   | Path of the image written for the frame | `output=res/f001.png`   |
+ * | `samples`  | Samples per pixel                       | `samples=64`            |
+ * | `lookfrom` | Position of the camera                  | `lookfrom=-2,2,5`       |
+ * | `lookat`   | Point the camera looks at               | `lookat=-2,-0.5,-1`     |
+ * | `vup`      | Up direction of the camera              | `vup=0,1,0`             |
+ * | `vfov`     | Vertical field of view in degrees       | `vfov=35`               |
+ *
+ * The frames without an `output` are written next to the output of the command
+ * line, numbered by their index in the file (e.g. `res/output_0003.png`).
+ */
+#pragma once
+
+#include "vec3.h"
+
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Settings of one frame of a batch
+struct Render_job
+{
+   std::string output; // Path of the image
+   int samples = 1;    // Samples per pixel
+   Point3 lookfrom, lookat;
+   Vec3 vup;
+   double vfov = 35.0; // Vertical field of view in degrees
+};
+
+// Parses "x,y,z"
+inline bool parse_vec3(const std::string &text, Vec3 &v)
+{
+   double x, y, z;
+   char end;
+   if (sscanf(text.c_str(), "%lf,%lf,%lf%c", &x, &y, &z, &end) != 3)
+      return false;
+   v = Vec3(x, y, z);
+   return true;
+}
+
+// The path of an image with a suffix before its extension: "dir/name.png" becomes "dir/name<suffix>.png"
+inline std::string suffixed_output(const std::string &output, const std::string &suffix)
+{
+   size_t dot = output.find_last_of('.');
+   size_t slash = output.find_last_of("/\\");
+   if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+      return output + suffix;
+   return output.substr(0, dot) + suffix + output.substr(dot);
+}
+
+// Path of the image of frame `index` when the job file does not give one: "dir/name.png" becomes "dir/name_0003.png"
+inline std::string numbered_output(const std::string &output, int index)
+{
+   char number[16];
+   snprintf(number, sizeof(number), "_%04d", index);
+   return suffixed_output(output, number);
+}
+
+/**
+ * @brief Reads the frames of a job file, see the top of this file for the format
+ * @param defaults Settings of the frames not given in the file, `defaults.output` being numbered
+ * @return false after printing the first error, `jobs` then being incomplete
+ */
+inline bool read_job_file(const std::string &path, const Render_job &defaults, std::vector<Render_job> &jobs)
+{
+   std::ifstream file(path);
+   if (!file)
+   {
+      std::cerr << "Cannot open the job file " << path << std::endl;
+      return false;
+   }
+
+   std::string line;
+   for (int line_number = 1; std::getline(file, line); line_number++)
+   {
+      line = line.substr(0, line.find('#'));
+
+      Render_job job = defaults;
+      job.output = numbered_output(defaults.output, (int)jobs.size());
+
+      std::istringstream settings(line);
+      std::string setting;
+      bool empty = true;
+      while (settings >> setting)
+      {
+         empty = false;
+         size_t equal = setting.find('=');
+         std::string key = setting.substr(0, equal);
+         std::string value = equal == std::string::npos ? "" : setting.substr(equal + 1);
+
+         bool ok = !value.empty();
+         if (key == "output")
+            job.output = value;
+         else if (key == "samples")
+            ok = ok && sscanf(value.c_str(), "%d", &job.samples) == 1 && job.samples > 0;
+         else if (key == "lookfrom")
+            ok = ok && parse_vec3(value, job.lookfrom);
+         else if (key == "lookat")
+            ok = ok && parse_vec3(value, job.lookat);
+         else if (key == "vup")
+            ok = ok && parse_vec3(value, job.vup);
+         else if (key == "vfov")
+            ok = ok && sscanf(value.c_str(), "%lf", &job.vfov) == 1 && job.vfov > 0 && job.vfov < 180;
+         else
+            ok = false;
+
+         if (!ok)
+         {
+            std::cerr << path << ":" << line_number << ": invalid setting \"" << setting << "\"" << std::endl;
+            return false;
+         }
+      }
+
+      if (!empty)
+         jobs.push_back(job);
+   }
+
+   return true;
+}
@@ -0,0 +1,1047 @@
+/**
+ * @file render_server.h
+ * @brief A render daemon answering HTTP requests, over a cache of scenes and with the requests batched on one camera
+ *
+ * A render from the command line builds the scene, the camera and the GPU context for a single image. The server
+ * (`--serve <port>`) keeps them: the scenes stay loaded with their hierarchy, and one camera, with its threads and
+ * its GPU context, renders the images of all the clients.
+ *
+ * **API**, HTTP/1.1 with one request per connection:
+ *
+ * | Request           | Response                                                                                  |
+ * |-------------------|-------------------------------------------------------------------------------------------|
+ * | `POST /scenes`    | The body is a binary or text scene (see scene_file.h), loaded and cached. Answers its     |
+ * |                   | hash, with 201 when it was loaded and 200 when it was already cached                      |
+ * | `GET /scenes`     | The cached scenes, the most recently used first: hash, objects and bytes, one per line    |
+ * | `GET /render?...` | The image, refined pass after pass, see below                                             |
+ * | `GET /metrics`    | The counters, the latencies and the queue depth in the Prometheus text format             |
+ * | `GET /`           | A page showing `/render` with the same parameters                                         |
+ *
+ * Only `POST /scenes` may have a body, of at most `max_scene_bytes`, the bodies received at once by all the
+ * connections being limited to `max_upload_bytes` (503 past it).
+ *
+ * The parameters of `/render` are all optional, their defaults being those of the command line: `scene` (a
+ * hash answered by `POST /scenes`, else the scene of the command line), `width`, `height`, `samples`, `depth`,
+ * `seed`, `lookfrom`, `lookat` and `vup` (as `x,y,z`), `vfov`, `denoise` (`none`, `atrous` or `oidn`, applied
+ * to the final image) and `stream`. With `stream=1`, the default, the response is a `multipart/x-mixed-replace`
+ * stream of PNGs, one per pass, that a browser shows refining in an `<img>`; a client slower than the passes only
+ * gets the latest image. With `stream=0`, it is the final PNG. The `X-Samples` header of each image gives its
+ * samples per pixel.
+ *
+ * **Scene cache**: the scenes are keyed by the FNV-1a hash of their bytes, so that uploading a scene again costs
+ * a hash instead of a hierarchy build. Past `Server_settings::scene_cache` scenes, the least recently used is
+ * evicted, except the scene of the command line. The requests hold their scene, which is only freed once the
+ * last of them is done.
+ *
+ * **Batching**: one thread owns the camera. Up to `max_batch` requests render together, each round rendering
+ * a pass of each of them in turn, and the queued requests join the batch between rounds: a request gets its
+ * first image after at most a round, whatever is being rendered. The passes double from 1 sample per pixel up
+ * to `max_pass_samples`. The batch is sorted by scene and resolution, so that the passes following each other
+ * reuse the scene uploaded to the GPU and the buffers. The identical requests share one render, the later ones
+ * getting its next images. Each pass continues the sample sequence of the pixels (see `Camera::renderRegion`),
+ * so an image does not depend on the requests it was batched with.
+ *
+ * **Metrics**: `rt_request_seconds` (to the end of the response) and `rt_first_image_seconds` are summaries with
+ * the p50 and p99 of the last `latency_window` renders. `rt_queue_depth` counts the requests waiting to join the
+ * batch, past `max_queue` of which the requests are refused with 503, and `rt_batch_size` those rendering.
+ */
+#pragma once
+
+#include "accumulation_buffer.h"
+#include "bvh.h"
+#include "camera.h"
+#include "denoiser.h"
+#include "distributed.h"
+#include "image_writer.h"
+#include "render_job.h"
+#include "scene_file.h"
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+
+// Settings of the server, see the top of this file
+struct Server_settings
+{
+   int scene_cache = 8;                   // Scenes kept loaded, that of the command line included
+   int max_batch = 8;                     // Requests rendered together, a pass of each in turn
+   int max_queue = 64;                    // Requests waiting to join the batch, the next ones are refused
+   int max_connections = 256;             // Open connections, the next ones are refused
+   int max_pass_samples = 16;             // Samples per pixel of the largest passes
+   int png_level = 0;                     // Deflate level of the images sent, 0 to store them (stb's least is 5)
+   int max_samples = 1 << 16;             // Samples per pixel of a request
+   int max_pixels = 3840 * 2160;          // Of a request
+   size_t max_scene_bytes = 1ull << 31;   // Of an uploaded scene
+   size_t max_upload_bytes = 1ull << 32;  // Of all the scenes being received at once, the next ones are refused
+   int latency_window = 1024;             // Last renders of the latency quantiles
+   int timeout_ms = 60000;                // To receive a request, and to send each part of a response
+};
+
+// 64-bit FNV-1a, the key of the scenes in the cache
+inline uint64_t fnv1a_hash(const unsigned char *data, size_t size)
+{
+   uint64_t hash = 0xcbf29ce484222325ull;
+   for (size_t i = 0; i < size; i++)
+      hash = (hash ^ data[i]) * 0x100000001b3ull;
+   return hash;
+}
+
+inline std::string hash_string(uint64_t hash)
+{
+   char text[17];
+   snprintf(text, sizeof(text), "%016llx", (unsigned long long)hash);
+   return text;
+}
+
+//==============================================================================
+// HTTP
+//==============================================================================
+
+struct Http_request
+{
+   std::string method, path;
+   std::map<std::string, std::string> query; // Decoded parameters of the target
+   std::vector<unsigned char> body;
+};
+
+inline const char *http_reason(int status)
+{
+   switch (status)
+   {
+   case 200:
+      return "OK";
+   case 201:
+      return "Created";
+   case 400:
+      return "Bad Request";
+   case 404:
+      return "Not Found";
+   case 405:
+      return "Method Not Allowed";
+   case 413:
+      return "Payload Too Large";
+   case 431:
+      return "Request Header Fields Too Large";
+   case 503:
+      return "Service Unavailable";
+   default:
+      return "Internal Server Error";
+   }
+}
+
+// Decodes the %XX escapes and the '+' of a query string
+inline std::string url_decode(const std::string &text)
+{
+   std::string decoded;
+   for (size_t i = 0; i < text.size(); i++)
+   {
+      unsigned int byte;
+      if (text[i] == '+')
+         decoded += ' ';
+      else if (text[i] == '%' && i + 2 < text.size() && sscanf(text.c_str() + i + 1, "%2x", &byte) == 1)
+      {
+         decoded += (char)byte;
+         i += 2;
+      }
+      else
+         decoded += text[i];
+   }
+   return decoded;
+}
+
+// Escapes the characters of a parameter that are not letters, digits or ",.-_"
+inline std::string url_encode(const std::string &text)
+{
+   std::string encoded;
+   for (char c : text)
+   {
+      char escape[4];
+      snprintf(escape, sizeof(escape), "%%%02X", (unsigned char)c);
+      encoded += isalnum((unsigned char)c) || strchr(",.-_", c) != nullptr ? std::string(1, c) : escape;
+   }
+   return encoded;
+}
+
+/**
+ * @brief Receives a request, its headers and then its body
+ *
+ * The body is received as it comes, never allocated from the declared length alone.
+ * @param accept_body Called with the parsed request and the `Content-Length`, when not 0, before
+ *                    receiving the body: 0 to receive it, else the status of the error to answer
+ * @return 0, or the status of the error to answer (-1 when the connection is lost)
+ */
+inline int receive_http_request(Socket &socket, Http_request &request,
+                                const std::function<int(const Http_request &, size_t)> &accept_body)
+{
+   static constexpr size_t MAX_HEAD = 16384;
+
+   // The end of the head may come with the first bytes of the body
+   std::string head;
+   size_t head_end;
+   char chunk[4096];
+   while ((head_end = head.find("\r\n\r\n")) == std::string::npos)
+   {
+      if (head.size() > MAX_HEAD)
+         return 431;
+      int received = socket.receive_some(chunk, sizeof(chunk));
+      if (received <= 0)
+         return -1;
+      head.append(chunk, received);
+   }
+
+   std::istringstream lines(head.substr(0, head_end));
+   std::string line, target, version;
+   std::getline(lines, line);
+   std::istringstream request_line(line);
+   if (!(request_line >> request.method >> target >> version) || version.compare(0, 5, "HTTP/") != 0)
+      return 400;
+
+   size_t content_length = 0;
+   while (std::getline(lines, line))
+   {
+      size_t colon = line.find(':');
+      if (colon == std::string::npos)
+         continue;
+      std::string name = line.substr(0, colon);
+      std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+      if (name == "content-length")
+         content_length = (size_t)strtoull(line.c_str() + colon + 1, nullptr, 10);
+   }
+
+   size_t question = target.find('?');
+   request.path = target.substr(0, question);
+   if (question != std::string::npos)
+   {
+      std::istringstream parameters(target.substr(question + 1));
+      std::string parameter;
+      while (std::getline(parameters, parameter, '&'))
+      {
+         size_t equal = parameter.find('=');
+         if (!parameter.empty())
+            request.query[url_decode(parameter.substr(0, equal))] =
+                equal == std::string::npos ? "" : url_decode(parameter.substr(equal + 1));
+      }
+   }
+
+   if (content_length == 0)
+      return 0;
+   if (int status = accept_body(request, content_length))
+      return status;
+   const size_t received = std::min(content_length, head.size() - head_end - 4);
+   request.body.assign(head.begin() + head_end + 4, head.begin() + head_end + 4 + received);
+   std::vector<unsigned char> buffer(std::min<size_t>(content_length, 1 << 16));
+   while (request.body.size() < content_length)
+   {
+      int bytes = socket.receive_some(buffer.data(), std::min(buffer.size(), content_length - request.body.size()));
+      if (bytes <= 0)
+         return -1;
+      request.body.insert(request.body.end(), buffer.begin(), buffer.begin() + bytes);
+   }
+   return 0;
+}
+
+// Sends a whole response, closing the connection after it
+inline bool send_http_response(Socket &socket, int status, const std::string &content_type, const void *body,
+                               size_t size, const std::string &headers = "")
+{
+   std::string head = "HTTP/1.1 " + std::to_string(status) + " " + http_reason(status) +
+                      "\r\nContent-Type: " + content_type + "\r\nContent-Length: " + std::to_string(size) +
+                      "\r\nCache-Control: no-cache\r\nConnection: close\r\n" + headers + "\r\n";
+   return socket.send_all(head.data(), head.size()) && (size == 0 || socket.send_all(body, size));
+}
+
+inline bool send_http_text(Socket &socket, int status, const std::string &text)
+{
+   return send_http_response(socket, status, "text/plain; charset=utf-8", text.data(), text.size());
+}
+
+//==============================================================================
+// SCENE CACHE
+//==============================================================================
+
+// A scene of the cache, shared by the requests rendering it
+struct Cached_scene
+{
+   uint64_t hash = 0;
+   size_t bytes = 0;                 // Of the file or the upload
+   const Bvh *bvh = nullptr;         // Of `file`, or of the scene of the command line
+   std::unique_ptr<Scene_file> file; // Null for the scene of the command line, which is never evicted
+};
+
+/**
+ * @class Scene_cache
+ * @brief The loaded scenes by hash, the least recently used being evicted past the capacity
+ */
+class Scene_cache
+{
+ public:
+   explicit Scene_cache(int capacity) : capacity(std::max(1, capacity)) {}
+
+   // The scene of a hash, which becomes the most recently used, null if it is not cached
+   std::shared_ptr<Cached_scene> find(uint64_t hash)
+   {
+      std::lock_guard<std::mutex> lock(mutex);
+      for (auto entry = entries.begin(); entry != entries.end(); ++entry)
+      {
+         if ((*entry)->hash == hash)
+         {
+            entries.splice(entries.begin(), entries, entry);
+            hits++;
+            return entries.front();
+         }
+      }
+      misses++;
+      return nullptr;
+   }
+
+   /**
+    * @brief Adds a scene, evicting the least recently used ones past the capacity
+    * @return The scene cached under its hash, which is the one already there when it was loaded twice
+    */
+   std::shared_ptr<Cached_scene> insert(std::shared_ptr<Cached_scene> scene)
+   {
+      std::lock_guard<std::mutex> lock(mutex);
+      for (const std::shared_ptr<Cached_scene> &entry : entries)
+         if (entry->hash == scene->hash)
+            return entry;
+
+      entries.push_front(std::move(scene));
+      for (auto entry = std::prev(entries.end()); (int)entries.size() > capacity && entry != entries.begin();)
+      {
+         // The pinned scenes keep their place
+         auto previous = std::prev(entry);
+         if ((*entry)->file != nullptr)
+         {
+            entries.erase(entry);
+            evictions++;
+         }
+         entry = previous;
+      }
+      return entries.front();
+   }
+
+   // The scenes, the most recently used first
+   std::vector<std::shared_ptr<Cached_scene>> list()
+   {
+      std::lock_guard<std::mutex> lock(mutex);
+      return std::vector<std::shared_ptr<Cached_scene>>(entries.begin(), entries.end());
+   }
+
+   // Appends the metrics of the cache
+   void write_metrics(std::ostream &out)
+   {
+      std::lock_guard<std::mutex> lock(mutex);
+      out << "# TYPE rt_scene_cache_entries gauge\nrt_scene_cache_entries " << entries.size() << "\n";
+      out << "# TYPE rt_scene_cache_hits_total counter\nrt_scene_cache_hits_total " << hits << "\n";
+      out << "# TYPE rt_scene_cache_misses_total counter\nrt_scene_cache_misses_total " << misses << "\n";
+      out << "# TYPE rt_scene_cache_evictions_total counter\nrt_scene_cache_evictions_total " << evictions << "\n";
+   }
+
+ private:
+   std::mutex mutex;
+   std::list<std::shared_ptr<Cached_scene>> entries; // The most recently used first
+   int capacity;
+   unsigned long long hits = 0, misses = 0, evictions = 0;
+};
+
+//==============================================================================
+// METRICS
+//==============================================================================
+
+/**
+ * @class Latency_window
+ * @brief The durations of the last events, for their quantiles, and the count and sum of all of them
+ */
+class Latency_window
+{
+ public:
+   explicit Latency_window(int size) : values(std::max(1, size)) {}
+
+   void add(double seconds)
+   {
+      values[count % values.size()] = seconds;
+      count++;
+      sum += seconds;
+   }
+
+   // Of the last events, 0 without events
+   double quantile(double q) const
+   {
+      std::vector<double> last(values.begin(), values.begin() + std::min<size_t>(count, values.size()));
+      if (last.empty())
+         return 0;
+      auto nth = last.begin() + std::min(last.size() - 1, (size_t)(q * last.size()));
+      std::nth_element(last.begin(), nth, last.end());
+      return *nth;
+   }
+
+   // As a Prometheus summary
+   void write_metrics(std::ostream &out, const std::string &name, const std::string &help) const
+   {
+      out << "# HELP " << name << " " << help << "\n# TYPE " << name << " summary\n";
+      out << name << "{quantile=\"0.5\"} " << quantile(0.5) << "\n";
+      out << name << "{quantile=\"0.99\"} " << quantile(0.99) << "\n";
+      out << name << "_sum " << sum << "\n" << name << "_count " << count << "\n";
+   }
+
+ private:
+   std::vector<double> values; // Ring of the last durations
+   size_t count = 0;
+   double sum = 0;
+};
+
+//==============================================================================
+// SERVER
+//==============================================================================
+
+/**
+ * @class Render_server
+ * @brief Renders the requests of the HTTP clients on one camera, see the top of this file
+ */
+class Render_server
+{
+ public:
+   /**
+    * @param camera Renders all the requests, its resolution, depth, seed and denoiser being their defaults
+    * @param scene The scene of the command line, rendered when a request gives none
+    * @param defaults Gives the samples and the view of the requests that do not give them
+    */
+   Render_server(Camera &camera, Render_method method, const Bvh &scene, const Render_job &defaults,
+                 const Server_settings &settings)
+       : camera(camera), method(method), settings(settings), cache(settings.scene_cache),
+         request_latency(settings.latency_window), first_image_latency(settings.latency_window)
+   {
+      auto cached = std::make_shared<Cached_scene>();
+      std::vector<unsigned char> bytes;
+      if (Scene_file::serialize(scene, bytes))
+         cached->hash = fnv1a_hash(bytes.data(), bytes.size());
+      cached->bytes = bytes.size();
+      cached->bvh = &scene;
+      default_scene = cache.insert(cached);
+
+      this->defaults.width = camera.image_width;
+      this->defaults.height = camera.image_height;
+      this->defaults.samples = defaults.samples;
+      this->defaults.max_depth = camera.max_depth;
+      this->defaults.seed = (uint32_t)RndGen::get_seed();
+      this->defaults.lookfrom = defaults.lookfrom;
+      this->defaults.lookat = defaults.lookat;
+      this->defaults.vup = defaults.vup;
+      this->defaults.vfov = defaults.vfov;
+      this->defaults.denoiser = camera.denoise_settings.type;
+      camera.show_progress = false;
+   }
+
+   /**
+    * @brief Answers the connections to `port` until the process is stopped
+    * @return 1 if the port is not available
+    */
+   int run(int port)
+   {
+      Socket server;
+      if (!server.listen(port, 64))
+      {
+         std::cerr << "Cannot listen on port " << port << std::endl;
+         return 1;
+      }
+      std::cout << "Render server listening on port " << port << ", rendering with "
+                << render_method_names[(int)method] << ", scene " << hash_string(default_scene->hash) << std::endl;
+
+      std::thread(&Render_server::render_loop, this).detach();
+      while (true)
+      {
+         Socket connection = server.accept();
+         if (!connection.is_open())
+            continue;
+         connection.set_timeout(settings.timeout_ms);
+
+         {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (connections >= settings.max_connections)
+            {
+               rejected++;
+               send_http_text(connection, 503, "Too many connections\n");
+               continue;
+            }
+            connections++;
+         }
+         std::thread(&Render_server::serve_connection, this, std::move(connection)).detach();
+      }
+   }
+
+ private:
+   // The parameters of a `/render` request
+   struct Render_request
+   {
+      std::shared_ptr<Cached_scene> scene;
+      int width = 0, height = 0, samples = 1, max_depth = 1;
+      uint32_t seed = 0;
+      Point3 lookfrom, lookat;
+      Vec3 vup;
+      double vfov = 35.0;
+      Denoiser_type denoiser = Denoiser_type::None;
+
+      // Equal for the requests of the same image, which share a render
+      std::string key() const
+      {
+         std::ostringstream key;
+         key << std::setprecision(17) << scene->hash << ' ' << width << ' ' << height << ' ' << samples << ' '
+             << max_depth << ' ' << seed << ' ' << lookfrom << ' ' << lookat << ' ' << vup << ' ' << vfov << ' '
+             << (int)denoiser;
+         return key.str();
+      }
+   };
+
+   // A render, shared by the connections of its identical requests
+   struct Server_render
+   {
+      Render_request request;
+      std::string key;
+      std::chrono::steady_clock::time_point queued;
+
+      // Of the render thread only
+      Accumulation_buffer accumulation;
+      int done = 0; // Samples per pixel rendered
+
+      // Shared, with the lock held
+      std::shared_ptr<const std::vector<unsigned char>> image; // RGB of the last pass
+      int image_samples = 0;
+      int version = 0; // Images published so far
+      int viewers = 0; // Connections waiting for the images, the render is dropped when none is left
+      bool finished = false, failed = false;
+   };
+
+   Camera &camera;
+   const Render_method method;
+   const Server_settings settings;
+   Render_request defaults;
+   Scene_cache cache;
+   std::shared_ptr<Cached_scene> default_scene;
+
+   // Shared between the render thread and the connections
+   std::mutex mutex;
+   std::condition_variable changed; // Signaled when a render is queued, published or left by its viewers
+   std::deque<std::shared_ptr<Server_render>> queue;                       // Waiting to join the batch
+   std::unordered_map<std::string, std::shared_ptr<Server_render>> renders; // Queued or rendering, by key
+   int connections = 0;
+   size_t upload_bytes = 0; // Of the bodies being received or loaded
+   int batch_size = 0;
+   Latency_window request_latency, first_image_latency;
+   unsigned long long completed = 0, failed = 0, rejected = 0, cancelled = 0, invalid = 0, shared = 0;
+   unsigned long long passes = 0, rays = 0;
+
+   //==============================================================================
+   // CONNECTIONS
+   //==============================================================================
+
+   void serve_connection(Socket socket)
+   {
+      // Only the scenes have a body, counted in the uploads until the connection is done
+      size_t reserved = 0;
+      auto accept_body = [&](const Http_request &request, size_t size)
+      {
+         if (request.path != "/scenes" || request.method != "POST" || size > settings.max_scene_bytes)
+            return 413;
+         std::lock_guard<std::mutex> lock(mutex);
+         if (upload_bytes + size > settings.max_upload_bytes)
+            return 503;
+         upload_bytes += size;
+         reserved = size;
+         return 0;
+      };
+
+      Http_request request;
+      int status = receive_http_request(socket, request, accept_body);
+      if (status > 0)
+         send_http_text(socket, status, std::string(http_reason(status)) + "\n");
+      else if (status == 0)
+         route(socket, request);
+
+      std::lock_guard<std::mutex> lock(mutex);
+      connections--;
+      upload_bytes -= reserved;
+   }
+
+   void route(Socket &socket, Http_request &request)
+   {
+      const bool get = request.method == "GET";
+      if (request.path == "/render" && get)
+         render(socket, request);
+      else if (request.path == "/scenes" && request.method == "POST")
+         upload_scene(socket, request);
+      else if (request.path == "/scenes" && get)
+         list_scenes(socket);
+      else if (request.path == "/metrics" && get)
+      {
+         std::string text = metrics();
+         send_http_response(socket, 200, "text/plain; version=0.0.4", text.data(), text.size());
+      }
+      else if (request.path == "/" && get)
+         send_page(socket, request);
+      else if (request.path == "/render" || request.path == "/scenes" || request.path == "/metrics" ||
+               request.path == "/")
+         send_http_text(socket, 405, "Method not allowed\n");
+      else
+         send_http_text(socket, 404, "Unknown path, see render_server.h for the API\n");
+   }
+
+   void upload_scene(Socket &socket, Http_request &request)
+   {
+      auto start = std::chrono::steady_clock::now();
+      const uint64_t hash = fnv1a_hash(request.body.data(), request.body.size());
+      if (cache.find(hash) != nullptr)
+      {
+         send_http_text(socket, 200, hash_string(hash) + "\n");
+         return;
+      }
+
+      // Loaded and built here, while the render thread goes on
+      auto scene = std::make_shared<Cached_scene>();
+      scene->hash = hash;
+      scene->bytes = request.body.size();
+      scene->file.reset(new Scene_file());
+      if (!scene->file->load_memory(std::move(request.body), "uploaded scene " + hash_string(hash)))
+      {
+         send_http_text(socket, 400, "Invalid scene, see the log of the server\n");
+         return;
+      }
+      scene->bvh = &scene->file->get_bvh();
+      scene = cache.insert(scene);
+
+      const auto elapsed = std::chrono::steady_clock::now() - start;
+      const double load_ms = std::chrono::duration<double, std::milli>(elapsed).count();
+      log("Scene " + hash_string(hash) + " loaded, " + std::to_string(scene->bvh->build_stats().primitive_count) +
+          " objects in " + std::to_string((int)load_ms) + " ms");
+      send_http_text(socket, 201, hash_string(hash) + "\n");
+   }
+
+   void list_scenes(Socket &socket)
+   {
+      std::ostringstream text;
+      for (const std::shared_ptr<Cached_scene> &scene : cache.list())
+         text << hash_string(scene->hash) << ' ' << scene->bvh->build_stats().primitive_count << ' ' << scene->bytes
+              << (scene == default_scene ? " default" : "") << '\n';
+      send_http_text(socket, 200, text.str());
+   }
+
+   // A page showing the stream of `/render`, with the parameters of the page
+   void send_page(Socket &socket, const Http_request &request)
+   {
+      std::string query;
+      for (const auto &parameter : request.query)
+         query += (query.empty() ? "?" : "&amp;") + url_encode(parameter.first) + "=" + url_encode(parameter.second);
+      std::string page = "<!DOCTYPE html>\n<html><head><title>302 ray tracer</title></head>\n"
+                         "<body style=\"margin:0;background:#000\"><img src=\"/render" +
+                         query + "\" style=\"display:block;margin:auto;max-width:100%\"></body></html>\n";
+      send_http_response(socket, 200, "text/html; charset=utf-8", page.data(), page.size());
+   }
+
+   /**
+    * @brief The request of the parameters of a `/render`, on the defaults of the command line
+    * @return 0, or the status of the error to answer with the reason in `error`
+    */
+   int parse_render(const Http_request &http, Render_request &request, bool &stream, std::string &error)
+   {
+      request = defaults;
+      request.scene = default_scene;
+      stream = true;
+
+      auto integer = [](const std::string &text, int min, int max, int &value)
+      {
+         char *end;
+         long long parsed = strtoll(text.c_str(), &end, 10);
+         value = (int)parsed;
+         return !text.empty() && *end == '\0' && parsed >= min && parsed <= max;
+      };
+
+      for (const auto &parameter : http.query)
+      {
+         const std::string &name = parameter.first, &value = parameter.second;
+         bool ok;
+         int number = 0;
+         if (name == "scene")
+         {
+            char *end;
+            uint64_t hash = strtoull(value.c_str(), &end, 16);
+            ok = !value.empty() && *end == '\0' && (request.scene = cache.find(hash)) != nullptr;
+            if (!ok)
+            {
+               error = "unknown scene " + value + ", upload it with POST /scenes";
+               return 404;
+            }
+         }
+         else if (name == "width")
+            ok = integer(value, 1, settings.max_pixels, request.width);
+         else if (name == "height")
+            ok = integer(value, 1, settings.max_pixels, request.height);
+         else if (name == "samples")
+            ok = integer(value, 1, settings.max_samples, request.samples);
+         else if (name == "depth")
+            ok = integer(value, 1, 1024, request.max_depth);
+         else if (name == "seed")
+         {
+            char *end;
+            request.seed = (uint32_t)strtoul(value.c_str(), &end, 10);
+            ok = !value.empty() && *end == '\0';
+         }
+         else if (name == "lookfrom")
+            ok = parse_vec3(value, request.lookfrom);
+         else if (name == "lookat")
+            ok = parse_vec3(value, request.lookat);
+         else if (name == "vup")
+            ok = parse_vec3(value, request.vup);
+         else if (name == "vfov")
+         {
+            char *end;
+            request.vfov = strtod(value.c_str(), &end);
+            ok = !value.empty() && *end == '\0' && request.vfov > 0 && request.vfov < 180;
+         }
+         else if (name == "denoise")
+         {
+            ok = value == "none" || value == "atrous" || (value == "oidn" && denoise::oidn_available());
+            request.denoiser = value == "atrous" ? Denoiser_type::Atrous
+                               : value == "oidn" ? Denoiser_type::Oidn
+                                                 : Denoiser_type::None;
+         }
+         else if (name == "stream")
+         {
+            ok = integer(value, 0, 1, number);
+            stream = number == 1;
+         }
+         else
+         {
+            error = "unknown parameter " + name;
+            return 400;
+         }
+
+         if (!ok)
+         {
+            error = "invalid " + name + ": " + value;
+            return 400;
+         }
+      }
+
+      if ((long long)request.width * request.height > settings.max_pixels)
+      {
+         error = "more than " + std::to_string(settings.max_pixels) + " pixels";
+         return 400;
+      }
+      return 0;
+   }
+
+   // Queues the render of a request or joins the identical one, null if the queue is full, with the lock held
+   std::shared_ptr<Server_render> start_render(const Render_request &request)
+   {
+      const std::string key = request.key();
+      auto existing = renders.find(key);
+      if (existing != renders.end())
+      {
+         shared++;
+         existing->second->viewers++;
+         return existing->second;
+      }
+      if ((int)queue.size() >= settings.max_queue)
+         return nullptr;
+
+      auto render = std::make_shared<Server_render>();
+      render->request = request;
+      render->key = key;
+      render->queued = std::chrono::steady_clock::now();
+      render->viewers = 1;
+      renders[key] = render;
+      queue.push_back(render);
+      changed.notify_all();
+      return render;
+   }
+
+   void render(Socket &socket, const Http_request &http)
+   {
+      const auto start = std::chrono::steady_clock::now();
+      Render_request request;
+      bool stream;
+      std::string error;
+      if (int status = parse_render(http, request, stream, error))
+      {
+         {
+            std::lock_guard<std::mutex> lock(mutex);
+            invalid++;
+         }
+         send_http_text(socket, status, error + "\n");
+         return;
+      }
+
+      std::unique_lock<std::mutex> lock(mutex);
+      std::shared_ptr<Server_render> render = start_render(request);
+      if (render == nullptr)
+      {
+         rejected++;
+         lock.unlock();
+         send_http_text(socket, 503, "The queue is full, retry later\n");
+         return;
+      }
+
+      static const std::string boundary = "rtframe";
+      if (stream)
+      {
+         lock.unlock();
+         std::string head = "HTTP/1.1 200 OK\r\nContent-Type: multipart/x-mixed-replace; boundary=" + boundary +
+                            "\r\nCache-Control: no-cache\r\nConnection: close\r\n\r\n";
+         bool ok = socket.send_all(head.data(), head.size());
+         lock.lock();
+         if (!ok)
+            return leave(render);
+      }
+
+      // A slow client skips the images published while it received the previous one
+      int sent_version = 0;
+      double first_image_s = -1;
+      while (true)
+      {
+         changed.wait(lock, [&] { return render->finished || (stream && render->version > sent_version); });
+         if (render->failed)
+         {
+            failed++;
+            lock.unlock();
+            if (!stream)
+               send_http_text(socket, 500, "The render failed, see the log of the server\n");
+            lock.lock();
+            return leave(render);
+         }
+         if (render->version == sent_version)
+            break; // The last image was sent
+
+         std::shared_ptr<const std::vector<unsigned char>> image = render->image;
+         const int samples = render->image_samples;
+         sent_version = render->version;
+         const bool last = render->finished;
+         lock.unlock();
+
+         std::vector<unsigned char> png =
+             image_io::encode_png(request.width, request.height, image->data(), settings.png_level);
+         const std::string headers = "X-Samples: " + std::to_string(samples) + "\r\n";
+         bool ok;
+         if (stream)
+         {
+            std::string part = "--" + boundary + "\r\nContent-Type: image/png\r\nContent-Length: " +
+                               std::to_string(png.size()) + "\r\n" + headers + "\r\n";
+            ok = socket.send_all(part.data(), part.size()) && socket.send_all(png.data(), png.size()) &&
+                 socket.send_all("\r\n", 2);
+         }
+         else
+            ok = send_http_response(socket, 200, "image/png", png.data(), png.size(), headers);
+         if (first_image_s < 0)
+            first_image_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+         lock.lock();
+         if (!ok)
+            return leave(render);
+         if (last)
+            break;
+      }
+      lock.unlock();
+
+      bool ok = !stream || socket.send_all(("--" + boundary + "--\r\n").data(), boundary.size() + 6);
+      const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+      lock.lock();
+      if (ok)
+      {
+         completed++;
+         request_latency.add(seconds);
+         first_image_latency.add(first_image_s);
+      }
+      leave(render);
+      lock.unlock();
+
+      log("GET /render " + std::to_string(request.width) + "x" + std::to_string(request.height) + ", " +
+          std::to_string(request.samples) + " samples per pixel in " + std::to_string((int)(seconds * 1000)) + " ms");
+   }
+
+   // A connection no longer waits for the images of a render, with the lock held
+   void leave(const std::shared_ptr<Server_render> &render)
+   {
+      if (--render->viewers == 0 && !render->finished)
+      {
+         cancelled++;
+         changed.notify_all();
+      }
+   }
+
+   std::string metrics()
+   {
+      std::ostringstream out;
+      {
+         std::lock_guard<std::mutex> lock(mutex);
+         out << "# HELP rt_requests_total Render requests by result\n# TYPE rt_requests_total counter\n";
+         const std::pair<const char *, unsigned long long> results[] = {
+             {"completed", completed}, {"failed", failed},   {"rejected", rejected},
+             {"cancelled", cancelled}, {"invalid", invalid}, {"shared", shared}};
+         for (const auto &result : results)
+            out << "rt_requests_total{result=\"" << result.first << "\"} " << result.second << "\n";
+         out << "# HELP rt_queue_depth Requests waiting to join the batch\n# TYPE rt_queue_depth gauge\n"
+             << "rt_queue_depth " << queue.size() << "\n";
+         out << "# HELP rt_batch_size Renders of the current round\n# TYPE rt_batch_size gauge\n"
+             << "rt_batch_size " << batch_size << "\n";
+         out << "# TYPE rt_connections gauge\nrt_connections " << connections << "\n";
+         out << "# TYPE rt_passes_total counter\nrt_passes_total " << passes << "\n";
+         out << "# TYPE rt_rays_total counter\nrt_rays_total " << rays << "\n";
+         request_latency.write_metrics(out, "rt_request_seconds", "Time to send the whole response of a render");
+         first_image_latency.write_metrics(out, "rt_first_image_seconds", "Time to send the first image of a render");
+      }
+      cache.write_metrics(out);
+      return out.str();
+   }
+
+   void log(const std::string &line)
+   {
+      static std::mutex log_mutex;
+      std::lock_guard<std::mutex> lock(log_mutex);
+      std::cout << line << std::endl;
+   }
+
+   //==============================================================================
+   // RENDER THREAD
+   //==============================================================================
+
+   // Renders the batch round after round, forever
+   void render_loop()
+   {
+      std::vector<std::shared_ptr<Server_render>> batch;
+      std::shared_ptr<Cached_scene> uploaded; // Of the GPU context, held so that its address is not reused
+      Aov_buffers aovs;
+      std::vector<float> colors;
+
+      while (true)
+      {
+         {
+            std::unique_lock<std::mutex> lock(mutex);
+            auto dropped = [&](const std::shared_ptr<Server_render> &render)
+            {
+               if (render->viewers > 0 && !render->finished)
+                  return false;
+               finish(*render);
+               return true;
+            };
+            batch.erase(std::remove_if(batch.begin(), batch.end(), dropped), batch.end());
+            batch_size = (int)batch.size();
+            changed.wait(lock, [&] { return !batch.empty() || !queue.empty(); });
+
+            while ((int)batch.size() < settings.max_batch && !queue.empty())
+            {
+               if (!dropped(queue.front()))
+                  batch.push_back(queue.front());
+               queue.pop_front();
+            }
+            batch_size = (int)batch.size();
+         }
+
+         std::stable_sort(batch.begin(), batch.end(),
+                          [](const std::shared_ptr<Server_render> &a, const std::shared_ptr<Server_render> &b)
+                          {
+                             const Render_request &ra = a->request, &rb = b->request;
+                             return std::make_tuple(ra.scene.get(), ra.width, ra.height) <
+                                    std::make_tuple(rb.scene.get(), rb.width, rb.height);
+                          });
+         for (const std::shared_ptr<Server_render> &render : batch)
+            render_pass(*render, uploaded, aovs, colors);
+      }
+   }
+
+   // Renders the next pass of a render and publishes its image
+   void render_pass(Server_render &render, std::shared_ptr<Cached_scene> &uploaded, Aov_buffers &aovs,
+                    std::vector<float> &colors)
+   {
+      const Render_request &request = render.request;
+      const Bvh &scene = *request.scene->bvh;
+      if (uploaded != request.scene)
+      {
+         camera.invalidateSceneCUDA();
+         uploaded = request.scene;
+      }
+      if (camera.image_width != request.width || camera.image_height != request.height)
+         camera.setResolution(request.width, request.height);
+      camera.setView(request.lookfrom, request.lookat, request.vup, request.vfov);
+      camera.max_depth = request.max_depth;
+      RndGen::set_seed(request.seed);
+
+      const int n = std::min({std::max(1, render.done), settings.max_pass_samples, request.samples - render.done});
+      bool ok = camera.renderRegion(scene, method, 0, 0, request.width, request.height, render.done, n,
+                                    request.samples);
+      if (ok)
+      {
+         if (render.done == 0)
+            render.accumulation.resize(request.width, request.height);
+         render.accumulation.merge(camera.accumulation, n);
+         render.done += n;
+      }
+      const bool last = render.done >= request.samples;
+
+      auto image = std::make_shared<std::vector<unsigned char>>((size_t)request.width * request.height * 3);
+      if (ok)
+         render.accumulation.resolve(*image);
+      if (ok && last && request.denoiser != Denoiser_type::None)
+      {
+         // The merged sums are those of a CPU frame
+         const Denoiser_type type = camera.denoise_settings.type;
+         camera.denoise_settings.type = request.denoiser;
+         camera.accumulation = render.accumulation;
+         camera.renderAovs(scene, aovs);
+         camera.denoiseFrame(aovs, Render_method::Parallel, *image, colors);
+         camera.denoise_settings.type = type;
+      }
+
+      std::lock_guard<std::mutex> lock(mutex);
+      passes++;
+      rays += camera.stats.total().rays;
+      if (ok)
+      {
+         render.image = std::move(image);
+         render.image_samples = render.done;
+         render.version++;
+      }
+      if (!ok || last)
+      {
+         render.failed = !ok;
+         finish(render);
+      }
+      changed.notify_all();
+   }
+
+   // The later identical requests start a new render, with the lock held
+   void finish(Server_render &render)
+   {
+      render.finished = true;
+      auto entry = renders.find(render.key);
+      if (entry != renders.end() && entry->second.get() == &render)
+         renders.erase(entry);
+   }
+};
+
+/**
+ * @brief Answers the render requests of the HTTP clients connecting to `port` until the process is stopped
+ * See `Render_server`, the arguments being those of its constructor.
+ * @return 1 if the port is not available
+ */
+inline int run_render_server(int port, Camera &camera, Render_method method, const Bvh &scene,
+                             const Render_job &defaults, const Server_settings &settings)
+{
+   Render_server server(camera, method, scene, defaults, settings);
+   return server.run(port);
+}
@@ -0,0 +1,217 @@
+/**
+ * @file render_stats.h
+ * @brief Per-thread ray statistics, merged into a per-frame report.
+ *
+ * Counting the rays with a single shared atomic makes every thread write to
+ * the same cache line for every bounce. Instead, each render thread owns a
+ * `Thread_stats` shard, padded to a full cache line so that two shards never
+ * share one, and increments it with plain (non-atomic) operations. The shards
+ * are only merged once the frame is done, by `Render_stats::total`.
+ *
+ * `Ray_counters` is a plain struct so that the CUDA renderer can fill the
+ * same counters on the device and hand them back to the host.
+ */
+#pragma once
+
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <vector>
+
+/**
+ * @brief The raw counters, shared between the CPU and CUDA renderers
+ */
+struct Ray_counters
+{
+   static const int HISTOGRAM_SIZE = 32; // Bounce depths above this are counted in the last bucket
+
+   unsigned long long rays;                            // All the rays traced (primary + secondary)
+   unsigned long long primary_rays;                    // Rays leaving the camera
+   unsigned long long secondary_rays;                  // Rays scattered by a material
+   unsigned long long hits;                            // Rays that hit an object
+   unsigned long long misses;                          // Rays that escaped to the background
+   unsigned long long depth_histogram[HISTOGRAM_SIZE]; // Number of rays traced at each bounce depth
+};
+
+/**
+ * @brief The counters of one render thread, alone on their cache line(s)
+ */
+struct alignas(64) Thread_stats : public Ray_counters
+{
+   Thread_stats() : Ray_counters{} {}
+
+   /**
+    * @brief Records a traced ray
+    * @param bounce 0 for a primary ray, then incremented at each scattering
+    * @param hit Whether the ray hit an object
+    */
+   inline void count_ray(int bounce, bool hit)
+   {
+      rays++;
+      if (bounce == 0)
+         primary_rays++;
+      else
+         secondary_rays++;
+
+      if (hit)
+         hits++;
+      else
+         misses++;
+
+      depth_histogram[std::min(bounce, HISTOGRAM_SIZE - 1)]++;
+   }
+
+   void merge(const Ray_counters &other)
+   {
+      rays += other.rays;
+      primary_rays += other.primary_rays;
+      secondary_rays += other.secondary_rays;
+      hits += other.hits;
+      misses += other.misses;
+      for (int i = 0; i < HISTOGRAM_SIZE; i++)
+         depth_histogram[i] += other.depth_histogram[i];
+   }
+};
+
+/**
+ * @class Render_stats
+ * @brief The set of per-thread shards for one frame
+ */
+class Render_stats
+{
+ public:
+   double render_ms = 0.0; // Duration of the last render, set by the camera
+
+   // Clears the counters and prepares one shard per render thread
+   void reset(int n_threads)
+   {
+      shards.assign(std::max(1, n_threads), Thread_stats());
+      render_ms = 0.0;
+      sample_histogram.clear();
+      pixel_count = 0;
+   }
+
+   // The shard owned by the given thread, only this thread may write to it
+   Thread_stats &shard(int thread_index) { return shards[thread_index]; }
+
+   // Adds counters coming from another source (e.g. the GPU) to the first shard
+   void add(const Ray_counters &counters) { shards[0].merge(counters); }
+
+   // Merges all the shards, to be called once the frame is done
+   Thread_stats total() const
+   {
+      Thread_stats t;
+      for (const auto &s : shards)
+         t.merge(s);
+      return t;
+   }
+
+   unsigned long long rays() const { return total().rays; }
+
+   /**
+    * @brief Records the number of samples of each pixel of the frame, summarized in the report
+    * Pixels are counted in power-of-two buckets: [1, 2), [2, 4), [4, 8)...
+    */
+   void record_samples_per_pixel(const std::vector<int> &counts)
+   {
+      sample_histogram.clear();
+      pixel_count = counts.size();
+      min_samples = pixel_count ? counts[0] : 0;
+      max_samples = min_samples;
+      total_samples = 0;
+
+      for (int n : counts)
+      {
+         min_samples = std::min(min_samples, n);
+         max_samples = std::max(max_samples, n);
+         total_samples += n;
+
+         if (n <= 0)
+            continue;
+
+         size_t bucket = 0;
+         while ((2ull << bucket) <= (unsigned long long)n)
+            bucket++;
+         if (sample_histogram.size() <= bucket)
+            sample_histogram.resize(bucket + 1, 0);
+         sample_histogram[bucket]++;
+      }
+   }
+
+   void print_report(std::ostream &out) const
+   {
+      Thread_stats t = total();
+
+      auto percent = [&](unsigned long long n) { return t.rays ? 100.0 * n / t.rays : 0.0; };
+
+      out << "Rays traced: " << t.rays << " (" << t.primary_rays << " primary, " << t.secondary_rays << " secondary)"
+          << std::endl;
+      out << "Hits: " << t.hits << " (" << std::fixed << std::setprecision(1) << percent(t.hits) << " %), misses: "
+          << t.misses << " (" << percent(t.misses) << " %)" << std::endl;
+
+      if (render_ms > 0)
+         out << "Throughput: " << std::setprecision(2) << t.rays / (render_ms * 1000.0) << " Mrays/s" << std::endl;
+
+      // Only show the depths that were reached
+      int last = 0;
+      for (int i = 0; i < Ray_counters::HISTOGRAM_SIZE; i++)
+         if (t.depth_histogram[i] > 0)
+            last = i;
+
+      out << "Rays per bounce depth:" << std::endl;
+      for (int i = 0; i <= last && t.rays > 0; i++)
+      {
+         const int barWidth = 40;
+         int len = t.depth_histogram[0] ? (int)(barWidth * t.depth_histogram[i] / t.depth_histogram[0]) : 0;
+
+         out << std::setw(5) << i << (i == Ray_counters::HISTOGRAM_SIZE - 1 ? "+" : " ") << std::setw(16)
+             << t.depth_histogram[i] << " " << std::setprecision(1) << std::setw(5) << percent(t.depth_histogram[i])
+             << " % ";
+         for (int j = 0; j < len; j++)
+            out << "█";
+         out << std::endl;
+      }
+
+      if (pixel_count == 0)
+         return;
+
+      out << "Samples per pixel: " << std::setprecision(1) << (double)total_samples / pixel_count << " on average (min "
+          << min_samples << ", max " << max_samples << ")" << std::endl;
+
+      // The distribution is only interesting when the pixels did not all get the same number of samples
+      if (min_samples == max_samples)
+         return;
+
+      const int barWidth = 40;
+      unsigned long long largest = *std::max_element(sample_histogram.begin(), sample_histogram.end());
+
+      for (size_t i = 0; i < sample_histogram.size(); i++)
+      {
+         if (sample_histogram[i] == 0)
+            continue;
+
+         int len = (int)(barWidth * sample_histogram[i] / largest);
+         double share = 100.0 * sample_histogram[i] / pixel_count;
+
+         std::ostringstream range;
+         range << (1ull << i);
+         if (i > 0)
+            range << "-" << (2ull << i) - 1;
+         out << std::setw(12) << range.str() << std::setw(16) << sample_histogram[i] << " " << std::setw(5) << share
+             << " % ";
+         for (int j = 0; j < len; j++)
+            out << "█";
+         out << std::endl;
+      }
+   }
+
+ private:
+   std::vector<Thread_stats> shards = std::vector<Thread_stats>(1);
+
+   // Distribution of the samples per pixel, see `record_samples_per_pixel`
+   std::vector<unsigned long long> sample_histogram;
+   size_t pixel_count = 0;
+   int min_samples = 0, max_samples = 0;
+   unsigned long long total_samples = 0;
+};
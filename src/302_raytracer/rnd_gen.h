@@ -3,20 +3,170 @@
  * @brief A random number generator utility class.
  *
  * This class provides static methods to generate random numbers, including uniform and normal distributions.
- * It uses the Mersenne Twister engine for random number generation and allows setting a seed for reproducibility.
  * The random number generator is thread-local to ensure thread safety in multi-threaded applications.
+ *
+ * **Engines:**
+ * The engine is selected at compile time with the `RNG_ENGINE` CMake option:
+ * - `Pcg32` (default): 16 bytes of state, one 64-bit multiply per number
+ * - `Xoshiro256pp`: 32 bytes of state, 64-bit output
+ * - `Mt19937_engine`: the Mersenne Twister (2.5 KB of state), kept as a reference
+ *
+ * Any type providing `seed(seed, stream)`, `next_u32()` and `next_double()` can be plugged in.
+ *
+ * **Deterministic rendering:**
+ * Instead of letting each thread draw from its own long sequence, the renderers call
+ * `seed_sample(pixel, sample)` before each sample. The engine is then reseeded from a hash
+ * of the global seed, the pixel and the sample index, so that the image does not depend on
+ * the number of threads nor on the order in which pixels are rendered.
  */
+#include "trace.h"
+
+#include <cstdint>
 #include <random>
 
 #pragma once
 using namespace std;
 
+/**
+ * @brief PCG32 generator (XSH-RR variant), see https://www.pcg-random.org
+ */
+class Pcg32
+{
+ public:
+   using result_type = uint32_t;
+
+   Pcg32(uint64_t seed = 0x853c49e6748fea9bULL, uint64_t stream = 0xda3e39cb94b95bdbULL) { this->seed(seed, stream); }
+
+   void seed(uint64_t seed, uint64_t stream = 0xda3e39cb94b95bdbULL)
+   {
+      state = 0;
+      inc = (stream << 1u) | 1u;
+      next_u32();
+      state += seed;
+      next_u32();
+   }
+
+   inline uint32_t next_u32()
+   {
+      uint64_t old = state;
+      state = old * 6364136223846793005ULL + inc;
+      uint32_t xorshifted = (uint32_t)(((old >> 18u) ^ old) >> 27u);
+      uint32_t rot = (uint32_t)(old >> 59u);
+      return (xorshifted >> rot) | (xorshifted << ((-rot) & 31));
+   }
+
+   // Returns a real in [0,1) with 32 bits of resolution
+   inline double next_double() { return next_u32() * 0x1p-32; }
+
+   // So that the engine can be used with the standard distributions
+   static constexpr result_type min() { return 0; }
+   static constexpr result_type max() { return UINT32_MAX; }
+   result_type operator()() { return next_u32(); }
+
+ private:
+   uint64_t state, inc;
+};
+
+/**
+ * @brief xoshiro256++ generator, see https://prng.di.unimi.it
+ */
+class Xoshiro256pp
+{
+ public:
+   using result_type = uint64_t;
+
+   Xoshiro256pp(uint64_t seed = 0x853c49e6748fea9bULL, uint64_t stream = 0) { this->seed(seed, stream); }
+
+   void seed(uint64_t seed, uint64_t stream = 0)
+   {
+      // The state is expanded with splitmix64, as recommended by the authors
+      uint64_t x = seed ^ (stream * 0x9e3779b97f4a7c15ULL);
+      for (auto &word : s)
+      {
+         uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+         z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+         z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+         word = z ^ (z >> 31);
+      }
+   }
+
+   inline uint64_t next_u64()
+   {
+      const uint64_t result = rotl(s[0] + s[3], 23) + s[0];
+      const uint64_t t = s[1] << 17;
+
+      s[2] ^= s[0];
+      s[3] ^= s[1];
+      s[1] ^= s[2];
+      s[0] ^= s[3];
+      s[2] ^= t;
+      s[3] = rotl(s[3], 45);
+
+      return result;
+   }
+
+   inline uint32_t next_u32() { return (uint32_t)(next_u64() >> 32); }
+
+   // Returns a real in [0,1) with 53 bits of resolution
+   inline double next_double() { return (next_u64() >> 11) * 0x1p-53; }
+
+   static constexpr result_type min() { return 0; }
+   static constexpr result_type max() { return UINT64_MAX; }
+   result_type operator()() { return next_u64(); }
+
+ private:
+   uint64_t s[4];
+
+   static inline uint64_t rotl(const uint64_t x, int k) { return (x << k) | (x >> (64 - k)); }
+};
+
+/**
+ * @brief The original Mersenne Twister, wrapped into the engine interface
+ */
+class Mt19937_engine
+{
+ public:
+   using result_type = uint32_t;
+
+   Mt19937_engine(uint64_t seed = 5489u, uint64_t stream = 0) { this->seed(seed, stream); }
+
+   void seed(uint64_t seed, uint64_t stream = 0) { gen.seed((uint32_t)(seed ^ (stream * 0x9e3779b97f4a7c15ULL))); }
+
+   inline uint32_t next_u32() { return gen(); }
+
+   inline double next_double() { return distribution(gen); }
+
+   static constexpr result_type min() { return 0; }
+   static constexpr result_type max() { return UINT32_MAX; }
+   result_type operator()() { return gen(); }
+
+ private:
+   std::mt19937 gen;
+   std::uniform_real_distribution<double> distribution{0.0, 1.0};
+};
+
 class RndGen
 {
  public:
+#if defined(RNG_ENGINE_XOSHIRO256PP)
+   using Engine = Xoshiro256pp;
+#elif defined(RNG_ENGINE_MT19937)
+   using Engine = Mt19937_engine;
+#else
+   using Engine = Pcg32;
+#endif
+
    RndGen() = delete; // Prevent instantiation
 
-   static void set_seed(unsigned int seed) { get_rng() = std::mt19937(seed); }
+   // Sets the global seed used by `seed_sample`, and reseeds the engine of the calling thread
+   static void set_seed(unsigned int seed)
+   {
+      global_seed() = seed;
+      get_rng().seed(seed);
+   }
+
+   // The global seed, also used for the random states of the GPU renderer
+   static uint64_t get_seed() { return global_seed(); }
 
    static unsigned int get_random_seed()
    {
@@ -24,11 +174,32 @@ class RndGen
       return seed;
    }
 
+   /**
+    * @brief Reseeds the engine of the calling thread for the given sample of a pixel
+    *
+    * The seed only depends on the global seed, the pixel and the sample index
+    * (counter-based seeding), so renders are reproducible whatever the number of
+    * threads or the rendering order.
+    */
+   static void seed_sample(uint64_t pixel_index, uint64_t sample_index)
+   {
+      TRACE_STAGE(Trace_stage::Rng);
+      get_rng().seed(hash(global_seed() ^ hash(pixel_index)), sample_index);
+   }
+
+   /**
+    * @brief The engine of the calling thread, to suspend a random sequence and resume it later
+    * The wavefront renderer keeps one engine per path in flight, and swaps it in before
+    * working on the path, so that each path draws the same numbers as in a one-path-at-a-time render.
+    */
+   static Engine save_state() { return get_rng(); }
+   static void restore_state(const Engine &state) { get_rng() = state; }
+
    static double random_double()
    {
+      TRACE_STAGE(Trace_stage::Rng);
       // Returns a random real in [0,1).
-      static thread_local std::uniform_real_distribution<double> distribution(0.0, 1.0);
-      return distribution(get_rng());
+      return get_rng().next_double();
    }
 
    static double random_normal()
@@ -47,10 +218,28 @@ class RndGen
       return dis(get_rng());
    }
 
+   // The splitmix64 finalizer, a cheap and good 64-bit mixing function
+   static inline uint64_t hash(uint64_t x)
+   {
+      x += 0x9e3779b97f4a7c15ULL;
+      x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+      x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+      return x ^ (x >> 31);
+   }
+
+   // Maps a hash to a real in [0,1), without touching the state of the engine
+   static inline double hash_to_double(uint64_t x) { return (hash(x) >> 11) * 0x1p-53; }
+
  private:
-   static std::mt19937 &get_rng()
+   static uint64_t &global_seed()
+   {
+      static uint64_t seed = 0;
+      return seed;
+   }
+
+   static Engine &get_rng()
    {
-      static thread_local std::mt19937 gen(std::random_device{}());
+      static thread_local Engine gen(std::random_device{}());
       return gen;
    }
-};
\ No newline at end of file
+};
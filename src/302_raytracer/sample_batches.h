@@ -0,0 +1,131 @@
+/**
+ * @file sample_batches.h
+ * @brief Sharing the samples of a frame between devices of different speeds.
+ *
+ * The samples per pixel of a frame are cut into batches that the devices (the CPU
+ * threads, one or several GPUs) take from a shared counter, each at its own pace,
+ * so that the split follows their throughputs without knowing them in advance.
+ *
+ * Near the end of the frame, a slow device taking the last batch would delay the
+ * others. The time of the last batch of each device is therefore measured, and a
+ * device does not take a batch when the other active devices together would render
+ * all the remaining batches before it finished that one.
+ */
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+/**
+ * @class Sample_batches
+ * @brief The batches of samples [first_sample, first_sample + n_samples) of a frame, taken by the devices
+ *
+ * The devices are numbered from 0, each one is driven by a single thread. A device whose batch fails
+ * gives it back for the others and takes no more batches.
+ */
+class Sample_batches
+{
+ public:
+   Sample_batches(int first_sample, int n_samples, int n_batches, int n_devices)
+       : first_sample(first_sample), n_samples(n_samples), devices(n_devices)
+   {
+      n_batches = std::max(1, std::min(n_batches, n_samples));
+      batch_size = std::max(1, (n_samples + n_batches - 1) / n_batches);
+      this->n_batches = (n_samples + batch_size - 1) / batch_size;
+   }
+
+   /**
+    * @brief Renders batches on `device` with `render(first_sample, n_samples)` until the device should stop
+    * Called again after the other devices are done, renders the batches they left, e.g. after a failure.
+    * @return false if a batch failed
+    */
+   bool run(int device, const std::function<bool(int, int)> &render)
+   {
+      int batch;
+      while ((batch = take(device)) >= 0)
+      {
+         const int first = first_sample + batch * batch_size;
+         const int n = std::min(batch_size, first_sample + n_samples - first);
+
+         auto start_time = std::chrono::high_resolution_clock::now();
+         bool ok = render(first, n);
+         auto end_time = std::chrono::high_resolution_clock::now();
+
+         std::lock_guard<std::mutex> lock(mutex);
+         Device &d = devices[device];
+         if (!ok)
+         {
+            returned.push_back(batch);
+            d.active = false;
+            d.failed = true;
+            return false;
+         }
+         d.batch_ms = std::chrono::duration<double, std::milli>(end_time - start_time).count();
+         d.busy_ms += d.batch_ms;
+         d.samples += n;
+         d.batches++;
+      }
+      return true;
+   }
+
+   bool failed(int device) const { return devices[device].failed; }
+
+   // Samples per pixel rendered by a device
+   int samples(int device) const { return devices[device].samples; }
+
+   // Batches rendered by a device, and the time spent on them
+   int batches(int device) const { return devices[device].batches; }
+   double busy_ms(int device) const { return devices[device].busy_ms; }
+
+ private:
+   struct Device
+   {
+      double batch_ms = 0; // Time of the last batch, 0 before the first one
+      double busy_ms = 0;  // Time of all the batches
+      int samples = 0, batches = 0;
+      bool active = true; // Still takes batches
+      bool failed = false;
+   };
+
+   const int first_sample, n_samples;
+   int batch_size, n_batches;
+
+   std::mutex mutex;
+   int next_batch = 0;
+   std::vector<int> returned; // Batches that failed, for the other devices
+   std::vector<Device> devices;
+
+   // The next batch of a device, -1 when it should stop
+   int take(int device)
+   {
+      std::lock_guard<std::mutex> lock(mutex);
+      Device &d = devices[device];
+      if (d.failed)
+         return -1;
+
+      if (!returned.empty())
+      {
+         int batch = returned.back();
+         returned.pop_back();
+         return batch;
+      }
+
+      // Batches per ms of the other devices, for those that have finished a batch
+      double others_rate = 0;
+      for (const Device &other : devices)
+         if (&other != &d && other.active && other.batch_ms > 0)
+            others_rate += 1 / other.batch_ms;
+
+      const int remaining = n_batches - next_batch;
+      if (remaining == 0 || (others_rate > 0 && d.batch_ms > remaining / others_rate))
+      {
+         d.active = false;
+         return -1;
+      }
+      d.active = true;
+      return next_batch++;
+   }
+};
@@ -0,0 +1,96 @@
+/**
+ * @class Pixel_sampler
+ * @brief Generates the sub-pixel offsets used to jitter the camera rays.
+ *
+ * Purely random offsets tend to clump, leaving parts of the pixel unsampled, so
+ * more samples are needed to reach a given noise level. This class offers better
+ * distributed alternatives:
+ *
+ * - `Sampler_type::Random`: independent uniform offsets (the original behaviour)
+ * - `Sampler_type::Stratified`: the pixel is cut into a `n x n` grid, with one
+ *   jittered sample per cell. Samples beyond `n * n` fall back to random offsets.
+ * - `Sampler_type::R2`: the R2 low-discrepancy sequence (Roberts, 2018), based on
+ *   the plastic number. It is well distributed for any number of samples, which
+ *   makes it suited to progressive rendering.
+ *
+ * To decorrelate neighbouring pixels, the stratified and R2 patterns are shifted
+ * by a per-pixel random offset (Cranley-Patterson rotation) derived from a hash of
+ * the global seed and the pixel index, so the pattern does not depend on the engine
+ * state but changes with `--seed`.
+ */
+#pragma once
+
+#include "rnd_gen.h"
+
+#include <algorithm>
+#include <cmath>
+
+enum class Sampler_type
+{
+   Random,
+   Stratified,
+   R2
+};
+
+class Pixel_sampler
+{
+ public:
+   /**
+    * @param type The sampling pattern
+    * @param pixel_index Index of the pixel in the image, used for the per-pixel rotation
+    * @param samples_per_pixel Number of samples planned for the pixel, sets the stratification grid
+    */
+   Pixel_sampler(Sampler_type type, uint64_t pixel_index, int samples_per_pixel) : type(type)
+   {
+      const uint64_t key = RndGen::hash(RndGen::get_seed());
+      rotation_x = RndGen::hash_to_double(key ^ (2 * pixel_index));
+      rotation_y = RndGen::hash_to_double(key ^ (2 * pixel_index + 1));
+      strata = std::max(1, (int)std::sqrt((double)samples_per_pixel));
+   }
+
+   /**
+    * @brief Offsets for the given sample, in the range [-0.5, 0.5)
+    * The engine of the calling thread must have been seeded for this sample beforehand.
+    */
+   inline void offset(int sample_index, double &offset_x, double &offset_y) const
+   {
+      double u, v;
+
+      switch (type)
+      {
+      case Sampler_type::R2:
+      {
+         // 1/g and 1/g^2, where g = 1.32471795724474602596 is the plastic number
+         const double a1 = 0.7548776662466927600;
+         const double a2 = 0.5698402909980532659;
+         u = wrap(rotation_x + a1 * sample_index);
+         v = wrap(rotation_y + a2 * sample_index);
+         break;
+      }
+      case Sampler_type::Stratified:
+         if (sample_index < strata * strata)
+         {
+            int cell_x = sample_index % strata;
+            int cell_y = sample_index / strata;
+            u = wrap(rotation_x + (cell_x + RndGen::random_double()) / strata);
+            v = wrap(rotation_y + (cell_y + RndGen::random_double()) / strata);
+            break;
+         }
+         [[fallthrough]];
+      default:
+         u = RndGen::random_double();
+         v = RndGen::random_double();
+         break;
+      }
+
+      offset_x = u - 0.5;
+      offset_y = v - 0.5;
+   }
+
+ private:
+   Sampler_type type;
+   double rotation_x, rotation_y;
+   int strata;
+
+   static inline double wrap(double x) { return x - std::floor(x); }
+};
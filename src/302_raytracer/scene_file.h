@@ -0,0 +1,762 @@
+/**
+ * @file scene_file.h
+ * @brief Scenes of spheres loaded from files, a compact binary format mapped in memory and a text format
+ *
+ * Building a scene in code allocates one `Sphere` per object, then the `Bvh` copies
+ * them into its leaves: a million spheres take seconds before the first ray. The
+ * binary format instead stores the spheres as they are traced, so that loading it
+ * is mapping the file and pointing a `Sphere_soa` and a `Bvh` to its arrays.
+ *
+ * **Binary format** (little-endian, each section starting on a 64-byte boundary):
+ * | Section       | Content                                                                 |
+ * |---------------|-------------------------------------------------------------------------|
+ * | Header        | `Scene_file_header`                                                     |
+ * | Sphere arrays | cx, cy, cz, radius, radius², as `real`, then the material ids as int32, |
+ * |               | `padded_spheres` entries each, in the leaf order of the hierarchy       |
+ * | Materials     | `Scene_file_material` each                                              |
+ * | Hierarchy     | The `Bvh_node`s, optional                                               |
+ *
+ * The file is used in place when it was written with the same `real` and `Bvh_node`
+ * layout as the program. Otherwise its spheres are converted and the hierarchy is
+ * rebuilt, which is slower but gives the same image.
+ *
+ * **Text format**, to write scenes by hand or from a script, one statement per line,
+ * the text after a `#` being ignored:
+ *
+ *     material <name> lambertian|constant|normals <r> <g> <b>
+ *     sphere <x> <y> <z> <radius> <material name>
+ *
+ * The numbers are finite and the radii not negative. A material must be declared before
+ * the spheres that use it. `Scene_file::save` converts a text scene (or any scene made of
+ * spheres) to the binary format.
+ */
+#pragma once
+
+#include "bvh.h"
+#include "hittable_list.h"
+#include "material.h"
+#include "sphere_soa.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN // Without the old winsock.h, which conflicts with the winsock2.h of distributed.h
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/**
+ * @class Mapped_file
+ * @brief Read-only memory mapping of a whole file
+ */
+class Mapped_file
+{
+ public:
+   Mapped_file() {}
+   ~Mapped_file() { close(); }
+
+   Mapped_file(const Mapped_file &) = delete;
+   Mapped_file &operator=(const Mapped_file &) = delete;
+
+   bool open(const std::string &path)
+   {
+      close();
+#ifdef _WIN32
+      HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                                FILE_ATTRIBUTE_NORMAL, nullptr);
+      if (file == INVALID_HANDLE_VALUE)
+         return false;
+      LARGE_INTEGER file_size;
+      if (GetFileSizeEx(file, &file_size) && file_size.QuadPart > 0)
+      {
+         mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+         if (mapping != nullptr)
+            bytes = static_cast<const unsigned char *>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+         n_bytes = bytes != nullptr ? (size_t)file_size.QuadPart : 0;
+      }
+      CloseHandle(file);
+#else
+      int fd = ::open(path.c_str(), O_RDONLY);
+      if (fd < 0)
+         return false;
+      struct stat info;
+      if (fstat(fd, &info) == 0 && info.st_size > 0)
+      {
+         void *address = mmap(nullptr, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+         if (address != MAP_FAILED)
+         {
+            bytes = static_cast<const unsigned char *>(address);
+            n_bytes = (size_t)info.st_size;
+         }
+      }
+      ::close(fd); // The mapping stays valid
+#endif
+      return bytes != nullptr;
+   }
+
+   void close()
+   {
+#ifdef _WIN32
+      if (bytes != nullptr)
+         UnmapViewOfFile(bytes);
+      if (mapping != nullptr)
+         CloseHandle(mapping);
+      mapping = nullptr;
+#else
+      if (bytes != nullptr)
+         munmap(const_cast<unsigned char *>(bytes), n_bytes);
+#endif
+      bytes = nullptr;
+      n_bytes = 0;
+   }
+
+   const unsigned char *data() const { return bytes; }
+   size_t size() const { return n_bytes; }
+
+ private:
+   const unsigned char *bytes = nullptr;
+   size_t n_bytes = 0;
+#ifdef _WIN32
+   HANDLE mapping = nullptr;
+#endif
+};
+
+/**
+ * @brief First bytes of a binary scene file
+ */
+struct Scene_file_header
+{
+   char magic[8];              // "RT302SCN"
+   uint32_t version;           // `Scene_file::VERSION`
+   uint32_t real_size;         // sizeof(real) of the sphere arrays
+   uint32_t node_size;         // sizeof(Bvh_node) of the hierarchy
+   uint32_t n_spheres;
+   uint32_t padded_spheres;    // Entries of each sphere array, see `Sphere_soa::padded_size_for_view`
+   uint32_t n_materials;
+   uint32_t n_nodes;           // 0 without hierarchy
+   uint32_t reserved;          // 0
+   uint64_t arrays_offset[6];  // cx, cy, cz, radius, radius², material ids
+   uint64_t materials_offset;
+   uint64_t nodes_offset;
+   uint64_t file_size;         // To detect a truncated file
+};
+
+// A material of the table, the same for all the precisions
+struct Scene_file_material
+{
+   int32_t type;    // One of `Scene_file::material_types`
+   int32_t reserved;
+   double r, g, b;  // Albedo or color
+};
+
+/**
+ * @class Scene_file
+ * @brief A scene of spheres with its hierarchy, built in code or loaded from a file
+ */
+class Scene_file
+{
+ public:
+   static constexpr uint32_t VERSION = 1;
+   static constexpr size_t ALIGNMENT = 64; // Of the sections, for the SIMD loads and the cache lines
+
+   // Materials as named in the text format, their index is their type in the binary format
+   static constexpr const char *material_types[] = {"lambertian", "constant", "normals"};
+
+   Scene_file() {}
+
+   Scene_file(const Scene_file &) = delete;
+   Scene_file &operator=(const Scene_file &) = delete;
+
+   // The hierarchy over the objects of a scene built in code
+   void build(const Hittable_list &objects)
+   {
+      TRACE_SCOPE("scene", "build BVH");
+      bvh.reset(new Bvh(objects));
+      file.close();
+      received = {};
+   }
+
+   /**
+    * @brief Loads a scene from a binary or a text file, recognized by their first bytes
+    * @return false after printing the error
+    */
+   bool load(const std::string &path)
+   {
+      TRACE_SCOPE("scene", "load scene");
+      auto start_time = std::chrono::high_resolution_clock::now();
+
+      bvh.reset();
+      received = {};
+      if (!file.open(path))
+      {
+         std::cerr << "Cannot open the scene file " << path << std::endl;
+         return false;
+      }
+
+      bool ok = file.size() >= 8 && memcmp(file.data(), MAGIC, 8) == 0 ? load_binary(path, file.data(), file.size())
+                                                                         : load_text(path, file.data(), file.size());
+
+      auto end_time = std::chrono::high_resolution_clock::now();
+      load_ms = std::chrono::duration<double, std::milli>(end_time - start_time).count();
+      return ok;
+   }
+
+   /**
+    * @brief Loads a scene received in memory, e.g. the bytes of `serialize` sent by another process
+    *
+    * The buffer of a binary scene is kept, its spheres and hierarchy being used in place as those of a
+    * mapped file. The text scenes are parsed, and built like those of `load`.
+    * @param name Of the scene in the error messages
+    * @return false after printing the error
+    */
+   bool load_memory(std::vector<unsigned char> bytes, const std::string &name)
+   {
+      TRACE_SCOPE("scene", "load scene");
+      auto start_time = std::chrono::high_resolution_clock::now();
+
+      bvh.reset();
+      file.close();
+      received = std::move(bytes);
+      bool ok;
+      if (received.size() >= 8 && memcmp(received.data(), MAGIC, 8) == 0)
+         ok = load_binary(name, received.data(), received.size());
+      else
+      {
+         ok = load_text(name, received.data(), received.size());
+         received = {};
+      }
+
+      auto end_time = std::chrono::high_resolution_clock::now();
+      load_ms = std::chrono::duration<double, std::milli>(end_time - start_time).count();
+      return ok;
+   }
+
+   const Bvh &get_bvh() const { return *bvh; }
+   Bvh &get_bvh() { return *bvh; } // To move its spheres, see `Bvh::move_spheres`
+
+   // Time taken by `load`, hierarchy included
+   double get_load_ms() const { return load_ms; }
+
+   /**
+    * @brief Writes the spheres and the hierarchy of a `Bvh` made of spheres only
+    *
+    * The extension chooses the format: `.txt` for the text format (without the
+    * hierarchy), else binary.
+    *
+    * @return false after printing the error
+    */
+   static bool save(const std::string &path, const Bvh &bvh)
+   {
+      vector<Scene_file_material> materials;
+      if (!file_materials(bvh, materials))
+         return false;
+
+      size_t dot = path.find_last_of('.');
+      bool text = dot != std::string::npos && path.substr(dot) == ".txt";
+      bool ok = text ? save_text(path, bvh.get_leaf_spheres(), materials) : save_binary(path, bvh, materials);
+      if (!ok)
+         std::cerr << "Cannot write the scene file " << path << std::endl;
+      return ok;
+   }
+
+   /**
+    * @brief The binary file of a `Bvh` made of spheres only, in memory
+    * @return false after printing the error
+    */
+   static bool serialize(const Bvh &bvh, std::vector<unsigned char> &bytes)
+   {
+      vector<Scene_file_material> materials;
+      if (!file_materials(bvh, materials))
+         return false;
+      bytes = binary_bytes(bvh, materials);
+      return true;
+   }
+
+ private:
+   static constexpr char MAGIC[9] = "RT302SCN";
+
+   Mapped_file file;
+   std::vector<unsigned char> received; // Of `load_memory`, instead of the file
+   std::unique_ptr<Bvh> bvh;
+   double load_ms = 0;
+
+   //==============================================================================
+   // BINARY FORMAT
+   //==============================================================================
+
+   static size_t align(size_t offset) { return (offset + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT; }
+
+   // The materials of the table, false after printing the error when the scene cannot be saved
+   static bool file_materials(const Bvh &bvh, vector<Scene_file_material> &materials)
+   {
+      const Sphere_soa &spheres = bvh.get_leaf_spheres();
+      if (spheres.size() != bvh.build_stats().primitive_count)
+      {
+         std::cerr << "Only the scenes made of spheres can be saved" << std::endl;
+         return false;
+      }
+
+      for (const auto &mat : spheres.get_materials())
+      {
+         if (!to_file(mat.get(), materials.emplace_back()))
+         {
+            std::cerr << "Generic materials cannot be saved in a scene file" << std::endl;
+            return false;
+         }
+      }
+      return true;
+   }
+
+   static bool save_binary(const std::string &path, const Bvh &bvh, const vector<Scene_file_material> &materials)
+   {
+      vector<unsigned char> bytes = binary_bytes(bvh, materials);
+      FILE *out = fopen(path.c_str(), "wb");
+      if (out == nullptr)
+         return false;
+      bool ok = fwrite(bytes.data(), 1, bytes.size(), out) == bytes.size();
+      return fclose(out) == 0 && ok;
+   }
+
+   static vector<unsigned char> binary_bytes(const Bvh &bvh, const vector<Scene_file_material> &materials)
+   {
+      const Sphere_soa &spheres = bvh.get_leaf_spheres();
+      const int n = spheres.size();
+      const int padded = Sphere_soa::padded_size_for_view(n);
+
+      Scene_file_header header = {};
+      memcpy(header.magic, MAGIC, 8);
+      header.version = VERSION;
+      header.real_size = sizeof(real);
+      header.node_size = sizeof(Bvh_node);
+      header.n_spheres = n;
+      header.padded_spheres = padded;
+      header.n_materials = (uint32_t)materials.size();
+      header.n_nodes = bvh.node_count();
+
+      size_t offset = align(sizeof(header));
+      for (int a = 0; a < 6; a++)
+      {
+         header.arrays_offset[a] = offset;
+         offset = align(offset + padded * (a < 5 ? sizeof(real) : sizeof(int32_t)));
+      }
+      header.materials_offset = offset;
+      offset = align(offset + materials.size() * sizeof(Scene_file_material));
+      header.nodes_offset = offset;
+      header.file_size = offset + header.n_nodes * sizeof(Bvh_node);
+
+      // Each section is copied at its offset, the gaps staying zero
+      vector<unsigned char> bytes(header.file_size, 0);
+      auto write = [&](size_t at, const void *data, size_t size)
+      {
+         if (size > 0)
+            memcpy(bytes.data() + at, data, size);
+      };
+
+      // The arrays of the spheres end with the padding spheres of a view, never hit
+      const real *arrays[5] = {spheres.center_x(), spheres.center_y(), spheres.center_z(), spheres.radii(),
+                               spheres.radii_squared()};
+      const real padding[5] = {std::numeric_limits<real>::quiet_NaN(), std::numeric_limits<real>::quiet_NaN(),
+                               std::numeric_limits<real>::quiet_NaN(), 0, 0};
+      write(0, &header, sizeof(header));
+      for (int a = 0; a < 5; a++)
+      {
+         vector<real> values(arrays[a], arrays[a] + n);
+         values.resize(padded, padding[a]);
+         write(header.arrays_offset[a], values.data(), values.size() * sizeof(real));
+      }
+      vector<int32_t> ids(spheres.material_id_array(), spheres.material_id_array() + n);
+      ids.resize(padded, 0);
+      write(header.arrays_offset[5], ids.data(), ids.size() * sizeof(int32_t));
+      write(header.materials_offset, materials.data(), materials.size() * sizeof(Scene_file_material));
+      write(header.nodes_offset, bvh.get_nodes(), header.n_nodes * sizeof(Bvh_node));
+      return bytes;
+   }
+
+   // From the mapped file or the received bytes, which stay alive while the scene uses them in place
+   bool load_binary(const std::string &path, const unsigned char *data, size_t size)
+   {
+      Scene_file_header header;
+      if (size < sizeof(header))
+         return binary_error(path, "truncated header");
+      memcpy(&header, data, sizeof(header));
+
+      if (header.version != VERSION)
+         return binary_error(path, "unsupported version " + std::to_string(header.version));
+      if (header.real_size != sizeof(float) && header.real_size != sizeof(double))
+         return binary_error(path, "invalid precision");
+      if (header.file_size > size || header.padded_spheres < header.n_spheres ||
+          header.n_spheres > (uint32_t)std::numeric_limits<int>::max())
+         return binary_error(path, "truncated file");
+
+      // Every section must be aligned and inside the file
+      auto in_file = [&](uint64_t offset, uint64_t size)
+      { return offset % ALIGNMENT == 0 && offset <= header.file_size && size <= header.file_size - offset; };
+      bool sections_ok = in_file(header.materials_offset, header.n_materials * sizeof(Scene_file_material)) &&
+                         in_file(header.nodes_offset, (uint64_t)header.n_nodes * header.node_size);
+      for (int a = 0; a < 6; a++)
+         sections_ok = sections_ok && in_file(header.arrays_offset[a], (uint64_t)header.padded_spheres *
+                                                                             (a < 5 ? header.real_size : 4));
+      if (!sections_ok || overlapping_sections(header))
+         return binary_error(path, "invalid section offsets");
+
+      vector<shared_ptr<Material>> materials(header.n_materials);
+      for (uint32_t i = 0; i < header.n_materials; i++)
+      {
+         Scene_file_material m;
+         memcpy(&m, data + header.materials_offset + i * sizeof(m), sizeof(m));
+         materials[i] = from_file(m);
+         if (materials[i] == nullptr)
+            return binary_error(path, "invalid material type " + std::to_string(m.type));
+      }
+
+      const int n = (int)header.n_spheres;
+      const int32_t *ids = reinterpret_cast<const int32_t *>(data + header.arrays_offset[5]);
+      for (int i = 0; i < n; i++)
+      {
+         if (ids[i] < 0 || ids[i] >= (int32_t)header.n_materials)
+            return binary_error(path, "invalid material id");
+      }
+
+      // Same layout as the program: the arrays and the nodes are used in place
+      const bool same_layout = header.real_size == sizeof(real) && header.node_size == sizeof(Bvh_node) &&
+                               (int)header.padded_spheres >= Sphere_soa::padded_size_for_view(n);
+      if (same_layout && header.n_nodes > 0)
+      {
+         const Bvh_node *nodes = reinterpret_cast<const Bvh_node *>(data + header.nodes_offset);
+         const real *arrays[5];
+         for (int a = 0; a < 5; a++)
+            arrays[a] = reinterpret_cast<const real *>(data + header.arrays_offset[a]);
+         if (!valid_hierarchy(nodes, (int)header.n_nodes, n, (int)header.padded_spheres, arrays))
+            return binary_error(path, "invalid hierarchy");
+
+         Sphere_soa spheres = Sphere_soa::view(n, arrays[0], arrays[1], arrays[2], arrays[3], arrays[4], ids,
+                                               std::move(materials), nodes[0].bbox);
+         bvh.reset(new Bvh(nodes, (int)header.n_nodes, std::move(spheres)));
+         return true;
+      }
+
+      // Otherwise the spheres are copied at the precision of the program, and the hierarchy rebuilt
+      Sphere_soa spheres;
+      spheres.reserve(n);
+      for (int i = 0; i < n; i++)
+      {
+         real values[4];
+         for (int a = 0; a < 4; a++)
+         {
+            values[a] = read_real(data + header.arrays_offset[a], i, header.real_size);
+            if (!std::isfinite(values[a]) || (a == 3 && values[a] < 0))
+               return binary_error(path, "invalid sphere " + std::to_string(i));
+         }
+         spheres.add(Point3(values[0], values[1], values[2]), values[3], materials[ids[i]]);
+      }
+      bvh.reset(new Bvh(spheres));
+      file.close();
+      received = {};
+      return true;
+   }
+
+   static real read_real(const unsigned char *array, int i, uint32_t real_size)
+   {
+      if (real_size == sizeof(float))
+      {
+         float value;
+         memcpy(&value, array + i * sizeof(float), sizeof(float));
+         return (real)value;
+      }
+      double value;
+      memcpy(&value, array + i * sizeof(double), sizeof(double));
+      return (real)value;
+   }
+
+   // Whether two non-empty sections of the file, the header included, share bytes
+   static bool overlapping_sections(const Scene_file_header &header)
+   {
+      vector<std::pair<uint64_t, uint64_t>> sections = {
+          {0, sizeof(header)},
+          {header.materials_offset, header.n_materials * sizeof(Scene_file_material)},
+          {header.nodes_offset, (uint64_t)header.n_nodes * header.node_size}};
+      for (int a = 0; a < 6; a++)
+         sections.push_back({header.arrays_offset[a], (uint64_t)header.padded_spheres *
+                                                          (a < 5 ? header.real_size : 4)});
+      sections.erase(std::remove_if(sections.begin(), sections.end(), [](const auto &s) { return s.second == 0; }),
+                     sections.end());
+      std::sort(sections.begin(), sections.end());
+      for (size_t i = 1; i < sections.size(); i++)
+      {
+         if (sections[i - 1].first + sections[i - 1].second > sections[i].first)
+            return true;
+      }
+      return false;
+   }
+
+   /**
+    * @brief Checks that the traversal of the nodes stays in the arrays and finds every sphere it should
+    *
+    * In depth-first order, the first child of an interior node follows it and the second one comes
+    * later, each node having a single parent, so that the depth fits the traversal stacks of the CPU
+    * and the GPU. The leaves hold all the spheres, each one once and in the order of the arrays, their
+    * SIMD blocks staying in the `padded_spheres` entries of the arrays whatever their first sphere. The
+    * spheres are finite, and the boxes bound them and the children.
+    *
+    * @param arrays cx, cy, cz and radius of the spheres
+    */
+   static bool valid_hierarchy(const Bvh_node *nodes, int n_nodes, int n_spheres, int padded_spheres,
+                               const real *const arrays[4])
+   {
+      auto inside = [](const Aabb &outer, const Aabb &inner)
+      {
+         for (int a = 0; a < 3; a++)
+         {
+            const Interval &o = outer.axis_interval(a), &in = inner.axis_interval(a);
+            if (!(o.min <= in.min && in.max <= o.max)) // False with a NaN
+               return false;
+         }
+         return true;
+      };
+
+      vector<int> depth(n_nodes, 0);
+      depth[0] = 1;
+      int next_sphere = 0; // The first sphere of the next leaf
+      for (int i = 0; i < n_nodes; i++)
+      {
+         const Bvh_node &node = nodes[i];
+         if (depth[i] == 0 || depth[i] > Bvh::MAX_TREE_DEPTH)
+            return false;
+         if (node.is_leaf())
+         {
+            const int blocks = (node.count + Sphere_soa::WIDTH - 1) / Sphere_soa::WIDTH;
+            if (node.offset != next_sphere || node.offset > n_spheres - node.count ||
+                (int64_t)node.offset + (int64_t)blocks * Sphere_soa::WIDTH > padded_spheres)
+               return false;
+            next_sphere += node.count;
+            for (int s = node.offset; s < node.offset + node.count; s++)
+            {
+               const real r = arrays[3][s];
+               if (!std::isfinite(r) || r < 0)
+                  return false;
+               for (int a = 0; a < 3; a++)
+               {
+                  const Interval &box = node.bbox.axis_interval(a);
+                  const real c = arrays[a][s];
+                  if (!std::isfinite(c) || !box.contains(c - r) || !box.contains(c + r))
+                     return false;
+               }
+            }
+         }
+         else if (node.count != 0 || i + 1 >= n_nodes || node.offset <= i + 1 || node.offset >= n_nodes ||
+                  node.axis < 0 || node.axis > 2)
+            return false;
+         else
+         {
+            // A node reached twice would have two depths, and a shared subtree may hide a deeper path
+            for (int child : {i + 1, node.offset})
+            {
+               if (depth[child] != 0 || !inside(node.bbox, nodes[child].bbox))
+                  return false;
+               depth[child] = depth[i] + 1;
+            }
+         }
+      }
+      return next_sphere == n_spheres;
+   }
+
+   bool binary_error(const std::string &path, const std::string &error)
+   {
+      std::cerr << path << ": " << error << std::endl;
+      file.close();
+      received = {};
+      return false;
+   }
+
+   static bool to_file(const Material *mat, Scene_file_material &m)
+   {
+      m = {};
+      Color c;
+      switch (mat->type)
+      {
+      case Material_type::Lambertian:
+         m.type = 0;
+         c = static_cast<const Lambertian *>(mat)->albedo;
+         break;
+      case Material_type::Constant:
+         m.type = 1;
+         c = static_cast<const Constant *>(mat)->color;
+         break;
+      case Material_type::ShowNormals:
+         m.type = 2;
+         c = static_cast<const ShowNormals *>(mat)->albedo;
+         break;
+      default:
+         return false;
+      }
+      m.r = c.x();
+      m.g = c.y();
+      m.b = c.z();
+      return true;
+   }
+
+   // The material of an entry of the table, nullptr for an unknown type
+   static shared_ptr<Material> from_file(const Scene_file_material &m)
+   {
+      Color c(m.r, m.g, m.b);
+      switch (m.type)
+      {
+      case 0:
+         return make_shared<Lambertian>(c);
+      case 1:
+         return make_shared<Constant>(c);
+      case 2:
+         return make_shared<ShowNormals>(c);
+      default:
+         return nullptr;
+      }
+   }
+
+   //==============================================================================
+   // TEXT FORMAT
+   //==============================================================================
+
+   static bool save_text(const std::string &path, const Sphere_soa &spheres,
+                         const vector<Scene_file_material> &materials)
+   {
+      FILE *out = fopen(path.c_str(), "w");
+      if (out == nullptr)
+         return false;
+
+      fprintf(out, "# %d spheres, %d materials\n", spheres.size(), (int)materials.size());
+      for (size_t i = 0; i < materials.size(); i++)
+      {
+         const Scene_file_material &m = materials[i];
+         fprintf(out, "material m%d %s %s %s %s\n", (int)i, material_types[m.type], format_real((real)m.r).c_str(),
+                 format_real((real)m.g).c_str(), format_real((real)m.b).c_str());
+      }
+      for (int i = 0; i < spheres.size(); i++)
+      {
+         Point3 c = spheres.center(i);
+         fprintf(out, "sphere %s %s %s %s m%d\n", format_real(c.x()).c_str(), format_real(c.y()).c_str(),
+                 format_real(c.z()).c_str(), format_real(spheres.get_radius(i)).c_str(), spheres.get_material_id(i));
+      }
+
+      return fclose(out) == 0;
+   }
+
+   // The shortest of the usual and the exact representations that reads back to the same value
+   static std::string format_real(real value)
+   {
+      char text[32];
+      snprintf(text, sizeof(text), "%.*g", std::numeric_limits<real>::digits10, (double)value);
+      if ((real)strtod(text, nullptr) != value)
+         snprintf(text, sizeof(text), "%.*g", std::numeric_limits<real>::max_digits10, (double)value);
+      return text;
+   }
+
+   // Parses the whole mapped file or received buffer, without a stream or an allocation per line
+   bool load_text(const std::string &path, const unsigned char *data, size_t size)
+   {
+      const char *text = reinterpret_cast<const char *>(data);
+      const char *end = text + size;
+
+      std::unordered_map<std::string, shared_ptr<Material>> materials;
+      Sphere_soa spheres;
+
+      int line_number = 1;
+      for (const char *line = text; line < end; line_number++)
+      {
+         const char *line_end = static_cast<const char *>(memchr(line, '\n', end - line));
+         if (line_end == nullptr)
+            line_end = end;
+         const char *comment = static_cast<const char *>(memchr(line, '#', line_end - line));
+
+         // strtod stops at the newline, the statement is copied only to end it there
+         std::string statement(line, comment != nullptr ? comment : line_end);
+         line = line_end + 1;
+
+         const char *p = statement.c_str();
+         std::string keyword = next_word(p);
+         if (keyword.empty())
+            continue;
+
+         double v[4];
+         bool ok;
+         if (keyword == "material")
+         {
+            std::string name = next_word(p), type = next_word(p);
+            ok = parse_numbers(p, v, 3);
+            int type_index = -1;
+            for (int t = 0; t < 3; t++)
+               if (type == material_types[t])
+                  type_index = t;
+            ok = ok && !name.empty() && type_index >= 0 && next_word(p).empty();
+            if (ok)
+               materials[name] = from_file(Scene_file_material{type_index, 0, v[0], v[1], v[2]});
+         }
+         else if (keyword == "sphere")
+         {
+            ok = parse_numbers(p, v, 4) && v[3] >= 0;
+            auto mat = materials.find(next_word(p));
+            ok = ok && mat != materials.end() && next_word(p).empty();
+            if (ok)
+               spheres.add(Point3(v[0], v[1], v[2]), v[3], mat->second);
+         }
+         else
+            ok = false;
+
+         if (!ok)
+         {
+            std::cerr << path << ":" << line_number << ": invalid statement \"" << statement << "\"" << std::endl;
+            file.close();
+            return false;
+         }
+      }
+
+      file.close();
+      bvh.reset(new Bvh(spheres));
+      return true;
+   }
+
+   // The next word of a statement, empty at its end
+   static std::string next_word(const char *&p)
+   {
+      while (*p == ' ' || *p == '\t' || *p == '\r')
+         p++;
+      const char *start = p;
+      while (*p != '\0' && *p != ' ' && *p != '\t' && *p != '\r')
+         p++;
+      return std::string(start, p);
+   }
+
+   // Finite numbers only, strtod also reading "nan" and "inf"
+   static bool parse_numbers(const char *&p, double *values, int count)
+   {
+      for (int i = 0; i < count; i++)
+      {
+         char *number_end;
+         values[i] = strtod(p, &number_end);
+         if (number_end == p || !std::isfinite(values[i]))
+            return false;
+         p = number_end;
+      }
+      return true;
+   }
+};
@@ -0,0 +1,325 @@
+/**
+ * @file scene_file_test.cc
+ * @brief Checks that `Scene_file::load_memory` rejects the malformed scenes
+ *
+ * The scenes received by the render server and the workers are used in place, so a
+ * header or a hierarchy that the loader accepts must be safe to traverse. Each case
+ * alters the bytes of a valid scene: truncated, overlapping sections, invalid material
+ * ids, nodes shared by two parents or deeper than the traversal stack, leaves outside
+ * the arrays or missing spheres, and boxes that do not bound their spheres. The text
+ * scenes must have finite numbers and radii that are not negative.
+ *
+ * Run by `ctest`, the exit status is the number of failed checks.
+ */
+#include "bvh.h"
+#include "scene_file.h"
+#include "scenes.h"
+
+#include <cmath>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <limits>
+#include <string>
+#include <vector>
+
+static int failures = 0;
+
+static void check(bool condition, const std::string &what)
+{
+   if (!condition)
+   {
+      std::cerr << "FAILED: " << what << std::endl;
+      failures++;
+   }
+}
+
+static Scene_file_header header_of(const std::vector<unsigned char> &bytes)
+{
+   Scene_file_header header;
+   memcpy(&header, bytes.data(), sizeof(header));
+   return header;
+}
+
+static void set_header(std::vector<unsigned char> &bytes, const Scene_file_header &header)
+{
+   memcpy(bytes.data(), &header, sizeof(header));
+}
+
+static std::vector<Bvh_node> nodes_of(const std::vector<unsigned char> &bytes)
+{
+   Scene_file_header header = header_of(bytes);
+   std::vector<Bvh_node> nodes(header.n_nodes);
+   memcpy(nodes.data(), bytes.data() + header.nodes_offset, nodes.size() * sizeof(Bvh_node));
+   return nodes;
+}
+
+// Replaces the hierarchy, the nodes being appended at the end of the file
+static void set_nodes(std::vector<unsigned char> &bytes, const std::vector<Bvh_node> &nodes)
+{
+   Scene_file_header header = header_of(bytes);
+   header.nodes_offset = (bytes.size() + Scene_file::ALIGNMENT - 1) / Scene_file::ALIGNMENT * Scene_file::ALIGNMENT;
+   header.n_nodes = (uint32_t)nodes.size();
+   header.file_size = header.nodes_offset + nodes.size() * sizeof(Bvh_node);
+   bytes.resize(header.file_size);
+   memcpy(bytes.data() + header.nodes_offset, nodes.data(), nodes.size() * sizeof(Bvh_node));
+   set_header(bytes, header);
+}
+
+static Bvh_node leaf(const Aabb &box, int offset, int count)
+{
+   Bvh_node node;
+   node.bbox = box;
+   node.offset = offset;
+   node.count = count;
+   node.axis = 0;
+   return node;
+}
+
+static Bvh_node interior(const Aabb &box, int second_child)
+{
+   Bvh_node node;
+   node.bbox = box;
+   node.offset = second_child;
+   node.count = 0;
+   node.axis = 0;
+   return node;
+}
+
+// A path of `depth` nodes, each interior node having a leaf as its second child
+static void chain(std::vector<Bvh_node> &nodes, const Aabb &box, int depth)
+{
+   const int index = (int)nodes.size();
+   if (depth == 1)
+   {
+      nodes.push_back(leaf(box, 0, 1));
+      return;
+   }
+   nodes.push_back(interior(box, 0));
+   chain(nodes, box, depth - 1);
+   nodes[index].offset = (int)nodes.size();
+   nodes.push_back(leaf(box, 0, 1));
+}
+
+// Gives the leaves one sphere each in their order, the last one holding the rest of the `n_spheres`
+static void cover(std::vector<Bvh_node> &nodes, int n_spheres)
+{
+   int next = 0;
+   Bvh_node *last = nullptr;
+   for (Bvh_node &node : nodes)
+   {
+      if (node.is_leaf())
+      {
+         node.offset = next++;
+         last = &node;
+      }
+   }
+   last->count = n_spheres - last->offset;
+}
+
+static void set_real(std::vector<unsigned char> &bytes, int array, int sphere, real value)
+{
+   memcpy(bytes.data() + header_of(bytes).arrays_offset[array] + sphere * sizeof(real), &value, sizeof(value));
+}
+
+static bool loads(const std::vector<unsigned char> &bytes)
+{
+   Scene_file file;
+   return file.load_memory(bytes, "test");
+}
+
+int main()
+{
+   const Bvh reference(many_spheres(1000));
+   std::vector<unsigned char> valid;
+   check(Scene_file::serialize(reference, valid), "serialize");
+   const Scene_file_header header = header_of(valid);
+   const Aabb scene_box = reference.bounding_box();
+
+   // The valid scene is used in place, and hits as the hierarchy it was saved from
+   {
+      Scene_file file;
+      check(file.load_memory(valid, "valid"), "valid scene loaded");
+      check(file.get_bvh().node_count() == reference.node_count(), "valid scene used in place");
+      for (int i = 0; i < 64; i++)
+      {
+         Ray r(Point3(-2, 2, 5), Vec3(-0.4 + i * 0.0125, -0.5, -1));
+         Hit_record a, b;
+         const bool hit = reference.hit(r, Interval(0.001, inf), a);
+         check(hit == file.get_bvh().hit(r, Interval(0.001, inf), b) && (!hit || a.t == b.t), "same hits");
+      }
+   }
+
+   std::vector<std::pair<std::string, std::function<void(std::vector<unsigned char> &)>>> malformed = {
+       {"truncated header", [](auto &bytes) { bytes.resize(sizeof(Scene_file_header) - 1); }},
+       {"truncated file", [](auto &bytes) { bytes.resize(bytes.size() - 1); }},
+       {"unsupported version",
+        [](auto &bytes)
+        {
+           Scene_file_header h = header_of(bytes);
+           h.version++;
+           set_header(bytes, h);
+        }},
+       {"misaligned section",
+        [](auto &bytes)
+        {
+           Scene_file_header h = header_of(bytes);
+           h.arrays_offset[2] += 8;
+           set_header(bytes, h);
+        }},
+       {"section past the end",
+        [](auto &bytes)
+        {
+           Scene_file_header h = header_of(bytes);
+           h.nodes_offset = h.file_size;
+           set_header(bytes, h);
+        }},
+       {"overlapping arrays",
+        [](auto &bytes)
+        {
+           Scene_file_header h = header_of(bytes);
+           h.arrays_offset[1] = h.arrays_offset[0];
+           set_header(bytes, h);
+        }},
+       {"nodes over the header",
+        [](auto &bytes)
+        {
+           Scene_file_header h = header_of(bytes);
+           h.nodes_offset = 0;
+           set_header(bytes, h);
+        }},
+       {"material id out of the table",
+        [&](auto &bytes)
+        {
+           const int32_t id = (int32_t)header.n_materials;
+           memcpy(bytes.data() + header.arrays_offset[5] + 7 * sizeof(int32_t), &id, sizeof(id));
+        }},
+       {"negative material id",
+        [&](auto &bytes)
+        {
+           const int32_t id = -1;
+           memcpy(bytes.data() + header.arrays_offset[5], &id, sizeof(id));
+        }},
+       {"invalid material type",
+        [&](auto &bytes)
+        {
+           const int32_t type = 1000;
+           memcpy(bytes.data() + header.materials_offset, &type, sizeof(type));
+        }},
+       {"node shared by two parents", // 0 -> (1, 2), 1 -> (2, 3)
+        [&](auto &bytes)
+        {
+           set_nodes(bytes, {interior(scene_box, 2), interior(scene_box, 3), leaf(scene_box, 0, 1),
+                             leaf(scene_box, 1, 1)});
+        }},
+       {"unreached node",
+        [&](auto &bytes)
+        {
+           set_nodes(bytes, {interior(scene_box, 2), leaf(scene_box, 0, 1), leaf(scene_box, 1, 1),
+                             leaf(scene_box, 2, 1)});
+        }},
+       {"second child before the first one",
+        [&](auto &bytes) { set_nodes(bytes, {interior(scene_box, 1), leaf(scene_box, 0, 1)}); }},
+       {"hierarchy deeper than the traversal stack",
+        [&](auto &bytes)
+        {
+           std::vector<Bvh_node> nodes;
+           chain(nodes, scene_box, Bvh::MAX_TREE_DEPTH + 1);
+           cover(nodes, (int)header.n_spheres);
+           set_nodes(bytes, nodes);
+        }},
+       {"leaf past the spheres",
+        [&](auto &bytes) { set_nodes(bytes, {leaf(scene_box, 1, (int)header.n_spheres)}); }},
+       {"leaf box missing its spheres",
+        [&](auto &bytes)
+        {
+           std::vector<Bvh_node> nodes = nodes_of(bytes);
+           for (Bvh_node &node : nodes)
+           {
+              if (node.is_leaf())
+              {
+                 node.bbox = Aabb(node.bbox.x, node.bbox.y, Interval(node.bbox.z.min, node.bbox.z.min));
+                 break;
+              }
+           }
+           set_nodes(bytes, nodes);
+        }},
+       {"child outside its parent",
+        [&](auto &bytes)
+        {
+           std::vector<Bvh_node> nodes = nodes_of(bytes);
+           nodes[0].bbox = Aabb(nodes[0].bbox.x, nodes[0].bbox.y, Interval(nodes[0].bbox.z.min, nodes[0].bbox.z.min));
+           set_nodes(bytes, nodes);
+        }},
+       {"box with a NaN",
+        [&](auto &bytes)
+        {
+           std::vector<Bvh_node> nodes = nodes_of(bytes);
+           nodes[1].bbox.x.max = std::nan("");
+           set_nodes(bytes, nodes);
+        }},
+       {"leaves skipping a sphere",
+        [&](auto &bytes)
+        {
+           std::vector<Bvh_node> nodes = nodes_of(bytes);
+           for (Bvh_node &node : nodes)
+           {
+              if (node.count > 1)
+              {
+                 node.count--;
+                 break;
+              }
+           }
+           set_nodes(bytes, nodes);
+        }},
+       {"leaves without the last spheres",
+        [&](auto &bytes)
+        {
+           std::vector<Bvh_node> nodes;
+           chain(nodes, scene_box, 3);
+           cover(nodes, (int)header.n_spheres - 1);
+           set_nodes(bytes, nodes);
+        }},
+       {"sphere in two leaves",
+        [&](auto &bytes)
+        {
+           std::vector<Bvh_node> nodes;
+           chain(nodes, scene_box, 3);
+           cover(nodes, (int)header.n_spheres);
+           nodes[3].offset = 0; // The leaf of sphere 1 holds sphere 0 again
+           set_nodes(bytes, nodes);
+        }},
+       {"negative radius", [](auto &bytes) { set_real(bytes, 3, 5, -0.01); }},
+       {"NaN radius", [](auto &bytes) { set_real(bytes, 3, 5, std::numeric_limits<real>::quiet_NaN()); }},
+       {"infinite center", [](auto &bytes) { set_real(bytes, 0, 5, std::numeric_limits<real>::infinity()); }},
+   };
+   for (auto &[name, alter] : malformed)
+   {
+      std::vector<unsigned char> bytes = valid;
+      alter(bytes);
+      check(!loads(bytes), name + " rejected");
+   }
+
+   // The deepest hierarchy the traversal stack holds is still accepted
+   {
+      std::vector<unsigned char> bytes = valid;
+      std::vector<Bvh_node> nodes;
+      chain(nodes, scene_box, Bvh::MAX_TREE_DEPTH);
+      cover(nodes, (int)header.n_spheres);
+      set_nodes(bytes, nodes);
+      check(loads(bytes), "hierarchy as deep as the traversal stack loaded");
+   }
+
+   // The text scenes
+   auto text = [](const std::string &scene) { return std::vector<unsigned char>(scene.begin(), scene.end()); };
+   const std::string material = "material grey lambertian 0.5 0.5 0.5\n";
+   check(loads(text(material + "sphere 0 0 -1 0.5 grey\nsphere 0 -100.5 -1 100 grey\n")), "text scene loaded");
+   check(loads(text(material + "sphere 0 0 -1 0 grey\n")), "text sphere of radius 0 loaded");
+   for (const char *sphere : {"sphere 0 0 -1 -0.5 grey", "sphere nan 0 -1 0.5 grey", "sphere 0 0 -1 inf grey",
+                              "sphere 0 -inf -1 0.5 grey", "sphere 0 0 0x1p2000 0.5 grey"})
+      check(!loads(text(material + sphere + "\n")), std::string("text \"") + sphere + "\" rejected");
+   check(!loads(text("material grey lambertian nan 0.5 0.5\n")), "text material with a NaN rejected");
+
+   std::cerr << (failures == 0 ? "All the checks passed" : std::to_string(failures) + " checks failed") << std::endl;
+   return failures;
+}
@@ -0,0 +1,171 @@
+/**
+ * @file scenes.h
+ * @brief The scenes built in code, shared by the renderer and the benchmarks
+ *
+ * - `demo_scene`: the spheres of the project, seen by the default camera.
+ * - `many_spheres`: a procedural field of small spheres lying on the ground of the
+ *   demo scene, to measure how the renderers scale with the number of objects.
+ * - `instanced_spheres`: the same field made of instances of a few tiles of spheres,
+ *   to reach hundreds of millions of visible spheres in little memory.
+ */
+#pragma once
+
+#include "bvh.h"
+#include "hittable_list.h"
+#include "instance.h"
+#include "material.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+inline Hittable_list demo_scene()
+{
+   Hittable_list s;
+
+   auto material_uniform_red = make_shared<Constant>(Color(1, 0.0, 0.0));
+   auto material_uniform_blue = make_shared<Constant>(Color(0, 0.0, 1.0));
+   auto material_normals = make_shared<ShowNormals>(Color(0, 0.0, 0.0));
+   auto material_lambert = make_shared<Lambertian>(Color(0.7, 0.7, 0.7));
+
+   s.add_sphere(Point3(0, -950.5, -1), 950, material_lambert); // Ground
+   s.add_sphere(Point3(-3.5, 0.45, -1.8), .8, material_uniform_red);
+   s.add_sphere(Point3(-1.3, 0.18, -5), .7, material_uniform_blue);
+   s.add_sphere(Point3(-.7, .2, -.3), .6, material_lambert);
+   s.add_sphere(Point3(1.2, 0, -2), 0.5, material_lambert);
+
+   // Small "ISC" spheres at the bottom
+   for (int i = 0; i < 5; i++)
+   {
+      s.add_sphere(Point3(-3.5 + i * 0.5, -0.3, 1.2), 0.2, material_normals);
+   }
+
+   return s;
+}
+
+/**
+ * @brief The ground of the demo scene covered by `n_spheres` small spheres
+ *
+ * The spheres are spread uniformly over the part of the ground seen by the default
+ * camera, their radius shrinking with their number so that they cover about a third
+ * of it. The scene only depends on `n_spheres` and `seed`, not on the random engine
+ * of the renderers, so that the benchmarks of different builds trace the same scene.
+ */
+// Splitmix64, uniform in [0, 1)
+inline double scene_random(uint64_t &seed)
+{
+   uint64_t z = (seed += 0x9e3779b97f4a7c15ull);
+   z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+   z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+   return (double)((z ^ (z >> 31)) >> 11) * 0x1.0p-53;
+}
+
+// The materials of the procedural fields
+inline vector<shared_ptr<Material>> field_palette()
+{
+   return {
+       make_shared<Lambertian>(Color(0.7, 0.7, 0.7)), make_shared<Lambertian>(Color(0.8, 0.3, 0.3)),
+       make_shared<Lambertian>(Color(0.3, 0.8, 0.3)), make_shared<Lambertian>(Color(0.3, 0.3, 0.8)),
+       make_shared<Constant>(Color(1.0, 0.6, 0.1)),   make_shared<ShowNormals>(Color(0, 0, 0)),
+   };
+}
+
+// The ground of the demo scene, and the part of it seen by the default camera, from (-2, 2, 5) towards (-2, -0.5, -1)
+namespace field
+{
+constexpr double ground_radius = 950;
+const Point3 ground_center(0, -950.5, -1);
+constexpr double x_min = -12, x_max = 8, z_min = -20, z_max = 4;
+constexpr double area = (x_max - x_min) * (z_max - z_min);
+
+// Radius of the `n_spheres` spheres covering about a third of the field
+inline double sphere_radius(double n_spheres) { return std::sqrt(area / (3 * PI * std::max(1.0, n_spheres))); }
+
+// Height of the ground
+inline double ground_y(double x, double z)
+{
+   double dx = x - ground_center.x(), dz = z - ground_center.z();
+   return ground_center.y() + std::sqrt(ground_radius * ground_radius - dx * dx - dz * dz);
+}
+} // namespace field
+
+inline Hittable_list many_spheres(int n_spheres, uint64_t seed = 302)
+{
+   Hittable_list s;
+   s.spheres.reserve(n_spheres + 1);
+
+   auto random = [&seed] { return scene_random(seed); };
+   const vector<shared_ptr<Material>> palette = field_palette();
+   const int n_materials = (int)palette.size();
+
+   using namespace field;
+   s.add_sphere(ground_center, ground_radius, palette[0]);
+   const double radius = sphere_radius(n_spheres);
+
+   for (int i = 0; i < n_spheres; i++)
+   {
+      double x = x_min + (x_max - x_min) * random();
+      double z = z_min + (z_max - z_min) * random();
+      double r = radius * (0.5 + random());
+      const shared_ptr<Material> &mat = palette[std::min((int)(n_materials * random()), n_materials - 1)];
+
+      // On the curved ground rather than on a plane
+      s.add_sphere(Point3(x, ground_y(x, z) + r, z), r, mat);
+   }
+
+   return s;
+}
+
+/**
+ * @brief The field of `many_spheres` made of instances of square tiles of `tile_spheres` spheres
+ *
+ * The field is cut into about `n_spheres / tile_spheres` square cells, each one an instance of
+ * one of `n_tiles` tiles, turned by a multiple of 90 degrees so that the repetition is less
+ * visible. The tiles are flat, the instances following the curved ground by their center only.
+ * Each tile is stored once, as a `Bvh`: the memory grows with `n_tiles * tile_spheres` and the
+ * number of cells, not with the number of spheres seen.
+ */
+inline Hittable_list instanced_spheres(double n_spheres, int tile_spheres, int n_tiles = 4, uint64_t seed = 302)
+{
+   using namespace field;
+   auto random = [&seed] { return scene_random(seed); };
+   const vector<shared_ptr<Material>> palette = field_palette();
+   const int n_materials = (int)palette.size();
+
+   // Square cells, as many as needed for the spheres
+   const double n_cells = std::max(1.0, n_spheres / std::max(1, tile_spheres));
+   const double side = std::sqrt(area / n_cells);
+   const int nx = std::max(1, (int)std::ceil((x_max - x_min) / side));
+   const int nz = std::max(1, (int)std::ceil((z_max - z_min) / side));
+   const double radius = sphere_radius(n_spheres);
+
+   vector<shared_ptr<const Hittable>> tiles;
+   for (int t = 0; t < n_tiles; t++)
+   {
+      Hittable_list tile;
+      tile.spheres.reserve(tile_spheres);
+      for (int i = 0; i < tile_spheres; i++)
+      {
+         double r = radius * (0.5 + random());
+         const shared_ptr<Material> &mat = palette[std::min((int)(n_materials * random()), n_materials - 1)];
+         tile.add_sphere(Point3(side * (random() - 0.5), r, side * (random() - 0.5)), r, mat);
+      }
+      tiles.push_back(make_shared<Bvh>(tile));
+   }
+
+   Hittable_list s;
+   s.add_sphere(ground_center, ground_radius, palette[0]);
+   for (int i = 0; i < nx; i++)
+   {
+      for (int k = 0; k < nz; k++)
+      {
+         const double x = x_min + (i + 0.5) * side, z = z_min + (k + 0.5) * side;
+         const shared_ptr<const Hittable> &tile = tiles[std::min((int)(n_tiles * random()), n_tiles - 1)];
+         const Transform place = Transform::translate(Vec3(x, ground_y(x, z), z)) *
+                                 Transform::rotate(Vec3(0, 1, 0), 90 * std::floor(4 * random()));
+         s.add(make_shared<Instance>(tile, place));
+      }
+   }
+
+   return s;
+}
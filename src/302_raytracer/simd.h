@@ -0,0 +1,283 @@
+/**
+ * @file simd.h
+ * @brief Thin wrappers over the SIMD instruction sets, used by the SoA kernels.
+ *
+ * `Simd<T>` packs `Simd<T>::WIDTH` values of type `T` in one register and
+ * exposes the handful of operations needed by the intersection kernels. The
+ * widest instruction set enabled at compile time is used:
+ *
+ * | Instruction set | Macro          | Doubles per register | Floats per register |
+ * |-----------------|----------------|----------------------|---------------------|
+ * | AVX-512         | `__AVX512F__`  | 8                    | 16                  |
+ * | AVX2            | `__AVX2__`     | 4                    | 8                   |
+ * | SSE2 (x86-64)   | `__SSE2__`     | 2                    | 4                   |
+ * | NEON (AArch64)  | `__aarch64__`  | 2                    | 4                   |
+ * | none            |                | 1                    | 1                   |
+ *
+ * The instruction sets beyond the SSE2 baseline are only enabled when the
+ * compiler targets them, see the `NATIVE_ARCH` option in CMakeLists.txt.
+ * Defining `SIMD_SCALAR_ONLY` forces the scalar fallback (the primary
+ * template), which is the reference for the vectorized versions.
+ *
+ * The operations are the plain IEEE ones (no fused multiply-add), so that the
+ * kernels give bit for bit the same results as the scalar code.
+ */
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+
+#if !defined(SIMD_SCALAR_ONLY)
+#if defined(__AVX512F__) || defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+#endif
+
+// Scalar fallback, one value per "register"
+template <typename T> struct Simd
+{
+   static constexpr int WIDTH = 1;
+   static constexpr const char *NAME = "scalar";
+
+   using Mask = bool;
+
+   T v;
+
+   static inline Simd load(const T *p) { return {*p}; }
+   static inline Simd broadcast(T x) { return {x}; }
+   inline void store(T *p) const { *p = v; }
+
+   friend inline Simd operator+(Simd a, Simd b) { return {a.v + b.v}; }
+   friend inline Simd operator-(Simd a, Simd b) { return {a.v - b.v}; }
+   friend inline Simd operator*(Simd a, Simd b) { return {a.v * b.v}; }
+   friend inline Simd operator/(Simd a, Simd b) { return {a.v / b.v}; }
+   static inline Simd sqrt(Simd a) { return {std::sqrt(a.v)}; }
+
+   static inline Mask less(Simd a, Simd b) { return a.v < b.v; }
+   static inline Mask both(Mask a, Mask b) { return a && b; }
+   static inline bool none(Mask m) { return !m; }
+
+   static inline Simd select(Mask m, Simd a, Simd b) { return m ? a : b; }
+};
+
+#if !defined(SIMD_SCALAR_ONLY) && defined(__AVX512F__)
+
+template <> struct Simd<double>
+{
+   static constexpr int WIDTH = 8;
+   static constexpr const char *NAME = "AVX-512";
+
+   using Mask = __mmask8;
+
+   __m512d v;
+
+   static inline Simd load(const double *p) { return {_mm512_loadu_pd(p)}; }
+   static inline Simd broadcast(double x) { return {_mm512_set1_pd(x)}; }
+   inline void store(double *p) const { _mm512_storeu_pd(p, v); }
+
+   friend inline Simd operator+(Simd a, Simd b) { return {_mm512_add_pd(a.v, b.v)}; }
+   friend inline Simd operator-(Simd a, Simd b) { return {_mm512_sub_pd(a.v, b.v)}; }
+   friend inline Simd operator*(Simd a, Simd b) { return {_mm512_mul_pd(a.v, b.v)}; }
+   friend inline Simd operator/(Simd a, Simd b) { return {_mm512_div_pd(a.v, b.v)}; }
+   static inline Simd sqrt(Simd a) { return {_mm512_sqrt_pd(a.v)}; }
+
+   static inline Mask less(Simd a, Simd b) { return _mm512_cmp_pd_mask(a.v, b.v, _CMP_LT_OQ); }
+   static inline Mask both(Mask a, Mask b) { return a & b; }
+   static inline bool none(Mask m) { return m == 0; }
+
+   // Lane-wise `m ? a : b`
+   static inline Simd select(Mask m, Simd a, Simd b) { return {_mm512_mask_blend_pd(m, b.v, a.v)}; }
+};
+
+template <> struct Simd<float>
+{
+   static constexpr int WIDTH = 16;
+   static constexpr const char *NAME = "AVX-512";
+
+   using Mask = __mmask16;
+
+   __m512 v;
+
+   static inline Simd load(const float *p) { return {_mm512_loadu_ps(p)}; }
+   static inline Simd broadcast(float x) { return {_mm512_set1_ps(x)}; }
+   inline void store(float *p) const { _mm512_storeu_ps(p, v); }
+
+   friend inline Simd operator+(Simd a, Simd b) { return {_mm512_add_ps(a.v, b.v)}; }
+   friend inline Simd operator-(Simd a, Simd b) { return {_mm512_sub_ps(a.v, b.v)}; }
+   friend inline Simd operator*(Simd a, Simd b) { return {_mm512_mul_ps(a.v, b.v)}; }
+   friend inline Simd operator/(Simd a, Simd b) { return {_mm512_div_ps(a.v, b.v)}; }
+   static inline Simd sqrt(Simd a) { return {_mm512_sqrt_ps(a.v)}; }
+
+   static inline Mask less(Simd a, Simd b) { return _mm512_cmp_ps_mask(a.v, b.v, _CMP_LT_OQ); }
+   static inline Mask both(Mask a, Mask b) { return a & b; }
+   static inline bool none(Mask m) { return m == 0; }
+
+   static inline Simd select(Mask m, Simd a, Simd b) { return {_mm512_mask_blend_ps(m, b.v, a.v)}; }
+};
+
+#elif !defined(SIMD_SCALAR_ONLY) && defined(__AVX2__)
+
+template <> struct Simd<double>
+{
+   static constexpr int WIDTH = 4;
+   static constexpr const char *NAME = "AVX2";
+
+   using Mask = __m256d;
+
+   __m256d v;
+
+   static inline Simd load(const double *p) { return {_mm256_loadu_pd(p)}; }
+   static inline Simd broadcast(double x) { return {_mm256_set1_pd(x)}; }
+   inline void store(double *p) const { _mm256_storeu_pd(p, v); }
+
+   friend inline Simd operator+(Simd a, Simd b) { return {_mm256_add_pd(a.v, b.v)}; }
+   friend inline Simd operator-(Simd a, Simd b) { return {_mm256_sub_pd(a.v, b.v)}; }
+   friend inline Simd operator*(Simd a, Simd b) { return {_mm256_mul_pd(a.v, b.v)}; }
+   friend inline Simd operator/(Simd a, Simd b) { return {_mm256_div_pd(a.v, b.v)}; }
+   static inline Simd sqrt(Simd a) { return {_mm256_sqrt_pd(a.v)}; }
+
+   static inline Mask less(Simd a, Simd b) { return _mm256_cmp_pd(a.v, b.v, _CMP_LT_OQ); }
+   static inline Mask both(Mask a, Mask b) { return _mm256_and_pd(a, b); }
+   static inline bool none(Mask m) { return _mm256_movemask_pd(m) == 0; }
+
+   static inline Simd select(Mask m, Simd a, Simd b) { return {_mm256_blendv_pd(b.v, a.v, m)}; }
+};
+
+template <> struct Simd<float>
+{
+   static constexpr int WIDTH = 8;
+   static constexpr const char *NAME = "AVX2";
+
+   using Mask = __m256;
+
+   __m256 v;
+
+   static inline Simd load(const float *p) { return {_mm256_loadu_ps(p)}; }
+   static inline Simd broadcast(float x) { return {_mm256_set1_ps(x)}; }
+   inline void store(float *p) const { _mm256_storeu_ps(p, v); }
+
+   friend inline Simd operator+(Simd a, Simd b) { return {_mm256_add_ps(a.v, b.v)}; }
+   friend inline Simd operator-(Simd a, Simd b) { return {_mm256_sub_ps(a.v, b.v)}; }
+   friend inline Simd operator*(Simd a, Simd b) { return {_mm256_mul_ps(a.v, b.v)}; }
+   friend inline Simd operator/(Simd a, Simd b) { return {_mm256_div_ps(a.v, b.v)}; }
+   static inline Simd sqrt(Simd a) { return {_mm256_sqrt_ps(a.v)}; }
+
+   static inline Mask less(Simd a, Simd b) { return _mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ); }
+   static inline Mask both(Mask a, Mask b) { return _mm256_and_ps(a, b); }
+   static inline bool none(Mask m) { return _mm256_movemask_ps(m) == 0; }
+
+   static inline Simd select(Mask m, Simd a, Simd b) { return {_mm256_blendv_ps(b.v, a.v, m)}; }
+};
+
+#elif !defined(SIMD_SCALAR_ONLY) && defined(__SSE2__)
+
+template <> struct Simd<double>
+{
+   static constexpr int WIDTH = 2;
+   static constexpr const char *NAME = "SSE2";
+
+   using Mask = __m128d;
+
+   __m128d v;
+
+   static inline Simd load(const double *p) { return {_mm_loadu_pd(p)}; }
+   static inline Simd broadcast(double x) { return {_mm_set1_pd(x)}; }
+   inline void store(double *p) const { _mm_storeu_pd(p, v); }
+
+   friend inline Simd operator+(Simd a, Simd b) { return {_mm_add_pd(a.v, b.v)}; }
+   friend inline Simd operator-(Simd a, Simd b) { return {_mm_sub_pd(a.v, b.v)}; }
+   friend inline Simd operator*(Simd a, Simd b) { return {_mm_mul_pd(a.v, b.v)}; }
+   friend inline Simd operator/(Simd a, Simd b) { return {_mm_div_pd(a.v, b.v)}; }
+   static inline Simd sqrt(Simd a) { return {_mm_sqrt_pd(a.v)}; }
+
+   static inline Mask less(Simd a, Simd b) { return _mm_cmplt_pd(a.v, b.v); }
+   static inline Mask both(Mask a, Mask b) { return _mm_and_pd(a, b); }
+   static inline bool none(Mask m) { return _mm_movemask_pd(m) == 0; }
+
+   // SSE2 has no blend instruction
+   static inline Simd select(Mask m, Simd a, Simd b) { return {_mm_or_pd(_mm_and_pd(m, a.v), _mm_andnot_pd(m, b.v))}; }
+};
+
+template <> struct Simd<float>
+{
+   static constexpr int WIDTH = 4;
+   static constexpr const char *NAME = "SSE2";
+
+   using Mask = __m128;
+
+   __m128 v;
+
+   static inline Simd load(const float *p) { return {_mm_loadu_ps(p)}; }
+   static inline Simd broadcast(float x) { return {_mm_set1_ps(x)}; }
+   inline void store(float *p) const { _mm_storeu_ps(p, v); }
+
+   friend inline Simd operator+(Simd a, Simd b) { return {_mm_add_ps(a.v, b.v)}; }
+   friend inline Simd operator-(Simd a, Simd b) { return {_mm_sub_ps(a.v, b.v)}; }
+   friend inline Simd operator*(Simd a, Simd b) { return {_mm_mul_ps(a.v, b.v)}; }
+   friend inline Simd operator/(Simd a, Simd b) { return {_mm_div_ps(a.v, b.v)}; }
+   static inline Simd sqrt(Simd a) { return {_mm_sqrt_ps(a.v)}; }
+
+   static inline Mask less(Simd a, Simd b) { return _mm_cmplt_ps(a.v, b.v); }
+   static inline Mask both(Mask a, Mask b) { return _mm_and_ps(a, b); }
+   static inline bool none(Mask m) { return _mm_movemask_ps(m) == 0; }
+
+   static inline Simd select(Mask m, Simd a, Simd b) { return {_mm_or_ps(_mm_and_ps(m, a.v), _mm_andnot_ps(m, b.v))}; }
+};
+
+#elif !defined(SIMD_SCALAR_ONLY) && defined(__aarch64__) && defined(__ARM_NEON)
+
+template <> struct Simd<double>
+{
+   static constexpr int WIDTH = 2;
+   static constexpr const char *NAME = "NEON";
+
+   using Mask = uint64x2_t;
+
+   float64x2_t v;
+
+   static inline Simd load(const double *p) { return {vld1q_f64(p)}; }
+   static inline Simd broadcast(double x) { return {vdupq_n_f64(x)}; }
+   inline void store(double *p) const { vst1q_f64(p, v); }
+
+   friend inline Simd operator+(Simd a, Simd b) { return {vaddq_f64(a.v, b.v)}; }
+   friend inline Simd operator-(Simd a, Simd b) { return {vsubq_f64(a.v, b.v)}; }
+   friend inline Simd operator*(Simd a, Simd b) { return {vmulq_f64(a.v, b.v)}; }
+   friend inline Simd operator/(Simd a, Simd b) { return {vdivq_f64(a.v, b.v)}; }
+   static inline Simd sqrt(Simd a) { return {vsqrtq_f64(a.v)}; }
+
+   static inline Mask less(Simd a, Simd b) { return vcltq_f64(a.v, b.v); }
+   static inline Mask both(Mask a, Mask b) { return vandq_u64(a, b); }
+   static inline bool none(Mask m) { return vmaxvq_u32(vreinterpretq_u32_u64(m)) == 0; }
+
+   static inline Simd select(Mask m, Simd a, Simd b) { return {vbslq_f64(m, a.v, b.v)}; }
+};
+
+template <> struct Simd<float>
+{
+   static constexpr int WIDTH = 4;
+   static constexpr const char *NAME = "NEON";
+
+   using Mask = uint32x4_t;
+
+   float32x4_t v;
+
+   static inline Simd load(const float *p) { return {vld1q_f32(p)}; }
+   static inline Simd broadcast(float x) { return {vdupq_n_f32(x)}; }
+   inline void store(float *p) const { vst1q_f32(p, v); }
+
+   friend inline Simd operator+(Simd a, Simd b) { return {vaddq_f32(a.v, b.v)}; }
+   friend inline Simd operator-(Simd a, Simd b) { return {vsubq_f32(a.v, b.v)}; }
+   friend inline Simd operator*(Simd a, Simd b) { return {vmulq_f32(a.v, b.v)}; }
+   friend inline Simd operator/(Simd a, Simd b) { return {vdivq_f32(a.v, b.v)}; }
+   static inline Simd sqrt(Simd a) { return {vsqrtq_f32(a.v)}; }
+
+   static inline Mask less(Simd a, Simd b) { return vcltq_f32(a.v, b.v); }
+   static inline Mask both(Mask a, Mask b) { return vandq_u32(a, b); }
+   static inline bool none(Mask m) { return vmaxvq_u32(m) == 0; }
+
+   static inline Simd select(Mask m, Simd a, Simd b) { return {vbslq_f32(m, a.v, b.v)}; }
+};
+
+#endif
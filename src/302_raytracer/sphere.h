@@ -26,9 +26,11 @@
 class Sphere : public Hittable
 {
  public:
-   Sphere(const Point3 &center, double radius, shared_ptr<Material> mat)
+   Sphere(const Point3 &center, real radius, shared_ptr<Material> mat)
        : center(center), radius(std::fmax(0, radius)), mat(mat)
    {
+      auto rvec = Vec3(this->radius, this->radius, this->radius);
+      bbox = Aabb(center - rvec, center + rvec);
    }
 
    /**
@@ -89,13 +91,21 @@ class Sphere : public Hittable
       rec.t = root;
       rec.p = r.at(rec.t);
       rec.normal = (rec.p - center) / radius;
-      rec.mat_ptr = mat;
+      rec.mat_ptr = mat.get();
 
       return true;
    }
 
+   Aabb bounding_box() const override { return bbox; }
+
+   const Point3 &get_center() const { return center; }
+   real get_radius() const { return radius; }
+   const Material *get_material() const { return mat.get(); }
+   const shared_ptr<Material> &get_shared_material() const { return mat; }
+
  private:
    Point3 center;
-   double radius;
-   shared_ptr<Material> mat;
+   real radius;
+   shared_ptr<Material> mat; // The sphere keeps the material alive, hit records only point to it
+   Aabb bbox;
 };
\ No newline at end of file
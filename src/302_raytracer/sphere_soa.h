@@ -0,0 +1,473 @@
+/**
+ * @class Sphere_soa
+ * @brief A set of spheres stored as a structure of arrays, intersected with SIMD instructions.
+ *
+ * A list of `Sphere` objects is tested one object after the other through a
+ * virtual call, each reading its data from a separate heap allocation. This class
+ * instead keeps the centers, squared radii and material ids in separate
+ * contiguous arrays, so that `Simd<real>::WIDTH` spheres (see simd.h) are
+ * tested against a ray with each instruction.
+ *
+ * **Usage:**
+ * - As the storage of the spheres of a `Hittable_list`, which are then not
+ *   allocated one by one.
+ * - As the leaf storage of a `Bvh`: the spheres are then stored in leaf order
+ *   and `hit_range` tests the spheres of a single leaf.
+ * - `hit_packet` tests a packet of coherent rays (e.g. the primary rays of
+ *   neighbouring samples) against the spheres, one ray per lane.
+ * - As a view of arrays owned by someone else (see `view`), e.g. the arrays
+ *   of a memory-mapped scene file, which are then used without any copy.
+ *
+ * The hit records are identical to those of `Sphere::hit`: the same operations
+ * are performed in the same order, and the closest hit is kept.
+ */
+#pragma once
+
+#include "hittable.h"
+#include "simd.h"
+#include "sphere.h"
+
+#include <algorithm>
+#include <limits>
+#include <unordered_map>
+
+/**
+ * @brief Up to `SIZE` rays stored as a structure of arrays, one ray per SIMD lane
+ */
+struct Ray_packet
+{
+   static constexpr int SIZE = Simd<real>::WIDTH;
+
+   real ox[SIZE], oy[SIZE], oz[SIZE]; // Origins
+   real dx[SIZE], dy[SIZE], dz[SIZE]; // Directions
+   int count = 0;                       // Number of rays, the other lanes repeat the last ray
+
+   Ray_packet(const Ray *rays, int n)
+   {
+      count = std::min(n, SIZE);
+      for (int i = 0; i < SIZE; i++)
+      {
+         const Ray &r = rays[std::min(i, count - 1)];
+         ox[i] = r.origin().x();
+         oy[i] = r.origin().y();
+         oz[i] = r.origin().z();
+         dx[i] = r.direction().x();
+         dy[i] = r.direction().y();
+         dz[i] = r.direction().z();
+      }
+   }
+
+   Ray ray(int i) const { return Ray(Point3(ox[i], oy[i], oz[i]), Vec3(dx[i], dy[i], dz[i])); }
+};
+
+class Sphere_soa : public Hittable
+{
+ public:
+   using Lanes = Simd<real>;
+   static constexpr int WIDTH = Lanes::WIDTH;
+
+   Sphere_soa() {}
+
+   // The copies of a view share its arrays, the other copies get their own. The vectors keep their buffer when
+   // moved, so the moves need nothing special
+   Sphere_soa(const Sphere_soa &other) { *this = other; }
+   Sphere_soa(Sphere_soa &&) = default;
+   Sphere_soa &operator=(Sphere_soa &&) = default;
+
+   Sphere_soa &operator=(const Sphere_soa &other)
+   {
+      cx_storage = other.cx_storage;
+      cy_storage = other.cy_storage;
+      cz_storage = other.cz_storage;
+      radius_storage = other.radius_storage;
+      radius_sq_storage = other.radius_sq_storage;
+      material_ids_storage = other.material_ids_storage;
+      materials = other.materials;
+      material_index = other.material_index;
+      last_material_id = other.last_material_id;
+      n_spheres = other.n_spheres;
+      bbox = other.bbox;
+
+      if (other.is_view())
+         set_arrays(other.cx, other.cy, other.cz, other.radius, other.radius_sq, other.material_ids);
+      else
+         use_storage();
+      return *this;
+   }
+
+   /**
+    * @brief Spheres stored in arrays owned by the caller, which must outlive the view
+    *
+    * The arrays must hold `padded_size_for_view(n)` spheres, those past the `n` spheres
+    * having a NaN center, so that the SIMD loads stay in the arrays whatever the
+    * instruction set. `material_ids` are indices in `materials`.
+    */
+   static Sphere_soa view(int n, const real *cx, const real *cy, const real *cz, const real *radius,
+                          const real *radius_sq, const int32_t *material_ids, vector<shared_ptr<Material>> materials,
+                          const Aabb &bbox)
+   {
+      Sphere_soa spheres;
+      spheres.n_spheres = n;
+      spheres.materials = std::move(materials);
+      for (int i = 0; i < (int)spheres.materials.size(); i++)
+         spheres.material_index.emplace(spheres.materials[i].get(), i);
+      spheres.bbox = bbox;
+      spheres.set_arrays(cx, cy, cz, radius, radius_sq, material_ids);
+      return spheres;
+   }
+
+   // Blocks of NaN spheres after the last sphere of a view that suit all the SIMD widths
+   static constexpr int PADDING = 16;
+   static int padded_size_for_view(int n) { return (n + PADDING - 1) / PADDING * PADDING + PADDING; }
+
+   // Copies the spheres of `objects`, the other kinds of objects cannot be stored and are skipped
+   Sphere_soa(const vector<shared_ptr<Hittable>> &objects)
+   {
+      int unsupported = 0;
+      for (const auto &object : objects)
+      {
+         const Sphere *sphere = dynamic_cast<const Sphere *>(object.get());
+         if (sphere)
+            add(*sphere);
+         else
+            unsupported++;
+      }
+
+      if (unsupported > 0)
+         cerr << "Warning: " << unsupported << " non-sphere objects are ignored by Sphere_soa" << endl;
+   }
+
+   void add(const Sphere &sphere)
+   {
+      add(sphere.get_center(), sphere.get_radius(), sphere.get_shared_material());
+   }
+
+   // Same sphere as `Sphere(center, radius, mat)`, without allocating it
+   void add(const Point3 &center, real r, const shared_ptr<Material> &mat)
+   {
+      r = std::fmax(0, r);
+
+      // Copies the spheres of a view first. The new sphere replaces the first padding sphere, the arrays only
+      // growing by a block of padding when the last one is used
+      if (is_view())
+         copy_view();
+      resize_arrays(padded_size(n_spheres + 1));
+
+      cx_storage[n_spheres] = center.x();
+      cy_storage[n_spheres] = center.y();
+      cz_storage[n_spheres] = center.z();
+      radius_storage[n_spheres] = r;
+      radius_sq_storage[n_spheres] = r * r;
+      material_ids_storage[n_spheres] = material_id(mat);
+      n_spheres++;
+
+      use_storage();
+      bbox = Aabb(bbox, sphere_box(n_spheres - 1));
+   }
+
+   // Appends sphere `i` of another set
+   void add(const Sphere_soa &other, int i)
+   {
+      add(other.center(i), other.radius[i], other.materials[other.material_ids[i]]);
+   }
+
+   // Moves and resizes sphere `i`, keeping its material. The spheres of a view are copied first, the box of the
+   // set only grows
+   void set_sphere(int i, const Point3 &center, real r)
+   {
+      r = std::fmax(0, r);
+      if (is_view())
+      {
+         copy_view();
+         resize_arrays(padded_size(n_spheres));
+         use_storage();
+      }
+
+      cx_storage[i] = center.x();
+      cy_storage[i] = center.y();
+      cz_storage[i] = center.z();
+      radius_storage[i] = r;
+      radius_sq_storage[i] = r * r;
+      bbox = Aabb(bbox, sphere_box(i));
+   }
+
+   void reserve(int n)
+   {
+      for (auto *v : {&cx_storage, &cy_storage, &cz_storage, &radius_storage, &radius_sq_storage})
+         v->reserve(padded_size(n));
+      material_ids_storage.reserve(padded_size(n));
+   }
+
+   void clear()
+   {
+      for (auto *v : {&cx_storage, &cy_storage, &cz_storage, &radius_storage, &radius_sq_storage})
+         v->clear();
+      material_ids_storage.clear();
+      materials.clear();
+      material_index.clear();
+      last_material_id = 0;
+      n_spheres = 0;
+      bbox = Aabb();
+      use_storage();
+   }
+
+   bool hit(const Ray &r, Interval ray_t, Hit_record &rec) const override
+   {
+      return hit_range(r, ray_t, rec, 0, n_spheres);
+   }
+
+   /**
+    * @brief Intersects a ray with the spheres [first, first + count)
+    *
+    * The spheres are tested `WIDTH` at a time. The lanes past the end of the range
+    * contain other spheres (or the padding) and are ignored.
+    */
+   bool hit_range(const Ray &r, Interval ray_t, Hit_record &rec, int first, int count) const
+   {
+      const Vec3 &o = r.origin();
+      const Vec3 &d = r.direction();
+
+      const Lanes ox = Lanes::broadcast(o.x()), oy = Lanes::broadcast(o.y()), oz = Lanes::broadcast(o.z());
+      const Lanes dx = Lanes::broadcast(d.x()), dy = Lanes::broadcast(d.y()), dz = Lanes::broadcast(d.z());
+      const Lanes a = Lanes::broadcast(d.length_squared());
+      const Lanes t_min = Lanes::broadcast(ray_t.min), t_max = Lanes::broadcast(ray_t.max);
+      const Lanes no_hit = Lanes::broadcast(inf);
+
+      real closest = ray_t.max;
+      int best = -1;
+      const int end = first + count;
+
+      for (int i = first; i < end; i += WIDTH)
+      {
+         // Same steps as `Sphere::hit`, for WIDTH spheres
+         Lanes ocx = Lanes::load(&cx[i]) - ox;
+         Lanes ocy = Lanes::load(&cy[i]) - oy;
+         Lanes ocz = Lanes::load(&cz[i]) - oz;
+         Lanes h = dx * ocx + dy * ocy + dz * ocz;
+         Lanes c = (ocx * ocx + ocy * ocy + ocz * ocz) - Lanes::load(&radius_sq[i]);
+
+         // A negative discriminant gives NaN roots, which fail all the comparisons below
+         Lanes sqrtd = Lanes::sqrt(h * h - a * c);
+
+         Lanes near_root = (h - sqrtd) / a;
+         Lanes far_root = (h + sqrtd) / a;
+         auto near_ok = Lanes::both(Lanes::less(t_min, near_root), Lanes::less(near_root, t_max));
+         auto far_ok = Lanes::both(Lanes::less(t_min, far_root), Lanes::less(far_root, t_max));
+
+         if (Lanes::none(near_ok) && Lanes::none(far_ok))
+            continue;
+
+         real roots[WIDTH];
+         Lanes::select(near_ok, near_root, Lanes::select(far_ok, far_root, no_hit)).store(roots);
+
+         // Keep the first of the closest spheres, as the sequential tests would
+         const int lanes = std::min(WIDTH, end - i);
+         for (int j = 0; j < lanes; j++)
+         {
+            if (roots[j] < closest)
+            {
+               closest = roots[j];
+               best = i + j;
+            }
+         }
+      }
+
+      if (best < 0)
+         return false;
+
+      fill_record(r, closest, best, rec);
+      return true;
+   }
+
+   /**
+    * @brief Intersects a packet of rays with the spheres [first, first + count)
+    *
+    * Each lane follows its own ray: `closest[i]` is the current upper bound of ray `i`,
+    * lowered when a closer sphere is found, and `best[i]` the index of that sphere.
+    * Records are filled later by `fill_record`, so that a packet can be tested against
+    * several ranges (e.g. the leaves of a hierarchy) first.
+    */
+   void hit_packet_range(const Ray_packet &packet, real t_min, real closest[Ray_packet::SIZE],
+                         int best[Ray_packet::SIZE], int first, int count) const
+   {
+      const Lanes ox = Lanes::load(packet.ox), oy = Lanes::load(packet.oy), oz = Lanes::load(packet.oz);
+      const Lanes dx = Lanes::load(packet.dx), dy = Lanes::load(packet.dy), dz = Lanes::load(packet.dz);
+      const Lanes a = dx * dx + dy * dy + dz * dz;
+      const Lanes t_lo = Lanes::broadcast(t_min);
+
+      // The sphere indices are small integers, exactly represented as doubles
+      Lanes t_hi = Lanes::load(closest);
+      real best_lanes[Ray_packet::SIZE];
+      for (int j = 0; j < Ray_packet::SIZE; j++)
+         best_lanes[j] = best[j];
+      Lanes best_index = Lanes::load(best_lanes);
+
+      for (int i = first; i < first + count; i++)
+      {
+         Lanes ocx = Lanes::broadcast(cx[i]) - ox;
+         Lanes ocy = Lanes::broadcast(cy[i]) - oy;
+         Lanes ocz = Lanes::broadcast(cz[i]) - oz;
+         Lanes h = dx * ocx + dy * ocy + dz * ocz;
+         Lanes c = (ocx * ocx + ocy * ocy + ocz * ocz) - Lanes::broadcast(radius_sq[i]);
+         Lanes sqrtd = Lanes::sqrt(h * h - a * c);
+
+         Lanes near_root = (h - sqrtd) / a;
+         Lanes far_root = (h + sqrtd) / a;
+         auto near_ok = Lanes::both(Lanes::less(t_lo, near_root), Lanes::less(near_root, t_hi));
+         auto far_ok = Lanes::both(Lanes::less(t_lo, far_root), Lanes::less(far_root, t_hi));
+
+         Lanes index = Lanes::broadcast(i);
+         best_index = Lanes::select(near_ok, index, Lanes::select(far_ok, index, best_index));
+         t_hi = Lanes::select(near_ok, near_root, Lanes::select(far_ok, far_root, t_hi));
+      }
+
+      t_hi.store(closest);
+      best_index.store(best_lanes);
+      for (int j = 0; j < Ray_packet::SIZE; j++)
+         best[j] = (int)best_lanes[j];
+   }
+
+   /**
+    * @brief Intersects all the rays of a packet with all the spheres
+    * @param hits Set to whether each ray hit a sphere, `recs` is only filled for those
+    */
+   void hit_packet(const Ray_packet &packet, Interval ray_t, Hit_record recs[Ray_packet::SIZE],
+                   bool hits[Ray_packet::SIZE]) const
+   {
+      real closest[Ray_packet::SIZE];
+      int best[Ray_packet::SIZE];
+      std::fill(closest, closest + Ray_packet::SIZE, ray_t.max);
+      std::fill(best, best + Ray_packet::SIZE, -1);
+
+      hit_packet_range(packet, ray_t.min, closest, best, 0, n_spheres);
+
+      for (int j = 0; j < packet.count; j++)
+      {
+         hits[j] = best[j] >= 0;
+         if (hits[j])
+            fill_record(packet.ray(j), closest[j], best[j], recs[j]);
+      }
+   }
+
+   // Fills the record of the hit of ray `r` with sphere `index` at distance `t`, like `Sphere::hit`
+   inline void fill_record(const Ray &r, real t, int index, Hit_record &rec) const
+   {
+      Point3 center(cx[index], cy[index], cz[index]);
+      rec.t = t;
+      rec.p = r.at(t);
+      rec.normal = (rec.p - center) / radius[index];
+      rec.mat_ptr = materials[material_ids[index]].get();
+   }
+
+   Aabb bounding_box() const override { return bbox; }
+
+   int size() const { return n_spheres; }
+   bool empty() const { return n_spheres == 0; }
+
+   // Whether the arrays belong to someone else, see `view`
+   bool is_view() const { return n_spheres > 0 && cx != cx_storage.data(); }
+
+   Point3 center(int i) const { return Point3(cx[i], cy[i], cz[i]); }
+   real get_radius(int i) const { return radius[i]; }
+   int get_material_id(int i) const { return material_ids[i]; }
+   const vector<shared_ptr<Material>> &get_materials() const { return materials; }
+
+   // Raw arrays, padded as described in `view`
+   const real *center_x() const { return cx; }
+   const real *center_y() const { return cy; }
+   const real *center_z() const { return cz; }
+   const real *radii() const { return radius; }
+   const real *radii_squared() const { return radius_sq; }
+   const int32_t *material_id_array() const { return material_ids; }
+
+   // Box of sphere `i`, the same as `Sphere::bounding_box`
+   Aabb sphere_box(int i) const
+   {
+      Vec3 rvec(radius[i], radius[i], radius[i]);
+      return Aabb(center(i) - rvec, center(i) + rvec);
+   }
+
+   // Name of the instruction set used by the kernels
+   static const char *instruction_set() { return Lanes::NAME; }
+
+ private:
+   // One array per component, padded to a multiple of WIDTH (plus one full block, see `padded_size`)
+   vector<real> cx_storage, cy_storage, cz_storage;
+   vector<real> radius_storage, radius_sq_storage;
+   vector<int32_t> material_ids_storage; // Index in `materials`
+
+   // The arrays used by the kernels: the vectors above, or those given to `view`
+   const real *cx = nullptr, *cy = nullptr, *cz = nullptr;
+   const real *radius = nullptr, *radius_sq = nullptr;
+   const int32_t *material_ids = nullptr;
+
+   vector<shared_ptr<Material>> materials; // Distinct materials, kept alive for the hit records
+   unordered_map<const Material *, int> material_index;
+   int last_material_id = 0; // Material of the last sphere added
+
+   int n_spheres = 0;
+   Aabb bbox;
+
+   /**
+    * A range may start anywhere, so a full block of padding is kept after the last
+    * sphere, for the loads of the last block of a range to stay in the arrays
+    */
+   static int padded_size(int n) { return (n + WIDTH - 1) / WIDTH * WIDTH + WIDTH; }
+
+   // The padding spheres have a NaN center, so they are never hit. The arrays never shrink, see `add`
+   void resize_arrays(int n)
+   {
+      const real nan = std::numeric_limits<real>::quiet_NaN();
+      cx_storage.resize(n, nan);
+      cy_storage.resize(n, nan);
+      cz_storage.resize(n, nan);
+      radius_storage.resize(n, 0.0);
+      radius_sq_storage.resize(n, 0.0);
+      material_ids_storage.resize(n, 0);
+   }
+
+   void set_arrays(const real *x, const real *y, const real *z, const real *r, const real *r_sq, const int32_t *ids)
+   {
+      cx = x;
+      cy = y;
+      cz = z;
+      radius = r;
+      radius_sq = r_sq;
+      material_ids = ids;
+   }
+
+   // Points the kernels to the vectors, to be called whenever they may have moved
+   void use_storage()
+   {
+      set_arrays(cx_storage.data(), cy_storage.data(), cz_storage.data(), radius_storage.data(),
+                 radius_sq_storage.data(), material_ids_storage.data());
+   }
+
+   // Copies the arrays of a view into the vectors, without the padding
+   void copy_view()
+   {
+      cx_storage.assign(cx, cx + n_spheres);
+      cy_storage.assign(cy, cy + n_spheres);
+      cz_storage.assign(cz, cz + n_spheres);
+      radius_storage.assign(radius, radius + n_spheres);
+      radius_sq_storage.assign(radius_sq, radius_sq + n_spheres);
+      material_ids_storage.assign(material_ids, material_ids + n_spheres);
+      use_storage();
+   }
+
+   int material_id(const shared_ptr<Material> &mat)
+   {
+      // Consecutive spheres mostly share their material
+      if (!materials.empty() && materials[last_material_id] == mat)
+         return last_material_id;
+
+      auto it = material_index.find(mat.get());
+      if (it != material_index.end())
+         return last_material_id = it->second;
+
+      last_material_id = (int)materials.size();
+      materials.push_back(mat);
+      material_index.emplace(mat.get(), last_material_id);
+      return last_material_id;
+   }
+};
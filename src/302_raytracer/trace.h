@@ -0,0 +1,440 @@
+/**
+ * @file trace.h
+ * @brief Scoped timers of the renderers, exported to the Chrome trace event format
+ *
+ * The timers are only compiled with the `TRACE` CMake option (which defines `RT_TRACE`).
+ * Without it the macros below expand to nothing, and the renderers carry no timing code at all.
+ *
+ * - `TRACE_SCOPE(category, name)`: an event lasting from this line to the end of the enclosing
+ *   scope, on the track of the calling thread. `TRACE_SCOPE_ARGS` adds two integer arguments,
+ *   e.g. the position of a tile.
+ * - `TRACE_THREAD(name, index)`: names the track of the calling thread, e.g. "worker 3". The
+ *   workers of successive renders are new threads, the workers of the same index share a track.
+ * - `TRACE_STAGE(stage)`: sampled timer of the hot stages (intersection, shading, random numbers),
+ *   which run far too often for one event per call. Only one call in `STAGE_SAMPLE_PERIOD` reads
+ *   the clock, and the total time of the stage is extrapolated from those calls, minus the cost of
+ *   reading the clock. The stages nest: the shading time includes the random numbers it draws.
+ *   The clock is the wall clock, the CPU clock of a thread being far too slow to read: with more
+ *   threads than cores, the time slices of the other threads are counted too. A random number
+ *   takes a few ns, well below the ~20-40 ns of a clock read, so its estimate is only an order
+ *   of magnitude.
+ * - `Trace::add_event`: events timed elsewhere, e.g. the GPU kernels timed with cudaEvents.
+ *
+ * Nothing is recorded before `Trace::start()`. Each thread appends to its own buffer, without
+ * locking but the first time. Once the renders are done, `Trace::write` merges the buffers into
+ * a JSON file for chrome://tracing or https://ui.perfetto.dev, and `Trace::print_summary`
+ * reports the busy and idle time of the workers and the time of the stages.
+ */
+#pragma once
+
+#ifdef RT_TRACE
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+#define TRACE_SCOPE(category, name) Trace_scope TRACE_CONCAT(trace_scope_, __LINE__)(category, name)
+#define TRACE_SCOPE_ARGS(category, name, arg0, value0, arg1, value1)                                                \
+   Trace_scope TRACE_CONCAT(trace_scope_, __LINE__)(category, name, arg0, value0, arg1, value1)
+#define TRACE_THREAD(name, index) Trace::set_thread(name, index)
+#define TRACE_STAGE(stage) Trace_stage_timer TRACE_CONCAT(trace_stage_, __LINE__)(stage)
+
+// The hot stages timed by sampling, see `TRACE_STAGE`
+enum class Trace_stage
+{
+   Intersect, // Intersection of the rays with the scene
+   Shade,     // Scattering at the hits, including the random numbers drawn
+   Rng,       // Seeding of the sample sequences and random numbers
+   Count
+};
+
+const char *const trace_stage_names[] = {"intersect", "shade", "rng"};
+
+struct Trace_event
+{
+   const char *name;     // Static strings only, they are not copied
+   const char *category; // Static too
+   int track;            // Thread id of the event in the trace
+   double start_us;      // Since `Trace::start`
+   double duration_us;
+   const char *arg_names[2]; // Null for no argument
+   long long arg_values[2];
+};
+
+// Calls and sampled time of a stage on one thread
+struct Trace_stage_counters
+{
+   unsigned long long calls = 0;
+   unsigned long long sampled_calls = 0;
+   long long sampled_ns = 0;
+};
+
+class Trace
+{
+ public:
+   static const unsigned STAGE_SAMPLE_PERIOD = 64; // Calls of a stage per timed call
+
+   // The events of one thread, with the stages it timed
+   struct Thread_buffer
+   {
+      int track = 0;
+      std::vector<Trace_event> events;
+      Trace_stage_counters stages[(int)Trace_stage::Count];
+   };
+
+   Trace() = delete; // Prevent instantiation
+
+   // The clock of the stages, in ns
+   static long long stage_clock_ns()
+   {
+      return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch())
+          .count();
+   }
+
+   static bool enabled() { return active().load(std::memory_order_relaxed); }
+
+   // Clears what was recorded and starts recording. Not to be called while rendering.
+   static void start()
+   {
+      {
+         std::lock_guard<std::mutex> lock(registry_mutex());
+         for (auto &buffer : buffers())
+         {
+            buffer->events.clear();
+            for (auto &stage : buffer->stages)
+               stage = Trace_stage_counters();
+         }
+      }
+
+      epoch() = std::chrono::steady_clock::now();
+      calibrate();
+      active().store(true, std::memory_order_relaxed);
+   }
+
+   static void stop() { active().store(false, std::memory_order_relaxed); }
+
+   // Microseconds since `start`
+   static double now_us()
+   {
+      return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - epoch()).count();
+   }
+
+   /**
+    * @brief Records an event timed by the caller
+    * @param track A track from `track_id`, or -1 for the track of the calling thread
+    */
+   static void add_event(const char *category, const char *name, double start_us, double duration_us, int track = -1,
+                         const char *arg0 = nullptr, long long value0 = 0, const char *arg1 = nullptr,
+                         long long value1 = 0)
+   {
+      if (!enabled())
+         return;
+      Thread_buffer &buffer = thread_buffer();
+      buffer.events.push_back({name, category, track < 0 ? buffer.track : track, start_us, duration_us,
+                               {arg0, arg1}, {value0, value1}});
+   }
+
+   // The track of a name, created on its first use, e.g. "GPU compute"
+   static int track_id(const std::string &name)
+   {
+      std::lock_guard<std::mutex> lock(registry_mutex());
+      auto it = track_names().find(name);
+      if (it != track_names().end())
+         return it->second;
+      int id = (int)track_names().size();
+      track_names()[name] = id;
+      return id;
+   }
+
+   // Moves the calling thread to the track "<name> <index>", or "<name>" for a negative index
+   static void set_thread(const char *name, int index)
+   {
+      if (enabled())
+         thread_buffer().track = track_id(index < 0 ? std::string(name) : name + (" " + std::to_string(index)));
+   }
+
+   // The buffer of the calling thread, registered on its first use
+   static Thread_buffer &thread_buffer()
+   {
+      static thread_local Thread_buffer *buffer = nullptr;
+      if (buffer == nullptr)
+      {
+         int track = track_id("thread " + std::to_string(thread_count()++));
+         std::lock_guard<std::mutex> lock(registry_mutex());
+         buffers().push_back(std::make_unique<Thread_buffer>());
+         buffer = buffers().back().get();
+         buffer->track = track;
+      }
+      return *buffer;
+   }
+
+   // Writes the events in the JSON object format of the Chrome trace viewer
+   static bool write(const std::string &path)
+   {
+      std::ofstream out(path);
+      if (!out)
+         return false;
+
+      std::lock_guard<std::mutex> lock(registry_mutex());
+      out << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+
+      // The names of the tracks, shown in the order they were created
+      bool first = true;
+      for (const auto &entry : track_names())
+      {
+         out << (first ? "" : ",\n") << "{\"ph\": \"M\", \"name\": \"thread_name\", \"pid\": 1, \"tid\": "
+             << entry.second << ", \"args\": {\"name\": \"" << entry.first << "\"}},\n"
+             << "{\"ph\": \"M\", \"name\": \"thread_sort_index\", \"pid\": 1, \"tid\": " << entry.second
+             << ", \"args\": {\"sort_index\": " << entry.second << "}}";
+         first = false;
+      }
+
+      out << std::fixed << std::setprecision(3);
+      for (const auto &buffer : buffers())
+      {
+         for (const Trace_event &e : buffer->events)
+         {
+            out << (first ? "" : ",\n") << "{\"ph\": \"X\", \"name\": \"" << e.name << "\", \"cat\": \"" << e.category
+                << "\", \"pid\": 1, \"tid\": " << e.track << ", \"ts\": " << e.start_us
+                << ", \"dur\": " << e.duration_us;
+            if (e.arg_names[0] != nullptr)
+            {
+               out << ", \"args\": {\"" << e.arg_names[0] << "\": " << e.arg_values[0];
+               if (e.arg_names[1] != nullptr)
+                  out << ", \"" << e.arg_names[1] << "\": " << e.arg_values[1];
+               out << "}";
+            }
+            out << "}";
+            first = false;
+         }
+      }
+
+      // The sampled stages have no events, their estimated totals go with the metadata
+      out << "\n], \"otherData\": {\"stage_sample_period\": " << STAGE_SAMPLE_PERIOD;
+      for (int s = 0; s < (int)Trace_stage::Count; s++)
+      {
+         double total = 0;
+         for (const auto &buffer : buffers())
+            total += estimate_ms(buffer->stages[s]);
+         out << ", \"" << trace_stage_names[s] << "_ms\": " << total;
+      }
+      out << "}}\n";
+
+      return (bool)out;
+   }
+
+   /**
+    * @brief Reports the busy time of every track (the time in its "tile" events) against the
+    *        time of the renders (the "render" events), and the estimated time of the stages
+    */
+   static void print_summary(std::ostream &out)
+   {
+      std::lock_guard<std::mutex> lock(registry_mutex());
+
+      std::map<int, double> busy_us;
+      std::map<int, int> tiles;
+      double render_us = 0;
+      size_t n_events = 0;
+      for (const auto &buffer : buffers())
+      {
+         n_events += buffer->events.size();
+         for (const Trace_event &e : buffer->events)
+         {
+            if (std::string(e.category) == "tile")
+            {
+               busy_us[e.track] += e.duration_us;
+               tiles[e.track]++;
+            }
+            else if (std::string(e.category) == "render")
+               render_us += e.duration_us;
+         }
+      }
+
+      out << "Trace: " << n_events << " events" << std::endl;
+      if (!busy_us.empty() && render_us > 0)
+      {
+         out << std::fixed << std::setprecision(1);
+         out << "Load balance over " << render_us / 1000 << " ms of rendering:" << std::endl;
+         for (const auto &entry : track_names())
+         {
+            auto it = busy_us.find(entry.second);
+            if (it == busy_us.end())
+               continue;
+            out << "  " << std::left << std::setw(16) << entry.first << std::right << std::setw(10)
+                << it->second / 1000 << " ms busy, " << std::setw(10) << std::max(0.0, render_us - it->second) / 1000
+                << " ms idle (" << std::setw(5) << 100 * it->second / render_us << " % busy), "
+                << tiles[entry.second] << " tiles" << std::endl;
+         }
+      }
+
+      bool any_stage = false;
+      for (int s = 0; s < (int)Trace_stage::Count; s++)
+      {
+         double total = 0;
+         unsigned long long calls = 0;
+         for (const auto &buffer : buffers())
+         {
+            total += estimate_ms(buffer->stages[s]);
+            calls += buffer->stages[s].calls;
+         }
+         if (calls == 0)
+            continue;
+         if (!any_stage)
+            out << "Stages (1 call in " << STAGE_SAMPLE_PERIOD << " timed, summed over the threads):" << std::endl;
+         any_stage = true;
+         out << "  " << std::left << std::setw(16) << trace_stage_names[s] << std::right << std::fixed
+             << std::setprecision(1) << std::setw(10) << total << " ms, " << calls << " calls" << std::endl;
+      }
+      out << std::defaultfloat;
+   }
+
+ private:
+   static std::atomic<bool> &active()
+   {
+      static std::atomic<bool> flag{false};
+      return flag;
+   }
+
+   static std::chrono::steady_clock::time_point &epoch()
+   {
+      static std::chrono::steady_clock::time_point time = std::chrono::steady_clock::now();
+      return time;
+   }
+
+   static std::mutex &registry_mutex()
+   {
+      static std::mutex mutex;
+      return mutex;
+   }
+
+   static std::vector<std::unique_ptr<Thread_buffer>> &buffers()
+   {
+      static std::vector<std::unique_ptr<Thread_buffer>> all;
+      return all;
+   }
+
+   static std::map<std::string, int> &track_names()
+   {
+      static std::map<std::string, int> names;
+      return names;
+   }
+
+   static std::atomic<int> &thread_count()
+   {
+      static std::atomic<int> count{0};
+      return count;
+   }
+
+   // Time measured by a timed call doing nothing, subtracted from the sampled time
+   static double &clock_overhead_ns()
+   {
+      static double ns = 0;
+      return ns;
+   }
+
+   // The lowest mean of a few rounds, so that an interruption does not inflate the overhead
+   static void calibrate()
+   {
+      const int rounds = 20, n = 1000;
+      double lowest = 0;
+      for (int round = 0; round < rounds; round++)
+      {
+         long long total = 0;
+         for (int i = 0; i < n; i++)
+         {
+            long long start = stage_clock_ns();
+            total += stage_clock_ns() - start;
+         }
+         lowest = round == 0 ? (double)total / n : std::min(lowest, (double)total / n);
+      }
+      clock_overhead_ns() = lowest;
+   }
+
+   static double estimate_ms(const Trace_stage_counters &c)
+   {
+      if (c.sampled_calls == 0)
+         return 0;
+      double sampled = std::max(0.0, c.sampled_ns - c.sampled_calls * clock_overhead_ns());
+      return sampled * ((double)c.calls / c.sampled_calls) * 1e-6;
+   }
+};
+
+// See `TRACE_SCOPE`
+class Trace_scope
+{
+ public:
+   Trace_scope(const char *category, const char *name, const char *arg0 = nullptr, long long value0 = 0,
+               const char *arg1 = nullptr, long long value1 = 0)
+       : category(category), name(name), arg_names{arg0, arg1}, arg_values{value0, value1},
+         start_us(Trace::enabled() ? Trace::now_us() : -1)
+   {
+   }
+
+   ~Trace_scope()
+   {
+      if (start_us >= 0)
+         Trace::add_event(category, name, start_us, Trace::now_us() - start_us, -1, arg_names[0], arg_values[0],
+                          arg_names[1], arg_values[1]);
+   }
+
+   Trace_scope(const Trace_scope &) = delete;
+   Trace_scope &operator=(const Trace_scope &) = delete;
+
+ private:
+   const char *category, *name;
+   const char *arg_names[2];
+   long long arg_values[2];
+   double start_us; // Negative when not recording
+};
+
+// See `TRACE_STAGE`
+class Trace_stage_timer
+{
+ public:
+   explicit Trace_stage_timer(Trace_stage stage)
+   {
+      if (!Trace::enabled())
+         return;
+      Trace_stage_counters &c = Trace::thread_buffer().stages[(int)stage];
+      if (++c.calls % Trace::STAGE_SAMPLE_PERIOD == 0)
+      {
+         counters = &c;
+         start_ns = Trace::stage_clock_ns();
+      }
+   }
+
+   ~Trace_stage_timer()
+   {
+      if (counters == nullptr)
+         return;
+      counters->sampled_ns += Trace::stage_clock_ns() - start_ns;
+      counters->sampled_calls++;
+   }
+
+   Trace_stage_timer(const Trace_stage_timer &) = delete;
+   Trace_stage_timer &operator=(const Trace_stage_timer &) = delete;
+
+ private:
+   Trace_stage_counters *counters = nullptr; // Set when this call is timed
+   long long start_ns = 0;
+};
+
+#else
+
+#define TRACE_SCOPE(category, name)
+#define TRACE_SCOPE_ARGS(category, name, arg0, value0, arg1, value1)
+#define TRACE_THREAD(name, index)
+#define TRACE_STAGE(stage)
+
+#endif
@@ -8,9 +8,28 @@
 
 using namespace std;
 
-const double inf = numeric_limits<double>::infinity();
+/**
+ * Scalar type of the geometry of the CPU renderers (`Vec3`, `Ray`, `Interval`, the hittables).
+ * Selected with the PRECISION CMake option, `double` being the reference. In `float`, the
+ * vectors are half the size and the SIMD kernels process twice as many lanes, as on the GPU.
+ */
+#if defined(REAL_FLOAT)
+using real = float;
+#else
+using real = double;
+#endif
+
+const real inf = numeric_limits<real>::infinity();
 const double PI = 3.1415926535897932385;
 
+// Closest distance accepted for a hit, so that a scattered ray does not hit its own surface.
+// Larger in float, where the error on the hit point is larger.
+#if defined(REAL_FLOAT)
+const real RAY_T_MIN = 0.001f;
+#else
+const real RAY_T_MIN = 0.0001;
+#endif
+
 namespace utils
 {
 inline double degrees_to_radians(double degrees) { return degrees * M_PI / 180.0; }
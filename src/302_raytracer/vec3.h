@@ -1,24 +1,26 @@
 #pragma once
 
 #include "rnd_gen.h"
+#include "utils.h"
+
 #include <cmath>
 #include <iostream>
 
 class Vec3
 {
  public:
-   double e[3];
+   real e[3];
 
    Vec3() : e{0, 0, 0} {}
-   Vec3(double e0, double e1, double e2) : e{e0, e1, e2} {}
+   Vec3(real e0, real e1, real e2) : e{e0, e1, e2} {}
 
-   double x() const { return e[0]; }
-   double y() const { return e[1]; }
-   double z() const { return e[2]; }
+   real x() const { return e[0]; }
+   real y() const { return e[1]; }
+   real z() const { return e[2]; }
 
    Vec3 operator-() const { return Vec3(-e[0], -e[1], -e[2]); }
-   double operator[](int i) const { return e[i]; }
-   double &operator[](int i) { return e[i]; }
+   real operator[](int i) const { return e[i]; }
+   real &operator[](int i) { return e[i]; }
 
    Vec3 &operator+=(const Vec3 &v)
    {
@@ -28,7 +30,7 @@ class Vec3
       return *this;
    }
 
-   Vec3 &operator*=(double t)
+   Vec3 &operator*=(real t)
    {
       e[0] *= t;
       e[1] *= t;
@@ -36,11 +38,11 @@ class Vec3
       return *this;
    }
 
-   Vec3 &operator/=(double t) { return *this *= 1 / t; }
+   Vec3 &operator/=(real t) { return *this *= 1 / t; }
 
-   double length() const { return std::sqrt(length_squared()); }
+   real length() const { return std::sqrt(length_squared()); }
 
-   double length_squared() const { return e[0] * e[0] + e[1] * e[1] + e[2] * e[2]; }
+   real length_squared() const { return e[0] * e[0] + e[1] * e[1] + e[2] * e[2]; }
 
    bool near_zero() const
    {
@@ -51,13 +53,13 @@ class Vec3
 
    static Vec3 random() { return Vec3(RndGen::random_double(), RndGen::random_double(), RndGen::random_double()); }
 
-   static Vec3 random(double min, double max)
+   static Vec3 random(real min, real max)
    {
       return Vec3(RndGen::random_double(min, max), RndGen::random_double(min, max), RndGen::random_double(min, max));
    }
 
    friend Vec3 unit_vector(const Vec3 &v);
-   friend double dot(const Vec3 &u, const Vec3 &v);
+   friend real dot(const Vec3 &u, const Vec3 &v);
 
    static Vec3 random_unit_vector() { return unit_vector(random(-1, 1)); }
 
@@ -76,6 +78,17 @@ class Vec3
       }
    }
 
+   /**
+    * @brief Random unit vector around the z axis, of density cos(theta) / pi
+    * Closed form, from two random numbers: a point drawn uniformly in the unit disk, lifted to the hemisphere.
+    */
+   static Vec3 random_cosine_direction()
+   {
+      const double r1 = RndGen::random_double(), r2 = RndGen::random_double();
+      const double phi = 2 * PI * r1, r = std::sqrt(r2);
+      return Vec3(std::cos(phi) * r, std::sin(phi) * r, std::sqrt(1 - r2));
+   }
+
    static Vec3 random_in_hemisphere(const Vec3 &normal)
    {
       Vec3 in_unit_sphere = random_in_unit_sphere();
@@ -100,13 +113,13 @@ inline Vec3 operator-(const Vec3 &u, const Vec3 &v) { return Vec3(u.e[0] - v.e[0
 
 inline Vec3 operator*(const Vec3 &u, const Vec3 &v) { return Vec3(u.e[0] * v.e[0], u.e[1] * v.e[1], u.e[2] * v.e[2]); }
 
-inline Vec3 operator*(double t, const Vec3 &v) { return Vec3(t * v.e[0], t * v.e[1], t * v.e[2]); }
+inline Vec3 operator*(real t, const Vec3 &v) { return Vec3(t * v.e[0], t * v.e[1], t * v.e[2]); }
 
-inline Vec3 operator*(const Vec3 &v, double t) { return t * v; }
+inline Vec3 operator*(const Vec3 &v, real t) { return t * v; }
 
-inline Vec3 operator/(const Vec3 &v, double t) { return (1 / t) * v; }
+inline Vec3 operator/(const Vec3 &v, real t) { return (1 / t) * v; }
 
-inline double dot(const Vec3 &u, const Vec3 &v) { return u.e[0] * v.e[0] + u.e[1] * v.e[1] + u.e[2] * v.e[2]; }
+inline real dot(const Vec3 &u, const Vec3 &v) { return u.e[0] * v.e[0] + u.e[1] * v.e[1] + u.e[2] * v.e[2]; }
 
 inline Vec3 cross(const Vec3 &u, const Vec3 &v)
 {
@@ -0,0 +1,121 @@
+/**
+ * @file wavefront.h
+ * @brief Queues of the wavefront (stream) path tracer, see `Camera::renderPassWavefront`.
+ *
+ * Instead of following one path from the camera to the sky before starting the
+ * next one, the wavefront renderer moves a whole batch of paths (a wave) one
+ * bounce forward at a time, in separate stages:
+ *
+ * 1. Generation: the primary rays of all the samples of the wave are queued.
+ * 2. Intersection: all the queued rays are intersected with the scene. The
+ *    primary rays of a pixel are coherent, so they are traced in SIMD packets.
+ * 3. Shading: the hits are grouped by material, then each material scatters
+ *    its rays. The paths that end write their color, the others are compacted
+ *    into the queue of the next bounce.
+ *
+ * After the first bounce, the rays are traced one by one. Sorting them by
+ * direction before tracing was tried, and cost more than it saved.
+ *
+ * Each path keeps its own random engine, swapped in during its shading, so that
+ * it draws the same numbers as in `Camera::ray_color` and the image is the same
+ * as with the other CPU renderers.
+ */
+#pragma once
+
+#include "accumulation_buffer.h"
+#include "color.h"
+#include "hittable.h"
+#include "ray.h"
+#include "rnd_gen.h"
+#include "sphere_soa.h"
+#include "vec3.h"
+
+#include <algorithm>
+#include <vector>
+
+/**
+ * @class Path_queue
+ * @brief The rays of the paths in flight, with the throughput of their path, as a structure of arrays
+ */
+class Path_queue
+{
+ public:
+   std::vector<real> ox, oy, oz; // Origins
+   std::vector<real> dx, dy, dz; // Directions
+   std::vector<real> tr, tg, tb; // Throughputs of the paths
+   std::vector<int> path;        // Index of the path in the wave
+
+   int size() const { return (int)path.size(); }
+   bool empty() const { return path.empty(); }
+
+   void clear()
+   {
+      for (auto *v : {&ox, &oy, &oz, &dx, &dy, &dz, &tr, &tg, &tb})
+         v->clear();
+      path.clear();
+   }
+
+   void push(const Ray &r, const Color &throughput, int path_index)
+   {
+      ox.push_back(r.origin().x());
+      oy.push_back(r.origin().y());
+      oz.push_back(r.origin().z());
+      dx.push_back(r.direction().x());
+      dy.push_back(r.direction().y());
+      dz.push_back(r.direction().z());
+      tr.push_back(throughput.x());
+      tg.push_back(throughput.y());
+      tb.push_back(throughput.z());
+      path.push_back(path_index);
+   }
+
+   Ray ray(int i) const { return Ray(Point3(ox[i], oy[i], oz[i]), Vec3(dx[i], dy[i], dz[i])); }
+   Color throughput(int i) const { return Color(tr[i], tg[i], tb[i]); }
+
+   // The rays [first, first + count) as a SIMD packet, `count` being at most `Ray_packet::SIZE`
+   Ray_packet packet(int first, int count) const
+   {
+      Ray rays[Ray_packet::SIZE];
+      for (int j = 0; j < count; j++)
+         rays[j] = ray(first + j);
+      return Ray_packet(rays, count);
+   }
+};
+
+/**
+ * @brief Working buffers of one thread of the wavefront renderer, reused from tile to tile
+ */
+struct Wavefront_state
+{
+   Path_queue rays;                     // Rays of the current bounce
+   Path_queue next;                     // Rays scattered by the current bounce, swapped with `rays` after it
+   std::vector<Hit_record> recs;        // Hits of the rays of the current bounce
+   std::vector<unsigned char> hits;     // Whether each ray of the current bounce hit an object
+   std::vector<RndGen::Engine> engines; // Random sequence of each path of the wave
+   std::vector<Color> colors;           // Color gathered by each path of the wave
+
+   std::vector<int> keys, order, bucket_start; // Counting sort of the queues
+
+   // Pixels of the tile being rendered, and the sums of their samples
+   std::vector<int> pixels;
+   std::vector<Color> pixel_colors;
+   std::vector<double> luminance_squares;
+   Tile_accumulation tile; // The sums of the tile, merged into the image at its end
+
+   /**
+    * @brief Stable counting sort of the indices [0, keys.size()) by key, into `order`
+    * Stable, so that the order of the rays does not depend on anything but the keys.
+    */
+   void sort_by_key(int n_keys)
+   {
+      bucket_start.assign(n_keys + 1, 0);
+      for (int key : keys)
+         bucket_start[key + 1]++;
+      for (int k = 0; k < n_keys; k++)
+         bucket_start[k + 1] += bucket_start[k];
+
+      order.resize(keys.size());
+      for (int i = 0; i < (int)keys.size(); i++)
+         order[bucket_start[keys[i]]++] = i;
+   }
+};